@@ -5,8 +5,10 @@ use azure_security_keyvault::prelude::*;
 use azure_security_keyvault::KeyClient;
 use base64::{engine::general_purpose, Engine as _};
 use openssl::hash::{Hasher, MessageDigest};
+use openssl::md::Md;
 use openssl::pkey::{PKey, Public};
-use openssl::rsa::Rsa;
+use openssl::pkey_ctx::PkeyCtx;
+use openssl::rsa::{Padding, Rsa};
 use openssl::sha::sha256;
 use openssl::sign::Verifier;
 use std::env;
@@ -21,7 +23,8 @@ const USAGE: &str = r#"
 AKV Signing Tool
 
 USAGE:
-    akvsign <INPUT_FILE> --output-format <FORMAT> [--verify]
+    akvsign <INPUT_FILE> --output-format <FORMAT> [--verify] [--digest <SHA256>]
+    akvsign --digest-supported
 
 ARGS:
     <INPUT_FILE>    Path to the file to be signed
@@ -29,6 +32,9 @@ ARGS:
 OPTIONS:
     --output-format <FORMAT>    Output format for the signature [possible values: raw, cosesign1]
     --verify                    Verify the signature after signing
+    --digest <SHA256>           Sign this SHA-256 digest (64 hex digits) of the input file
+                                rather than reading the file, which need not exist (raw only)
+    --digest-supported          Exit with zero to show that --digest is supported
 
 ENVIRONMENT VARIABLES:
     KEYVAULT_URL    URL of the Azure Key Vault (required)
@@ -74,6 +80,14 @@ struct Opt {
     #[structopt(long)]
     verify: bool,
 
+    /// SHA-256 digest (hex) to sign instead of the input file contents
+    #[structopt(long)]
+    digest: Option<String>,
+
+    /// Probe for the --digest option
+    #[structopt(long)]
+    digest_supported: bool,
+
     /// Print usage information
     #[structopt(long, help = "Print detailed usage information")]
     help: bool,
@@ -88,6 +102,10 @@ async fn main() -> Result<(), Box<dyn Error>> {
         return Ok(());
     }
 
+    if opt.digest_supported {
+        return Ok(());
+    }
+
     let input_path = opt.input.expect("Input file path not provided!");
     let is_cose_sign1_out_fmt = match opt.output_format {
         Some(ref s) if s == "cosesign1" => true,
@@ -111,24 +129,39 @@ async fn main() -> Result<(), Box<dyn Error>> {
         public_key_path.display()
     );
 
-    // Read input file
-    let mut file = File::open(&input_path)?;
     let mut data = Vec::new();
-    file.read_to_end(&mut data)?;
     let mut cose_sign1_doc: Option<cosesign1::CoseSign1> = None;
 
-    // Calculate sha256 of input file contents and convert to base64 url encode
-    if is_cose_sign1_out_fmt {
-        let c = cosesign1::CoseSign1::new(data, Some(public_key.public_key_to_der()?));
-        let tbs = c.create_tbs().expect("Failed to create to-be-signed data");
-        data = tbs.to_vec();
-        cose_sign1_doc = Some(c);
-    }
+    let hashed_data = match opt.digest {
+        // Digest protocol: the caller has already hashed the input file
+        Some(ref hex) => {
+            if is_cose_sign1_out_fmt {
+                return Err("--digest cannot be used with --output-format cosesign1".into());
+            }
+
+            parse_sha256(hex)?
+        }
+        None => {
+            // Read input file
+            let mut file = File::open(&input_path)?;
+            file.read_to_end(&mut data)?;
+
+            if is_cose_sign1_out_fmt {
+                let c = cosesign1::CoseSign1::new(data, Some(public_key.public_key_to_der()?));
+                let tbs = c.create_tbs().expect("Failed to create to-be-signed data");
+                data = tbs.to_vec();
+                cose_sign1_doc = Some(c);
+            }
+
+            // Calculate sha256 of input file contents
+            let mut hasher = Hasher::new(MessageDigest::sha256())?;
+            hasher.update(&data)?;
+            hasher.finish()?.to_vec()
+        }
+    };
 
-    let mut hasher = Hasher::new(MessageDigest::sha256())?;
-    hasher.update(&data)?;
-    let hashed_data = hasher.finish()?;
-    let data_to_sign = general_purpose::URL_SAFE_NO_PAD.encode(hashed_data);
+    // Convert the digest to base64 url encode
+    let data_to_sign = general_purpose::URL_SAFE_NO_PAD.encode(&hashed_data);
 
     // Send sign request to AKV with base64url encoded digest
     let sign_result = key_client
@@ -169,7 +202,13 @@ async fn main() -> Result<(), Box<dyn Error>> {
 
     // Optional step: Verify signature
     if !is_cose_sign1_out_fmt && opt.verify {
-        match verify_signature(&data, &signature, &public_key) {
+        let result = if opt.digest.is_some() {
+            verify_digest_signature(&hashed_data, &signature, &public_key)
+        } else {
+            verify_signature(&data, &signature, &public_key)
+        };
+
+        match result {
             Ok(true) => println!("Signature verification successful!"),
             Ok(false) => println!("Signature verification failed!"),
             Err(e) => println!("Error during signature verification: {}", e),
@@ -206,6 +245,30 @@ fn verify_signature(
     Ok(verifier.verify(signature)?)
 }
 
+fn verify_digest_signature(
+    digest: &[u8],
+    signature: &[u8],
+    public_key: &Rsa<openssl::pkey::Public>,
+) -> Result<bool, Box<dyn Error>> {
+    let pkey = PKey::from_rsa(public_key.clone())?;
+    let mut ctx = PkeyCtx::new(&pkey)?;
+    ctx.verify_init()?;
+    ctx.set_rsa_padding(Padding::PKCS1)?;
+    ctx.set_signature_md(Md::sha256())?;
+    Ok(ctx.verify(digest, signature)?)
+}
+
+fn parse_sha256(hex: &str) -> Result<Vec<u8>, Box<dyn Error>> {
+    if hex.len() != 64 || !hex.bytes().all(|c| c.is_ascii_hexdigit()) {
+        return Err(format!("--digest must be 64 hex digits: {}", hex).into());
+    }
+
+    Ok((0..64)
+        .step_by(2)
+        .map(|i| u8::from_str_radix(&hex[i..i + 2], 16))
+        .collect::<Result<Vec<u8>, _>>()?)
+}
+
 fn signer_public_key_hash(public_key: &Rsa<Public>) -> Result<Vec<u8>, Box<dyn Error>> {
     let n = public_key.n().to_vec();
     let e = public_key.e().to_vec();
@@ -0,0 +1,78 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "boottime.h"
+#include <efilib.h>
+#include <string.h>
+#include "efivar.h"
+
+/* 08b5e462-25eb-42c0-a7d1-e9f78c3c7e09 (BOOTTIME_VARIABLE_GUID) */
+static const EFI_GUID _guid =
+    {0x08b5e462,0x25eb,0x42c0,{0xa7,0xd1,0xe9,0xf7,0x8c,0x3c,0x7e,0x09}};
+
+static boottime_t _boottime;
+
+/* index of the stage in progress (or -1 if none) */
+static int _current = -1;
+
+static UINT64 _rdtsc(void)
+{
+    UINT32 lo;
+    UINT32 hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+static UINT64 _now(void)
+{
+    return _rdtsc() - _boottime.entry_tsc;
+}
+
+static void _end_stage(void)
+{
+    if (_current >= 0)
+    {
+        _boottime.stages[_current].end = _now();
+        _current = -1;
+    }
+}
+
+void boottime_init(void)
+{
+    memset(&_boottime, 0, sizeof(_boottime));
+    _boottime.magic = BOOTTIME_MAGIC;
+    _boottime.version = BOOTTIME_VERSION;
+    _boottime.entry_tsc = _rdtsc();
+    _current = -1;
+}
+
+void boottime_stage(const char* name)
+{
+    boottime_stage_t* stage;
+
+    _end_stage();
+
+    if (_boottime.num_stages == BOOTTIME_MAX_STAGES)
+        return;
+
+    _current = _boottime.num_stages++;
+    stage = &_boottime.stages[_current];
+    strlcpy(stage->name, name, sizeof(stage->name));
+    stage->start = _now();
+}
+
+int boottime_publish(void)
+{
+    UINT64 start;
+
+    _end_stage();
+
+    /* Calibrate the TSC against the firmware's one-millisecond stall */
+    start = _rdtsc();
+    uefi_call_wrapper(BS->Stall, 1, 1000);
+    _boottime.tsc_frequency = (_rdtsc() - start) * 1000;
+
+    return set_volatile_efi_var(
+        L"boottime", &_guid, &_boottime, sizeof(_boottime));
+}
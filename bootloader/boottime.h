@@ -0,0 +1,19 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_BOOTLOADER_BOOTTIME_H
+#define _CVMBOOT_BOOTLOADER_BOOTTIME_H
+
+#include <efi.h>
+#include <utils/boottime.h>
+
+/* Record the TSC on entry to efi_main() */
+void boottime_init(void);
+
+/* End the current stage (if any) and start a new one with the given name */
+void boottime_stage(const char* name);
+
+/* End the current stage and publish the timings in a volatile EFI variable */
+int boottime_publish(void);
+
+#endif /* _CVMBOOT_BOOTLOADER_BOOTTIME_H */
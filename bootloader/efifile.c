@@ -332,14 +332,38 @@ done:
     return status;
 }
 
-EFI_STATUS efi_file_load(
+static int _read_callback(
+    void* context,
+    void* data,
+    size_t size,
+    size_t* sizeRead)
+{
+    UINTN n = 0;
+
+    if (efi_file_read((efi_file_t*)context, data, size, &n) != EFI_SUCCESS)
+        return -1;
+
+    *sizeRead = n;
+    return 0;
+}
+
+/* Number of pages allocated by _load() for a file of the given size */
+static UINTN _LoadPages(UINTN size)
+{
+    return EFI_SIZE_TO_PAGES(size + 2);
+}
+
+static EFI_STATUS _load(
     IN EFI_HANDLE imageHandle,
     IN const CHAR16* path,
+    IN EFI_PHYSICAL_ADDRESS maxAddress,
     OUT void** data,
-    OUT UINTN* size)
+    OUT UINTN* size,
+    OUT sha256_t* hash)
 {
     EFI_STATUS status = EFI_UNSUPPORTED;
     efi_file_t* efiFile = NULL;
+    UINTN numPages = 0;
 
     /* Check parameters */
     if (!path || !data || !size)
@@ -369,7 +393,27 @@ EFI_STATUS efi_file_load(
     }
 
     /* Allocate a buffer to hold file in memory (allocate extra byte) */
-    if (!(*data = AllocatePool(*size + 2)))
+    if (maxAddress)
+    {
+        EFI_PHYSICAL_ADDRESS address = maxAddress;
+
+        numPages = _LoadPages(*size);
+
+        if ((status = uefi_call_wrapper(
+            BS->AllocatePages,
+            4,
+            AllocateMaxAddress,
+            EfiLoaderData,
+            numPages,
+            &address)) != EFI_SUCCESS)
+        {
+            numPages = 0;
+            goto done;
+        }
+
+        *data = (void*)address;
+    }
+    else if (!(*data = AllocatePool(*size + 2)))
     {
         status = EFI_OUT_OF_RESOURCES;
         goto done;
@@ -379,8 +423,17 @@ EFI_STATUS efi_file_load(
     ((char*)*data)[*size] = '\0';
     ((char*)*data)[*size+1] = '\0';
 
-    /* Read the entire file */
-    if ((status = _readn(efiFile, *data, *size)) != EFI_SUCCESS)
+    /* Read the entire file (hashing each chunk as it arrives) */
+    if (hash)
+    {
+        if (sha256_read(hash, *data, *size, SHA256_READ_CHUNK_SIZE,
+            _read_callback, efiFile) != 0)
+        {
+            status = EFI_DEVICE_ERROR;
+            goto done;
+        }
+    }
+    else if ((status = _readn(efiFile, *data, *size)) != EFI_SUCCESS)
     {
         goto done;
     }
@@ -391,8 +444,18 @@ done:
 
     if (status != EFI_SUCCESS)
     {
-        if (*data)
+        if (numPages)
+        {
+            uefi_call_wrapper(
+                BS->FreePages,
+                2,
+                (EFI_PHYSICAL_ADDRESS)*data,
+                numPages);
+        }
+        else if (*data)
+        {
             FreePool(*data);
+        }
 
         *data = NULL;
         *size = 0;
@@ -403,3 +466,40 @@ done:
 
     return status;
 }
+
+EFI_STATUS efi_file_load(
+    IN EFI_HANDLE imageHandle,
+    IN const CHAR16* path,
+    OUT void** data,
+    OUT UINTN* size)
+{
+    return _load(imageHandle, path, 0, data, size, NULL);
+}
+
+EFI_STATUS efi_file_load_and_hash(
+    IN EFI_HANDLE imageHandle,
+    IN const CHAR16* path,
+    IN EFI_PHYSICAL_ADDRESS maxAddress,
+    OUT void** data,
+    OUT UINTN* size,
+    OUT sha256_t* hash)
+{
+    if (!hash)
+        return EFI_INVALID_PARAMETER;
+
+    return _load(imageHandle, path, maxAddress, data, size, hash);
+}
+
+EFI_STATUS efi_file_free_pages(
+    IN void* data,
+    IN UINTN size)
+{
+    if (!data)
+        return EFI_INVALID_PARAMETER;
+
+    return uefi_call_wrapper(
+        BS->FreePages,
+        2,
+        (EFI_PHYSICAL_ADDRESS)data,
+        _LoadPages(size));
+}
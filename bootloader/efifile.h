@@ -5,6 +5,7 @@
 #define _CVMBOOT_BOOTLOADER_EFIFILE_H
 
 #include <efi.h>
+#include <utils/sha256.h>
 
 typedef struct _efi_file efi_file_t;
 
@@ -28,4 +29,23 @@ EFI_STATUS efi_file_load(
     OUT void** data,
     OUT UINTN* size);
 
+/* Like efi_file_load() but also computes the SHA-256 hash of the file one
+ * chunk at a time as it is read, avoiding a second pass over the buffer.
+ * If maxAddress is non-zero, the file is loaded into pages that lie below
+ * that address (so parts of it may be handed to the kernel in place), and
+ * must be released with efi_file_free_pages() rather than FreePool().
+ */
+EFI_STATUS efi_file_load_and_hash(
+    IN EFI_HANDLE imageHandle,
+    IN const CHAR16* path,
+    IN EFI_PHYSICAL_ADDRESS maxAddress,
+    OUT void** data,
+    OUT UINTN* size,
+    OUT sha256_t* hash);
+
+/* Release a file loaded by efi_file_load_and_hash() with a maxAddress */
+EFI_STATUS efi_file_free_pages(
+    IN void* data,
+    IN UINTN size);
+
 #endif /* _CVMBOOT_BOOTLOADER_EFIFILE_H */
@@ -3,18 +3,14 @@
 
 #include "efivar.h"
 
-int set_efi_var(
+static int _set_efi_var(
     const CHAR16* name,
     const EFI_GUID* guid,
+    UINT32 attrs,
     const void* value_data,
     size_t value_size)
 {
     int ret = -1;
-    UINT32 attrs = 0;
-
-    attrs |= EFI_VARIABLE_NON_VOLATILE;
-    attrs |= EFI_VARIABLE_BOOTSERVICE_ACCESS;
-    attrs |= EFI_VARIABLE_RUNTIME_ACCESS;
 
     if (RT->SetVariable(
         (CHAR16*)name,
@@ -31,3 +27,32 @@ int set_efi_var(
 done:
     return ret;
 }
+
+int set_efi_var(
+    const CHAR16* name,
+    const EFI_GUID* guid,
+    const void* value_data,
+    size_t value_size)
+{
+    UINT32 attrs = 0;
+
+    attrs |= EFI_VARIABLE_NON_VOLATILE;
+    attrs |= EFI_VARIABLE_BOOTSERVICE_ACCESS;
+    attrs |= EFI_VARIABLE_RUNTIME_ACCESS;
+
+    return _set_efi_var(name, guid, attrs, value_data, value_size);
+}
+
+int set_volatile_efi_var(
+    const CHAR16* name,
+    const EFI_GUID* guid,
+    const void* value_data,
+    size_t value_size)
+{
+    UINT32 attrs = 0;
+
+    attrs |= EFI_VARIABLE_BOOTSERVICE_ACCESS;
+    attrs |= EFI_VARIABLE_RUNTIME_ACCESS;
+
+    return _set_efi_var(name, guid, attrs, value_data, value_size);
+}
@@ -14,4 +14,11 @@ int set_efi_var(
     const void* value_data,
     size_t value_size);
 
+/* set a variable that does not survive a reset (not written to flash) */
+int set_volatile_efi_var(
+    const CHAR16* name,
+    const EFI_GUID* guid,
+    const void* value_data,
+    size_t value_size);
+
 #endif /* _CVMBOOT_BOOTLOADER_EFIVAR_H */
@@ -106,3 +106,21 @@ done:
 
     return ret;
 }
+
+int process_events_blob_callback(
+    uint32_t pcrnum,
+    uint32_t type,
+    const void* data,
+    size_t size,
+    void* callback_data)
+{
+    TCG_EVENTTYPE event_type;
+
+    /* measure exactly what process_events_callback() would measure */
+    if (type == EVENTS_BLOB_TYPE_STRING)
+        event_type = EV_IPL;
+    else
+        event_type = EV_COMPACT_HASH;
+
+    return hash_log_extend_event(pcrnum, data, size, event_type, data, size);
+}
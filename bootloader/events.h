@@ -26,4 +26,12 @@ int process_events_callback(
     const char* signer,
     void* callback_data);
 
+// Callback for events_blob_walk()
+int process_events_blob_callback(
+    uint32_t pcrnum,
+    uint32_t type,
+    const void* data,
+    size_t size,
+    void* callback_data);
+
 #endif /* _CVMBOOT_BOOTLOADER_EVENTS_H */
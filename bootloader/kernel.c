@@ -9,6 +9,7 @@
 #include "efifile.h"
 #include "console.h"
 #include "sleep.h"
+#include "boottime.h"
 
 #define SECTOR_SIZE ((UINTN)512)
 #define MINIMUM_SUPPORTED_VERSION 0x020B
@@ -219,13 +220,26 @@ static EFI_STATUS _LoadInitrd(
     *initrdSizeOut = 0;
     *errorLine = 0;
 
+    /* If the initrd is already page aligned and low enough in memory (as it
+     * is when cvmboot.cpio is loaded into pages below INITRD_ADDRESS_MAX),
+     * then hand it to the kernel in place rather than copying it.
+     */
+    if ((UINTN)data % EFI_PAGE_SIZE == 0 &&
+        (EFI_PHYSICAL_ADDRESS)data + size - 1 <= INITRD_ADDRESS_MAX)
+    {
+        *initrdDataOut = (void*)data;
+        *initrdSizeOut = size;
+        status = EFI_SUCCESS;
+        goto done;
+    }
+
     /* Round size of the file to next multiple of 4 */
-    initrdSize = (size + 3) / size * size;
+    initrdSize = (size + 3) / 4 * 4;
 
     /* Allocate space to place this file into memory for the kernel */
     if ((status = _AllocatePages(
         AllocateMaxAddress,
-        0x3fffffff,
+        INITRD_ADDRESS_MAX,
         _ByteToPages(initrdSize),
         &initrdData)) != EFI_SUCCESS)
     {
@@ -480,6 +494,8 @@ EFI_STATUS start_kernel(
     }
 
     /* Load the kernel */
+    boottime_stage("kernel");
+
     if ((status = _LoadKernel(
         kernel_data,
         kernel_size,
@@ -495,6 +511,8 @@ EFI_STATUS start_kernel(
     }
 
     /* Load the initial ramdisk */
+    boottime_stage("initrd");
+
     if ((status = _LoadInitrd(
         initrd_data,
         initrd_size,
@@ -512,6 +530,9 @@ EFI_STATUS start_kernel(
     paramsData->setup.ramdisk_size = initrdSize;
     paramsData->setup.ramdisk_image = (UINT32)(EFI_PHYSICAL_ADDRESS)initrdData;
 
+    /* Publish the stage timings for Linux to read from efivarfs */
+    boottime_publish();
+
     /* Print status message */
     efi_set_colors(EFI_LIGHTCYAN, EFI_BLACK);
     Print(L"Starting kernel...\n");
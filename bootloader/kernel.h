@@ -7,6 +7,9 @@
 #include <efi.h>
 #include <efilib.h>
 
+/* Highest address at which the initrd is placed (ramdisk_image is 32 bits) */
+#define INITRD_ADDRESS_MAX ((EFI_PHYSICAL_ADDRESS)0x3fffffff)
+
 EFI_STATUS start_kernel(
     const void* kernel_data,
     size_t kernel_size,
@@ -9,6 +9,7 @@
 #include <utils/events.h>
 #include <utils/paths.h>
 #include <utils/cpio.h>
+#include <utils/lz4.h>
 #include <utils/strings.h>
 #include "tpm2.h"
 #include "key.h"
@@ -27,6 +28,7 @@
 #include "console.h"
 #include "timestamp.h"
 #include "conf.h"
+#include "boottime.h"
 
 __attribute__((__used__)) static const char _timestamp[] = TIMESTAMP;
 
@@ -64,6 +66,61 @@ done:
     return ret;
 }
 
+/* Replace an LZ4-compressed cvmboot.cpio (whose hash has already been
+ * verified) with its decompressed contents, placed below INITRD_ADDRESS_MAX
+ * so that the initrd can still be handed to the kernel in place.
+ */
+static int _decompress_cpio(void** data, UINTN* size)
+{
+    int ret = -1;
+    uint64_t content_size;
+    EFI_PHYSICAL_ADDRESS address = INITRD_ADDRESS_MAX;
+    UINTN num_pages = 0;
+    uint8_t* out = NULL;
+
+    if (lz4_get_content_size(*data, *size, &content_size) < 0)
+        goto done;
+
+    if (content_size > INITRD_ADDRESS_MAX)
+        goto done;
+
+    /* Allocate two extra zero bytes, like efi_file_load_and_hash() */
+    num_pages = EFI_SIZE_TO_PAGES(content_size + 2);
+
+    if (uefi_call_wrapper(
+        BS->AllocatePages,
+        4,
+        AllocateMaxAddress,
+        EfiLoaderData,
+        num_pages,
+        &address) != EFI_SUCCESS)
+    {
+        num_pages = 0;
+        goto done;
+    }
+
+    out = (uint8_t*)address;
+    out[content_size] = '\0';
+    out[content_size + 1] = '\0';
+
+    if (lz4_decompress_frame(*data, *size, out, content_size) < 0)
+        goto done;
+
+    efi_file_free_pages(*data, *size);
+    *data = out;
+    *size = content_size;
+    out = NULL;
+
+    ret = 0;
+
+done:
+
+    if (out)
+        uefi_call_wrapper(BS->FreePages, 2, address, num_pages);
+
+    return ret;
+}
+
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
 {
     const BOOLEAN trace = FALSE;
@@ -73,14 +130,19 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
     CHAR16 cpio_path[PATH_MAX];
     void* cpio_data = NULL;
     UINTN cpio_size = 0;
+    sha256_t cpio_hash = SHA256_INITIALIZER;
     conf_t conf;
 
+    boottime_init();
+
     InitializeLib(image_handle, system_table);
 
     globals.image_handle = image_handle;
     globals.system_table = system_table;
 
     /* Create the TCG2 protocol (needed to measure PCRs) */
+    boottime_stage("tcg2");
+
     if (!(globals.tcg2 = TCG2_GetProtocol(&err)))
     {
         Print(L"Failed to get the TCG2 protocol");
@@ -89,26 +151,30 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
 
     /* Print the splash screen */
     {
+        boottime_stage("splash");
         print_splash_screen();
 
         if (trace)
             pause(NULL);
-
-        Sleep(1);
     }
 
     /* Initialize the crypto engine */
+    boottime_stage("crypto");
     crypto_initialize();
 
     /* Get path of cvmboot.cpio */
     paths_getw(cpio_path, FILENAME_CVMBOOT_CPIO);
 
-    /* Load cvmboot.cpio */
-    if (efi_file_load(
+    /* Load cvmboot.cpio below INITRD_ADDRESS_MAX, hashing it as it is read */
+    boottime_stage("cpio");
+
+    if (efi_file_load_and_hash(
         image_handle,
         cpio_path,
+        INITRD_ADDRESS_MAX,
         &cpio_data,
-        &cpio_size) != EFI_SUCCESS)
+        &cpio_size,
+        &cpio_hash) != EFI_SUCCESS)
     {
         Print(L"Failed to load %s\n", cpio_path);
         pause(NULL);
@@ -121,6 +187,7 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
         void* data = NULL;
         UINTN size;
 
+        boottime_stage("sig");
         paths_getw(path, FILENAME_CVMBOOT_CPIO_SIG);
 
         /* Load cvmboot.cpio.sig */
@@ -159,22 +226,30 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
         }
 
         /* Check the digest of the CPIO against the signature */
+        if (memcmp(&cpio_hash, &sig.digest, sizeof(sha256_t)) != 0)
         {
-            sha256_t hash;
+            Print(L"Invalid cvmboot.cpio hash: %s", cpio_path);
+            pause(NULL);
+            system_reset();
+        }
+    }
 
-            memset(&hash, 0, sizeof(hash));
-            sha256_compute(&hash, cpio_data, cpio_size);
+    /* Decompress cvmboot.cpio if needed (the signature covers the frame) */
+    if (lz4_is_frame(cpio_data, cpio_size))
+    {
+        boottime_stage("decompress");
 
-            if (memcmp(&hash, &sig.digest, sizeof(sha256_t)) != 0)
-            {
-                Print(L"Invalid cvmboot.cpio hash: %s", cpio_path);
-                pause(NULL);
-                system_reset();
-            }
+        if (_decompress_cpio(&cpio_data, &cpio_size) < 0)
+        {
+            Print(L"Failed to decompress %s\n", cpio_path);
+            pause(NULL);
+            system_reset();
         }
     }
 
     /* Load the configuration file */
+    boottime_stage("conf");
+
     if (conf_load(cpio_data, cpio_size, &conf, &err) < 0)
     {
         Print(L"failed to load configuration file: %a\n", err.buf);
@@ -189,6 +264,8 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
     }
 
     /* Load and measure identity/events files */
+    boottime_stage("events");
+
     {
         char signer[SHA256_STRING_SIZE] = "";
         void* data = NULL;
@@ -202,6 +279,25 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
             sizeof(bootloader_sig.signer));
 
         if (cpio_load_file(
+            cpio_data, cpio_size, FILENAME_EVENTS_BIN, &data, &size) == 0)
+        {
+            err_t err;
+
+            /* Measure the events precompiled by cvmdisk */
+            if (events_blob_walk(
+                data,
+                size,
+                signer,
+                process_events_blob_callback,
+                NULL, /* callback data */
+                &err) != 0)
+            {
+                Print(L"failed to process events blob: %a\n", err.buf);
+                pause(NULL);
+                system_reset();
+            }
+        }
+        else if (cpio_load_file(
             cpio_data, cpio_size, FILENAME_EVENTS, &data, &size) == 0)
         {
             err_t err;
@@ -8,6 +8,7 @@
 
 static const char* _arg0 = "unknown";
 static bool _show_file_line_func;
+static void (*_exit_hook)(void);
 
 void err_set_arg0(const char* arg0)
 {
@@ -19,6 +20,11 @@ void err_show_file_line_func(bool flag)
     _show_file_line_func = flag;
 }
 
+void err_set_exit_hook(void (*hook)(void))
+{
+    _exit_hook = hook;
+}
+
 static void _verr(
     const char* file,
     unsigned int line,
@@ -46,6 +52,10 @@ void __err(
     va_start(ap, fmt);
     _verr(file, line, func, fmt, ap);
     va_end(ap);
+
+    if (_exit_hook)
+        _exit_hook();
+
     exit(1);
 }
 
@@ -10,6 +10,10 @@ void err_set_arg0(const char* arg0);
 
 void err_show_file_line_func(bool flag);
 
+/* Set a function that ERR() calls after printing the error and before exiting
+ * the process; it may end just the calling thread instead */
+void err_set_exit_hook(void (*hook)(void));
+
 __attribute__((format(printf, 4, 5)))
 void __err(
     const char* file,
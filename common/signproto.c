@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "signproto.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <utils/strings.h>
+#include <utils/sig.h>
+
+_Static_assert(SIGNPROTO_MAX_SIGNATURE_SIZE == SIG_MAX_SIGNATURE_SIZE, "");
+
+int signproto_readn(int fd, void* data, size_t size)
+{
+    uint8_t* p = (uint8_t*)data;
+
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int signproto_writen(int fd, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+
+    while (size)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int signproto_connect(const char* socket_path, int* fd_out)
+{
+    int ret = -1;
+    int fd = -1;
+    struct sockaddr_un addr;
+
+    if (!socket_path || !fd_out)
+        goto done;
+
+    *fd_out = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path)) >=
+        sizeof(addr.sun_path))
+    {
+        goto done;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        goto done;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        goto done;
+
+    *fd_out = fd;
+    fd = -1;
+    ret = 0;
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    return ret;
+}
+
+int signproto_request(
+    int fd,
+    const sha256_t* digest,
+    signproto_response_t* response)
+{
+    signproto_request_t request;
+
+    if (fd < 0 || !digest || !response)
+        return -1;
+
+    memset(&request, 0, sizeof(request));
+    request.magic = SIGNPROTO_MAGIC;
+    request.digest = *digest;
+
+    if (signproto_writen(fd, &request, sizeof(request)) < 0)
+        return -1;
+
+    if (signproto_readn(fd, response, sizeof(signproto_response_t)) < 0)
+        return -1;
+
+    if (response->magic != SIGNPROTO_MAGIC || response->status != 0)
+        return -1;
+
+    if (response->signature_size > sizeof(response->signature) ||
+        response->pubkey_size > sizeof(response->pubkey))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int signproto_sign(
+    const char* socket_path,
+    const sha256_t* digest,
+    signproto_response_t* response)
+{
+    int ret = -1;
+    int fd = -1;
+
+    if (signproto_connect(socket_path, &fd) < 0)
+        goto done;
+
+    if (signproto_request(fd, digest, response) < 0)
+        goto done;
+
+    ret = 0;
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    return ret;
+}
@@ -0,0 +1,82 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_COMMON_SIGNPROTO_H
+#define _CVMBOOT_COMMON_SIGNPROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utils/sha256.h>
+
+/*
+**==============================================================================
+**
+** Protocol between 'cvmsign serve' and its clients over a Unix domain socket.
+** A client sends any number of fixed-size requests on a connection and reads
+** one fixed-size response for each. Integers are in host byte order (both
+** ends are on the same machine).
+**
+**==============================================================================
+*/
+
+/* Signing tools of the form "unix:<socket-path>" name a signing service */
+#define SIGNPROTO_PREFIX "unix:"
+
+/* ASCII "CVMSIGN1" */
+#define SIGNPROTO_MAGIC 0x314e4749534d5643
+
+/* same as SIG_MAX_SIGNATURE_SIZE (sig.h is not included since its sig_t
+ * clashes with the one from <signal.h>)
+ */
+#define SIGNPROTO_MAX_SIGNATURE_SIZE 1024
+
+#define SIGNPROTO_MAX_PUBKEY_SIZE 4096
+
+#define SIGNPROTO_DEFAULT_SOCKET_NAME "cvmsign.sock"
+
+typedef struct signproto_request
+{
+    uint64_t magic;
+    sha256_t digest;
+}
+signproto_request_t;
+
+typedef struct signproto_response
+{
+    uint64_t magic;
+
+    /* zero on success */
+    int32_t status;
+    uint32_t signature_size;
+    uint8_t signature[SIGNPROTO_MAX_SIGNATURE_SIZE];
+
+    /* SHA256(modulus||exponent) of the signing key */
+    sha256_t signer;
+
+    /* public key in PEM format (without a zero terminator) */
+    uint32_t pubkey_size;
+    uint8_t pubkey[SIGNPROTO_MAX_PUBKEY_SIZE];
+}
+signproto_response_t;
+
+/* Connect to the signing service listening on socket_path */
+int signproto_connect(const char* socket_path, int* fd);
+
+/* Send a request on a connection and wait for its response */
+int signproto_request(
+    int fd,
+    const sha256_t* digest,
+    signproto_response_t* response);
+
+/* Connect, sign one digest, and disconnect */
+int signproto_sign(
+    const char* socket_path,
+    const sha256_t* digest,
+    signproto_response_t* response);
+
+/* Read or write exactly size bytes (returns -1 on error or early EOF) */
+int signproto_readn(int fd, void* data, size_t size);
+
+int signproto_writen(int fd, const void* data, size_t size);
+
+#endif /* _CVMBOOT_COMMON_SIGNPROTO_H */
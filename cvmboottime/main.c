@@ -0,0 +1,216 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <utils/boottime.h>
+#include <utils/allocator.h>
+#include <common/err.h>
+#include <common/file.h>
+
+allocator_t __allocator = { malloc, free };
+
+#define EFIVARFS_PATH "/sys/firmware/efi/efivars/" \
+    BOOTTIME_VARIABLE_NAME "-" BOOTTIME_VARIABLE_GUID
+
+/* aggregated samples (in milliseconds) of one stage across all inputs */
+typedef struct series
+{
+    char name[BOOTTIME_NAME_SIZE];
+    double* samples;
+    size_t count;
+}
+series_t;
+
+#define MAX_SERIES (BOOTTIME_MAX_STAGES + 2)
+
+static series_t _series[MAX_SERIES];
+static size_t _num_series;
+
+static void _load(const char* path, boottime_t* bt)
+{
+    void* data;
+    size_t size;
+    const uint8_t* p;
+
+    if (load_file(path, &data, &size) < 0)
+        ERR("failed to read file: %s", path);
+
+    p = data;
+
+    /* efivarfs files start with the 4-byte variable attributes */
+    if (size == sizeof(boottime_t) + sizeof(uint32_t))
+    {
+        p += sizeof(uint32_t);
+        size -= sizeof(uint32_t);
+    }
+
+    if (size != sizeof(boottime_t))
+        ERR("bad size: %s", path);
+
+    memcpy(bt, p, sizeof(boottime_t));
+    free(data);
+
+    if (bt->magic != BOOTTIME_MAGIC || bt->version != BOOTTIME_VERSION)
+        ERR("bad magic number or version: %s", path);
+
+    if (bt->num_stages > BOOTTIME_MAX_STAGES || bt->tsc_frequency == 0)
+        ERR("corrupt boot timings: %s", path);
+
+    for (size_t i = 0; i < bt->num_stages; i++)
+        bt->stages[i].name[BOOTTIME_NAME_SIZE - 1] = '\0';
+}
+
+static double _ms(const boottime_t* bt, uint64_t ticks)
+{
+    return (double)ticks * 1000.0 / (double)bt->tsc_frequency;
+}
+
+static double _total(const boottime_t* bt)
+{
+    if (bt->num_stages == 0)
+        return 0;
+
+    return _ms(bt, bt->stages[bt->num_stages - 1].end);
+}
+
+static void _add_sample(const char* name, double ms)
+{
+    series_t* s = NULL;
+
+    for (size_t i = 0; i < _num_series; i++)
+    {
+        if (strcmp(_series[i].name, name) == 0)
+        {
+            s = &_series[i];
+            break;
+        }
+    }
+
+    if (!s)
+    {
+        if (_num_series == MAX_SERIES)
+            ERR("too many distinct stages");
+
+        s = &_series[_num_series++];
+        snprintf(s->name, sizeof(s->name), "%s", name);
+    }
+
+    if (!(s->samples = realloc(s->samples, (s->count + 1) * sizeof(double))))
+        ERR("out of memory");
+
+    s->samples[s->count++] = ms;
+}
+
+static int _compare(const void* x, const void* y)
+{
+    const double a = *(const double*)x;
+    const double b = *(const double*)y;
+    return (a > b) - (a < b);
+}
+
+/* nearest-rank percentile of sorted samples */
+static double _percentile(const series_t* s, double pct)
+{
+    size_t rank = (size_t)(pct / 100.0 * s->count + 0.999999);
+
+    if (rank == 0)
+        rank = 1;
+
+    return s->samples[rank - 1];
+}
+
+static void _dump(const boottime_t* bt)
+{
+    printf("%-16s %10s %10s\n", "stage", "start(ms)", "time(ms)");
+
+    for (size_t i = 0; i < bt->num_stages; i++)
+    {
+        const boottime_stage_t* st = &bt->stages[i];
+
+        printf("%-16s %10.3f %10.3f\n",
+            st->name, _ms(bt, st->start), _ms(bt, st->end - st->start));
+    }
+
+    printf("%-16s %10s %10.3f\n", "total", "", _total(bt));
+    printf("%-16s %10s %10.3f\n", "firmware", "", _ms(bt, bt->entry_tsc));
+}
+
+static void _dump_aggregate(size_t num_inputs)
+{
+    printf("%zu boots\n", num_inputs);
+    printf("%-16s %6s %10s %10s %10s %10s %10s\n",
+        "stage", "count", "min(ms)", "p50(ms)", "p90(ms)", "max(ms)",
+        "mean(ms)");
+
+    for (size_t i = 0; i < _num_series; i++)
+    {
+        series_t* s = &_series[i];
+        double sum = 0;
+
+        qsort(s->samples, s->count, sizeof(double), _compare);
+
+        for (size_t j = 0; j < s->count; j++)
+            sum += s->samples[j];
+
+        printf("%-16s %6zu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+            s->name,
+            s->count,
+            s->samples[0],
+            _percentile(s, 50),
+            _percentile(s, 90),
+            s->samples[s->count - 1],
+            sum / s->count);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    err_set_arg0(argv[0]);
+
+    if (argc == 2 &&
+        (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        printf("Usage: %s [FILE...]\n\n", argv[0]);
+        printf("Decodes the bootloader stage timings that cvmboot.efi "
+            "publishes in the\nvolatile EFI variable " EFIVARFS_PATH ".\n"
+            "With no arguments, this variable is read from efivarfs. With "
+            "several\nfiles (collected from many boots), prints per-stage "
+            "statistics.\n");
+        return 0;
+    }
+
+    if (argc <= 2)
+    {
+        boottime_t bt;
+
+        _load(argc == 2 ? argv[1] : EFIVARFS_PATH, &bt);
+        _dump(&bt);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        boottime_t bt;
+
+        _load(argv[i], &bt);
+
+        for (size_t j = 0; j < bt.num_stages; j++)
+        {
+            const boottime_stage_t* st = &bt.stages[j];
+            _add_sample(st->name, _ms(&bt, st->end - st->start));
+        }
+
+        _add_sample("total", _total(&bt));
+        _add_sample("firmware", _ms(&bt, bt.entry_tsc));
+    }
+
+    _dump_aggregate(argc - 1);
+
+    for (size_t i = 0; i < _num_series; i++)
+        free(_series[i].samples);
+
+    return 0;
+}
@@ -312,7 +312,7 @@ int blockdev_open_slice(
     if (start >= file_size)
         ERAISE(-EINVAL);
 
-    if (end >= file_size)
+    if (end > file_size)
         ERAISE(-EINVAL);
 
     /* Adjust file size to size of slice */
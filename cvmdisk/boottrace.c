@@ -0,0 +1,343 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "boottrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "eraise.h"
+
+#define SECTOR_SIZE 512
+
+/* most devices whose reads are kept apart while loading a trace */
+#define MAX_DEVICES 16
+
+/* Parse a tracefs line for a block event, for example:
+ *
+ *     systemd-1 [000] ..... 1.000: block_bio_queue: 253,0 R 2048 + 8 [systemd]
+ *
+ * Returns 1 for a read, 0 for any other line, or a negative errno.
+ */
+static int _parse_event(
+    const char* line,
+    unsigned int* major,
+    unsigned int* minor,
+    size_t* sector,
+    size_t* count)
+{
+    const char* p;
+    char rwbs[16];
+    char* end;
+
+    if (!(p = strstr(line, " block_")) || !(p = strchr(p, ':')))
+        return 0;
+
+    if (sscanf(p + 1, "%u,%u %15s", major, minor, rwbs) != 3)
+        return -EINVAL;
+
+    /* skip writes, discards and flushes */
+    if (!strchr(rwbs, 'R') || strchr(rwbs, 'W') || strchr(rwbs, 'D'))
+        return 0;
+
+    if (!(p = strstr(p, " + ")))
+        return 0;
+
+    /* the sector is the number before " + " */
+    {
+        const char* q = p;
+
+        while (q > line && isdigit(q[-1]))
+            q--;
+
+        if (q == p)
+            return -EINVAL;
+
+        *sector = strtoul(q, NULL, 10);
+    }
+
+    *count = strtoul(p + 3, &end, 10);
+
+    if (end == p + 3)
+        return -EINVAL;
+
+    return 1;
+}
+
+typedef struct device_reads
+{
+    unsigned int major;
+    unsigned int minor;
+    frag_list_t reads;
+}
+device_reads_t;
+
+int boottrace_load(const char* path, frag_list_t* reads)
+{
+    int ret = 0;
+    FILE* is = NULL;
+    char line[1024];
+    device_reads_t devs[MAX_DEVICES];
+    size_t num_devs = 0;
+    size_t best = 0;
+
+    memset(devs, 0, sizeof(devs));
+
+    if (!path || !reads)
+        ERAISE(-EINVAL);
+
+    memset(reads, 0, sizeof(frag_list_t));
+
+    if (!(is = fopen(path, "r")))
+        ERAISE(-errno);
+
+    while (fgets(line, sizeof(line), is))
+    {
+        const char* p = line;
+        unsigned int major = 0;
+        unsigned int minor = 0;
+        size_t sector;
+        size_t count;
+        size_t i;
+        int r;
+
+        while (isspace(*p))
+            p++;
+
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        if (isdigit(*p) && !strstr(p, " block_") &&
+            sscanf(p, "%zu %zu", &sector, &count) == 2)
+        {
+            r = 1;
+        }
+        else
+        {
+            ECHECK(r = _parse_event(p, &major, &minor, &sector, &count));
+        }
+
+        if (r != 1 || count == 0)
+            continue;
+
+        /* group the reads by device */
+        for (i = 0; i < num_devs; i++)
+        {
+            if (devs[i].major == major && devs[i].minor == minor)
+                break;
+        }
+
+        if (i == num_devs)
+        {
+            if (num_devs == MAX_DEVICES)
+                continue;
+
+            devs[num_devs].major = major;
+            devs[num_devs].minor = minor;
+            num_devs++;
+        }
+
+        if (frags_append(
+            &devs[i].reads, sector * SECTOR_SIZE, count * SECTOR_SIZE) < 0)
+        {
+            ERAISE(-ENOMEM);
+        }
+    }
+
+    /* keep the device read the most (the recorder filters on one) */
+    for (size_t i = 1; i < num_devs; i++)
+    {
+        if (devs[i].reads.size > devs[best].reads.size)
+            best = i;
+    }
+
+    if (num_devs > 0)
+    {
+        *reads = devs[best].reads;
+        memset(&devs[best].reads, 0, sizeof(frag_list_t));
+    }
+
+done:
+
+    for (size_t i = 0; i < num_devs; i++)
+        frags_release(&devs[i].reads);
+
+    if (is)
+        fclose(is);
+
+    return ret;
+}
+
+/* append a fragment, extending the last one when they are contiguous */
+static int _append(frag_list_t* list, size_t offset, size_t length)
+{
+    frag_t* tail = list->tail;
+
+    if (length == 0)
+        return 0;
+
+    if (tail && tail->offset + tail->length == offset)
+    {
+        list->num_blocks -= tail->length / 4096;
+        tail->length += length;
+        list->num_blocks += tail->length / 4096;
+        return 0;
+    }
+
+    return frags_append(list, offset, length);
+}
+
+static int _compare_frags(const void* a, const void* b)
+{
+    const frag_t* x = *(const frag_t**)a;
+    const frag_t* y = *(const frag_t**)b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* append the parts of the sorted frags that overlap [start, end) */
+static int _append_range(
+    const frag_t** array,
+    size_t num_frags,
+    size_t start,
+    size_t end,
+    frag_list_t* list)
+{
+    size_t lo = 0;
+    size_t hi = num_frags;
+
+    /* find the first fragment that ends after start */
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if (array[mid]->offset + array[mid]->length <= start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < num_frags && array[i]->offset < end; i++)
+    {
+        size_t x = array[i]->offset;
+        size_t y = array[i]->offset + array[i]->length;
+
+        if (x < start)
+            x = start;
+
+        if (y > end)
+            y = end;
+
+        if (x < y && _append(list, x, y - x) < 0)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int boottrace_order_frags(
+    const frag_list_t* frags,
+    size_t start,
+    size_t end,
+    const frag_list_t* reads,
+    size_t block_size,
+    frag_list_t* ordered)
+{
+    int ret = 0;
+    size_t num_blocks;
+    uint8_t* placed = NULL;
+    size_t* order = NULL;
+    size_t num_ordered = 0;
+    const frag_t** array = NULL;
+    size_t num_frags = 0;
+
+    if (ordered)
+        memset(ordered, 0, sizeof(frag_list_t));
+
+    if (!frags || !reads || !ordered || block_size == 0 || end <= start)
+        ERAISE(-EINVAL);
+
+    num_blocks = (end - start + block_size - 1) / block_size;
+
+    if (!(placed = calloc(num_blocks, sizeof(uint8_t))))
+        ERAISE(-ENOMEM);
+
+    if (!(order = malloc(num_blocks * sizeof(size_t))))
+        ERAISE(-ENOMEM);
+
+    /* Number the blocks in the order that the trace first reads them */
+    for (const frag_t* p = reads->head; p; p = p->next)
+    {
+        size_t first;
+        size_t last;
+
+        if (p->length == 0 || p->offset >= end - start)
+            continue;
+
+        first = p->offset / block_size;
+        last = (p->offset + p->length - 1) / block_size;
+
+        if (last >= num_blocks)
+            last = num_blocks - 1;
+
+        for (size_t b = first; b <= last; b++)
+        {
+            if (!placed[b])
+            {
+                placed[b] = 1;
+                order[num_ordered++] = b;
+            }
+        }
+    }
+
+    /* Index the fragments by offset */
+    for (const frag_t* p = frags->head; p; p = p->next)
+        num_frags++;
+
+    if (!(array = malloc((num_frags + 1) * sizeof(frag_t*))))
+        ERAISE(-ENOMEM);
+
+    num_frags = 0;
+
+    for (const frag_t* p = frags->head; p; p = p->next)
+        array[num_frags++] = p;
+
+    qsort(array, num_frags, sizeof(frag_t*), _compare_frags);
+
+    /* First the blocks that were read, in first-read order */
+    for (size_t i = 0; i < num_ordered; i++)
+    {
+        size_t x = start + order[i] * block_size;
+        size_t y = x + block_size;
+
+        ECHECK(_append_range(array, num_frags, x, y < end ? y : end, ordered));
+    }
+
+    /* Then the blocks that were not read, in offset order */
+    for (size_t b = 0; b < num_blocks; b++)
+    {
+        size_t x = start + b * block_size;
+        size_t y = x + block_size;
+
+        if (!placed[b])
+        {
+            ECHECK(_append_range(
+                array, num_frags, x, y < end ? y : end, ordered));
+        }
+    }
+
+done:
+
+    if (ret != 0 && ordered)
+    {
+        frags_release(ordered);
+        memset(ordered, 0, sizeof(frag_list_t));
+    }
+
+    free(placed);
+    free(order);
+    free(array);
+
+    return ret;
+}
@@ -0,0 +1,29 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_BOOTTRACE_H
+#define _CVMBOOT_CVMDISK_BOOTTRACE_H
+
+#include <stddef.h>
+#include "frags.h"
+
+/* Load a block-access trace of the root file system, recorded at boot by
+ * cvmboot_premount.script (the tracefs output of the block_bio_queue event
+ * for the dm-verity device), into a list of reads in the order issued. Each
+ * line is either a tracefs event or a "<sector> <count>" pair, in 512-byte
+ * sectors from the start of the root file system. Writes are ignored. */
+int boottrace_load(const char* path, frag_list_t* reads);
+
+/* Reorder frags (absolute offsets of the data fragments of the root file
+ * system, which spans [start, end)) so that block_size blocks come first in
+ * the order the trace first reads them, followed by the unread blocks in
+ * offset order. The result covers the same bytes, clipped to [start, end). */
+int boottrace_order_frags(
+    const frag_list_t* frags,
+    size_t start,
+    size_t end,
+    const frag_list_t* reads,
+    size_t block_size,
+    frag_list_t* ordered);
+
+#endif /* _CVMBOOT_CVMDISK_BOOTTRACE_H */
@@ -0,0 +1,602 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include "download.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <common/strings.h>
+#include <utils/strings.h>
+#include "eraise.h"
+#include "http.h"
+#include "bits.h"
+#include "progress.h"
+#include "shasha256.h"
+
+#define BLOCK_SIZE 4096
+
+#define MAGIC 0x6c3a9e5d0b174f28
+
+/* number of attempts to fetch a chunk before giving up */
+#define MAX_ATTEMPTS 5
+
+/* header of the <path>.ranges file (followed by one bit per chunk) */
+typedef struct state_header
+{
+    uint64_t magic;
+    uint64_t file_size;
+    uint64_t chunk_size;
+    uint64_t num_chunks;
+    char etag[HTTP_ETAG_SIZE];
+}
+state_header_t;
+
+typedef struct download
+{
+    http_url_t url;
+    char etag[HTTP_ETAG_SIZE];
+    int fd;
+    int state_fd;
+    size_t file_size;
+    size_t chunk_size;
+    size_t num_chunks;
+    bool print_progress;
+    progress_t progress;
+
+    /* fields below are guarded by lock */
+    pthread_mutex_t lock;
+    uint8_t* bits; /* chunks already present in the file */
+    size_t next_chunk; /* next chunk handed to a worker */
+    size_t next_fold; /* next chunk folded into the digest */
+    size_t completed;
+    sha256_t** leaves; /* block hashes of chunks waiting to be folded */
+    shasha256_ctx_t shasha;
+    sha256_t tail_leaf; /* hash of the final partial block */
+    bool has_tail;
+    int err;
+}
+download_t;
+
+static ssize_t _readn(int fd, void* data, size_t size, off_t off)
+{
+    uint8_t* p = data;
+    size_t r = size;
+
+    while (r)
+    {
+        ssize_t n = pread(fd, p, r, off);
+
+        if (n < 0)
+            return -errno;
+
+        if (n == 0)
+            break;
+
+        p += n;
+        r -= n;
+        off += n;
+    }
+
+    return size - r;
+}
+
+static int _writen(int fd, const void* data, size_t size, off_t off)
+{
+    const uint8_t* p = data;
+
+    while (size)
+    {
+        ssize_t n = pwrite(fd, p, size, off);
+
+        if (n <= 0)
+            return (n < 0) ? -errno : -EIO;
+
+        p += n;
+        size -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+static void _fail(download_t* d, int err)
+{
+    pthread_mutex_lock(&d->lock);
+
+    if (d->err == 0)
+        d->err = err;
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* fetch [offset, offset + size) into buf, reconnecting on failure */
+static int _fetch_chunk(
+    download_t* d,
+    http_conn_t** conn,
+    uint8_t* buf,
+    size_t offset,
+    size_t size)
+{
+    int ret = -EIO;
+
+    for (size_t attempt = 0; attempt < MAX_ATTEMPTS; attempt++)
+    {
+        http_response_t resp;
+
+        if (attempt > 0)
+        {
+            http_close(*conn);
+            *conn = NULL;
+            sleep(attempt);
+        }
+
+        if (!*conn && (ret = http_connect(&d->url, conn)) < 0)
+            continue;
+
+        if ((ret = http_get_range(*conn, &d->url, offset, offset + size - 1,
+            &resp)) < 0)
+        {
+            continue;
+        }
+
+        /* client errors (bad SAS token, missing blob) will not go away */
+        if (resp.status >= 400 && resp.status < 500)
+            return -EACCES;
+
+        if (resp.status != 206 || !resp.has_range ||
+            resp.range_first != offset ||
+            resp.range_last != offset + size - 1 ||
+            resp.content_length != size)
+        {
+            ret = -EPROTO;
+            continue;
+        }
+
+        /* the blob must not change between requests */
+        if (*d->etag && *resp.etag && strcmp(d->etag, resp.etag) != 0)
+            return -ESTALE;
+
+        if ((ret = http_read_body(*conn, buf, size)) < 0)
+            continue;
+
+        if (!resp.keep_alive)
+        {
+            http_close(*conn);
+            *conn = NULL;
+        }
+
+        return 0;
+    }
+
+    return ret;
+}
+
+/* write the non-zero runs of blocks, leaving zero blocks as holes */
+static int _write_chunk(
+    download_t* d,
+    const uint8_t* buf,
+    size_t offset,
+    size_t size,
+    const sha256_t* leaves,
+    const sha256_t* zero_leaf)
+{
+    const size_t nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t i = 0;
+
+    while (i < nblocks)
+    {
+        size_t j = i;
+
+        while (j < nblocks && !sha256_equal(&leaves[j], zero_leaf))
+            j++;
+
+        if (j > i)
+        {
+            const size_t start = i * BLOCK_SIZE;
+            const size_t end = (j * BLOCK_SIZE < size) ? j * BLOCK_SIZE : size;
+            int r;
+
+            if ((r = _writen(d->fd, buf + start, end - start,
+                offset + start)) < 0)
+            {
+                return r;
+            }
+        }
+
+        i = j + 1;
+    }
+
+    return 0;
+}
+
+/* mark the chunk as present and fold completed chunks into the digest */
+static int _complete_chunk(
+    download_t* d,
+    size_t index,
+    sha256_t* leaves,
+    bool present)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (!present)
+    {
+        const size_t byte = index / 8;
+
+        set_bit(d->bits, index);
+
+        if (_writen(d->state_fd, &d->bits[byte], 1,
+            sizeof(state_header_t) + byte) < 0)
+        {
+            ret = -EIO;
+        }
+    }
+
+    d->leaves[index] = leaves;
+
+    /* chunks complete out of order, but the digest is sequential */
+    while (d->next_fold < d->num_chunks && d->leaves[d->next_fold])
+    {
+        const size_t i = d->next_fold;
+        const size_t offset = i * d->chunk_size;
+        size_t size = d->file_size - offset;
+        size_t nfull;
+
+        if (size > d->chunk_size)
+            size = d->chunk_size;
+
+        nfull = size / BLOCK_SIZE;
+
+        for (size_t j = 0; j < nfull; j++)
+            shasha256_update_leaf(&d->shasha, &d->leaves[i][j]);
+
+        if (size % BLOCK_SIZE)
+        {
+            d->tail_leaf = d->leaves[i][nfull];
+            d->has_tail = true;
+        }
+
+        free(d->leaves[i]);
+        d->leaves[i] = NULL;
+        d->next_fold++;
+    }
+
+    d->completed++;
+
+    if (d->print_progress)
+        progress_update(&d->progress, d->completed, d->num_chunks);
+
+    pthread_mutex_unlock(&d->lock);
+
+    return ret;
+}
+
+static void* _worker(void* arg)
+{
+    download_t* d = (download_t*)arg;
+    http_conn_t* conn = NULL;
+    uint8_t* buf = NULL;
+    sha256_t zero_leaf;
+    int r = 0;
+
+    if (!(buf = malloc(d->chunk_size)))
+    {
+        r = -ENOMEM;
+        goto done;
+    }
+
+    memset(buf, 0, BLOCK_SIZE);
+    sha256_compute(&zero_leaf, buf, BLOCK_SIZE);
+
+    for (;;)
+    {
+        size_t index;
+        bool present;
+        size_t offset;
+        size_t size;
+        size_t nblocks;
+        sha256_t* leaves;
+
+        pthread_mutex_lock(&d->lock);
+        {
+            if (d->err || d->next_chunk == d->num_chunks)
+            {
+                pthread_mutex_unlock(&d->lock);
+                break;
+            }
+
+            index = d->next_chunk++;
+            present = test_bit(d->bits, index);
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        offset = index * d->chunk_size;
+        size = d->file_size - offset;
+
+        if (size > d->chunk_size)
+            size = d->chunk_size;
+
+        /* chunks from an earlier run are only read back for the digest */
+        if (present)
+        {
+            ssize_t n;
+
+            if ((n = _readn(d->fd, buf, size, offset)) != size)
+            {
+                r = (n < 0) ? n : -EIO;
+                goto done;
+            }
+        }
+        else if ((r = _fetch_chunk(d, &conn, buf, offset, size)) < 0)
+        {
+            goto done;
+        }
+
+        nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        if (!(leaves = malloc(nblocks * sizeof(sha256_t))))
+        {
+            r = -ENOMEM;
+            goto done;
+        }
+
+        for (size_t i = 0; i < nblocks; i++)
+        {
+            const uint8_t* p = buf + i * BLOCK_SIZE;
+            const size_t n = (i + 1 == nblocks) ? size - i * BLOCK_SIZE :
+                BLOCK_SIZE;
+
+            if (n == BLOCK_SIZE && all_zeros(p, n))
+                leaves[i] = zero_leaf;
+            else
+                sha256_compute(&leaves[i], p, n);
+        }
+
+        if (!present &&
+            (r = _write_chunk(d, buf, offset, size, leaves, &zero_leaf)) < 0)
+        {
+            free(leaves);
+            goto done;
+        }
+
+        if ((r = _complete_chunk(d, index, leaves, present)) < 0)
+            goto done;
+    }
+
+done:
+
+    if (r < 0)
+        _fail(d, r);
+
+    http_close(conn);
+    free(buf);
+
+    return NULL;
+}
+
+/* get the size and entity tag of the blob with a one-byte range request */
+static int _probe(download_t* d)
+{
+    int ret = 0;
+    http_conn_t* conn = NULL;
+    http_response_t resp;
+    char c;
+
+    ECHECK(http_connect(&d->url, &conn));
+    ECHECK(http_get_range(conn, &d->url, 0, 0, &resp));
+
+    /* a plain 200 means the server ignores range requests */
+    if (resp.status != 206 || !resp.has_range)
+        ERAISE((resp.status == 200) ? -ENOTSUP : -EACCES);
+
+    if (resp.content_length != 1)
+        ERAISE(-EPROTO);
+
+    ECHECK(http_read_body(conn, &c, 1));
+
+    d->file_size = resp.range_total;
+    strlcpy(d->etag, resp.etag, sizeof(d->etag));
+
+done:
+    http_close(conn);
+    return ret;
+}
+
+/* resume from <path>.ranges if it matches the blob; else start over */
+static int _open_state(download_t* d, const char* path)
+{
+    int ret = 0;
+    char state_path[PATH_MAX];
+    const size_t bits_size = (d->num_chunks + 7) / 8;
+    state_header_t header;
+    struct stat statbuf;
+    bool resume = false;
+
+    if (strlcpy2(state_path, path, DOWNLOAD_STATE_SUFFIX,
+        sizeof(state_path)) >= sizeof(state_path))
+    {
+        ERAISE(-ENAMETOOLONG);
+    }
+
+    if (!(d->bits = calloc(1, bits_size)))
+        ERAISE(-ENOMEM);
+
+    if ((d->state_fd = open(state_path, O_RDWR | O_CREAT, 0644)) < 0)
+        ERAISE(-errno);
+
+    if (_readn(d->state_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        header.magic == MAGIC &&
+        header.file_size == d->file_size &&
+        header.chunk_size == d->chunk_size &&
+        header.num_chunks == d->num_chunks &&
+        strncmp(header.etag, d->etag, sizeof(header.etag)) == 0 &&
+        fstat(d->fd, &statbuf) == 0 &&
+        statbuf.st_size == d->file_size &&
+        _readn(d->state_fd, d->bits, bits_size, sizeof(header)) == bits_size)
+    {
+        resume = true;
+    }
+
+    if (!resume)
+    {
+        /* discard old contents so that zero blocks become holes */
+        if (ftruncate(d->fd, 0) < 0 || ftruncate(d->fd, d->file_size) < 0)
+            ERAISE(-errno);
+
+        memset(&header, 0, sizeof(header));
+        header.magic = MAGIC;
+        header.file_size = d->file_size;
+        header.chunk_size = d->chunk_size;
+        header.num_chunks = d->num_chunks;
+        strlcpy(header.etag, d->etag, sizeof(header.etag));
+        memset(d->bits, 0, bits_size);
+
+        if (ftruncate(d->state_fd, 0) < 0)
+            ERAISE(-errno);
+
+        ECHECK(_writen(d->state_fd, &header, sizeof(header), 0));
+        ECHECK(_writen(d->state_fd, d->bits, bits_size, sizeof(header)));
+    }
+
+done:
+    return ret;
+}
+
+int download_file(
+    const char* url,
+    const char* path,
+    const download_options_t* options,
+    sha256_t* digest)
+{
+    int ret = 0;
+    download_t d;
+    pthread_t* threads = NULL;
+    size_t nthreads = 0;
+    char state_path[PATH_MAX];
+
+    memset(&d, 0, sizeof(d));
+    d.fd = -1;
+    d.state_fd = -1;
+    pthread_mutex_init(&d.lock, NULL);
+
+    if (!url || !path || !options || !digest)
+        ERAISE(-EINVAL);
+
+    if (options->connections == 0 || options->chunk_size == 0 ||
+        (options->chunk_size % BLOCK_SIZE) != 0)
+    {
+        ERAISE(-EINVAL);
+    }
+
+    /* a peer that drops a TLS connection must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    ECHECK(http_parse_url(url, &d.url));
+    ECHECK(_probe(&d));
+
+    d.chunk_size = options->chunk_size;
+    d.num_chunks = (d.file_size + d.chunk_size - 1) / d.chunk_size;
+    d.print_progress = options->progress;
+
+    if ((d.fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        ERAISE(-errno);
+
+    ECHECK(_open_state(&d, path));
+
+    if (!(d.leaves = calloc(d.num_chunks + 1, sizeof(sha256_t*))))
+        ERAISE(-ENOMEM);
+
+    shasha256_init(&d.shasha);
+
+    if (d.print_progress)
+    {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "Downloading %s", path);
+        progress_start(&d.progress, msg);
+    }
+
+    /* start the workers (one connection each) */
+    {
+        size_t n = options->connections;
+
+        if (n > d.num_chunks)
+            n = d.num_chunks;
+
+        if (!(threads = calloc(n, sizeof(pthread_t))))
+            ERAISE(-ENOMEM);
+
+        for (; nthreads < n; nthreads++)
+        {
+            if (pthread_create(&threads[nthreads], NULL, _worker, &d) != 0)
+            {
+                _fail(&d, -EAGAIN);
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    nthreads = 0;
+
+    /* keep <path>.ranges so that the download can be resumed */
+    if (d.err)
+    {
+        if (d.print_progress)
+            printf("\n");
+
+        ERAISE(d.err);
+    }
+
+    if (d.next_fold != d.num_chunks)
+        ERAISE(-EIO);
+
+    shasha256_final_leaf(digest, &d.shasha, d.has_tail ? &d.tail_leaf : NULL);
+
+    if (fsync(d.fd) < 0)
+        ERAISE(-errno);
+
+    strlcpy2(state_path, path, DOWNLOAD_STATE_SUFFIX, sizeof(state_path));
+
+    if (unlink(state_path) < 0)
+        ERAISE(-errno);
+
+    if (d.print_progress)
+        progress_end(&d.progress);
+
+done:
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (d.leaves)
+    {
+        for (size_t i = 0; i < d.num_chunks; i++)
+            free(d.leaves[i]);
+
+        free(d.leaves);
+    }
+
+    free(threads);
+    free(d.bits);
+
+    if (d.fd >= 0)
+        close(d.fd);
+
+    if (d.state_fd >= 0)
+        close(d.state_fd);
+
+    pthread_mutex_destroy(&d.lock);
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_DOWNLOAD_H
+#define _CVMBOOT_CVMDISK_DOWNLOAD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <utils/sha256.h>
+
+#define DOWNLOAD_DEFAULT_CONNECTIONS 8
+
+#define DOWNLOAD_DEFAULT_CHUNK_SIZE ((size_t)(4 * 1024 * 1024))
+
+/* suffix of the file that records which chunks have been downloaded */
+#define DOWNLOAD_STATE_SUFFIX ".ranges"
+
+typedef struct download_options
+{
+    /* number of concurrent HTTP connections */
+    size_t connections;
+
+    /* size of each range request (a multiple of 4096) */
+    size_t chunk_size;
+
+    /* print progress to standard output */
+    bool progress;
+}
+download_options_t;
+
+/* Download url to path with parallel range requests, leaving zero blocks as
+ * holes. Completed chunks are recorded in <path>.ranges so an interrupted
+ * download resumes where it left off. On success the state file is removed
+ * and the shasha256 digest of the file is returned.
+ */
+int download_file(
+    const char* url,
+    const char* path,
+    const download_options_t* options,
+    sha256_t* digest);
+
+#endif /* _CVMBOOT_CVMDISK_DOWNLOAD_H */
@@ -158,3 +158,36 @@ int preprocess_events(const char* events_path, const char* signer)
 
     return ret;
 }
+
+int compile_events(const char* events_path, const char* blob_path)
+{
+    char* text = NULL;
+    size_t text_size;
+    void* blob = NULL;
+    size_t blob_size;
+    unsigned int error_line;
+    err_t err;
+
+    if (load_file(events_path, (void**)&text, &text_size) != 0)
+        ERR("failed to load events file: %s", events_path);
+
+    if (events_blob_compile(
+        text,
+        text_size,
+        &blob,
+        &blob_size,
+        &error_line,
+        &err) != 0)
+    {
+        ERR("failed to compile events: %s:%u: %s",
+            events_path, error_line, err.buf);
+    }
+
+    if (write_file(blob_path, blob, blob_size) != 0)
+        ERR("failed to write file: %s", blob_path);
+
+    free(blob);
+    free(text);
+
+    return 0;
+}
@@ -33,4 +33,7 @@ int process_events(
     const char* signer,
     process_events_callback_data_t* cbd);
 
+/* Precompile the events file into the binary form used by the boot loader */
+int compile_events(const char* events_path, const char* blob_path);
+
 #endif /* _CVMBOOT_CVMDISK_EVENTS_H */
@@ -0,0 +1,371 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "ext4.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "eraise.h"
+#include "bits.h"
+
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPERBLOCK_SIZE 1024
+#define EXT4_MAGIC 0xEF53
+
+/* superblock fields (byte offsets) */
+#define SB_BLOCKS_COUNT_LO 0x04
+#define SB_FIRST_DATA_BLOCK 0x14
+#define SB_LOG_BLOCK_SIZE 0x18
+#define SB_BLOCKS_PER_GROUP 0x20
+#define SB_INODES_PER_GROUP 0x28
+#define SB_MAGIC 0x38
+#define SB_STATE 0x3A
+#define SB_INODE_SIZE 0x58
+#define SB_FEATURE_COMPAT 0x5C
+#define SB_FEATURE_INCOMPAT 0x60
+#define SB_FEATURE_RO_COMPAT 0x64
+#define SB_RESERVED_GDT_BLOCKS 0xCE
+#define SB_DESC_SIZE 0xFE
+#define SB_BLOCKS_COUNT_HI 0x150
+#define SB_BACKUP_BGS 0x24C
+
+/* group descriptor fields (byte offsets) */
+#define BG_BLOCK_BITMAP_LO 0x00
+#define BG_INODE_BITMAP_LO 0x04
+#define BG_INODE_TABLE_LO 0x08
+#define BG_FLAGS 0x12
+#define BG_BLOCK_BITMAP_HI 0x20
+#define BG_INODE_BITMAP_HI 0x24
+#define BG_INODE_TABLE_HI 0x28
+
+#define EXT4_VALID_FS 0x0001
+#define EXT4_ERROR_FS 0x0002
+
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2 0x0200
+
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC 0x0200
+
+#define EXT4_FEATURE_INCOMPAT_RECOVER 0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+
+/* The features known not to change the layout of the block bitmaps and of
+ * the metadata derived for BLOCK_UNINIT groups; any other incompat or
+ * ro_compat feature (such as bigalloc, whose bitmaps count clusters rather
+ * than blocks, meta_bg or a journal to recover) is refused */
+#define EXT4_KNOWN_INCOMPAT ( \
+    0x0002 /* filetype */ | \
+    0x0040 /* extents */ | \
+    EXT4_FEATURE_INCOMPAT_64BIT | \
+    0x0100 /* mmp */ | \
+    0x0200 /* flex_bg */ | \
+    0x0400 /* ea_inode */ | \
+    0x2000 /* csum_seed */ | \
+    0x4000 /* largedir */ | \
+    0x8000 /* inline_data */ | \
+    0x10000 /* encrypt */ | \
+    0x20000 /* casefold */)
+
+#define EXT4_KNOWN_RO_COMPAT ( \
+    EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+    0x0002 /* large_file */ | \
+    0x0008 /* huge_file */ | \
+    0x0010 /* gdt_csum */ | \
+    0x0020 /* dir_nlink */ | \
+    0x0040 /* extra_isize */ | \
+    0x0100 /* quota */ | \
+    0x0400 /* metadata_csum */ | \
+    0x1000 /* readonly */ | \
+    0x2000 /* project */ | \
+    0x8000 /* verity */ | \
+    0x10000 /* orphan_present */)
+
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+#define EXT4_MIN_DESC_SIZE 32
+#define EXT4_MIN_DESC_SIZE_64BIT 64
+
+static uint16_t _u16(const uint8_t* p, size_t offset)
+{
+    uint16_t x;
+    memcpy(&x, p + offset, sizeof(x));
+    return x;
+}
+
+static uint32_t _u32(const uint8_t* p, size_t offset)
+{
+    uint32_t x;
+    memcpy(&x, p + offset, sizeof(x));
+    return x;
+}
+
+static uint64_t _desc_u64(
+    const uint8_t* desc,
+    size_t desc_size,
+    size_t lo,
+    size_t hi)
+{
+    uint64_t x = _u32(desc, lo);
+
+    if (desc_size >= EXT4_MIN_DESC_SIZE_64BIT)
+        x |= (uint64_t)_u32(desc, hi) << 32;
+
+    return x;
+}
+
+static bool _is_power_of(size_t x, size_t n)
+{
+    while (x > 1 && x % n == 0)
+        x /= n;
+
+    return x == 1;
+}
+
+/* whether the group holds a copy of the superblock and descriptors */
+static bool _has_super(const uint8_t* sb, size_t group)
+{
+    if (group == 0)
+        return true;
+
+    if (_u32(sb, SB_FEATURE_COMPAT) & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+    {
+        return group == _u32(sb, SB_BACKUP_BGS) ||
+            group == _u32(sb, SB_BACKUP_BGS + 4);
+    }
+
+    if (!(_u32(sb, SB_FEATURE_RO_COMPAT) & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return true;
+
+    return group == 1 || _is_power_of(group, 3) || _is_power_of(group, 5) ||
+        _is_power_of(group, 7);
+}
+
+static void _set_range(uint8_t* bits, size_t nbits, uint64_t first, uint64_t n)
+{
+    for (uint64_t i = first; i < first + n && i < nbits; i++)
+        set_bit(bits, i);
+}
+
+static int _read(int fd, void* buf, size_t size, size_t offset)
+{
+    if (pread(fd, buf, size, offset) != (ssize_t)size)
+        return -EIO;
+
+    return 0;
+}
+
+int ext4_get_bitmap(const char* path, size_t offset, ext4_bitmap_t* bitmap)
+{
+    int ret = 0;
+    int fd = -1;
+    uint8_t sb[EXT4_SUPERBLOCK_SIZE];
+    uint32_t incompat;
+    uint32_t ro_compat;
+    size_t block_size;
+    uint64_t num_blocks;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    size_t desc_size;
+    size_t num_groups;
+    size_t gdt_blocks;
+    size_t inode_table_blocks;
+    uint8_t* gdt = NULL;
+    uint8_t* block = NULL;
+    uint8_t* bits = NULL;
+
+    if (bitmap)
+        memset(bitmap, 0, sizeof(ext4_bitmap_t));
+
+    if (!path || !bitmap)
+        ERAISE(-EINVAL);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        ERAISE(-errno);
+
+    ECHECK(_read(fd, sb, sizeof(sb), offset + EXT4_SUPERBLOCK_OFFSET));
+
+    if (_u16(sb, SB_MAGIC) != EXT4_MAGIC)
+        ERAISE(-EINVAL);
+
+    /* Trust the bitmaps only for a cleanly unmounted file system */
+    if (!(_u16(sb, SB_STATE) & EXT4_VALID_FS) ||
+        (_u16(sb, SB_STATE) & EXT4_ERROR_FS))
+    {
+        ERAISE(-ENOTSUP);
+    }
+
+    incompat = _u32(sb, SB_FEATURE_INCOMPAT);
+
+    ro_compat = _u32(sb, SB_FEATURE_RO_COMPAT);
+
+    if ((incompat & (EXT4_FEATURE_INCOMPAT_RECOVER |
+        EXT4_FEATURE_INCOMPAT_META_BG)) ||
+        (ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC) ||
+        (incompat & ~EXT4_KNOWN_INCOMPAT) ||
+        (ro_compat & ~EXT4_KNOWN_RO_COMPAT))
+    {
+        ERAISE(-ENOTSUP);
+    }
+
+    if (_u32(sb, SB_LOG_BLOCK_SIZE) > 6)
+        ERAISE(-EINVAL);
+
+    block_size = 1024 << _u32(sb, SB_LOG_BLOCK_SIZE);
+    num_blocks = _u32(sb, SB_BLOCKS_COUNT_LO);
+    first_data_block = _u32(sb, SB_FIRST_DATA_BLOCK);
+    blocks_per_group = _u32(sb, SB_BLOCKS_PER_GROUP);
+    desc_size = EXT4_MIN_DESC_SIZE;
+
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+    {
+        num_blocks |= (uint64_t)_u32(sb, SB_BLOCKS_COUNT_HI) << 32;
+        desc_size = _u16(sb, SB_DESC_SIZE);
+
+        if (desc_size < EXT4_MIN_DESC_SIZE_64BIT)
+            ERAISE(-EINVAL);
+    }
+
+    if (blocks_per_group == 0 || blocks_per_group > block_size * 8 ||
+        first_data_block >= num_blocks)
+    {
+        ERAISE(-EINVAL);
+    }
+
+    num_groups = (num_blocks - first_data_block + blocks_per_group - 1) /
+        blocks_per_group;
+    gdt_blocks = (num_groups * desc_size + block_size - 1) / block_size;
+    inode_table_blocks = ((size_t)_u32(sb, SB_INODES_PER_GROUP) *
+        _u16(sb, SB_INODE_SIZE) + block_size - 1) / block_size;
+
+    /* Read the group descriptor table, which follows the superblock */
+    if (!(gdt = malloc(num_groups * desc_size)))
+        ERAISE(-ENOMEM);
+
+    ECHECK(_read(fd, gdt, num_groups * desc_size,
+        offset + (first_data_block + 1) * block_size));
+
+    if (!(block = malloc(block_size)))
+        ERAISE(-ENOMEM);
+
+    if (!(bits = calloc((num_blocks + 7) / 8, 1)))
+        ERAISE(-ENOMEM);
+
+    /* Blocks before the first group (the boot block) are in use */
+    for (size_t i = 0; i < first_data_block; i++)
+        set_bit(bits, i);
+
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        const uint8_t* desc = gdt + g * desc_size;
+        const uint64_t first = first_data_block + g * blocks_per_group;
+        uint64_t n = blocks_per_group;
+        uint64_t bitmap_block = _desc_u64(
+            desc, desc_size, BG_BLOCK_BITMAP_LO, BG_BLOCK_BITMAP_HI);
+
+        if (first + n > num_blocks)
+            n = num_blocks - first;
+
+        /* A group whose bitmap was never initialized only holds its copy
+         * of the superblock and descriptors, and the bitmaps and inode
+         * tables placed in it (which are marked below for all groups) */
+        if (_u16(desc, BG_FLAGS) & EXT4_BG_BLOCK_UNINIT)
+        {
+            if (_has_super(sb, g))
+            {
+                _set_range(bits, num_blocks, first,
+                    1 + gdt_blocks + _u16(sb, SB_RESERVED_GDT_BLOCKS));
+            }
+
+            continue;
+        }
+
+        if (bitmap_block == 0 || bitmap_block >= num_blocks)
+            ERAISE(-EINVAL);
+
+        ECHECK(_read(fd, block, block_size, offset + bitmap_block * block_size));
+
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (test_bit(block, i))
+                set_bit(bits, first + i);
+        }
+    }
+
+    /* The bitmaps and inode tables of every group (with flex_bg, these may
+     * be in another group, including one whose bitmap is uninitialized) */
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        const uint8_t* desc = gdt + g * desc_size;
+
+        _set_range(bits, num_blocks, _desc_u64(desc, desc_size,
+            BG_BLOCK_BITMAP_LO, BG_BLOCK_BITMAP_HI), 1);
+        _set_range(bits, num_blocks, _desc_u64(desc, desc_size,
+            BG_INODE_BITMAP_LO, BG_INODE_BITMAP_HI), 1);
+        _set_range(bits, num_blocks, _desc_u64(desc, desc_size,
+            BG_INODE_TABLE_LO, BG_INODE_TABLE_HI), inode_table_blocks);
+    }
+
+    bitmap->bits = bits;
+    bitmap->num_blocks = num_blocks;
+    bitmap->block_size = block_size;
+    bits = NULL;
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    free(gdt);
+    free(block);
+    free(bits);
+
+    return ret;
+}
+
+void ext4_release_bitmap(ext4_bitmap_t* bitmap)
+{
+    if (bitmap)
+    {
+        free(bitmap->bits);
+        memset(bitmap, 0, sizeof(ext4_bitmap_t));
+    }
+}
+
+int ext4_get_extents(
+    const ext4_bitmap_t* bitmap,
+    size_t offset,
+    frag_list_t* extents)
+{
+    int ret = 0;
+
+    if (!bitmap || !extents)
+        ERAISE(-EINVAL);
+
+    for (size_t i = 0; i < bitmap->num_blocks; )
+    {
+        size_t n = 0;
+
+        if (!test_bit(bitmap->bits, i))
+        {
+            i++;
+            continue;
+        }
+
+        while (i + n < bitmap->num_blocks && test_bit(bitmap->bits, i + n))
+            n++;
+
+        if (frags_append(extents, offset + i * bitmap->block_size,
+            n * bitmap->block_size) < 0)
+        {
+            ERAISE(-ENOMEM);
+        }
+
+        i += n;
+    }
+
+done:
+    return ret;
+}
@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_EXT4_H
+#define _CVMBOOT_CVMDISK_EXT4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "frags.h"
+
+typedef struct ext4_bitmap
+{
+    /* one bit per file-system block, set if the block may be in use */
+    uint8_t* bits;
+    size_t num_blocks;
+    size_t block_size;
+}
+ext4_bitmap_t;
+
+/* Build the allocation bitmap of the EXT4 file system that starts at the
+ * given byte offset of path, from its superblock, group descriptors and
+ * block bitmaps. For groups whose bitmap was never initialized
+ * (BLOCK_UNINIT), it is derived from the metadata that they hold. Fails
+ * with -ENOTSUP when the file system needs journal recovery or has an
+ * incompat or ro_compat feature not known here (such as bigalloc). */
+int ext4_get_bitmap(const char* path, size_t offset, ext4_bitmap_t* bitmap);
+
+void ext4_release_bitmap(ext4_bitmap_t* bitmap);
+
+/* Append the runs of in-use blocks of the bitmap to extents, as byte ranges
+ * from the given offset (the start of the file system) */
+int ext4_get_extents(
+    const ext4_bitmap_t* bitmap,
+    size_t offset,
+    frag_list_t* extents);
+
+#endif /* _CVMBOOT_CVMDISK_EXT4_H */
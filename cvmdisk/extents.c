@@ -0,0 +1,390 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include "extents.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "eraise.h"
+#include "frags.h"
+#include "round.h"
+
+/* ranges claimed by a reading thread at a time */
+#define BATCH_SIZE 4
+
+typedef struct scan
+{
+    pthread_mutex_t lock;
+    int fd;
+    extents_t* extents;
+    size_t next;
+    int err;
+}
+scan_t;
+
+static int _append(extents_t* extents, uint64_t offset, uint64_t length)
+{
+    int ret = 0;
+    extent_t* e;
+
+    if (extents->size == extents->capacity)
+    {
+        size_t capacity = extents->capacity ? extents->capacity * 2 : 1024;
+        extent_t* data;
+
+        if (!(data = realloc(extents->data, capacity * sizeof(extent_t))))
+            ERAISE(-ENOMEM);
+
+        extents->data = data;
+        extents->capacity = capacity;
+    }
+
+    e = &extents->data[extents->size++];
+    memset(e, 0, sizeof(extent_t));
+    e->offset = offset;
+    e->length = length;
+
+done:
+    return ret;
+}
+
+static bool _is_zero(const uint8_t* p, size_t n)
+{
+    while (n && *p == 0)
+    {
+        p++;
+        n--;
+    }
+
+    return n == 0;
+}
+
+/* Trim the zero pages from both ends of e (emptying it if all zero) */
+static int _scan_extent(
+    int fd,
+    extent_t* e,
+    size_t alignment,
+    bool sha256,
+    uint8_t* buf)
+{
+    int ret = 0;
+    size_t first = 0;
+    size_t last = e->length;
+
+    if (pread(fd, buf, e->length, e->offset) != (ssize_t)e->length)
+        ERAISE(-EIO);
+
+    while (first < last && _is_zero(buf + first, alignment))
+        first += alignment;
+
+    while (last > first && _is_zero(buf + last - alignment, alignment))
+        last -= alignment;
+
+    e->offset += first;
+    e->length = last - first;
+
+    if (sha256 && e->length)
+        sha256_compute(&e->hash, buf + first, e->length);
+
+done:
+    return ret;
+}
+
+static void* _worker(void* arg)
+{
+    scan_t* s = (scan_t*)arg;
+    extents_t* extents = s->extents;
+    uint8_t* buf;
+    int r = 0;
+
+    if (!(buf = malloc(extents->granularity)))
+    {
+        r = -ENOMEM;
+        goto done;
+    }
+
+    for (;;)
+    {
+        size_t first;
+        size_t last;
+
+        pthread_mutex_lock(&s->lock);
+        {
+            if (s->err || s->next == extents->size)
+            {
+                pthread_mutex_unlock(&s->lock);
+                break;
+            }
+
+            first = s->next;
+            last = first + BATCH_SIZE;
+
+            if (last > extents->size)
+                last = extents->size;
+
+            s->next = last;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        for (size_t i = first; i < last; i++)
+        {
+            if ((r = _scan_extent(s->fd, &extents->data[i],
+                extents->alignment, extents->sha256, buf)) < 0)
+            {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    if (r != 0)
+    {
+        pthread_mutex_lock(&s->lock);
+
+        if (!s->err)
+            s->err = r;
+
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int extents_find(
+    const char* path,
+    size_t granularity,
+    size_t alignment,
+    bool sha256,
+    size_t num_threads,
+    extents_t* extents)
+{
+    int ret = 0;
+    frag_list_t frags = FRAG_LIST_INITIALIZER;
+    frag_list_t holes = FRAG_LIST_INITIALIZER;
+    scan_t s;
+    pthread_t* threads = NULL;
+    size_t nthreads = 0;
+    struct stat st;
+    size_t n = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.fd = -1;
+    pthread_mutex_init(&s.lock, NULL);
+
+    if (extents)
+        memset(extents, 0, sizeof(extents_t));
+
+    if (!path || !extents || alignment == 0 || (alignment & (alignment - 1))
+        || granularity == 0 || granularity % alignment || num_threads == 0)
+    {
+        ERAISE(-EINVAL);
+    }
+
+    if ((s.fd = open(path, O_RDONLY)) < 0)
+        ERAISE(-errno);
+
+    if (fstat(s.fd, &st) < 0)
+        ERAISE(-errno);
+
+    /* Page blobs (and VHDs) are a whole number of pages */
+    if (st.st_size % alignment)
+        ERAISE(-EINVAL);
+
+    extents->file_size = st.st_size;
+    extents->granularity = granularity;
+    extents->alignment = alignment;
+    extents->sha256 = sha256;
+
+    if (st.st_size == 0)
+        goto done;
+
+    ECHECK(frags_find(path, 0, st.st_size, &frags, &holes));
+
+    /* Widen the fragments to pages and merge them within chunks */
+    for (const frag_t* p = frags.head; p; p = p->next)
+    {
+        uint64_t x = p->offset / alignment * alignment;
+        uint64_t y = round_up_to_multiple(p->offset + p->length, alignment);
+
+        if (y > extents->file_size)
+            y = extents->file_size;
+
+        while (x < y)
+        {
+            const uint64_t chunk = x / granularity;
+            uint64_t end = (chunk + 1) * granularity;
+            extent_t* last;
+
+            if (end > y)
+                end = y;
+
+            last = extents->size ? &extents->data[extents->size - 1] : NULL;
+
+            if (last && last->offset / granularity == chunk)
+            {
+                if (end > last->offset + last->length)
+                    last->length = end - last->offset;
+            }
+            else
+            {
+                ECHECK(_append(extents, x, end - x));
+            }
+
+            x = end;
+        }
+    }
+
+    /* Trim zero pages and hash the ranges in parallel */
+    s.extents = extents;
+    {
+        if (!(threads = calloc(num_threads, sizeof(pthread_t))))
+            ERAISE(-ENOMEM);
+
+        for (; nthreads < num_threads; nthreads++)
+        {
+            if (pthread_create(&threads[nthreads], NULL, _worker, &s) != 0)
+                break;
+        }
+
+        if (nthreads == 0)
+            ERAISE(-EAGAIN);
+
+        for (size_t i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+
+        nthreads = 0;
+        ECHECK(s.err);
+    }
+
+    /* Drop the ranges that were all zero */
+    for (size_t i = 0; i < extents->size; i++)
+    {
+        if (extents->data[i].length)
+            extents->data[n++] = extents->data[i];
+    }
+
+    extents->size = n;
+
+done:
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (s.fd >= 0)
+        close(s.fd);
+
+    if (ret != 0 && extents)
+        extents_release(extents);
+
+    pthread_mutex_destroy(&s.lock);
+    free(threads);
+    frags_release(&frags);
+    frags_release(&holes);
+
+    return ret;
+}
+
+uint64_t extents_sizeof(const extents_t* extents)
+{
+    uint64_t n = 0;
+
+    for (size_t i = 0; i < extents->size; i++)
+        n += extents->data[i].length;
+
+    return n;
+}
+
+int extents_write_json(const extents_t* extents, FILE* os)
+{
+    int ret = 0;
+
+    if (!extents || !os)
+        ERAISE(-EINVAL);
+
+    fprintf(os, "{\n");
+    fprintf(os, "  \"file_size\": %lu,\n", extents->file_size);
+    fprintf(os, "  \"granularity\": %zu,\n", extents->granularity);
+    fprintf(os, "  \"alignment\": %zu,\n", extents->alignment);
+    fprintf(os, "  \"data_size\": %lu,\n", extents_sizeof(extents));
+    fprintf(os, "  \"ranges\": [");
+
+    for (size_t i = 0; i < extents->size; i++)
+    {
+        const extent_t* e = &extents->data[i];
+
+        fprintf(os, "%s\n    { \"offset\": %lu, \"length\": %lu",
+            i ? "," : "", e->offset, e->length);
+
+        if (extents->sha256)
+        {
+            sha256_string_t str;
+            sha256_format(&str, &e->hash);
+            fprintf(os, ", \"sha256\": \"%s\"", str.buf);
+        }
+
+        fprintf(os, " }");
+    }
+
+    fprintf(os, "%s]\n", extents->size ? "\n  " : "");
+    fprintf(os, "}\n");
+
+    if (ferror(os))
+        ERAISE(-EIO);
+
+done:
+    return ret;
+}
+
+int extents_write_binary(const extents_t* extents, FILE* os)
+{
+    int ret = 0;
+    extents_header_t h;
+
+    if (!extents || !os)
+        ERAISE(-EINVAL);
+
+    memset(&h, 0, sizeof(h));
+    h.magic = EXTENTS_MAGIC;
+    h.version = EXTENTS_VERSION;
+    h.flags = extents->sha256 ? EXTENTS_FLAG_SHA256 : 0;
+    h.file_size = extents->file_size;
+    h.granularity = extents->granularity;
+    h.alignment = extents->alignment;
+    h.num_ranges = extents->size;
+
+    if (fwrite(&h, sizeof(h), 1, os) != 1)
+        ERAISE(-EIO);
+
+    for (size_t i = 0; i < extents->size; i++)
+    {
+        const extent_t* e = &extents->data[i];
+        const uint64_t record[2] = { e->offset, e->length };
+
+        if (fwrite(record, sizeof(record), 1, os) != 1)
+            ERAISE(-EIO);
+
+        if (extents->sha256 && fwrite(&e->hash, sizeof(e->hash), 1, os) != 1)
+            ERAISE(-EIO);
+    }
+
+done:
+    return ret;
+}
+
+void extents_release(extents_t* extents)
+{
+    if (extents)
+    {
+        free(extents->data);
+        extents->data = NULL;
+        extents->size = 0;
+        extents->capacity = 0;
+    }
+}
@@ -0,0 +1,87 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_EXTENTS_H
+#define _CVMBOOT_CVMDISK_EXTENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <utils/sha256.h>
+
+#define EXTENTS_DEFAULT_GRANULARITY ((size_t)4 * 1024 * 1024)
+#define EXTENTS_DEFAULT_ALIGNMENT ((size_t)512)
+
+/* "CVMEXTS\0" as a little-endian integer */
+#define EXTENTS_MAGIC 0x00535458454d5643
+#define EXTENTS_VERSION 1
+
+/* the records of the binary manifest are followed by their SHA-256 */
+#define EXTENTS_FLAG_SHA256 1
+
+/* The binary manifest (little-endian) is this header, then num_ranges
+ * records: the offset and length (uint64_t), followed by the 32-byte SHA-256
+ * of the range if flags has EXTENTS_FLAG_SHA256 */
+typedef struct extents_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t file_size;
+    uint64_t granularity;
+    uint64_t alignment;
+    uint64_t num_ranges;
+}
+extents_header_t;
+
+typedef struct extent
+{
+    uint64_t offset;
+    uint64_t length;
+    sha256_t hash;
+}
+extent_t;
+
+typedef struct extents
+{
+    extent_t* data;
+    size_t size;
+    size_t capacity;
+    uint64_t file_size;
+    size_t granularity;
+    size_t alignment;
+    bool sha256;
+}
+extents_t;
+
+/* Find the ranges of path to upload, which hold all of its non-zero data:
+ *
+ *     - The data fragments (see frags_find()) are widened to multiples of
+ *       alignment (a power of two), such as the 512-byte pages of a page blob.
+ *     - Fragments within one granularity-sized chunk of the file (a multiple
+ *       of alignment, such as the 4 MiB limit of one page-blob write) are
+ *       merged into one range, and ranges never cross chunks, so the same
+ *       data of two images yields the same ranges.
+ *     - Each range is read (by num_threads threads) and trimmed of leading
+ *       and trailing zero pages, and dropped if all zero.
+ *     - If sha256 is true, the SHA-256 of each (trimmed) range is computed.
+ */
+int extents_find(
+    const char* path,
+    size_t granularity,
+    size_t alignment,
+    bool sha256,
+    size_t num_threads,
+    extents_t* extents);
+
+/* return the total length of the ranges in bytes */
+uint64_t extents_sizeof(const extents_t* extents);
+
+int extents_write_json(const extents_t* extents, FILE* os);
+
+int extents_write_binary(const extents_t* extents, FILE* os);
+
+void extents_release(extents_t* extents);
+
+#endif /* _CVMBOOT_CVMDISK_EXTENTS_H */
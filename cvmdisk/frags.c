@@ -241,6 +241,7 @@ int frags_copy(
     size_t source_offset,
     const char* dest,
     size_t dest_offset,
+    size_t order_size,
     const char* msg)
 {
     int ret = 0;
@@ -251,6 +252,7 @@ int frags_copy(
     size_t num_blocks = 0;
     progress_t progress;
     size_t fsync_counter = 0;
+    size_t order_block = SIZE_MAX;
 
     if ((fd1 = open(source, O_RDONLY)) < 0)
         ERAISE(-errno);
@@ -279,6 +281,23 @@ int frags_copy(
 
             if (!all_zeros(buf, sizeof(buf)))
             {
+                /* Write out the previous block before starting another, so
+                 * that the device sees the blocks in list order (without a
+                 * cache flush, which would commit thin metadata each time) */
+                if (order_size && off2 / order_size != order_block)
+                {
+                    if (order_block != SIZE_MAX &&
+                        sync_file_range(fd2, order_block * order_size,
+                            order_size, SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+                    {
+                        ERAISE(-errno);
+                    }
+
+                    order_block = off2 / order_size;
+                }
+
                 if (pwrite(fd2, buf, sizeof(buf), off2) != sizeof(buf))
                     ERAISE(-errno);
 
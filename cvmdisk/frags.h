@@ -43,12 +43,17 @@ int frags_find(
     frag_list_t* frags,
     frag_list_t* holes);
 
+/* Copy the fragments from source to dest in list order. If order_size is
+ * non-zero, each order_size-aligned block of dest is written out to the
+ * device before the next one is written, so a device that allocates on first
+ * write (such as a thin volume) allocates the blocks in list order. */
 int frags_copy(
     const frag_list_t* list,
     const char* source,
     size_t source_offset,
     const char* dest,
     size_t dest_offset,
+    size_t order_size,
     const char* msg);
 
 int frags_compare(
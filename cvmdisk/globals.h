@@ -14,6 +14,12 @@ typedef struct globals
 
     /* loopback device created by losetup from disk */
     char loop[PATH_MAX];
+
+    /* work on the image file directly (no loop devices, mounts or root) */
+    bool offline;
+
+    /* directory of cached initrd images (null to always run mkinitramfs) */
+    const char* initrd_cache;
 }
 globals_t;
 
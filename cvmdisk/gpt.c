@@ -311,6 +311,17 @@ int gpt_reload(gpt_t* gpt)
     if (!gpt)
         ERAISE(-EINVAL);
 
+    // Image files have no kernel partitions to reload.
+    {
+        struct stat st;
+
+        if (fstat(gpt->_blockdev->fd, &st) != 0)
+            ERAISE(-errno);
+
+        if (!S_ISBLK(st.st_mode))
+            goto done;
+    }
+
     // Force the kernel re-read the partition table. This often fails
     // on the first couple attempts, so retry several times.
     {
@@ -644,7 +655,7 @@ done:
     return ret;
 }
 
-int gpt_add_entry(gpt_t* gpt, const gpt_entry_t* entry)
+int gpt_append_entry(gpt_t* gpt, const gpt_entry_t* entry)
 {
     int ret = 0;
     guid_t unique_guid;
@@ -673,6 +684,16 @@ int gpt_add_entry(gpt_t* gpt, const gpt_entry_t* entry)
     gpt->_num_entries++;
 
     ECHECK(_gpt_update_crcs(gpt));
+
+done:
+    return ret;
+}
+
+int gpt_add_entry(gpt_t* gpt, const gpt_entry_t* entry)
+{
+    int ret = 0;
+
+    ECHECK(gpt_append_entry(gpt, entry));
     ECHECK(gpt_sync(gpt));
 
 done:
@@ -1159,6 +1180,43 @@ done:
     return ret;
 }
 
+int gpt_open_partition(
+    const char* disk,
+    size_t index,
+    int flags,
+    size_t block_size,
+    blockdev_t** blockdev)
+{
+    int ret = 0;
+    gpt_t* gpt = NULL;
+    gpt_entry_t entry;
+    size_t offset;
+
+    if (blockdev)
+        *blockdev = NULL;
+
+    if (!disk || !blockdev)
+        ERAISE(-EINVAL);
+
+    ECHECK(gpt_open(disk, O_RDONLY, &gpt));
+    ECHECK(gpt_get_entry(gpt, index, &entry));
+
+    if (_entry_is_null(&entry))
+        ERAISE(-ENOENT);
+
+    offset = gpt_entry_offset(&entry);
+
+    ECHECK(blockdev_open_slice(disk, flags, 0, block_size, offset,
+        offset + gpt_entry_size(&entry), blockdev));
+
+done:
+
+    if (gpt)
+        gpt_close(gpt);
+
+    return ret;
+}
+
 int gpt_is_sorted(const gpt_t* gpt)
 {
     int ret = 0;
@@ -167,6 +167,16 @@ INLINE size_t gpt_get_num_entries(const gpt_t* gpt)
     return gpt->_num_entries;
 }
 
+/* get the first and last LBAs that partitions may occupy */
+INLINE void gpt_get_usable_lbas(
+    const gpt_t* gpt,
+    uint64_t* first_usable_lba,
+    uint64_t* last_usable_lba)
+{
+    *first_usable_lba = gpt->_primary.header.first_usable_lba;
+    *last_usable_lba = gpt->_primary.header.last_usable_lba;
+}
+
 ssize_t gpt_remove_partition(gpt_t* gpt, size_t index);
 
 ssize_t gpt_shrink_partition(gpt_t* gpt, size_t index, size_t num_sectors);
@@ -203,8 +213,21 @@ int find_gpt_entry_by_type(
     char part[PATH_MAX],
     gpt_entry_t* entry);
 
+/* open the partition with the given index as a slice of disk, which may be
+ * an image file or a whole-disk device (no partition device is needed) */
+int gpt_open_partition(
+    const char* disk,
+    size_t index,
+    int flags,
+    size_t block_size,
+    blockdev_t** blockdev);
+
 int gpt_add_entry(gpt_t* gpt, const gpt_entry_t* entry);
 
+/* like gpt_add_entry() but without syncing, so that several changes can be
+ * written (and reread by the kernel) with one gpt_sync() */
+int gpt_append_entry(gpt_t* gpt, const gpt_entry_t* entry);
+
 int gpt_is_sorted(const gpt_t* gpt);
 
 #endif /* _CVMBOOT_CVMDISK_GPT_H */
@@ -81,6 +81,15 @@ const guid_t verity_type_guid =
     { 0xbf, 0x43, 0xbe, 0x20, 0x6e, 0x7f, 0x9a, 0xf0, }
 };
 
+/* "ebd0a0a2-b9e5-4433-87c0-68b6b72699c7" -- Microsoft basic data (NTFS) */
+const guid_t basic_data_type_guid =
+{
+    0xebd0a0a2,
+    0xb9e5,
+    0x4433,
+    { 0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7, }
+};
+
 int guid_generate(guid_t* guid)
 {
     uint8_t bytes[16];
@@ -60,5 +60,6 @@ extern const guid_t efi_upper_type_guid;
 extern const guid_t thin_data_type_guid;
 extern const guid_t thin_meta_type_guid;
 extern const guid_t verity_type_guid;
+extern const guid_t basic_data_type_guid;
 
 #endif /* _CVMBOOT_CVMDISK_GUID_H */
@@ -0,0 +1,537 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include "http.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <utils/strings.h>
+#include "eraise.h"
+
+/* maximum total size of the response headers */
+#define MAX_HEADERS_SIZE (64 * 1024)
+
+/* seconds before a stalled send or receive fails (and may be retried) */
+#define SOCKET_TIMEOUT 60
+
+struct http_conn
+{
+    int sock;
+    SSL* ssl;
+    size_t remaining; /* unread bytes of the current response body */
+    size_t pos;
+    size_t len;
+    char buf[16 * 1024];
+};
+
+/* CA bundles of common distributions, tried after the OpenSSL defaults */
+static const char* _ca_files[] =
+{
+    "/etc/ssl/certs/ca-certificates.crt",
+    "/etc/pki/tls/certs/ca-bundle.crt",
+    "/etc/ssl/ca-bundle.pem",
+};
+
+static SSL_CTX* _ssl_ctx;
+static pthread_once_t _ssl_once = PTHREAD_ONCE_INIT;
+
+static void _init_ssl_ctx(void)
+{
+    SSL_CTX* ctx;
+
+    if (!(ctx = SSL_CTX_new(TLS_client_method())))
+        return;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    /* OpenSSL is built with its own prefix, so also try the system CAs */
+    SSL_CTX_set_default_verify_paths(ctx);
+
+    for (size_t i = 0; i < sizeof(_ca_files) / sizeof(_ca_files[0]); i++)
+    {
+        if (access(_ca_files[i], R_OK) == 0)
+        {
+            SSL_CTX_load_verify_locations(ctx, _ca_files[i], NULL);
+            break;
+        }
+    }
+
+    _ssl_ctx = ctx;
+}
+
+int http_parse_url(const char* url, http_url_t* out)
+{
+    int ret = 0;
+    const char* p;
+    const char* host;
+    const char* end;
+    size_t n;
+
+    if (!url || !out)
+        ERAISE(-EINVAL);
+
+    memset(out, 0, sizeof(http_url_t));
+
+    if (strncmp(url, "https://", 8) == 0)
+    {
+        out->https = true;
+        p = url + 8;
+        strlcpy(out->port, "443", sizeof(out->port));
+    }
+    else if (strncmp(url, "http://", 7) == 0)
+    {
+        out->https = false;
+        p = url + 7;
+        strlcpy(out->port, "80", sizeof(out->port));
+    }
+    else
+    {
+        ERAISE(-EINVAL);
+    }
+
+    /* host[:port] ends at the first '/' or '?' */
+    host = p;
+    end = host + strcspn(host, "/?");
+
+    if (end == host)
+        ERAISE(-EINVAL);
+
+    /* split off the port */
+    {
+        const char* colon = memchr(host, ':', end - host);
+
+        if (colon)
+        {
+            const size_t plen = end - (colon + 1);
+
+            if (plen == 0 || plen >= sizeof(out->port))
+                ERAISE(-EINVAL);
+
+            memcpy(out->port, colon + 1, plen);
+            out->port[plen] = '\0';
+            n = colon - host;
+        }
+        else
+        {
+            n = end - host;
+        }
+    }
+
+    if (n == 0 || n >= sizeof(out->host))
+        ERAISE(-EINVAL);
+
+    memcpy(out->host, host, n);
+    out->host[n] = '\0';
+
+    /* the target is the remainder (with a leading '/') */
+    if (*end == '/')
+    {
+        if (strlcpy(out->target, end, sizeof(out->target)) >=
+            sizeof(out->target))
+        {
+            ERAISE(-ENAMETOOLONG);
+        }
+    }
+    else
+    {
+        out->target[0] = '/';
+
+        if (strlcpy(out->target + 1, end, sizeof(out->target) - 1) >=
+            sizeof(out->target) - 1)
+        {
+            ERAISE(-ENAMETOOLONG);
+        }
+    }
+
+done:
+    return ret;
+}
+
+int http_connect(const http_url_t* url, http_conn_t** conn_out)
+{
+    int ret = 0;
+    http_conn_t* conn = NULL;
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    int r;
+
+    if (conn_out)
+        *conn_out = NULL;
+
+    if (!url || !conn_out)
+        ERAISE(-EINVAL);
+
+    if (!(conn = calloc(1, sizeof(http_conn_t))))
+        ERAISE(-ENOMEM);
+
+    conn->sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((r = getaddrinfo(url->host, url->port, &hints, &res)) != 0)
+        ERAISE(-EHOSTUNREACH);
+
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next)
+    {
+        int sock;
+
+        if ((sock = socket(ai->ai_family, ai->ai_socktype, 0)) < 0)
+            continue;
+
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            conn->sock = sock;
+            break;
+        }
+
+        close(sock);
+    }
+
+    if (conn->sock < 0)
+        ERAISE(-ECONNREFUSED);
+
+    /* fail stalled transfers so that the caller can retry them */
+    {
+        const struct timeval tv = { SOCKET_TIMEOUT, 0 };
+        const int one = 1;
+
+        setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (url->https)
+    {
+        pthread_once(&_ssl_once, _init_ssl_ctx);
+
+        if (!_ssl_ctx)
+            ERAISE(-ENOMEM);
+
+        if (!(conn->ssl = SSL_new(_ssl_ctx)))
+            ERAISE(-ENOMEM);
+
+        /* send SNI and verify the certificate against the host name */
+        if (!SSL_set_tlsext_host_name(conn->ssl, url->host) ||
+            !SSL_set1_host(conn->ssl, url->host))
+        {
+            ERAISE(-EINVAL);
+        }
+
+        if (!SSL_set_fd(conn->ssl, conn->sock))
+            ERAISE(-EINVAL);
+
+        if (SSL_connect(conn->ssl) != 1)
+            ERAISE(-ECONNREFUSED);
+    }
+
+    *conn_out = conn;
+    conn = NULL;
+
+done:
+
+    if (res)
+        freeaddrinfo(res);
+
+    if (conn)
+        http_close(conn);
+
+    return ret;
+}
+
+void http_close(http_conn_t* conn)
+{
+    if (conn)
+    {
+        if (conn->ssl)
+        {
+            SSL_shutdown(conn->ssl);
+            SSL_free(conn->ssl);
+        }
+
+        if (conn->sock >= 0)
+            close(conn->sock);
+
+        free(conn);
+    }
+}
+
+static ssize_t _recv(http_conn_t* conn, void* data, size_t size)
+{
+    if (conn->ssl)
+    {
+        size_t n;
+
+        if (SSL_read_ex(conn->ssl, data, size, &n) != 1)
+            return -EIO;
+
+        return n;
+    }
+    else
+    {
+        ssize_t n;
+
+        while ((n = recv(conn->sock, data, size, 0)) < 0 && errno == EINTR)
+            ;
+
+        return (n < 0) ? -errno : n;
+    }
+}
+
+static int _send(http_conn_t* conn, const void* data, size_t size)
+{
+    const char* p = data;
+
+    while (size)
+    {
+        ssize_t n;
+
+        if (conn->ssl)
+        {
+            size_t m;
+
+            if (SSL_write_ex(conn->ssl, p, size, &m) != 1)
+                return -EIO;
+
+            n = m;
+        }
+        else if ((n = send(conn->sock, p, size, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* read one header line (without the CRLF) into line[] */
+static int _read_line(http_conn_t* conn, char* line, size_t size)
+{
+    size_t n = 0;
+
+    for (;;)
+    {
+        char c;
+
+        if (conn->pos == conn->len)
+        {
+            ssize_t r;
+
+            if ((r = _recv(conn, conn->buf, sizeof(conn->buf))) <= 0)
+                return (r == 0) ? -ECONNRESET : r;
+
+            conn->pos = 0;
+            conn->len = r;
+        }
+
+        c = conn->buf[conn->pos++];
+
+        if (c == '\n')
+            break;
+
+        if (n + 1 == size)
+            return -E2BIG;
+
+        line[n++] = c;
+    }
+
+    if (n > 0 && line[n - 1] == '\r')
+        n--;
+
+    line[n] = '\0';
+
+    return n;
+}
+
+static void _parse_header(char* line, http_response_t* resp)
+{
+    char* name = line;
+    char* value;
+    char* colon;
+
+    if (!(colon = strchr(line, ':')))
+        return;
+
+    *colon = '\0';
+    value = colon + 1;
+
+    while (isspace(*value))
+        value++;
+
+    if (strcasecmp(name, "Content-Length") == 0)
+    {
+        resp->content_length = strtoll(value, NULL, 10);
+    }
+    else if (strcasecmp(name, "Content-Range") == 0)
+    {
+        unsigned long long first;
+        unsigned long long last;
+        unsigned long long total;
+
+        if (sscanf(value, "bytes %llu-%llu/%llu", &first, &last, &total) == 3)
+        {
+            resp->has_range = true;
+            resp->range_first = first;
+            resp->range_last = last;
+            resp->range_total = total;
+        }
+    }
+    else if (strcasecmp(name, "Connection") == 0)
+    {
+        if (strcasecmp(value, "close") == 0)
+            resp->keep_alive = false;
+        else if (strcasecmp(value, "keep-alive") == 0)
+            resp->keep_alive = true;
+    }
+    else if (strcasecmp(name, "Transfer-Encoding") == 0)
+    {
+        /* chunked bodies are not supported; flag as unknown length */
+        if (strcasecmp(value, "identity") != 0)
+            resp->content_length = -1;
+    }
+    else if (strcasecmp(name, "ETag") == 0)
+    {
+        strlcpy(resp->etag, value, sizeof(resp->etag));
+    }
+}
+
+int http_get_range(
+    http_conn_t* conn,
+    const http_url_t* url,
+    size_t first,
+    size_t last,
+    http_response_t* resp)
+{
+    int ret = 0;
+    char* request = NULL;
+    int len;
+    char line[8192];
+    size_t total = 0;
+    int major;
+    int minor;
+
+    if (!conn || !url || !resp || first > last)
+        ERAISE(-EINVAL);
+
+    memset(resp, 0, sizeof(http_response_t));
+    resp->content_length = -1;
+
+    /* the body of the previous response must have been read */
+    if (conn->remaining)
+        ERAISE(-EBUSY);
+
+    len = asprintf(&request,
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Range: bytes=%zu-%zu\r\n"
+        "User-Agent: cvmdisk\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+        url->target, url->host, first, last);
+
+    if (len < 0)
+        ERAISE(-ENOMEM);
+
+    ECHECK(_send(conn, request, len));
+
+    /* status line */
+    ECHECK((len = _read_line(conn, line, sizeof(line))));
+    total += len;
+
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &resp->status) != 3)
+        ERAISE(-EPROTO);
+
+    resp->keep_alive = (major > 1 || (major == 1 && minor >= 1));
+
+    /* headers (up to the empty line) */
+    for (;;)
+    {
+        ECHECK((len = _read_line(conn, line, sizeof(line))));
+
+        if (len == 0)
+            break;
+
+        if ((total += len) > MAX_HEADERS_SIZE)
+            ERAISE(-E2BIG);
+
+        _parse_header(line, resp);
+    }
+
+    if (resp->content_length < 0)
+        ERAISE(-EPROTO);
+
+    conn->remaining = resp->content_length;
+
+done:
+    free(request);
+    return ret;
+}
+
+int http_read_body(http_conn_t* conn, void* data, size_t size)
+{
+    int ret = 0;
+    uint8_t* p = data;
+
+    if (!conn || (!data && size))
+        ERAISE(-EINVAL);
+
+    if (size > conn->remaining)
+        ERAISE(-EINVAL);
+
+    while (size)
+    {
+        size_t n;
+
+        /* drain buffered bytes first; then read large spans directly */
+        if (conn->pos < conn->len)
+        {
+            n = conn->len - conn->pos;
+
+            if (n > size)
+                n = size;
+
+            memcpy(p, conn->buf + conn->pos, n);
+            conn->pos += n;
+        }
+        else
+        {
+            ssize_t r;
+
+            if ((r = _recv(conn, p, size)) < 0)
+                ERAISE(r);
+
+            if (r == 0)
+                ERAISE(-ECONNRESET);
+
+            n = r;
+        }
+
+        p += n;
+        size -= n;
+        conn->remaining -= n;
+    }
+
+done:
+    return ret;
+}
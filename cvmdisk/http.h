@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_HTTP_H
+#define _CVMBOOT_CVMDISK_HTTP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define HTTP_HOST_SIZE 256
+#define HTTP_PORT_SIZE 8
+#define HTTP_TARGET_SIZE 4096
+#define HTTP_ETAG_SIZE 128
+
+typedef struct http_url
+{
+    bool https;
+    char host[HTTP_HOST_SIZE];
+    char port[HTTP_PORT_SIZE];
+    char target[HTTP_TARGET_SIZE]; /* path and query string */
+}
+http_url_t;
+
+typedef struct http_response
+{
+    int status;
+    ssize_t content_length; /* -1 if not present */
+    bool has_range; /* true if the Content-Range header was present */
+    size_t range_first;
+    size_t range_last;
+    size_t range_total;
+    bool keep_alive;
+    char etag[HTTP_ETAG_SIZE];
+}
+http_response_t;
+
+typedef struct http_conn http_conn_t;
+
+/* parse an http:// or https:// URL */
+int http_parse_url(const char* url, http_url_t* out);
+
+/* connect to the host of the URL (verifying the certificate for https) */
+int http_connect(const http_url_t* url, http_conn_t** conn_out);
+
+void http_close(http_conn_t* conn);
+
+/* send a GET request for the byte range [first, last] and read the headers */
+int http_get_range(
+    http_conn_t* conn,
+    const http_url_t* url,
+    size_t first,
+    size_t last,
+    http_response_t* resp);
+
+/* read exactly size bytes of the response body */
+int http_read_body(http_conn_t* conn, void* data, size_t size);
+
+#endif /* _CVMBOOT_CVMDISK_HTTP_H */
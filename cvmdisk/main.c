@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <utils/sig.h>
 #include <utils/cpio.h>
+#include <utils/lz4.h>
 #include <utils/events.h>
 #include <utils/sha256.h>
 #include <utils/strings.h>
@@ -31,6 +32,7 @@
 #include <common/strarr.h>
 #include <common/sparsecmp.h>
 #include <common/cvmvhd.h>
+#include <common/signproto.h>
 #include <time.h>
 #include "guid.h"
 #include "find.h"
@@ -55,18 +57,30 @@
 #include "frags.h"
 #include "progress.h"
 #include "sparse.h"
+#include "download.h"
+#include "mkcpio.h"
+#include "boottrace.h"
+#include "ext4.h"
+#include "bits.h"
+#include "thinplan.h"
+#include "thindedup.h"
+#include "stages.h"
+#include "treedigest.h"
+#include "extents.h"
+#include "stopwatch.h"
 
 //#define USE_EFI_EPHEMERAL_DISK
 
 #define THIN_BLOCK_SIZE_UNITS ((size_t)512)
 
-/* expressed in 512-byte units */
-#define THIN_BLOCK_SIZE ((size_t)1024)
+/* expressed as multiple of the thin block size */
+#define THIN_LOW_WATER_MARK ((size_t)1024)
 
-#define THIN_BLOCK_SIZE_IN_BYTES (THIN_BLOCK_SIZE * THIN_BLOCK_SIZE_UNITS)
+/* Default directory of the initrd images built by earlier runs */
+#define DEFAULT_INITRD_CACHE "/var/cache/cvmdisk/initrd"
 
-/* expressed as multiple of THIN_BLOCK_SIZE */
-#define THIN_LOW_WATER_MARK ((size_t)1024)
+/* Changes with every package installed or upgraded on the rootfs */
+#define PACKAGE_DATABASE "/var/lib/dpkg/status"
 
 /*
 **==============================================================================
@@ -95,6 +109,29 @@ typedef struct hostname_opt
 }
 hostname_opt_t;
 
+/* how the initrd joins the read-only lower layer with the writable upper
+ * layer: "snapshot" (dm-snapshot) with a chunk size, or "thin" (dm-thin with
+ * the lower layer as external origin) with a pool block size */
+typedef struct upper_layer_opt
+{
+    char engine[16];
+    size_t sectors;
+}
+upper_layer_opt_t;
+
+#define UPPER_LAYER_SNAPSHOT_CHUNK_KB 4
+#define UPPER_LAYER_THIN_BLOCK_KB 64
+
+/* the block size of the thin pool that holds the rootfs: either fixed or
+ * chosen by the planner (thinplan.h) from the rootfs extents */
+typedef struct thin_block_opt
+{
+    /* in 512-byte units (zero to choose by the objective) */
+    size_t sectors;
+    thinplan_objective_t objective;
+}
+thin_block_opt_t;
+
 static int _check_program(const char* name)
 {
     int ret = 0;
@@ -255,23 +292,17 @@ static void _check_vhd(const char* disk)
     buf_release(&buf);
 }
 
+/* espdir holds the contents of the EFI partition (mounted or exported) */
 static void _dump_expected_pcr_and_log_contents(
-    const char* disk,
+    const char* espdir,
     const sig_t* sig)
 {
     char events_path[PATH_MAX] = "";
-    char source[PATH_MAX];
-
-    if (find_gpt_entry_by_type(disk, &efi_type_guid, source, NULL) < 0)
-        ERR("Cannot find EFI partition: %s", disk);
-
-    if (mount(source, mntdir(), "vfat", 0, NULL) < 0)
-        ERR("Failed to mount EFI directory: %s => %s", source, mntdir());
 
     /* If no events command-line argument */
     {
         paths_set_prefix("");
-        paths_get(events_path, FILENAME_EVENTS, mntdir());
+        paths_get(events_path, FILENAME_EVENTS, espdir);
         paths_set_prefix("/boot/efi");
 
         if (access(events_path, R_OK) != 0)
@@ -330,9 +361,6 @@ static void _dump_expected_pcr_and_log_contents(
         sha256_format(&str, &pcr11);
         printf("%sPCR[11]=%s%s\n", colors_cyan, str.buf, colors_reset);
     }
-
-    if (umount(mntdir()) < 0)
-        ERR("failed to unmount: %s", mntdir());
 }
 
 static void _patch_fstab(const char* disk)
@@ -740,12 +768,177 @@ static size_t _get_num_sectors(const char* dev)
     return (size_t)n;
 }
 
+/* Get the path of the cached initrd.img for the initrd inputs installed on
+ * the rootfs: the kernel version and modules, the initramfs-tools
+ * configuration (which holds the cvmboot hooks and scripts, with the values
+ * written into them), the hooks of the installed packages, the modprobe and
+ * udev configuration that mkinitramfs copies, the cvmboot tools and the
+ * package database. The hooks copy binaries and their libraries from
+ * packages (veritysetup, cryptsetup, parted, libc, ...), so any package
+ * change yields another key. Without a package database (dpkg), the copied
+ * binaries cannot be accounted for and there is no cached initrd: returns
+ * -ENOENT. */
+static int _get_cached_initrd_path(const char* version, char path[PATH_MAX])
+{
+    char modules[PATH_MAX];
+    const char* inputs[] =
+    {
+        modules,
+        "/etc/initramfs-tools",
+        "/usr/share/initramfs-tools",
+        "/etc/modprobe.d",
+        "/lib/modprobe.d",
+        "/etc/udev",
+        "/usr/sbin/cvmverity",
+        "/usr/sbin/cvmephemeral",
+        PACKAGE_DATABASE,
+    };
+    const size_t num_inputs = sizeof(inputs) / sizeof(inputs[0]);
+    const char magic[] = "cvmdisk-initrd-cache-3";
+    sha256_ctx_t ctx;
+    sha256_t key;
+    sha256_string_t str;
+    stopwatch_t sw;
+    long num_threads;
+
+    *path = '\0';
+
+    if ((num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        num_threads = 1;
+
+    strlcpy2(modules, "/lib/modules/", version, sizeof(modules));
+
+    {
+        char fullpath[PATH_MAX];
+
+        strlcpy2(fullpath, mntdir(), PACKAGE_DATABASE, sizeof(fullpath));
+
+        if (access(fullpath, R_OK) != 0)
+        {
+            printf("Not caching initrd.img: no package database: %s\n",
+                PACKAGE_DATABASE);
+            return -ENOENT;
+        }
+    }
+
+    stopwatch_start(&sw);
+    sha256_init(&ctx);
+    sha256_update(&ctx, magic, sizeof(magic));
+    sha256_update(&ctx, version, strlen(version) + 1);
+
+    for (size_t i = 0; i < num_inputs; i++)
+    {
+        char fullpath[PATH_MAX];
+        sha256_t digest;
+        int r;
+
+        strlcpy2(fullpath, mntdir(), inputs[i], sizeof(fullpath));
+        sha256_update(&ctx, inputs[i], strlen(inputs[i]) + 1);
+
+        /* a missing input only contributes its name */
+        if ((r = treedigest(fullpath, num_threads, &digest)) == -ENOENT)
+            continue;
+
+        if (r < 0)
+            ERR("failed to compute digest: %s: %s", fullpath, strerror(-r));
+
+        sha256_update(&ctx, &digest, sizeof(digest));
+    }
+
+    sha256_final(&key, &ctx);
+    sha256_format(&str, &key);
+
+    if (snprintf(path, PATH_MAX, "%s/%s.img", globals.initrd_cache,
+        str.buf) >= PATH_MAX)
+    {
+        ERR("initrd cache path is too long: %s", globals.initrd_cache);
+    }
+
+    printf("initrd cache key: %s (%.2lf seconds)\n", str.buf,
+        stopwatch_seconds(&sw));
+
+    return 0;
+}
+
+/* Copy a file in process (paths may come from the command line) */
+static void _copy_file(const char* src, const char* dest)
+{
+    int in;
+    int out;
+    char buf[64 * 1024];
+    ssize_t n;
+
+    if ((in = open(src, O_RDONLY)) < 0)
+        ERR("failed to open %s", src);
+
+    if ((out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        ERR("failed to create %s", dest);
+
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if (write(out, buf, n) != n)
+            ERR("failed to write %s", dest);
+    }
+
+    if (n < 0)
+        ERR("failed to read %s", src);
+
+    if (close(out) < 0)
+        ERR("failed to close %s", dest);
+
+    close(in);
+}
+
+/* Create dir and any missing parent directories */
+static void _mkdir_parents(const char* dir)
+{
+    char path[PATH_MAX];
+
+    strlcpy(path, dir, sizeof(path));
+
+    for (char* p = path + 1; ; p++)
+    {
+        if (*p == '/' || *p == '\0')
+        {
+            const char c = *p;
+
+            *p = '\0';
+
+            if (mkdir(path, 0755) < 0 && errno != EEXIST)
+                ERR("failed to create directory: %s", path);
+
+            if (!(*p = c))
+                break;
+        }
+    }
+}
+
+/* Add initrd.img to the cache (renaming it into place, so that concurrent
+ * runs never see a partial image) */
+static void _store_cached_initrd(const char* initrd, const char* cached)
+{
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", cached, (int)getpid());
+
+    _mkdir_parents(globals.initrd_cache);
+    _copy_file(initrd, tmp);
+
+    if (rename(tmp, cached) < 0)
+    {
+        unlink(tmp);
+        ERR("failed to rename %s => %s", tmp, cached);
+    }
+}
+
 /* Install the Linux initrd onto the EFI system partition */
 static void _install_initrd_onto_esp(
     const char* disk,
     const char* version,
     bool use_resource_disk,
-    bool use_thin_provisioning)
+    bool use_thin_provisioning,
+    const upper_layer_opt_t* upper_layer,
+    size_t thin_block_size)
 {
     buf_t buf = BUF_INITIALIZER;
 
@@ -759,6 +952,7 @@ static void _install_initrd_onto_esp(
     _cleanup_sharedir_file("/etc/initramfs-tools/hooks/cvmboot");
     _cleanup_sharedir_file("/etc/initramfs-tools/hooks/cvmboot-resource-disk");
     _cleanup_sharedir_file("/etc/initramfs-tools/hooks/cvmboot-thin");
+    _cleanup_sharedir_file("/etc/initramfs-tools/hooks/cvmboot-upper-layer");
 
     /* install cvmboot.hook */
     _install_sharedir_file(
@@ -795,8 +989,39 @@ static void _install_initrd_onto_esp(
         if (load_file(src.buf, (void**)&format, &format_size) != 0)
             ERR("failed to load file: %s", src.buf);
 
-        if (asprintf(&content, format, num_thin_sectors) < 0)
+        if (asprintf(&content, format, num_thin_sectors, thin_block_size) < 0)
+            ERR("out of memory");
+
+        if (write_file(dest.buf, content, strlen(content)) < 0)
+            ERR("failed to write file: %s", dest.buf);
+
+        if (chmod(dest.buf, 0755) < 0)
+            ERR("chmod failed: %s", dest.buf);
+
+        free(format);
+        free(content);
+    }
+
+    /* install cvmboot-upper-layer.hook */
+    {
+        path_t src;
+        path_t dest;
+        char* format;
+        size_t format_size;
+        char* content;
+
+        makepath2(&src, sharedir(), "/cvmboot-upper-layer.hook");
+        makepath2(&dest, mntdir(),
+            "/etc/initramfs-tools/hooks/cvmboot-upper-layer");
+
+        if (load_file(src.buf, (void**)&format, &format_size) != 0)
+            ERR("failed to load file: %s", src.buf);
+
+        if (asprintf(&content, format,
+            upper_layer->engine, upper_layer->sectors) < 0)
+        {
             ERR("out of memory");
+        }
 
         if (write_file(dest.buf, content, strlen(content)) < 0)
             ERR("failed to write file: %s", dest.buf);
@@ -808,6 +1033,16 @@ static void _install_initrd_onto_esp(
         free(content);
     }
 
+    /* install cvmverity (used by cvmboot_premount.script) */
+    {
+        _install_sharedir_file("/cvmverity", "/usr/sbin/cvmverity");
+    }
+
+    /* install cvmephemeral (used by cvmboot_bottom.script) */
+    {
+        _install_sharedir_file("/cvmephemeral", "/usr/sbin/cvmephemeral");
+    }
+
     /* install cvmboot_premount.script */
     {
         _install_sharedir_file(
@@ -838,23 +1073,40 @@ static void _install_initrd_onto_esp(
     }
 #endif /* USE_EFI_EPHEMERAL_DISK */
 
-    /* Generate initrd.img on the EFI partition */
+    /* Generate initrd.img on the EFI partition (or reuse a cached one) */
     {
         char path[PATH_MAX];
         char fullpath[PATH_MAX];
-
-        printf("Generating initrd.img for kernel version %s...\n", version);
+        char cached[PATH_MAX] = "";
 
         paths_get(path, DIRNAME_CVMBOOT_HOME, NULL);
         strlcat(path, "/initrd.img-", sizeof(path));
         strlcat(path, version, sizeof(path));
 
-        execf(&buf, "chroot %s mkinitramfs -o %s %s", mntdir(), path, version);
-
         strlcpy3(fullpath, mntdir(), "/", path, sizeof(fullpath));
 
-        if (access(fullpath, F_OK) < 0)
-            printf("failed to create file: %s\n", fullpath);
+        if (globals.initrd_cache)
+            _get_cached_initrd_path(version, cached);
+
+        if (*cached && access(cached, R_OK) == 0)
+        {
+            printf("Reusing cached initrd.img for kernel version %s...\n",
+                version);
+            _copy_file(cached, fullpath);
+        }
+        else
+        {
+            printf("Generating initrd.img for kernel version %s...\n",
+                version);
+
+            execf(&buf, "chroot %s mkinitramfs -o %s %s", mntdir(), path,
+                version);
+
+            if (access(fullpath, F_OK) < 0)
+                printf("failed to create file: %s\n", fullpath);
+            else if (*cached)
+                _store_cached_initrd(fullpath, cached);
+        }
 
         printf("Created %s:%s\n", globals.disk, strip_mntdir(fullpath));
     }
@@ -1158,7 +1410,8 @@ done:
 static void _append_cmdline_option(
     const char* disk,
     const char* version,
-    bool force_hyperv_console)
+    bool force_hyperv_console,
+    bool record_boot_trace)
 {
     buf_t buf = BUF_INITIALIZER;
     buf_t boot_image = BUF_INITIALIZER;
@@ -1228,6 +1481,19 @@ static void _append_cmdline_option(
     }
 
     strrtrim(linux_cmdline);
+
+    /* Have cvmboot_premount.script record the reads of the rootfs */
+    if (record_boot_trace)
+    {
+        char* tmp;
+
+        if (asprintf(&tmp, "%s cvmboot.trace", linux_cmdline) < 0)
+            ERR("failed to format the linux_cmdline");
+
+        free(linux_cmdline);
+        linux_cmdline = tmp;
+    }
+
     printf("linux_cmdline=%s\n", linux_cmdline);
 
     /* Append 'cmdline' to the configuration file */
@@ -1603,7 +1869,111 @@ static void _dmsetup_remove_with_retries(const char* dmname)
     buf_release(&buf);
 }
 
-static void _initialize_thin_partitions(const char* disk)
+/* Get the data fragments of the root partition in the order to copy them */
+static void _get_thin_copy_frags(
+    const gpt_entry_t* entry,
+    const char* boot_trace,
+    size_t thin_block_size,
+    frag_list_t* frags)
+{
+    const uint64_t offset = gpt_entry_offset(entry);
+    const uint64_t end = offset + gpt_entry_size(entry);
+    frag_list_t holes = FRAG_LIST_INITIALIZER;
+
+    if (frags_find(globals.disk, offset, end, frags, &holes) < 0)
+        ERR("frags_find() failed: %s", globals.disk);
+
+    frags_release(&holes);
+
+    /* The thin pool allocates data blocks in the order they are first
+     * written, so copy the blocks read at boot first, in the order read,
+     * to make the boot-time reads of the data partition sequential */
+    if (boot_trace)
+    {
+        frag_list_t reads = FRAG_LIST_INITIALIZER;
+        frag_list_t ordered = FRAG_LIST_INITIALIZER;
+
+        if (boottrace_load(boot_trace, &reads) < 0)
+            ERR("cannot load boot trace: %s", boot_trace);
+
+        if (boottrace_order_frags(frags, offset, end, &reads,
+            thin_block_size * THIN_BLOCK_SIZE_UNITS, &ordered) < 0)
+        {
+            ERR("cannot order the root partition by the boot trace");
+        }
+
+        printf("Ordered thin data blocks by %zu reads in %s\n",
+            reads.size, boot_trace);
+
+        frags_release(frags);
+        frags_release(&reads);
+        *frags = ordered;
+    }
+}
+
+/* Write the thin data partition directly, storing identical blocks once, and
+ * build the thin metadata from the resulting mappings with thin_restore */
+static void _dedup_thin_partitions(
+    const gpt_entry_t* entry,
+    const char* data_dev,
+    const char* meta_dev,
+    size_t num_data_sectors,
+    const char* boot_trace,
+    size_t thin_block_size)
+{
+    const uint64_t offset = gpt_entry_offset(entry);
+    const uint64_t end = offset + gpt_entry_size(entry);
+    const size_t block_size = thin_block_size * THIN_BLOCK_SIZE_UNITS;
+    char xml[] = "/tmp/cvmdisk_thin_metadata_XXXXXX";
+    frag_list_t frags;
+    thindedup_stats_t stats;
+    buf_t buf = BUF_INITIALIZER;
+    long num_threads;
+    int fd;
+
+    _get_thin_copy_frags(entry, boot_trace, thin_block_size, &frags);
+
+    if ((fd = mkstemp(xml)) < 0)
+        ERR("failed to create temporary file: %s", xml);
+
+    close(fd);
+
+    if ((num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        num_threads = 1;
+
+    if (thindedup_convert(&frags, globals.disk, offset, end, data_dev,
+        num_data_sectors / thin_block_size, block_size, num_threads, xml,
+        &stats) < 0)
+    {
+        ERR("failed to deduplicate root partition into %s", data_dev);
+    }
+
+    printf("Restoring thin metadata...\n");
+    execf(&buf, "thin_restore -q -i %s -o %s", xml, meta_dev);
+    unlink(xml);
+
+    /* Print the deduplication savings */
+    {
+        const size_t saved = stats.num_mapped - stats.num_unique;
+        double percent = 0;
+
+        if (stats.num_mapped)
+            percent = (double)saved / stats.num_mapped * 100.0;
+
+        printf("Deduplicated %zu of %zu thin blocks (%zu MiB, %4.1lf%%)\n",
+            saved, stats.num_mapped, saved * block_size / (1024 * 1024),
+            percent);
+    }
+
+    frags_release(&frags);
+    buf_release(&buf);
+}
+
+static void _initialize_thin_partitions(
+    const char* disk,
+    const char* boot_trace,
+    size_t thin_block_size,
+    bool thin_dedup)
 {
     ssize_t root_index;
     char root_dev[PATH_MAX];
@@ -1651,6 +2021,15 @@ static void _initialize_thin_partitions(const char* disk)
     /* Get the number of root sectors (512 bytes) */
     num_root_sectors = _get_num_sectors(root_dev);
 
+    /* With deduplication, the data and metadata are written directly */
+    if (thin_dedup)
+    {
+        _dedup_thin_partitions(&entry, data_dev, meta_dev, num_data_sectors,
+            boot_trace, thin_block_size);
+        buf_release(&buf);
+        return;
+    }
+
     /* Zero-fill the first 4096 bytes of the meta device */
     printf("Initializing thin meta partition...\n");
     execf(&buf, "dd if=/dev/zero of=%s bs=4096 count=1 status=none", meta_dev);
@@ -1665,7 +2044,7 @@ static void _initialize_thin_partitions(const char* disk)
         num_data_sectors,
         meta_dev,
         data_dev,
-        THIN_BLOCK_SIZE,
+        thin_block_size,
         THIN_LOW_WATER_MARK);
 
     /* Create the volume */
@@ -1704,25 +2083,28 @@ static void _initialize_thin_partitions(const char* disk)
     /* Copy root partition to thin partition */
     {
         const uint64_t offset = gpt_entry_offset(&entry);
-        const uint64_t end = offset + gpt_entry_size(&entry);
-        frag_list_t frags = FRAG_LIST_INITIALIZER;
-        frag_list_t holes = FRAG_LIST_INITIALIZER;
+        frag_list_t frags;
 
-        if (frags_find(globals.disk, offset, end, &frags, &holes) < 0)
-            ERR("frags_find() failed: %s", globals.disk);
+        _get_thin_copy_frags(&entry, boot_trace, thin_block_size, &frags);
 
-        /* Copy data from root partition to thin data partition */
+        /* Copy data from root partition to thin data partition. With a boot
+         * trace, each thin block is written out before the next, so the pool
+         * allocates them in exactly the order of the trace */
         {
             char thin[PATH_MAX];
+            const size_t order_size =
+                boot_trace ? thin_block_size * THIN_BLOCK_SIZE_UNITS : 0;
 
             strlcpy2(thin, "/dev/mapper/", thin_volume_name(), sizeof(thin));
 
-            if (frags_copy(&frags, globals.disk, offset, thin, 0, msg) < 0)
+            if (frags_copy(
+                &frags, globals.disk, offset, thin, 0, order_size, msg) < 0)
+            {
                 ERR("frags_copy() failed");
+            }
         }
 
         frags_release(&frags);
-        frags_release(&holes);
     }
 
     /* Print the thin-provisioning savings */
@@ -1742,7 +2124,7 @@ static void _initialize_thin_partitions(const char* disk)
     buf_release(&buf);
 }
 
-static void _verify_thin_partitions(const char* disk)
+static void _verify_thin_partitions(const char* disk, size_t thin_block_size)
 {
     ssize_t root_index;
     char root_dev[PATH_MAX];
@@ -1800,7 +2182,7 @@ static void _verify_thin_partitions(const char* disk)
         num_data_sectors,
         meta_dev,
         data_dev,
-        THIN_BLOCK_SIZE,
+        thin_block_size,
         THIN_LOW_WATER_MARK,
         "1 read_only");
 
@@ -1887,98 +2269,281 @@ static void _punch_hole(const char* path, size_t offset, size_t len)
     close(fd);
 }
 
-static void _add_extra_partitions(
-    const char* disk,
-    bool use_thin_provisioning,
-    bool use_resource_disk,
-    bool verify)
+/* Punch holes over the blocks that the EXT4 rootfs has not allocated, so
+ * that stale data left in them by deleted files is neither hashed by verity
+ * nor copied into the thin partition, and is dropped from the image */
+static void _punch_free_ext4_blocks(const char* disk)
 {
-    int part_index;
     gpt_entry_t entry;
     char source[PATH_MAX];
-    buf_t buf = BUF_INITIALIZER;
-    size_t ext4_block_size;
-    size_t ext4_block_count;
-    size_t thin_data_partition_size = 0;
-    size_t thin_meta_partition_size = 0;
-    size_t available_disk_space;
-    size_t extra_space = 0;
-    size_t ext4_bytes;
-    const size_t gb = 1024*1024*1024;
-#ifdef USE_EFI_EPHEMERAL_DISK
-    const size_t efi_partition_size = gb;
-#endif /* USE_EFI_EPHEMERAL_DISK */
+    ext4_bitmap_t bitmap;
+    size_t offset;
+    size_t size;
+    size_t punched = 0;
+    int fd;
+    int r;
 
-    printf("%s>>> Adding extra partitions...%s\n", colors_green, colors_reset);
+    printf("%s>>> Punching free EXT4 blocks...%s\n",
+        colors_green, colors_reset);
 
-    /* find the Linux root partition */
-    if ((part_index = find_gpt_entry_by_type(
-        disk, &linux_type_guid, source, &entry)) < 0)
-    {
+    if (find_gpt_entry_by_type(disk, &linux_type_guid, source, &entry) < 0)
         ERR("Cannot find Linux root partition: disk=%s", disk);
-    }
 
-    /* Check whether rootfs is valid */
-    if (__test_ext4_rootfs(source) < 0)
-        ERR("partition is not an EXT4 rootfs partition: %s", source);
+    offset = gpt_entry_offset(&entry);
+    size = gpt_entry_size(&entry);
 
-    ext4_block_size = _get_ext4_block_size(source);
-    ext4_block_count = _get_ext4_block_count(source);
-    ext4_bytes = ext4_block_size * ext4_block_count;
+    /* temporarily detach loopback device */
+    lodetach(globals.loop);
+    *globals.loop = '\0';
 
-    /* Need extra space for upper layer disk */
-    if (!use_resource_disk)
-        extra_space += ext4_bytes;
+    if ((r = ext4_get_bitmap(globals.disk, offset, &bitmap)) < 0)
+    {
+        printf("Skipped: cannot use the EXT4 block bitmaps: %s\n",
+            strerror(-r));
+        losetup(globals.disk, globals.loop);
+        return;
+    }
 
-    /* Calculate space needed for thin partition */
-    if (use_thin_provisioning)
+    if ((fd = open(globals.disk, O_RDWR)) < 0)
+        ERR("failed to open: %s", globals.disk);
+
+    for (size_t i = 0; i < bitmap.num_blocks; )
     {
-        const size_t two_mb = 2*1024*1024;
-        size_t n;
-        size_t m;
-        const uint64_t offset = gpt_entry_offset(&entry);
-        const uint64_t end = offset + gpt_entry_size(&entry);
+        const int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        size_t n = 0;
+        size_t x;
+        size_t len;
 
-        /* Find sparse fragments */
+        if (test_bit(bitmap.bits, i))
         {
-            frag_list_t frags = FRAG_LIST_INITIALIZER;
-            frag_list_t holes = FRAG_LIST_INITIALIZER;
+            i++;
+            continue;
+        }
 
-            if (frags_find(globals.disk, offset, end, &frags, &holes) < 0)
-                ERR("frags_find() failed: %s", globals.disk);
+        while (i + n < bitmap.num_blocks && !test_bit(bitmap.bits, i + n))
+            n++;
 
-            n = frags.num_blocks * ext4_block_size;
-            n += gb;
+        x = i * bitmap.block_size;
+        len = n * bitmap.block_size;
+        i += n;
 
-            frags_release(&frags);
-            frags_release(&holes);
-        }
+        if (x >= size)
+            break;
 
-        n += (THIN_LOW_WATER_MARK * THIN_BLOCK_SIZE_IN_BYTES);
-        n = round_up_to_multiple(n, two_mb);
+        if (x + len > size)
+            len = size - x;
 
-        /* calculate size of thin meta partition (2.5%) */
-        m = n / 40;
-        m = round_up_to_multiple(m, two_mb);
+        if (fallocate(fd, mode, offset + x, len) < 0)
+            ERR("fallocate() failed: error=%d", errno);
 
-        thin_data_partition_size = n;
-        thin_meta_partition_size = m;
-        extra_space += thin_data_partition_size;
-        extra_space += thin_meta_partition_size;
+        punched += len;
     }
 
-    /* Leave room for the verity tree */
-    {
-        ssize_t n;
+    close(fd);
 
-        if ((n = verity_hash_dev_size(ext4_bytes)) < 0)
-            ERR("verity_hash_dev_size() failed");
+    printf("Punched %zu MiB of free EXT4 blocks\n", punched / (1024 * 1024));
 
-        extra_space += n;
-    }
+    ext4_release_bitmap(&bitmap);
 
-#ifdef USE_EFI_EPHEMERAL_DISK
-    /* Leave room for the EFI upper-layer partition */
+    /* restore setup of loopback device */
+    losetup(globals.disk, globals.loop);
+}
+
+/* Simulate the thin-pool block sizes for the rootfs extents: the blocks that
+ * EXT4 has allocated or, when its bitmaps cannot be used, the non-zero ones */
+static void _plan_thin_blocks(
+    const char* disk,
+    thinplan_objective_t objective,
+    thinplan_t* plan)
+{
+    gpt_entry_t entry;
+    char source[PATH_MAX];
+    ext4_bitmap_t bitmap;
+    frag_list_t extents = FRAG_LIST_INITIALIZER;
+    size_t offset;
+    size_t end;
+
+    if (find_gpt_entry_by_type(disk, &linux_type_guid, source, &entry) < 0)
+        ERR("Cannot find Linux root partition: disk=%s", disk);
+
+    offset = gpt_entry_offset(&entry);
+    end = offset + gpt_entry_size(&entry);
+
+    if (ext4_get_bitmap(globals.disk, offset, &bitmap) == 0)
+    {
+        if (ext4_get_extents(&bitmap, offset, &extents) < 0)
+            ERR("out of memory");
+
+        ext4_release_bitmap(&bitmap);
+    }
+    else
+    {
+        frag_list_t holes = FRAG_LIST_INITIALIZER;
+
+        if (frags_find(globals.disk, offset, end, &extents, &holes) < 0)
+            ERR("frags_find() failed: %s", globals.disk);
+
+        frags_release(&holes);
+    }
+
+    if (thinplan_choose(&extents, offset, end, objective, plan) < 0)
+        ERR("thinplan_choose() failed");
+
+    frags_release(&extents);
+}
+
+static void _print_thin_plan(const thinplan_t* plan)
+{
+    const double mb = 1024 * 1024;
+
+    printf("%-10s %12s %12s %12s %12s %12s\n", "block-KiB", "mappings",
+        "data-MiB", "meta-MiB", "total-MiB", "waste-MiB");
+
+    for (size_t i = 0; i < plan->num_candidates; i++)
+    {
+        const thinplan_candidate_t* c = &plan->candidates[i];
+
+        printf("%-10zu %12zu %12.1lf %12.1lf %12.1lf %12.1lf%s\n",
+            c->block_size / 1024,
+            c->num_mappings,
+            c->data_size / mb,
+            c->meta_size / mb,
+            (c->data_size + c->meta_size) / mb,
+            c->waste / mb,
+            i == plan->chosen ? " <==" : "");
+    }
+}
+
+/* Return the thin-pool block size (in 512-byte units) for the rootfs */
+static size_t _choose_thin_block_size(
+    const char* disk,
+    const thin_block_opt_t* thin_block)
+{
+    thinplan_t plan;
+    const thinplan_candidate_t* c;
+
+    if (thin_block->sectors)
+        return thin_block->sectors;
+
+    printf("%s>>> Planning thin block size...%s\n",
+        colors_green, colors_reset);
+
+    _plan_thin_blocks(disk, thin_block->objective, &plan);
+    _print_thin_plan(&plan);
+
+    c = &plan.candidates[plan.chosen];
+    printf("Using %zu KiB thin blocks (objective: %s)\n",
+        c->block_size / 1024, thinplan_objective_name(plan.objective));
+
+    return c->block_size / THIN_BLOCK_SIZE_UNITS;
+}
+
+/* Add the (empty) thin and upper-layer partitions, expanding the disk if
+ * needed; the thin partitions are initialized later */
+static void _add_extra_partitions(
+    const char* disk,
+    bool use_thin_provisioning,
+    bool use_resource_disk,
+    size_t thin_block_size)
+{
+    int part_index;
+    gpt_entry_t entry;
+    char source[PATH_MAX];
+    buf_t buf = BUF_INITIALIZER;
+    size_t ext4_block_size;
+    size_t ext4_block_count;
+    size_t thin_data_partition_size = 0;
+    size_t thin_meta_partition_size = 0;
+    size_t available_disk_space;
+    size_t extra_space = 0;
+    size_t ext4_bytes;
+    const size_t gb = 1024*1024*1024;
+#ifdef USE_EFI_EPHEMERAL_DISK
+    const size_t efi_partition_size = gb;
+#endif /* USE_EFI_EPHEMERAL_DISK */
+
+    printf("%s>>> Adding extra partitions...%s\n", colors_green, colors_reset);
+
+    /* find the Linux root partition */
+    if ((part_index = find_gpt_entry_by_type(
+        disk, &linux_type_guid, source, &entry)) < 0)
+    {
+        ERR("Cannot find Linux root partition: disk=%s", disk);
+    }
+
+    /* Check whether rootfs is valid */
+    if (__test_ext4_rootfs(source) < 0)
+        ERR("partition is not an EXT4 rootfs partition: %s", source);
+
+    ext4_block_size = _get_ext4_block_size(source);
+    ext4_block_count = _get_ext4_block_count(source);
+    ext4_bytes = ext4_block_size * ext4_block_count;
+
+    /* Need extra space for upper layer disk */
+    if (!use_resource_disk)
+        extra_space += ext4_bytes;
+
+    /* Calculate space needed for thin partition */
+    if (use_thin_provisioning)
+    {
+        const size_t two_mb = 2*1024*1024;
+        size_t n;
+        size_t m;
+        const uint64_t offset = gpt_entry_offset(&entry);
+        const uint64_t end = offset + gpt_entry_size(&entry);
+
+        /* Find sparse fragments */
+        {
+            frag_list_t frags = FRAG_LIST_INITIALIZER;
+            frag_list_t holes = FRAG_LIST_INITIALIZER;
+
+            if (frags_find(globals.disk, offset, end, &frags, &holes) < 0)
+                ERR("frags_find() failed: %s", globals.disk);
+
+            /* Every thin block that holds any data is allocated in full */
+            {
+                thinplan_candidate_t c;
+
+                if (thinplan_simulate(&frags, offset, end,
+                    thin_block_size * THIN_BLOCK_SIZE_UNITS, &c) < 0)
+                {
+                    ERR("thinplan_simulate() failed");
+                }
+
+                n = c.data_size;
+            }
+
+            n += gb;
+
+            frags_release(&frags);
+            frags_release(&holes);
+        }
+
+        n += (THIN_LOW_WATER_MARK * thin_block_size * THIN_BLOCK_SIZE_UNITS);
+        n = round_up_to_multiple(n, two_mb);
+
+        /* calculate size of thin meta partition (2.5%) */
+        m = n / 40;
+        m = round_up_to_multiple(m, two_mb);
+
+        thin_data_partition_size = n;
+        thin_meta_partition_size = m;
+        extra_space += thin_data_partition_size;
+        extra_space += thin_meta_partition_size;
+    }
+
+    /* Leave room for the verity tree */
+    {
+        ssize_t n;
+
+        if ((n = verity_hash_dev_size(ext4_bytes)) < 0)
+            ERR("verity_hash_dev_size() failed");
+
+        extra_space += n;
+    }
+
+#ifdef USE_EFI_EPHEMERAL_DISK
+    /* Leave room for the EFI upper-layer partition */
     extra_space += efi_partition_size;
 #endif /* USE_EFI_EPHEMERAL_DISK */
 
@@ -2075,13 +2640,6 @@ static void _add_extra_partitions(
                 losetup(globals.disk, globals.loop);
             }
         }
-
-        /* Initialize the thin meta/data partitions */
-        _initialize_thin_partitions(disk);
-
-        /* Test activation of thin partitions and compare ext4/thin */
-        if (verify)
-            _verify_thin_partitions(disk);
     }
 
     /* Add rootfs upper layer partition but default to the maximum size */
@@ -2136,6 +2694,20 @@ static int _locate_signtool(const char* signtool, char path[PATH_MAX])
     int ret = 0;
     struct stat statbuf;
 
+    /* unix:<socket-path> names a running 'cvmsign serve' */
+    if (strncmp(signtool, SIGNPROTO_PREFIX, strlen(SIGNPROTO_PREFIX)) == 0)
+    {
+        const char* socket_path = signtool + strlen(SIGNPROTO_PREFIX);
+
+        if (stat(socket_path, &statbuf) != 0 || !S_ISSOCK(statbuf.st_mode))
+            ERAISE(-EINVAL);
+
+        if (strlcpy(path, signtool, PATH_MAX) >= PATH_MAX)
+            ERAISE(-ENAMETOOLONG);
+
+        goto done;
+    }
+
     if (which(signtool, path) != 0)
         ERAISE(-EINVAL);
 
@@ -2155,6 +2727,27 @@ static void _test_signtool(const char* signtool_path)
     int fd = -1;
     char buffer[512] = { '\0' };
 
+    /* ask the signing service to sign a digest */
+    if (strncmp(signtool_path, SIGNPROTO_PREFIX, strlen(SIGNPROTO_PREFIX)) == 0)
+    {
+        signproto_response_t* response;
+        sha256_t digest;
+
+        if (!(response = malloc(sizeof(signproto_response_t))))
+            ERR("out of memory");
+
+        sha256_compute(&digest, buffer, sizeof(buffer));
+
+        if (signproto_sign(signtool_path + strlen(SIGNPROTO_PREFIX),
+            &digest, response) < 0)
+        {
+            ERR("failed to verify signing tool: %s", signtool_path);
+        }
+
+        free(response);
+        return;
+    }
+
     if ((fd = mkstemp(tmpfile)) < 0)
     {
         ERR_NOEXIT("failed to create temporary file: %s", tmpfile);
@@ -2259,55 +2852,168 @@ static void _purge_disk(
     gpt_close(gpt);
 }
 
-static void _create_cvmboot_cpio_archive(const char* disk, const char* signtool)
+/* Timestamp for the entries of cvmboot.cpio: SOURCE_DATE_EPOCH if set (see
+ * https://reproducible-builds.org/specs/source-date-epoch/), else zero.
+ */
+static uint32_t _source_date_epoch(void)
 {
-    buf_t buf = BUF_INITIALIZER;
-    char efi_path[PATH_MAX];
-    const char* source = efi_path;
-    sig_t sig;
-    const guid_t guid = efi_type_guid;
+    const char* str;
+    char* end;
+    unsigned long x;
+
+    if (!(str = getenv("SOURCE_DATE_EPOCH")) || !*str)
+        return 0;
+
+    x = strtoul(str, &end, 10);
+
+    if (*end || x > UINT32_MAX)
+        ERR("bad SOURCE_DATE_EPOCH environment variable: %s", str);
+
+    return (uint32_t)x;
+}
+
+static int _buf_write_callback(void* context, const void* data, size_t size)
+{
+    return buf_append((buf_t*)context, data, size);
+}
 
-    if (find_gpt_entry_by_type(disk, &guid, efi_path, NULL) < 0)
+/* Get the mtools drive specification of the EFI partition of an image file
+ * (the image path and the byte offset of the partition) */
+static void _get_esp_image_spec(const char* disk, char spec[PATH_MAX])
+{
+    gpt_entry_t entry;
+
+    if (find_gpt_entry_by_type(disk, &efi_type_guid, NULL, &entry) < 0)
         ERR("Cannot find EFI partition: %s", disk);
 
-    if (mount(source, mntdir(), "vfat", 0, NULL) < 0)
-        ERR("Failed to mount EFI directory: %s => %s", source, mntdir());
+    snprintf(spec, PATH_MAX, "%s@@%zu", disk, gpt_entry_offset(&entry));
+}
+
+/* Copy the EFI directory of the EFI partition of an image file into espdir,
+ * which needs neither a loop device nor a mount */
+static void _export_esp(const char* disk, const char* espdir)
+{
+    buf_t buf = BUF_INITIALIZER;
+    char spec[PATH_MAX];
+
+    _get_esp_image_spec(disk, spec);
+    execf(&buf, "mcopy -s -n -Q -i %s ::/EFI %s", spec, espdir);
+
+    buf_release(&buf);
+}
+
+/* Copy the files that protection creates from espdir back onto the EFI
+ * partition of an image file, then remove the exported EFI directory */
+static void _import_esp(const char* disk, const char* espdir)
+{
+    buf_t buf = BUF_INITIALIZER;
+    char spec[PATH_MAX];
+    const pathid_t ids[] =
+    {
+        FILENAME_CVMBOOT_CPIO,
+        FILENAME_CVMBOOT_CPIO_SIG,
+        FILENAME_EVENTS_BIN,
+    };
+
+    _get_esp_image_spec(disk, spec);
+    paths_set_prefix("");
+
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+    {
+        char local[PATH_MAX];
+        char target[PATH_MAX];
+
+        paths_get(local, ids[i], espdir);
+        paths_get(target, ids[i], NULL);
+
+        if (access(local, F_OK) == 0)
+            execf(&buf, "mcopy -o -Q -i %s %s ::%s", spec, local, target);
+        else
+            execf_return(&buf, "mdel -i %s ::%s 2> /dev/null", spec, target);
+    }
+
+    paths_set_prefix("/boot/efi");
+    execf(&buf, "rm -rf %s/EFI", espdir);
+
+    buf_release(&buf);
+}
+
+/* espdir holds the contents of the EFI partition (mounted or exported) */
+static void _create_cvmboot_cpio_archive(
+    const char* espdir,
+    const char* signtool,
+    bool compress)
+{
+    buf_t buf = BUF_INITIALIZER;
+    sig_t sig;
 
     // Create cvmboot.cpio and cvmboot.cpio.sig */
     {
-        char cwd[PATH_MAX];
         char home[PATH_MAX];
         char cpio[PATH_MAX];
         char cpio_sig[PATH_MAX];
-        void* cpio_data = NULL;
-        size_t cpio_size = 0;
+        char events[PATH_MAX];
+        char events_bin[PATH_MAX];
+        const uint32_t mtime = _source_date_epoch();
+        sha256_t digest;
+        size_t size;
 
         paths_set_prefix("");
-        paths_get(home, DIRNAME_CVMBOOT_HOME, mntdir());
-        paths_get(cpio, FILENAME_CVMBOOT_CPIO, mntdir());
-        paths_get(cpio_sig, FILENAME_CVMBOOT_CPIO_SIG, mntdir());
+        paths_get(home, DIRNAME_CVMBOOT_HOME, espdir);
+        paths_get(cpio, FILENAME_CVMBOOT_CPIO, espdir);
+        paths_get(cpio_sig, FILENAME_CVMBOOT_CPIO_SIG, espdir);
+        paths_get(events, FILENAME_EVENTS, espdir);
+        paths_get(events_bin, FILENAME_EVENTS_BIN, espdir);
         paths_set_prefix("/boot/efi");
 
-        if (!getcwd(cwd, sizeof(cwd)))
-            ERR("failed to get the current working directory");
+        // Precompile the events file so the bootloader need not parse it
+        // (the text form stays in the archive as a fallback):
+        if (access(events, R_OK) == 0)
+            compile_events(events, events_bin);
+        else
+            unlink(events_bin);
+
+        // Archive the cvmboot directory, page-aligning file data so the
+        // bootloader can use the initrd in place:
+        if (compress)
+        {
+            // Build the archive in memory and compress it (the signature
+            // covers the compressed bytes):
+            size_t bound;
+            void* data;
 
-        if (chdir(home) < 0)
-            ERR("failed to change directory to %s", home);
+            if (mkcpio(home, 4096, mtime, _buf_write_callback, &buf,
+                NULL, NULL) < 0)
+            {
+                ERR("failed to create CPIO archive from %s", home);
+            }
 
-        execf(&buf, "find . | cpio --create --format='newc' > %s", cpio);
+            bound = lz4_compress_frame_bound(buf.size);
 
-        if (chdir(cwd) < 0)
-            ERR("failed to change directory to %s", cwd);
+            if (!(data = malloc(bound)))
+                ERR("out of memory");
 
-        if (access(cpio, R_OK) < 0)
-            ERR("failed to create file: %s", cpio);
+            if (!(size = lz4_compress_frame(buf.data, buf.size, data, bound)))
+                ERR("failed to compress CPIO file: %s", cpio);
 
-        // Load CPIO file into memory:
-        if (load_file(cpio, &cpio_data, &cpio_size) < 0)
-            ERR("failed to load CPIO file into memory: %s", cpio);
+            if (write_file(cpio, data, size) < 0)
+                ERR("failed to write file: %s", cpio);
+
+            printf("%scompressed cvmboot.cpio: %zu => %zu bytes%s\n",
+                colors_cyan, buf.size, size, colors_reset);
+
+            sha256_compute(&digest, data, size);
+            free(data);
+        }
+        else
+        {
+            // Stream the archive to the EFI partition, hashing as it goes
+            if (mkcpio_file(home, cpio, 4096, mtime, &digest, &size) < 0)
+                ERR("failed to create file: %s", cpio);
+        }
 
         // Create the verity signature structure
-        if (sig_create(cpio_data, cpio_size, signtool, &sig) != 0)
+        if (sig_create_file(cpio, &digest, signtool, &sig) != 0)
             ERR("failed to create signature");
 
         // Write the file onto the EFI partition:
@@ -2316,14 +3022,9 @@ static void _create_cvmboot_cpio_archive(const char* disk, const char* signtool)
 
         printf("Created %s\n", strip_mntdir(cpio_sig));
         sig_dump_signer(&sig);
-
-        free(cpio_data);
     }
 
-    if (umount(mntdir()) < 0)
-        ERR("failed to unmount: %s", mntdir());
-
-    _dump_expected_pcr_and_log_contents(disk, &sig);
+    _dump_expected_pcr_and_log_contents(espdir, &sig);
 
     buf_release(&buf);
 }
@@ -2336,6 +3037,22 @@ static int _test_whether_prepared(const char* disk)
     struct stat statbuf;
     char loop[PATH_MAX];
 
+    if (globals.offline)
+    {
+        buf_t buf = BUF_INITIALIZER;
+
+        _get_esp_image_spec(disk, source);
+        paths_set_prefix("");
+        paths_get(path, DIRNAME_CVMBOOT_HOME, NULL);
+        paths_set_prefix("/boot/efi");
+
+        ret = execf_return(&buf, "mdir -b -i %s ::%s > /dev/null 2>&1",
+            source, path) == 0 ? 0 : -1;
+
+        buf_release(&buf);
+        return ret;
+    }
+
     losetup(disk, loop);
 
     if (find_gpt_entry_by_type(loop, &efi_type_guid, source, NULL) < 0)
@@ -2478,22 +3195,6 @@ static void _verify_disk(const char* disk)
 {
     int ret = 0;
     gpt_t* gpt;
-    uint32_t loopnum = 0;
-
-    // Extract the loopback number (e.g., 4 from /dev/loop3p4)
-    {
-        uint32_t partnum;
-
-        if (loop_parse(disk, &loopnum, &partnum) != 0)
-        {
-            ERR("invalid disk device name: %s", disk);
-        }
-
-        if (partnum != 0)
-        {
-            ERR("invalid disk device name: %s", disk);
-        }
-    }
 
     // Open the GUID partition table.
     if ((ret = gpt_open(disk, O_RDONLY, &gpt)) < 0)
@@ -2523,29 +3224,25 @@ static void _verify_disk(const char* disk)
             {
                 blockdev_t* hdev = NULL;
                 blockdev_t* ddev = NULL;
-                char hpath[PATH_MAX];
-                char dpath[PATH_MAX];
-                uint32_t partnum = (uint32_t)(i + 1);
                 const size_t block_size = VERITY_BLOCK_SIZE;
                 sha256_t roothash;
                 verity_superblock_t sb;
                 size_t index;
 
-                loop_format(hpath, loopnum, partnum);
-
-                // Open the verity device.
-                if (blockdev_open(hpath, O_RDONLY, 0, block_size, &hdev) != 0)
+                // Open the verity partition (as a slice of the disk).
+                if (gpt_open_partition(disk, i, O_RDONLY, block_size,
+                    &hdev) != 0)
                 {
-                    ERR("failed to open hash device: %s", hpath);
+                    ERR("failed to open hash partition %zu: %s", i + 1, disk);
                 }
 
                 // Get the roothash from the hash device.
                 if (verity_get_roothash(hdev, &roothash) != 0)
-                    ERR("failed to get roothash from %s", hpath);
+                    ERR("failed to get roothash from partition %zu", i + 1);
 
                 // Get the superblock form the hash device.
                 if (verity_get_superblock(hdev, &sb) != 0)
-                    ERR("failed to get superblock from %s", hpath);
+                    ERR("failed to get superblock from partition %zu", i + 1);
 
                 printf("%s>>> Verifying data partition...%s\n",
                     colors_green, colors_reset);
@@ -2561,8 +3258,8 @@ static void _verify_disk(const char* disk)
                     &roothash,
                     &hashtree)) < 0)
                 {
-                    ERR("failed to load hash tree: %s: %s", hpath,
-                        strerror(-ret));
+                    ERR("failed to load hash tree: partition %zu: %s",
+                        i + 1, strerror(-ret));
                 }
 
                 guid_t unique_guid;
@@ -2572,14 +3269,16 @@ static void _verify_disk(const char* disk)
                 if ((index = gpt_find_partition(
                     gpt, &unique_guid)) == (size_t)-1)
                 {
-                    ERR("cannot find related data partition for %s", hpath);
+                    ERR("cannot find related data partition for %zu", i + 1);
                 }
 
-                loop_format(dpath, loopnum, index + 1);
-
-                // Open the corresponding data device.
-                if (blockdev_open(dpath, O_RDONLY, 0, block_size, &ddev) != 0)
-                    ERR("failed to open data device: %s", dpath);
+                // Open the corresponding data partition.
+                if (gpt_open_partition(disk, index, O_RDONLY, block_size,
+                    &ddev) != 0)
+                {
+                    ERR("failed to open data partition %zu: %s",
+                        index + 1, disk);
+                }
 
                 if ((ret = verity_verify_data_device(
                     ddev,
@@ -2587,7 +3286,8 @@ static void _verify_disk(const char* disk)
                     &roothash,
                     &hashtree)) < 0)
                 {
-                    ERR("Verify of data disk failed:  %s", dpath);
+                    ERR("Verify of data partition %zu failed: %s",
+                        index + 1, disk);
                 }
 
                 blockdev_close(hdev);
@@ -2827,7 +3527,7 @@ static int _strip_disk(const char* disk, const char* vhd_file)
             snprintf(msg, sizeof(msg), "Copying partition %zu => %zu", i, j);
 
             if (frags_copy(
-                &frags, globals.disk, offset0, vhd_file, offset, msg) < 0)
+                &frags, globals.disk, offset0, vhd_file, offset, 0, msg) < 0)
             {
                 ERR("frags_copy failed(): %s => %s", globals.disk, vhd_file);
             }
@@ -2876,24 +3576,103 @@ static void _strip_disk_in_place(const char* disk)
     unlink(tmpfile);
 }
 
-void _protect_disk(const char* disk, const char* signtool, bool verify)
+/* Resources that the stages of prepare and protect read and write, from which
+ * the order between the stages is derived (see stages.h) */
+#define RES_GPT    (1 << 0) /* the partition table and the loop device */
+#define RES_ROOTFS (1 << 1) /* the EXT4 rootfs partition */
+#define RES_ESP    (1 << 2) /* the EFI system partition */
+#define RES_MOUNT  (1 << 3) /* the mount point: mntdir() */
+#define RES_THIN   (1 << 4) /* the thin partitions and the thin DM devices */
+#define RES_VERITY (1 << 5) /* the verity partition and roothash */
+#define RES_CONFIG (1 << 6) /* kernel version and thin block size */
+#define RES_ALL    0xffffffff
+
+/* Stages that mount the rootfs (with the ESP on /boot/efi) */
+#define RES_MOUNTED (RES_ROOTFS | RES_ESP | RES_MOUNT)
+
+/* The options of prepare and protect and the results passed between stages */
+typedef struct disk_context
 {
+    const char* disk;
+    const user_opt_t* user;
+    const hostname_opt_t* hostname;
+    const char* events;
+    bool skip_resolv_conf;
+    bool use_resource_disk;
+    bool use_thin_provisioning;
+    bool verify;
+    bool expand_root_partition;
+    bool no_strip;
+    bool force_hyperv_console;
+    const upper_layer_opt_t* upper_layer;
+    const char* boot_trace;
+    bool record_boot_trace;
+    const thin_block_opt_t* thin_block;
+    bool thin_dedup;
+    const char* signtool;
+    bool compress_cpio;
+
+    char version[PATH_MAX];
+    size_t thin_block_size;
+    size_t verity_index;
     sha256_t roothash;
-    sha256_string_t str;
+}
+disk_context_t;
+
+static void _add_stage(
+    stages_t* stages,
+    const char* name,
+    uint32_t inputs,
+    uint32_t outputs,
+    void (*run)(void* arg),
+    disk_context_t* ctx)
+{
+    if (stages_add(stages, name, inputs, outputs, run, ctx) < 0)
+        ERR("too many stages: %s", name);
+}
 
-    if (access(disk, F_OK) != 0)
-        ERR("cannot access %s", disk);
+/* Run independent stages concurrently and print the critical path */
+static void _run_stages(stages_t* stages)
+{
+    long num_threads;
+
+    if ((num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        num_threads = 1;
+
+    if (stages_run(stages, num_threads) < 0)
+    {
+        if (stages->failed)
+            ERR("stage failed: %s", stages->failed);
+
+        ERR("failed to run stages");
+    }
+
+    stages_dump(stages);
+}
+
+static void _stage_print_roothash(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    const char* disk = ctx->disk;
+    sha256_t roothash;
+    sha256_string_t str;
 
     // Compute the roothash from the hash device (created during "prepare")
     {
         blockdev_t* dev = NULL;
-        char path[PATH_MAX];
+        int index;
 
-        if (find_gpt_entry_by_type(disk, &verity_type_guid, path, NULL) < 0)
+        if ((index = find_gpt_entry_by_type(
+            disk, &verity_type_guid, NULL, NULL)) < 0)
+        {
             ERR("Cannot find verity partition: disk=%s", disk);
+        }
 
-        if (blockdev_open(path, O_RDONLY, 0, VERITY_BLOCK_SIZE, &dev) != 0)
-            ERR("failed to open hash device: %s", path);
+        if (gpt_open_partition(disk, index, O_RDONLY, VERITY_BLOCK_SIZE,
+            &dev) != 0)
+        {
+            ERR("failed to open hash partition: disk=%s", disk);
+        }
 
         if (verity_get_roothash(dev, &roothash) < 0)
             ERR("failed to get root hash from device");
@@ -2903,12 +3682,79 @@ void _protect_disk(const char* disk, const char* signtool, bool verify)
 
     sha256_format(&str, &roothash);
     printf("%sroothash: %s%s\n", colors_cyan, str.buf, colors_reset);
+}
+
+static void _stage_create_cpio_archive(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    const char* disk = ctx->disk;
+    char efi_path[PATH_MAX];
 
     // Create the cvmboot CPIO archive on the EFI partition
-    _create_cvmboot_cpio_archive(disk, signtool);
+    if (globals.offline)
+    {
+        _export_esp(disk, mntdir());
+        _create_cvmboot_cpio_archive(mntdir(), ctx->signtool,
+            ctx->compress_cpio);
+        _import_esp(disk, mntdir());
+    }
+    else
+    {
+        if (find_gpt_entry_by_type(disk, &efi_type_guid, efi_path, NULL) < 0)
+            ERR("Cannot find EFI partition: %s", disk);
+
+        if (mount(efi_path, mntdir(), "vfat", 0, NULL) < 0)
+            ERR("Failed to mount EFI directory: %s => %s", efi_path, mntdir());
+
+        _create_cvmboot_cpio_archive(mntdir(), ctx->signtool,
+            ctx->compress_cpio);
+
+        if (umount(mntdir()) < 0)
+            ERR("failed to unmount: %s", mntdir());
+    }
+}
 
-    if (verify)
-        _verify_disk(disk);
+static void _stage_verify_disk(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    _verify_disk(ctx->disk);
+}
+
+static void _add_cpio_stage(stages_t* stages, disk_context_t* ctx)
+{
+    _add_stage(stages, "create-cpio-archive", RES_GPT, RES_ESP | RES_MOUNT,
+        _stage_create_cpio_archive, ctx);
+}
+
+/* Add the stages of protect that read the verity partition (print the
+ * roothash and verify the disk), which overlap each other */
+static void _add_check_stages(stages_t* stages, disk_context_t* ctx)
+{
+    _add_stage(stages, "print-roothash", RES_GPT | RES_VERITY, 0,
+        _stage_print_roothash, ctx);
+
+    if (ctx->verify)
+    {
+        _add_stage(stages, "verify-disk", RES_GPT | RES_ROOTFS | RES_VERITY,
+            0, _stage_verify_disk, ctx);
+    }
+}
+
+static void _add_protect_stages(stages_t* stages, disk_context_t* ctx)
+{
+    _add_cpio_stage(stages, ctx);
+    _add_check_stages(stages, ctx);
+}
+
+static void _protect_disk(disk_context_t* ctx)
+{
+    stages_t stages = { .num_stages = 0 };
+
+    if (access(ctx->disk, F_OK) != 0)
+        ERR("cannot access %s", ctx->disk);
+
+    _add_protect_stages(&stages, ctx);
+    _run_stages(&stages);
 }
 
 /* ATTN: move to its own file: parsing.c? */
@@ -3016,6 +3862,113 @@ static void _get_user_option(int* argc, const char* argv[], user_opt_t* user)
         ERR("missing ssh-key file for --user option: \"%s\"", user->sshkey);
 }
 
+static void _get_upper_layer_option(
+    int* argc,
+    const char* argv[],
+    upper_layer_opt_t* upper_layer)
+{
+    const char* opt;
+    err_t err;
+    char* p;
+    uint32_t kb = 0;
+
+    strlcpy(upper_layer->engine, "snapshot", sizeof(upper_layer->engine));
+    upper_layer->sectors = UPPER_LAYER_SNAPSHOT_CHUNK_KB * 2;
+
+    if (getoption(argc, argv, "--upper-layer", &opt, &err) != 0)
+        return;
+
+    strlcpy(upper_layer->engine, opt, sizeof(upper_layer->engine));
+
+    if ((p = strchr(upper_layer->engine, ':')))
+    {
+        *p++ = '\0';
+
+        if (str2u32(p, &kb) != 0 || kb == 0)
+            ERR("bad size for --upper-layer option: \"%s\"", opt);
+    }
+
+    if (strcmp(upper_layer->engine, "snapshot") == 0)
+    {
+        if (kb == 0)
+            kb = UPPER_LAYER_SNAPSHOT_CHUNK_KB;
+
+        /* dm-snapshot chunks are a power of two */
+        if (kb < 4 || kb > 1024 || (kb & (kb - 1)))
+            ERR("bad chunk size for --upper-layer option: \"%s\"", opt);
+    }
+    else if (strcmp(upper_layer->engine, "thin") == 0)
+    {
+        if (kb == 0)
+            kb = UPPER_LAYER_THIN_BLOCK_KB;
+
+        /* dm-thin blocks are a multiple of 64 KiB */
+        if (kb % 64 || kb > 1024 * 1024)
+            ERR("bad block size for --upper-layer option: \"%s\"", opt);
+    }
+    else
+    {
+        ERR("bad engine for --upper-layer option: \"%s\"", opt);
+    }
+
+    upper_layer->sectors = (size_t)kb * 2;
+}
+
+static void _get_thin_block_option(
+    int* argc,
+    const char* argv[],
+    thin_block_opt_t* thin_block)
+{
+    const char* opt;
+    err_t err;
+    const char* p;
+    uint32_t kb;
+
+    thin_block->sectors = 0;
+    thin_block->objective = THINPLAN_OBJECTIVE_BALANCED;
+
+    if (getoption(argc, argv, "--thin-block-size", &opt, &err) != 0)
+        return;
+
+    if (strncmp(opt, "auto", 4) == 0 && (opt[4] == '\0' || opt[4] == ':'))
+    {
+        p = opt + 4;
+
+        if (*p == ':' && thinplan_parse_objective(p + 1,
+            &thin_block->objective) != 0)
+        {
+            ERR("bad objective for --thin-block-size option: \"%s\"", opt);
+        }
+
+        return;
+    }
+
+    /* dm-thin blocks are a multiple of 64 KiB, up to 1 GiB */
+    if (str2u32(opt, &kb) != 0 || kb == 0 || kb % 64 || kb > 1024 * 1024)
+        ERR("bad size for --thin-block-size option: \"%s\"", opt);
+
+    thin_block->sectors = (size_t)kb * 2;
+}
+
+static void _get_initrd_cache_option(int* argc, const char* argv[])
+{
+    const char* opt;
+    err_t err;
+
+    globals.initrd_cache = DEFAULT_INITRD_CACHE;
+
+    if (getoption(argc, argv, "--initrd-cache", &opt, &err) == 0)
+    {
+        if (*opt != '/')
+            ERR("--initrd-cache requires an absolute path: %s", opt);
+
+        globals.initrd_cache = opt;
+    }
+
+    if (getoption(argc, argv, "--no-initrd-cache", NULL, &err) == 0)
+        globals.initrd_cache = NULL;
+}
+
 static int _create_cvmsign_public_private_keys(
     const char* private_key_path,
     const char* public_key_path)
@@ -3088,162 +4041,331 @@ done:
     return ret;
 }
 
-static void _add_verity_partition(const char* disk, bool verify)
+static int _find_linux_partition(const char* disk)
 {
-    err_t err = ERR_INITIALIZER;
-    buf_t buf = BUF_INITIALIZER;
-    char linux_path[PATH_MAX];
-    sha256_t roothash;
+    int index;
 
     if (access(disk, F_OK) != 0)
         ERR("cannot access %s", disk);
 
-    /* Find the Linux rootfs partition */
-    if (find_gpt_entry_by_type(disk, &linux_type_guid, linux_path, NULL) < 0)
+    if ((index = find_gpt_entry_by_type(
+        disk, &linux_type_guid, NULL, NULL)) < 0)
+    {
         ERR("Cannot find Linux rootfs partition: %s", disk);
+    }
 
-    // Add the verity partition for the rootfs */
+    return index;
+}
+
+/* Add the verity partition for the rootfs (formatted later) */
+static void _create_verity_partition(disk_context_t* ctx)
+{
+    err_t err = ERR_INITIALIZER;
+    guid_t unique_guid;
+    int ret;
+
+    printf("%s>>> Adding verity partition...%s\n", colors_green, colors_reset);
+
+    if ((ret = verity_create_partition(
+        ctx->disk,
+        _find_linux_partition(ctx->disk),
+        &unique_guid,
+        &ctx->verity_index,
+        &err)) != 0)
     {
-        guid_t unique_guid;
-        const bool trace = true;
-        const bool progress = true;
-        int ret = 0;
+        ERR("%s: %s", err.buf, strerror(-ret));
+    }
+}
 
-        memset(&roothash, 0, sizeof(roothash));
+static void _stage_check_events(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    sha256_t signer = SHA256_INITIALIZER;
 
-        if ((ret = verity_add_partition(
-            disk,
-            linux_path,
-            trace,
-            progress,
-            &unique_guid,
-            &roothash,
-            &err)) != 0)
-        {
-            ERR("%s: %s", err.buf, strerror(-ret));
-        }
+    /* use a zero-valued signer */
+    sha256_string_t str;
+    sha256_format(&str, &signer);
+    preprocess_events(ctx->events, str.buf);
+}
+
+static void _stage_purge_disk(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Remove extra partitions
+    _purge_disk(ctx->disk, true, true);
+}
+
+static void _stage_remove_cvmboot_dir(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // remove the cvmboot directory from the ESP
+    _remove_cvmboot_dir(ctx->disk);
+}
+
+static void _stage_resize_root_partition(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Expand the EXT4 to use most of disk:
+    if (ctx->expand_root_partition)
+        _expand_ext4_root_partition(ctx->disk);
+    else
+        _round_root_partition(ctx->disk);
+}
+
+static void _stage_patch_rootfs(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Patch the fstab file to enable noatime:
+    _patch_fstab(ctx->disk);
+
+    // Disable Azure resource-disk formatting and mounting on /mnt:
+    if (ctx->use_resource_disk)
+        _preserve_resource_disk(ctx->disk);
+
+    // Update resolv.conf so apt commands will work below:
+    if (!ctx->skip_resolv_conf)
+        _update_resolv_conf(ctx->disk);
+
+    // Remove the KVP service:
+    _remove_kvp_service(ctx->disk);
 
-        // verity_add_partition() reassigns the loop device
-        disk = globals.loop;
+    // Remove cvmboot.conf if any:
+    _remove_cvmboot_conf(ctx->disk);
+}
+
+static void _stage_install_kernel(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Install the kernel onto the EFI partition:
+    _install_kernel_onto_esp(ctx->disk, ctx->version);
+
+    // Choose the thin block size, which the initrd needs to know:
+    if (ctx->use_thin_provisioning)
+    {
+        ctx->thin_block_size = _choose_thin_block_size(
+            ctx->disk, ctx->thin_block);
     }
+}
 
-    /* Add roothash to the cvmboot.conf file */
+static void _stage_install_boot_files(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Install the initrd onto the EFI partition:
+    _install_initrd_onto_esp(ctx->disk, ctx->version, ctx->use_resource_disk,
+        ctx->use_thin_provisioning, ctx->upper_layer, ctx->thin_block_size);
+
+    // Install the bootloader onto the EFI partition:
+    _install_bootloader(ctx->disk, ctx->events);
+
+    // Install Linux cmdline file onto EFI partition:
+    _append_cmdline_option(ctx->disk, ctx->version, ctx->force_hyperv_console,
+        ctx->record_boot_trace);
+}
+
+static void _stage_configure_users(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Add user:
+    if (*ctx->user->username)
+        _add_user(ctx->disk, ctx->user);
+
+    // Set hostname:
+    if (*ctx->hostname->buf)
+        _set_hostname(ctx->disk, ctx->hostname->buf);
+}
+
+static void _stage_punch_free_blocks(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Purge any extra partition created before:
+    _purge_disk(ctx->disk, true, true);
+
+    // Drop stale data from free EXT4 blocks before verity and thin:
+    _punch_free_ext4_blocks(ctx->disk);
+}
+
+static void _stage_add_partitions(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    // Add all partitions before any is opened, since a GPT update makes the
+    // kernel reread the partitions of the loop device:
+    _add_extra_partitions(ctx->disk, ctx->use_thin_provisioning,
+        ctx->use_resource_disk, ctx->thin_block_size);
+
+    _create_verity_partition(ctx);
+}
+
+static void _stage_initialize_thin(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    _initialize_thin_partitions(ctx->disk, ctx->boot_trace,
+        ctx->thin_block_size, ctx->thin_dedup);
+}
+
+static void _stage_verify_thin(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+
+    _verify_thin_partitions(ctx->disk, ctx->thin_block_size);
+}
+
+static void _stage_format_verity(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    err_t err = ERR_INITIALIZER;
+    const bool trace = true;
+    int ret;
+
+    // Leave the progress meter to the thin copy if it runs alongside:
+    const bool progress = !ctx->use_thin_provisioning;
+
+    if ((ret = verity_format_partition(
+        ctx->disk,
+        _find_linux_partition(ctx->disk),
+        ctx->verity_index,
+        trace,
+        progress,
+        &ctx->roothash,
+        &err)) != 0)
     {
-        char path[PATH_MAX];
-        char conf_path[PATH_MAX];
+        ERR("%s: %s", err.buf, strerror(-ret));
+    }
+}
 
-        if (find_gpt_entry_by_type(disk, &efi_type_guid, path, NULL) < 0)
-            ERR("Cannot find EFI partition: %s", disk);
+static void _stage_add_roothash_to_conf(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
+    buf_t buf = BUF_INITIALIZER;
+    char path[PATH_MAX];
+    char conf_path[PATH_MAX];
 
-        if (mount(path, mntdir(), "vfat", 0, NULL) < 0)
-            ERR("Failed to mount EFI directory: %s => %s", path, mntdir());
+    /* Add roothash to the cvmboot.conf file */
+    if (find_gpt_entry_by_type(ctx->disk, &efi_type_guid, path, NULL) < 0)
+        ERR("Cannot find EFI partition: %s", ctx->disk);
 
-        paths_set_prefix("");
-        paths_get(conf_path, FILENAME_CVMBOOT_CONF, mntdir());
-        paths_set_prefix("/boot/efi");
+    if (mount(path, mntdir(), "vfat", 0, NULL) < 0)
+        ERR("Failed to mount EFI directory: %s => %s", path, mntdir());
 
-        // Find and add hash of root filesystem partition to 'rootfs' file:
-        {
-            sha256_string_t str;
-            sha256_format(&str, &roothash);
-            execf(&buf, "sed -i '/^roothash=/d' %s", conf_path);
-            execf(&buf, "echo 'roothash=%s' >> %s", str.buf, conf_path);
-        }
+    paths_set_prefix("");
+    paths_get(conf_path, FILENAME_CVMBOOT_CONF, mntdir());
+    paths_set_prefix("/boot/efi");
 
-        umount(mntdir());
+    // Find and add hash of root filesystem partition to 'rootfs' file:
+    {
+        sha256_string_t str;
+        sha256_format(&str, &ctx->roothash);
+        execf(&buf, "sed -i '/^roothash=/d' %s", conf_path);
+        execf(&buf, "echo 'roothash=%s' >> %s", str.buf, conf_path);
     }
 
+    umount(mntdir());
     buf_release(&buf);
 }
 
-static void _prepare_disk(
-    const char* disk,
-    const user_opt_t* user,
-    const hostname_opt_t* hostname,
-    const char* events,
-    bool skip_resolv_conf,
-    bool use_resource_disk,
-    bool use_thin_provisioning,
-    bool verify,
-    bool expand_root_partition,
-    bool no_strip,
-    bool force_hyperv_console)
+static void _stage_strip_disk(void* arg)
 {
-    char version[PATH_MAX] = "";
+    disk_context_t* ctx = (disk_context_t*)arg;
 
-    /* check the validity of the events file */
-    if (events)
-    {
-        sha256_t signer = SHA256_INITIALIZER;
+    // Remove uneeded partitions:
+    _strip_disk_in_place(ctx->disk);
+}
 
-        /* use a zero-valued signer */
-        sha256_string_t str;
-        sha256_format(&str, &signer);
-        preprocess_events(events, str.buf);
-    }
+/* Add the stages of prepare (up to stripping), in the order that they would
+ * run one by one. Most stages mount the rootfs and so run in turn, but once
+ * the partitions are laid out, the thin copy and its verification run
+ * alongside the verity formatting and the update of cvmboot.conf. The initrd
+ * cannot be generated alongside the verity formatting, since it is written
+ * into the rootfs that verity hashes. */
+static void _add_prepare_stages(stages_t* stages, disk_context_t* ctx)
+{
+    /* check the validity of the events file */
+    if (ctx->events)
+        _add_stage(stages, "check-events", 0, 0, _stage_check_events, ctx);
 
-    // Remove extra partitions
-    _purge_disk(disk, true, true);
+    _add_stage(stages, "purge-disk", 0, RES_GPT, _stage_purge_disk, ctx);
 
-    // remove the cvmboot directory from the ESP
-    _remove_cvmboot_dir(disk);
+    _add_stage(stages, "remove-cvmboot-dir", RES_GPT, RES_MOUNTED,
+        _stage_remove_cvmboot_dir, ctx);
 
-    // Expand the EXT4 to use most of disk:
-    if (expand_root_partition)
-        _expand_ext4_root_partition(disk);
-    else
-        _round_root_partition(disk);
+    _add_stage(stages, "resize-root-partition", 0,
+        RES_GPT | RES_ROOTFS | RES_MOUNT, _stage_resize_root_partition, ctx);
 
-    // Patch the fstab file to enable noatime:
-    _patch_fstab(disk);
+    _add_stage(stages, "patch-rootfs", RES_GPT, RES_MOUNTED,
+        _stage_patch_rootfs, ctx);
 
-    // Disable Azure resource-disk formatting and mounting on /mnt:
-    if (use_resource_disk)
-        _preserve_resource_disk(disk);
+    _add_stage(stages, "install-kernel", RES_GPT, RES_MOUNTED | RES_CONFIG,
+        _stage_install_kernel, ctx);
 
-    // Update resolv.conf so apt commands will work below:
-    if (!skip_resolv_conf)
-        _update_resolv_conf(disk);
+    _add_stage(stages, "install-boot-files", RES_GPT | RES_CONFIG,
+        RES_MOUNTED, _stage_install_boot_files, ctx);
 
-    // Remove the KVP service:
-    _remove_kvp_service(disk);
+    _add_stage(stages, "configure-users", RES_GPT, RES_MOUNTED,
+        _stage_configure_users, ctx);
 
-    // Remove cvmboot.conf if any:
-    _remove_cvmboot_conf(disk);
+    _add_stage(stages, "punch-free-blocks", 0, RES_GPT | RES_ROOTFS,
+        _stage_punch_free_blocks, ctx);
 
-    // Install the kernel onto the EFI partition:
-    _install_kernel_onto_esp(disk, version);
+    _add_stage(stages, "add-partitions", RES_ROOTFS | RES_CONFIG,
+        RES_GPT | RES_MOUNT | RES_THIN | RES_VERITY, _stage_add_partitions,
+        ctx);
 
-    // Install the initrd onto the EFI partition:
-    _install_initrd_onto_esp(disk, version, use_resource_disk,
-        use_thin_provisioning);
+    if (ctx->use_thin_provisioning)
+    {
+        /* Initialize the thin meta/data partitions */
+        _add_stage(stages, "initialize-thin", RES_GPT | RES_ROOTFS |
+            RES_CONFIG, RES_THIN, _stage_initialize_thin, ctx);
 
-    // Install the bootloader onto the EFI partition:
-    _install_bootloader(disk, events);
+        /* Test activation of thin partitions and compare ext4/thin (always
+         * after deduplication, which bypasses dm-thin) */
+        if (ctx->verify || ctx->thin_dedup)
+        {
+            _add_stage(stages, "verify-thin", RES_GPT | RES_ROOTFS |
+                RES_CONFIG, RES_THIN, _stage_verify_thin, ctx);
+        }
+    }
 
-    // Install Linux cmdline file onto EFI partition:
-    _append_cmdline_option(disk, version, force_hyperv_console);
+    _add_stage(stages, "format-verity", RES_GPT | RES_ROOTFS, RES_VERITY,
+        _stage_format_verity, ctx);
 
-    // Add user:
-    if (*user->username)
-        _add_user(disk, user);
+    _add_stage(stages, "add-roothash-to-conf", RES_GPT | RES_VERITY,
+        RES_ESP | RES_MOUNT, _stage_add_roothash_to_conf, ctx);
+}
 
-    // Set hostname:
-    if (*hostname->buf)
-        _set_hostname(disk, hostname->buf);
+static void _add_strip_stage(stages_t* stages, disk_context_t* ctx)
+{
+    // Strip rewrites the whole disk and detaches the loop device:
+    if (!ctx->no_strip)
+    {
+        _add_stage(stages, "strip-disk", RES_ALL, RES_ALL, _stage_strip_disk,
+            ctx);
+    }
+}
 
-    // Purge any extra partition created before:
-    _purge_disk(disk, true, true);
+static void _stage_attach_loop(void* arg)
+{
+    disk_context_t* ctx = (disk_context_t*)arg;
 
-    _add_extra_partitions(disk, use_thin_provisioning, use_resource_disk,
-        verify);
+    losetup(globals.disk, globals.loop);
+    ctx->disk = globals.loop;
+}
 
-    // Add the verity partition for the rootfs
-    _add_verity_partition(disk, verify);
+static void _prepare_disk(disk_context_t* ctx)
+{
+    stages_t stages = { .num_stages = 0 };
 
-    // Remove uneededpartitions:
-    if (!no_strip)
-        _strip_disk_in_place(disk);
+    _add_prepare_stages(&stages, ctx);
+    _add_strip_stage(&stages, ctx);
+    _run_stages(&stages);
 }
 
 static bool _is_vhdx_path(const char* path)
@@ -3305,6 +4427,37 @@ Options:\n\
         Do not strip the EXT4 rootfs partition.\n\
     --force-hyperv-console\n\
         Force Hyper-V console settings in the kernel command line.\n\
+    --upper-layer=snapshot[:<chunk-kb>]|thin[:<block-kb>]\n\
+        Select how the writable upper layer is joined with the read-only\n\
+        rootfs at boot: dm-snapshot with the given chunk size (a power of\n\
+        two from 4 to 1024, default 4), or dm-thin with the rootfs as its\n\
+        external origin and the given pool block size (a multiple of 64,\n\
+        default 64). Sizes are in KiB. The default is snapshot:4.\n\
+    --record-boot-trace\n\
+        Record the reads of the rootfs at boot (kernel option cvmboot.trace),\n\
+        to be saved after boot with:\n\
+        cat /sys/kernel/tracing/trace > <trace-file>\n\
+    --boot-trace=<trace-file>\n\
+        Lay out the thin data partition in the order in which the recorded\n\
+        boot read the rootfs, so that boot-time reads are mostly sequential.\n\
+    --thin-block-size=<block-kb>|auto[:size|balanced|mappings]\n\
+        Set the block size of the thin pool that holds the rootfs (a multiple\n\
+        of 64 KiB), or choose it from the allocated extents of the rootfs\n\
+        (see 'cvmdisk thinplan'): the smallest data plus metadata (size), the\n\
+        largest block size within 10%% of that (balanced), or the fewest\n\
+        mappings (mappings). The default is auto:balanced.\n\
+    --thin-dedup\n\
+        Store identical blocks of the rootfs once in the thin data partition\n\
+        (mapping them to one shared block), then verify the thin volume\n\
+        against the rootfs. Requires thin_restore (thin-provisioning-tools).\n\
+    --initrd-cache=<dir>\n\
+        Reuse an initrd.img built by an earlier run whose inputs (kernel\n\
+        version and modules, /etc/initramfs-tools with the cvmboot hooks,\n\
+        /usr/share/initramfs-tools and the installed packages, as listed in\n\
+        /var/lib/dpkg/status) match, from the given directory (default\n\
+        /var/cache/cvmdisk/initrd), rather than running mkinitramfs.\n\
+    --no-initrd-cache\n\
+        Always run mkinitramfs (and do not add to the cache).\n\
 \n\
 Description:\n\
     This subcommand prepares a VM disk image for integrity protection by\n\
@@ -3346,7 +4499,12 @@ static int _subcommand_prepare(
     bool verify,
     bool expand_root_partition,
     bool no_strip,
-    bool force_hyperv_console)
+    bool force_hyperv_console,
+    const upper_layer_opt_t* upper_layer,
+    const char* boot_trace,
+    bool record_boot_trace,
+    const thin_block_opt_t* thin_block,
+    bool thin_dedup)
 {
     const char* input_disk = NULL;
     const char* output_disk = NULL;
@@ -3390,9 +4548,29 @@ static int _subcommand_prepare(
 
     _fixup_gpt(disk);
 
-    _prepare_disk(disk, user, hostname, events, skip_resolv_conf,
-        use_resource_disk, use_thin_provisioning, verify,
-        expand_root_partition, no_strip, force_hyperv_console);
+    {
+        disk_context_t ctx =
+        {
+            .disk = disk,
+            .user = user,
+            .hostname = hostname,
+            .events = events,
+            .skip_resolv_conf = skip_resolv_conf,
+            .use_resource_disk = use_resource_disk,
+            .use_thin_provisioning = use_thin_provisioning,
+            .verify = verify,
+            .expand_root_partition = expand_root_partition,
+            .no_strip = no_strip,
+            .force_hyperv_console = force_hyperv_console,
+            .upper_layer = upper_layer,
+            .boot_trace = boot_trace,
+            .record_boot_trace = record_boot_trace,
+            .thin_block = thin_block,
+            .thin_dedup = thin_dedup,
+        };
+
+        _prepare_disk(&ctx);
+    }
 
     return 0;
 }
@@ -3406,6 +4584,14 @@ Synopsis:\n\
 Options:\n\
     --verify\n\
         Verify the verity and thin partitions.\n\
+    --compress-cpio\n\
+        Compress the cvmboot.cpio archive with LZ4. The boot loader verifies\n\
+        the compressed archive and then decompresses it.\n\
+    --offline\n\
+        Work on the image file directly, without loop devices, mounts or\n\
+        root privileges: partitions are accessed as byte ranges given by the\n\
+        GPT and the EFI partition with mtools (mcopy), so several images can\n\
+        be protected at once on one host.\n\
 \n\
 Description:\n\
     The protect subcommand protects the VM disk image after it has been\n\
@@ -3424,9 +4610,16 @@ Description:\n\
         image (unless the --no-strip option is present).\n\
 \n\
     The resulting VM disk image is ready for deployment.\n\
+\n\
+    The signing tool is either a program (such as cvmsign or akvsign) or\n\
+    unix:<socket-path>, which names a running 'cvmsign serve' service.\n\
 \n\
 \n"
-static int _subcommand_protect(int argc, const char* argv[], bool verify)
+static int _subcommand_protect(
+    int argc,
+    const char* argv[],
+    bool verify,
+    bool compress_cpio)
 {
     const char* disk = NULL;
     buf_t buf = BUF_INITIALIZER;
@@ -3440,7 +4633,17 @@ static int _subcommand_protect(int argc, const char* argv[], bool verify)
     }
 
     _check_vhd(argv[2]);
-    _setup_loopback(argc, argv);
+
+    if (globals.offline)
+    {
+        // Slice the image file by its GPT rather than through a loop device
+        globals.disk = argv[2];
+        atexit(_atexit_function);
+    }
+    else
+    {
+        _setup_loopback(argc, argv);
+    }
 
     disk = argv[2];
     signtool = argv[3];
@@ -3474,7 +4677,17 @@ static int _subcommand_protect(int argc, const char* argv[], bool verify)
     execf(&buf, "sgdisk -s %s", disk);
 
     // Create the verity partitions:
-    _protect_disk(disk, signtool_path, verify);
+    {
+        disk_context_t ctx =
+        {
+            .disk = disk,
+            .verify = verify,
+            .signtool = signtool_path,
+            .compress_cpio = compress_cpio,
+        };
+
+        _protect_disk(&ctx);
+    }
 
     buf_release(&buf);
 
@@ -3511,11 +4724,45 @@ Options:\n\
         Do not strip the EXT4 rootfs partition.\n\
     --force-hyperv-console\n\
         Force Hyper-V console settings in the kernel command line.\n\
+    --upper-layer=snapshot[:<chunk-kb>]|thin[:<block-kb>]\n\
+        Select how the writable upper layer is joined with the read-only\n\
+        rootfs at boot: dm-snapshot with the given chunk size (a power of\n\
+        two from 4 to 1024, default 4), or dm-thin with the rootfs as its\n\
+        external origin and the given pool block size (a multiple of 64,\n\
+        default 64). Sizes are in KiB. The default is snapshot:4.\n\
+    --record-boot-trace\n\
+        Record the reads of the rootfs at boot (kernel option cvmboot.trace),\n\
+        to be saved after boot with:\n\
+        cat /sys/kernel/tracing/trace > <trace-file>\n\
+    --boot-trace=<trace-file>\n\
+        Lay out the thin data partition in the order in which the recorded\n\
+        boot read the rootfs, so that boot-time reads are mostly sequential.\n\
+    --thin-block-size=<block-kb>|auto[:size|balanced|mappings]\n\
+        Set the block size of the thin pool that holds the rootfs (a multiple\n\
+        of 64 KiB), or choose it from the allocated extents of the rootfs\n\
+        (see 'cvmdisk thinplan'): the smallest data plus metadata (size), the\n\
+        largest block size within 10%% of that (balanced), or the fewest\n\
+        mappings (mappings). The default is auto:balanced.\n\
+    --thin-dedup\n\
+        Store identical blocks of the rootfs once in the thin data partition\n\
+        (mapping them to one shared block), then verify the thin volume\n\
+        against the rootfs. Requires thin_restore (thin-provisioning-tools).\n\
+    --initrd-cache=<dir>\n\
+        Reuse an initrd.img built by an earlier run whose inputs (kernel\n\
+        version and modules, /etc/initramfs-tools with the cvmboot hooks,\n\
+        /usr/share/initramfs-tools and the installed packages, as listed in\n\
+        /var/lib/dpkg/status) match, from the given directory (default\n\
+        /var/cache/cvmdisk/initrd), rather than running mkinitramfs.\n\
+    --no-initrd-cache\n\
+        Always run mkinitramfs (and do not add to the cache).\n\
+    --compress-cpio\n\
+        Compress the cvmboot.cpio archive with LZ4.\n\
 \n\
 Description:\n\
     This subcommand both prepares and protects a VM disk image. It is\n\
     equivalent to running 'cvmdisk prepare' followed by 'cvmdisk protect'.\n\
     For more details see the prepare and protect subcommands.\n\
+    The signing tool may be unix:<socket-path> (see 'cvmsign serve').\n\
 \n\
 \n"
 static int _subcommand_init(
@@ -3531,7 +4778,13 @@ static int _subcommand_init(
     bool verify,
     bool expand_root_partition,
     bool no_strip,
-    bool force_hyperv_console)
+    bool force_hyperv_console,
+    bool compress_cpio,
+    const upper_layer_opt_t* upper_layer,
+    const char* boot_trace,
+    bool record_boot_trace,
+    const thin_block_opt_t* thin_block,
+    bool thin_dedup)
 {
     const char* input_disk = NULL;
     const char* output_disk = NULL;
@@ -3626,15 +4879,50 @@ static int _subcommand_init(
     // Fixup the GPT info:
     _fixup_gpt(disk);
 
-    _prepare_disk(disk, user, hostname, events, skip_resolv_conf,
-        use_resource_disk, use_thin_provisioning, verify,
-        expand_root_partition, no_strip, force_hyperv_console);
+    // Prepare and protect the disk as one graph of stages, so that protect
+    // stages start as soon as the prepare stages they depend on are done:
+    {
+        stages_t stages = { .num_stages = 0 };
+        disk_context_t ctx =
+        {
+            .disk = disk,
+            .user = user,
+            .hostname = hostname,
+            .events = events,
+            .skip_resolv_conf = skip_resolv_conf,
+            .use_resource_disk = use_resource_disk,
+            .use_thin_provisioning = use_thin_provisioning,
+            .verify = verify,
+            .expand_root_partition = expand_root_partition,
+            .no_strip = no_strip,
+            .force_hyperv_console = force_hyperv_console,
+            .upper_layer = upper_layer,
+            .boot_trace = boot_trace,
+            .record_boot_trace = record_boot_trace,
+            .thin_block = thin_block,
+            .thin_dedup = thin_dedup,
+            .signtool = signtool_path,
+            .compress_cpio = compress_cpio,
+        };
+
+        _add_prepare_stages(&stages, &ctx);
+
+        // Stripping copies the EFI system partition as is, so create and
+        // sign the CPIO archive before it, alongside the thin verification
+        // (stripping would otherwise wait for both in turn):
+        _add_cpio_stage(&stages, &ctx);
+
+        // Strip, then reattach the loop device that stripping detached:
+        if (!no_strip)
+        {
+            _add_strip_stage(&stages, &ctx);
+            _add_stage(&stages, "attach-loop", 0, RES_GPT,
+                _stage_attach_loop, &ctx);
+        }
 
-    // Protect the disk:
-    globals.disk = output_disk;
-    losetup(globals.disk, globals.loop);
-    disk = globals.loop;
-    _protect_disk(disk, signtool_path, verify);
+        _add_check_stages(&stages, &ctx);
+        _run_stages(&stages);
+    }
 
     // Convert VHD to VHDX (if needed)
     if (output_disk == output_disk_vhd_buf)
@@ -3970,6 +5258,148 @@ static int _subcommand_state(int argc, const char* argv[])
     return 0;
 }
 
+#define THINPLAN_USAGE "\n\
+Usage: %s %s [options] <disk>\n\
+\n\
+Synopsis:\n\
+    Reports how the rootfs of a disk image would fit thin pools of each\n\
+    candidate block size.\n\
+\n\
+Options:\n\
+    --thin-block-size=auto[:size|balanced|mappings]\n\
+        The objective by which to choose among the block sizes (see\n\
+        'cvmdisk prepare'). The default is auto:balanced.\n\
+\n\
+Description:\n\
+    For each block size from 64 KiB to 1 MiB, this subcommand simulates\n\
+    copying the allocated blocks of the EXT4 rootfs into a thin volume and\n\
+    prints the number of block mappings, the size of the thin data that is\n\
+    written, the estimated size of the thin metadata, and the part of the\n\
+    data that only pads partly used blocks. The size chosen by the objective\n\
+    is marked; it is what 'cvmdisk prepare' would use for this image.\n\
+\n"
+static int _subcommand_thinplan(
+    int argc,
+    const char* argv[],
+    const thin_block_opt_t* thin_block)
+{
+    thinplan_t plan;
+
+    if (argc != 3 || thin_block->sectors)
+    {
+        printf(THINPLAN_USAGE, argv[0], argv[1]);
+        exit(1);
+    }
+
+    _check_vhd(argv[2]);
+    _setup_loopback(argc, argv);
+
+    const char* disk = argv[2];
+
+    _plan_thin_blocks(disk, thin_block->objective, &plan);
+
+    printf("%s: %zu extents, %.1lf MiB (objective: %s)\n", globals.disk,
+        plan.num_extents, plan.extent_size / (1024.0 * 1024.0),
+        thinplan_objective_name(plan.objective));
+
+    _print_thin_plan(&plan);
+
+    return 0;
+}
+
+#define EXTENTS_USAGE "\n\
+Usage: %s %s [options] <disk>\n\
+\n\
+Synopsis:\n\
+    Writes a manifest of the ranges of a disk image that hold non-zero data,\n\
+    for uploading the image (such as to a page blob) without its holes.\n\
+\n\
+Options:\n\
+    --granularity=<kb>\n\
+        The size of the chunks that ranges are merged within and never\n\
+        cross, in KiB, up to 65536 (default 4096, the largest page-blob\n\
+        write).\n\
+    --alignment=<bytes>\n\
+        The power of two that ranges are aligned to (default 512, the page\n\
+        size of a page blob).\n\
+    --sha256\n\
+        Add the SHA-256 of each range, so that ranges uploaded before can be\n\
+        skipped.\n\
+    --format=json|binary\n\
+        The format of the manifest (default json).\n\
+    --output=<file>\n\
+        Write the manifest to the given file rather than standard output.\n\
+\n\
+Description:\n\
+    This subcommand finds the data fragments of the image (skipping its\n\
+    holes), widens them to the alignment and merges those within each chunk\n\
+    into one range. Each range is then read in parallel, trimmed of leading\n\
+    and trailing zero pages (or dropped if all zero) and optionally hashed.\n\
+    The JSON manifest lists the ranges as offset/length (and sha256) objects.\n\
+    The binary manifest is the little-endian header and records described\n\
+    in cvmdisk/extents.h.\n\
+\n"
+static int _subcommand_extents(
+    int argc,
+    const char* argv[],
+    size_t granularity,
+    size_t alignment,
+    bool sha256,
+    bool binary,
+    const char* output)
+{
+    extents_t extents;
+    FILE* os = stdout;
+    long num_threads;
+    int r;
+
+    if (argc != 3)
+    {
+        printf(EXTENTS_USAGE, argv[0], argv[1]);
+        exit(1);
+    }
+
+    const char* disk = argv[2];
+
+    if ((num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        num_threads = 1;
+
+    if ((r = extents_find(disk, granularity, alignment, sha256, num_threads,
+        &extents)) < 0)
+    {
+        ERR("failed to find the extents of %s: %s", disk, strerror(-r));
+    }
+
+    if (output && !(os = fopen(output, "w")))
+        ERR("failed to create file: %s", output);
+
+    if (binary)
+        r = extents_write_binary(&extents, os);
+    else
+        r = extents_write_json(&extents, os);
+
+    if (r < 0 || (os != stdout && fclose(os) != 0))
+        ERR("failed to write manifest: %s", output ? output : "stdout");
+
+    /* Print the summary (away from a manifest on standard output) */
+    if (output)
+    {
+        const uint64_t data_size = extents_sizeof(&extents);
+        double percent = 0;
+
+        if (extents.file_size)
+            percent = (double)data_size / extents.file_size * 100.0;
+
+        printf("%s: %zu ranges, %.1lf MiB of %.1lf MiB (%4.1lf%%)\n",
+            output, extents.size, data_size / (1024.0 * 1024.0),
+            extents.file_size / (1024.0 * 1024.0), percent);
+    }
+
+    extents_release(&extents);
+
+    return 0;
+}
+
 static int _subcommand_digest(int argc, const char* argv[])
 {
     sha256_t hash;
@@ -4073,8 +5503,8 @@ static int _subcommand_azcopy(int argc, const char* argv[])
             ERR("failed to create directory: %s", mntdir);
     }
 
-    /* Start the sparsefs driver */
-    execf(&buf, "sparsefs-mount %s %s", basedir, mntdir);
+    /* Start the sparsefs driver (computing the digest as data arrives) */
+    execf(&buf, "sparsefs-mount --digest %s %s", basedir, mntdir);
 
     /* Run azcopy */
     {
@@ -4099,6 +5529,14 @@ static int _subcommand_azcopy(int argc, const char* argv[])
         execf(&buf, "rm -f %s", filename);
         execf(&buf, "mv %s/%s %s", basedir, bn, filename);
         printf("Created %s\n", filename);
+
+        /* Move the digest written by sparsefs alongside the new file */
+        execf(&buf, "rm -f %s.shasha256", filename);
+        if (execf_return(&buf, "mv %s/%s.shasha256 %s.shasha256 2>/dev/null",
+            basedir, bn, filename) == 0)
+        {
+            printf("Created %s.shasha256\n", filename);
+        }
     }
 
     /* Remove the temporary directory */
@@ -4123,6 +5561,47 @@ static int _subcommand_azcopy(int argc, const char* argv[])
     return ret;
 }
 
+static int _subcommand_download(
+    int argc,
+    const char* argv[],
+    const download_options_t* options)
+{
+    sha256_t hash;
+    sha256_string_t str;
+    char sidecar[PATH_MAX];
+    char line[SHA256_STRING_SIZE + 1];
+
+    if (argc != 4)
+    {
+        printf("Usage: %s %s [--connections=<n>] [--chunk-size=<bytes>] "
+            "<url> <filename>\n", argv[0], argv[1]);
+        exit(1);
+    }
+
+    const char* url = argv[2];
+    const char* filename = argv[3];
+
+    if (download_file(url, filename, options, &hash) < 0)
+    {
+        ERR("download failed (rerun the same command to resume): %s",
+            filename);
+    }
+
+    printf("Created %s\n", filename);
+
+    /* Write the digest alongside the new file (as 'cvmdisk azcopy' does) */
+    sha256_format(&str, &hash);
+    snprintf(line, sizeof(line), "%s\n", str.buf);
+    strlcpy2(sidecar, filename, ".shasha256", sizeof(sidecar));
+
+    if (write_file(sidecar, line, strlen(line)) < 0)
+        ERR("failed to write %s", sidecar);
+
+    printf("Created %s\n", sidecar);
+
+    return 0;
+}
+
 const char USAGE[] = "\n\
 Usage: %s [options] <subcommand> <args...>\n\
 \n\
@@ -4131,6 +5610,8 @@ Where subcommand is:\n\
     protect   -- adds verity partitions and signs cvmboot.cpio\n\
     init      -- peforms both prepare and protect operations\n\
     state     -- print the state of disk image (base, prepared, protected)\n\
+    thinplan  -- report the thin block size to use for a disk image\n\
+    extents   -- write a manifest of the data ranges of a disk image\n\
     shell     -- shell into a disk image\n\
 \n\
 Options:\n\
@@ -4241,6 +5722,11 @@ int main(int argc, const char* argv[])
     {
         user_opt_t user;
         hostname_opt_t hostname;
+        upper_layer_opt_t upper_layer;
+        thin_block_opt_t thin_block;
+        bool thin_dedup = false;
+        const char* boot_trace = NULL;
+        bool record_boot_trace = false;
         bool skip_resolv_conf = false;
         bool use_resource_disk = false;
         bool use_thin_provisioning = true;
@@ -4279,6 +5765,38 @@ int main(int argc, const char* argv[])
         /* get the --user option */
         _get_user_option(&argc, argv, &user);
 
+        /* get the --upper-layer option */
+        _get_upper_layer_option(&argc, argv, &upper_layer);
+
+        /* get the --thin-block-size option */
+        _get_thin_block_option(&argc, argv, &thin_block);
+
+        /* get the --initrd-cache and --no-initrd-cache options */
+        _get_initrd_cache_option(&argc, argv);
+
+        if (getoption(&argc, argv, "--thin-dedup", NULL, &err) == 0)
+        {
+            if (!use_thin_provisioning)
+                ERR("--thin-dedup requires thin provisioning");
+
+            _check_program("thin_restore");
+            thin_dedup = true;
+        }
+
+        if (getoption(&argc, argv, "--record-boot-trace", NULL, &err) == 0)
+            record_boot_trace = true;
+
+        if (getoption(&argc, argv, "--boot-trace", &opt, &err) == 0)
+        {
+            if (access(opt, R_OK) != 0)
+                ERR("file does not exist: --boot-trace=%s", opt);
+
+            if (!use_thin_provisioning)
+                ERR("--boot-trace requires thin provisioning");
+
+            boot_trace = opt;
+        }
+
         if (getoption(&argc, argv, "--events", &opt, &err) == 0)
         {
             if (access(opt, R_OK) != 0)
@@ -4297,17 +5815,29 @@ int main(int argc, const char* argv[])
 
         return _subcommand_prepare(argc, argv, &user, &hostname, events,
             skip_resolv_conf, use_resource_disk, use_thin_provisioning,
-            verify, expand_root_partition, no_strip, force_hyperv_console);
+            verify, expand_root_partition, no_strip, force_hyperv_console,
+            &upper_layer, boot_trace, record_boot_trace, &thin_block,
+            thin_dedup);
     }
     else if (strcmp(subcommand, "protect") == 0)
     {
         bool verify = false;
+        bool compress_cpio = false;
 
-        _check_root();
+        if (getoption(&argc, argv, "--offline", NULL, &err) == 0)
+            globals.offline = true;
+
+        if (globals.offline)
+            _check_program("mcopy");
+        else
+            _check_root();
 
         if (getoption(&argc, argv, "--verify", NULL, &err) == 0)
             verify = true;
 
+        if (getoption(&argc, argv, "--compress-cpio", NULL, &err) == 0)
+            compress_cpio = true;
+
         /* Handle old-style private.pem/public.pem parameters */
         if (argc == 5)
         {
@@ -4319,12 +5849,17 @@ int main(int argc, const char* argv[])
             }
         }
 
-        return _subcommand_protect(argc, argv, verify);
+        return _subcommand_protect(argc, argv, verify, compress_cpio);
     }
     else if (strcmp(subcommand, "init") == 0)
     {
         user_opt_t user;
         hostname_opt_t hostname;
+        upper_layer_opt_t upper_layer;
+        thin_block_opt_t thin_block;
+        bool thin_dedup = false;
+        const char* boot_trace = NULL;
+        bool record_boot_trace = false;
         const char* events = NULL;
         const char* opt;
         bool delta = false;
@@ -4335,6 +5870,7 @@ int main(int argc, const char* argv[])
         bool expand_root_partition = false;
         bool no_strip = false;
         bool force_hyperv_console = false;
+        bool compress_cpio = false;
 
         memset(&user, 0, sizeof(user));
         memset(&hostname, 0, sizeof(hostname));
@@ -4343,6 +5879,9 @@ int main(int argc, const char* argv[])
         if (getoption(&argc, argv, "--delta", NULL, &err) == 0)
             delta = true;
 
+        if (getoption(&argc, argv, "--compress-cpio", NULL, &err) == 0)
+            compress_cpio = true;
+
         if (getoption(&argc, argv, "--skip-resolv-conf", NULL, &err) == 0)
             skip_resolv_conf = true;
 
@@ -4367,6 +5906,38 @@ int main(int argc, const char* argv[])
         /* get the --user option */
         _get_user_option(&argc, argv, &user);
 
+        /* get the --upper-layer option */
+        _get_upper_layer_option(&argc, argv, &upper_layer);
+
+        /* get the --thin-block-size option */
+        _get_thin_block_option(&argc, argv, &thin_block);
+
+        /* get the --initrd-cache and --no-initrd-cache options */
+        _get_initrd_cache_option(&argc, argv);
+
+        if (getoption(&argc, argv, "--thin-dedup", NULL, &err) == 0)
+        {
+            if (!use_thin_provisioning)
+                ERR("--thin-dedup requires thin provisioning");
+
+            _check_program("thin_restore");
+            thin_dedup = true;
+        }
+
+        if (getoption(&argc, argv, "--record-boot-trace", NULL, &err) == 0)
+            record_boot_trace = true;
+
+        if (getoption(&argc, argv, "--boot-trace", &opt, &err) == 0)
+        {
+            if (access(opt, R_OK) != 0)
+                ERR("file does not exist: --boot-trace=%s", opt);
+
+            if (!use_thin_provisioning)
+                ERR("--boot-trace requires thin provisioning");
+
+            boot_trace = opt;
+        }
+
         if (getoption(&argc, argv, "--events", &opt, &err) == 0)
         {
             if (access(opt, R_OK) != 0)
@@ -4396,13 +5967,74 @@ int main(int argc, const char* argv[])
 
         return _subcommand_init(argc, argv, &user, &hostname, events, delta,
             skip_resolv_conf, use_resource_disk, use_thin_provisioning,
-            verify, expand_root_partition, no_strip, force_hyperv_console);
+            verify, expand_root_partition, no_strip, force_hyperv_console,
+            compress_cpio, &upper_layer, boot_trace, record_boot_trace,
+            &thin_block, thin_dedup);
     }
     else if (strcmp(subcommand, "state") == 0)
     {
         _check_root();
         return _subcommand_state(argc, argv);
     }
+    else if (strcmp(subcommand, "thinplan") == 0)
+    {
+        thin_block_opt_t thin_block;
+
+        _check_root();
+
+        /* get the --thin-block-size option */
+        _get_thin_block_option(&argc, argv, &thin_block);
+
+        return _subcommand_thinplan(argc, argv, &thin_block);
+    }
+    else if (strcmp(subcommand, "extents") == 0)
+    {
+        size_t granularity = EXTENTS_DEFAULT_GRANULARITY;
+        size_t alignment = EXTENTS_DEFAULT_ALIGNMENT;
+        bool sha256 = false;
+        bool binary = false;
+        const char* output = NULL;
+        const char* opt;
+        uint32_t n;
+
+        if (getoption(&argc, argv, "--granularity", &opt, &err) == 0)
+        {
+            /* each reading thread buffers a whole chunk */
+            if (str2u32(opt, &n) != 0 || n == 0 || n > 64 * 1024)
+                ERR("--granularity option argument is invalid: %s", opt);
+
+            granularity = (size_t)n * 1024;
+        }
+
+        if (getoption(&argc, argv, "--alignment", &opt, &err) == 0)
+        {
+            if (str2u32(opt, &n) != 0 || n == 0 || (n & (n - 1)) ||
+                granularity % n)
+            {
+                ERR("--alignment option argument must be a power of two "
+                    "that divides the granularity: %s", opt);
+            }
+
+            alignment = n;
+        }
+
+        if (getoption(&argc, argv, "--sha256", NULL, &err) == 0)
+            sha256 = true;
+
+        if (getoption(&argc, argv, "--format", &opt, &err) == 0)
+        {
+            if (strcmp(opt, "binary") == 0)
+                binary = true;
+            else if (strcmp(opt, "json") != 0)
+                ERR("--format option argument is invalid: %s", opt);
+        }
+
+        if (getoption(&argc, argv, "--output", &opt, &err) == 0)
+            output = opt;
+
+        return _subcommand_extents(argc, argv, granularity, alignment, sha256,
+            binary, output);
+    }
     else if (strcmp(subcommand, "shell") == 0)
     {
         bool read_only = false;
@@ -4476,6 +6108,37 @@ int main(int argc, const char* argv[])
     {
         _subcommand_copy(argc, argv);
     }
+    else if (strcmp(subcommand, "download") == 0)
+    {
+        download_options_t options;
+        const char* opt;
+        uint32_t n;
+
+        options.connections = DOWNLOAD_DEFAULT_CONNECTIONS;
+        options.chunk_size = DOWNLOAD_DEFAULT_CHUNK_SIZE;
+        options.progress = true;
+
+        if (getoption(&argc, argv, "--connections", &opt, &err) == 0)
+        {
+            if (str2u32(opt, &n) != 0 || n == 0)
+                ERR("--connections option argument is invalid: %s", opt);
+
+            options.connections = n;
+        }
+
+        if (getoption(&argc, argv, "--chunk-size", &opt, &err) == 0)
+        {
+            if (str2u32(opt, &n) != 0 || n == 0 || (n % 4096) != 0)
+            {
+                ERR("--chunk-size option argument must be a multiple "
+                    "of 4096: %s", opt);
+            }
+
+            options.chunk_size = n;
+        }
+
+        _subcommand_download(argc, argv, &options);
+    }
     else
     {
         printf("%s: unknown subcommand: %s\n", argv[0], subcommand);
@@ -0,0 +1,183 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include "mkcpio.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <common/file.h>
+#include "eraise.h"
+
+static int _compare(const struct dirent** a, const struct dirent** b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int _filter(const struct dirent* ent)
+{
+    return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+/* Add the entries of dir/name (recursively), with name relative to dir */
+static int _add_dir(cpio_writer_t* writer, const char* dir, const char* name)
+{
+    int ret = 0;
+    struct dirent** ents = NULL;
+    int n = 0;
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+        ERAISE(-ENAMETOOLONG);
+
+    if ((n = scandir(path, &ents, _filter, _compare)) < 0)
+        ERAISE(-errno);
+
+    for (int i = 0; i < n; i++)
+    {
+        char relpath[PATH_MAX];
+        char fullpath[PATH_MAX];
+        struct stat st;
+        int r;
+
+        if (strcmp(name, ".") == 0)
+            r = snprintf(relpath, sizeof(relpath), "%s", ents[i]->d_name);
+        else
+            r = snprintf(relpath, sizeof(relpath), "%s/%s", name,
+                ents[i]->d_name);
+
+        if (r >= sizeof(relpath))
+            ERAISE(-ENAMETOOLONG);
+
+        if (snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, relpath) >=
+            sizeof(fullpath))
+        {
+            ERAISE(-ENAMETOOLONG);
+        }
+
+        if (lstat(fullpath, &st) < 0)
+            ERAISE(-errno);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (cpio_writer_add(writer, relpath, S_IFDIR | (st.st_mode & 07777),
+                NULL, 0) < 0)
+            {
+                ERAISE(-EIO);
+            }
+
+            ECHECK(_add_dir(writer, dir, relpath));
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            void* data = NULL;
+            size_t size = 0;
+
+            if (load_file(fullpath, &data, &size) < 0)
+                ERAISE(-EIO);
+
+            r = cpio_writer_add(writer, relpath, S_IFREG | (st.st_mode & 07777),
+                data, size);
+            free(data);
+
+            if (r < 0)
+                ERAISE(-EIO);
+        }
+        else
+        {
+            /* the ESP (vfat) only has directories and regular files */
+            ERAISE(-ENOTSUP);
+        }
+    }
+
+done:
+
+    if (ents)
+    {
+        for (int i = 0; i < n; i++)
+            free(ents[i]);
+
+        free(ents);
+    }
+
+    return ret;
+}
+
+int mkcpio(
+    const char* dir,
+    size_t alignment,
+    uint32_t mtime,
+    cpio_write_callback_t callback,
+    void* context,
+    sha256_t* hash,
+    size_t* size)
+{
+    int ret = 0;
+    cpio_writer_t writer;
+    struct stat st;
+
+    if (!dir || !callback)
+        ERAISE(-EINVAL);
+
+    if (cpio_writer_init(&writer, alignment, mtime, callback, context) < 0)
+        ERAISE(-EINVAL);
+
+    if (stat(dir, &st) < 0)
+        ERAISE(-errno);
+
+    if (!S_ISDIR(st.st_mode))
+        ERAISE(-ENOTDIR);
+
+    /* The first entry is the directory itself (as "find ." would list it) */
+    if (cpio_writer_add(&writer, ".", S_IFDIR | (st.st_mode & 07777),
+        NULL, 0) < 0)
+    {
+        ERAISE(-EIO);
+    }
+
+    ECHECK(_add_dir(&writer, dir, "."));
+
+    if (cpio_writer_finish(&writer, hash, size) < 0)
+        ERAISE(-EIO);
+
+done:
+    return ret;
+}
+
+static int _write_callback(void* context, const void* data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*)context) == size ? 0 : -1;
+}
+
+int mkcpio_file(
+    const char* dir,
+    const char* path,
+    size_t alignment,
+    uint32_t mtime,
+    sha256_t* hash,
+    size_t* size)
+{
+    int ret = 0;
+    FILE* os = NULL;
+
+    if (!path)
+        ERAISE(-EINVAL);
+
+    if (!(os = fopen(path, "wb")))
+        ERAISE(-errno);
+
+    ECHECK(mkcpio(dir, alignment, mtime, _write_callback, os, hash, size));
+
+    if (fflush(os) != 0)
+        ERAISE(-errno);
+
+done:
+
+    if (os && fclose(os) != 0 && ret == 0)
+        ret = -EIO;
+
+    return ret;
+}
@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_MKCPIO_H
+#define _CVMBOOT_CVMDISK_MKCPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utils/cpio.h>
+#include <utils/sha256.h>
+
+/* Create a newc CPIO archive of the contents of dir, like running
+ * "find . | cpio --create --format=newc" from dir, but reproducibly: each
+ * directory lists its entries in strcmp() order, every entry gets the given
+ * mtime, and uid/gid are zero. The archive is passed to the callback as it
+ * is produced and its digest and size are returned. See cpio_writer_init()
+ * for the meaning of alignment.
+ */
+int mkcpio(
+    const char* dir,
+    size_t alignment,
+    uint32_t mtime,
+    cpio_write_callback_t callback,
+    void* context,
+    sha256_t* hash,
+    size_t* size);
+
+/* Like mkcpio() but writes the archive to path */
+int mkcpio_file(
+    const char* dir,
+    const char* path,
+    size_t alignment,
+    uint32_t mtime,
+    sha256_t* hash,
+    size_t* size);
+
+#endif /* _CVMBOOT_CVMDISK_MKCPIO_H */
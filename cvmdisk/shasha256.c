@@ -95,3 +95,24 @@ void shasha256_final(sha256_t* hash, shasha256_ctx_t* ctx)
 
     sha256_final(hash, &ctx->ctx);
 }
+
+void shasha256_update_leaf(shasha256_ctx_t* ctx, const sha256_t* leaf)
+{
+    assert(ctx->len == 0);
+    sha256_update(&ctx->ctx, leaf, sizeof(sha256_t));
+}
+
+void shasha256_final_leaf(
+    sha256_t* hash,
+    shasha256_ctx_t* ctx,
+    const sha256_t* leaf)
+{
+    assert(ctx->len == 0);
+
+    /* shasha256_final() folds in sizeof(sha256_t*) bytes of the hash of
+     * the final partial block, so do the same to produce equal digests */
+    if (leaf)
+        sha256_update(&ctx->ctx, leaf, sizeof(sha256_t*));
+
+    sha256_final(hash, &ctx->ctx);
+}
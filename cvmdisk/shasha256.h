@@ -25,4 +25,13 @@ void shasha256_update(
 
 void shasha256_final(sha256_t* hash, shasha256_ctx_t* ctx);
 
+/* add the hash of a full block that was computed by the caller */
+void shasha256_update_leaf(shasha256_ctx_t* ctx, const sha256_t* leaf);
+
+/* finalize given the hash of the final partial block (null if none) */
+void shasha256_final_leaf(
+    sha256_t* hash,
+    shasha256_ctx_t* ctx,
+    const sha256_t* leaf);
+
 #endif /* _CVMBOOT_CVMDISK_SHASHA256_H */
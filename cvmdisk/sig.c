@@ -2,7 +2,10 @@
 // Licensed under the MIT License.
 
 #include "sig.h"
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <utils/hexstr.h>
 #include <utils/strings.h>
@@ -10,6 +13,7 @@
 #include <common/file.h>
 #include <common/key.h>
 #include <common/exec.h>
+#include <common/signproto.h>
 #include "eraise.h"
 #include "err.h"
 #include "colors.h"
@@ -43,9 +47,88 @@ void sig_dump_signer(const sig_t* p)
     hexstr_dump(p->signer, sizeof(p->signer));
 }
 
-int sig_create(
+/* Check whether the signing tool supports the digest protocol, in which case
+ *
+ *     <signtool> --digest-supported
+ *
+ * exits with zero without signing anything. Older tools take the option for
+ * the name of a file to sign, which does not exist, and fail.
+ */
+static bool _supports_digest(const char* signtool_path)
+{
+    buf_t buf = BUF_INITIALIZER;
+    int status;
+
+    status = execf_return(&buf, "%s --digest-supported > /dev/null 2>&1",
+        signtool_path);
+
+    buf_release(&buf);
+    return status == 0;
+}
+
+/* Ask the signing tool to sign just the digest with the digest protocol:
+ *
+ *     <signtool> --digest <sha256-hex> <filename>
+ *
+ * The tool writes the same outputs as when signing <filename> itself (which
+ * need not exist).
+ */
+static void _sign_digest(
+    const char* signtool_path,
+    const sha256_t* digest,
+    const char* filename,
+    const char* filename_sig)
+{
+    buf_t buf = BUF_INITIALIZER;
+    sha256_string_t str;
+
+    sha256_format(&str, digest);
+    execf(&buf, "%s --digest %s %s", signtool_path, str.buf, filename);
+
+    if (access(filename_sig, R_OK) != 0)
+        ERR("signing tool did not create %s", filename_sig);
+
+    buf_release(&buf);
+}
+
+/* Ask a running 'cvmsign serve' to sign the digest, writing the same outputs
+ * as a signing tool would.
+ */
+static int _sign_service(
+    const char* socket_path,
+    const sha256_t* digest,
+    const char* filename_sig,
+    const char* filename_signerpubkeyhash,
+    const char* filename_pub)
+{
+    int ret = 0;
+    signproto_response_t* response = NULL;
+
+    if (!(response = malloc(sizeof(signproto_response_t))))
+        ERAISE(-ENOMEM);
+
+    ECHECK(signproto_sign(socket_path, digest, response));
+
+    ECHECK(write_file(filename_sig,
+        response->signature, response->signature_size));
+
+    ECHECK(write_file(filename_signerpubkeyhash,
+        &response->signer, sizeof(response->signer)));
+
+    ECHECK(write_file(filename_pub,
+        response->pubkey, response->pubkey_size));
+
+done:
+    free(response);
+    return ret;
+}
+
+/* Sign data (or the file at path, whose digest is given) */
+static int _sig_create(
     const void* data,
     size_t size,
+    const char* path,
+    const sha256_t* file_digest,
     const char* signtool_path,
     sig_t* sig)
 {
@@ -77,8 +160,11 @@ int sig_create(
     if (!signtool_path)
         ERR("unexpected: null signtool_path parameter");
 
-    /* compute the digest */
-    sha256_compute(&digest, data, size);
+    /* compute the digest (unless the caller computed it already) */
+    if (path)
+        memcpy(&digest, file_digest, sizeof(digest));
+    else
+        sha256_compute(&digest, data, size);
 
     /* create a temporary directory */
     if (!mkdtemp(tmpdir))
@@ -92,10 +178,37 @@ int sig_create(
             "/filename.signerpubkeyhash", PATH_MAX);
         strlcpy2(filename_pub, tmpdir, "/filename.pub", PATH_MAX);
 
-        if (write_file(filename, data, size) < 0)
-            ERR("failed to create file: %s", filename);
+        if (strncmp(signtool_path, SIGNPROTO_PREFIX,
+            strlen(SIGNPROTO_PREFIX)) == 0)
+        {
+            const char* socket_path = signtool_path + strlen(SIGNPROTO_PREFIX);
 
-        execf(&buf, "%s %s", signtool_path, filename);
+            if (_sign_service(socket_path, &digest, filename_sig,
+                filename_signerpubkeyhash, filename_pub) < 0)
+            {
+                ERR("signing service failed: %s", socket_path);
+            }
+        }
+        /* pass only the digest to signing tools that support it */
+        else if (_supports_digest(signtool_path))
+        {
+            _sign_digest(signtool_path, &digest, filename, filename_sig);
+        }
+        else
+        {
+            /* link to an existing file rather than copying it */
+            if (path)
+            {
+                if (symlink(path, filename) < 0)
+                    ERR("failed to create symbolic link: %s", filename);
+            }
+            else if (write_file(filename, data, size) < 0)
+            {
+                ERR("failed to create file: %s", filename);
+            }
+
+            execf(&buf, "%s %s", signtool_path, filename);
+        }
     }
 
     /* load the signature file */
@@ -244,3 +357,29 @@ int sig_create(
 
     return 0;
 }
+
+int sig_create(
+    const void* data,
+    size_t size,
+    const char* signtool_path,
+    sig_t* sig)
+{
+    return _sig_create(data, size, NULL, NULL, signtool_path, sig);
+}
+
+int sig_create_file(
+    const char* path,
+    const sha256_t* digest,
+    const char* signtool_path,
+    sig_t* sig)
+{
+    char abspath[PATH_MAX];
+
+    if (!path || !digest)
+        ERR("unexpected: null parameter");
+
+    if (!realpath(path, abspath))
+        ERR("failed to resolve path: %s", path);
+
+    return _sig_create(NULL, 0, abspath, digest, signtool_path, sig);
+}
@@ -13,6 +13,17 @@ int sig_create(
     const char* signtool_path,
     sig_t* sig);
 
+/* Like sig_create() but signs an existing file whose digest the caller has
+ * already computed. Signing tools that support the digest protocol only
+ * receive the digest; others read the file through a symbolic link, so the
+ * file is never copied. The signature is verified against the digest.
+ */
+int sig_create_file(
+    const char* path,
+    const sha256_t* digest,
+    const char* signtool_path,
+    sig_t* sig);
+
 void sig_dump(const sig_t* p);
 
 void sig_dump_signer(const sig_t* p);
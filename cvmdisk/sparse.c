@@ -72,7 +72,7 @@ int sparse_copy(const char* source, const char* dest)
     snprintf(msg, sizeof(msg), "Copying %s => %s", source, dest);
 
     /* Perform the copy */
-    if (frags_copy(&frags, source, 0, dest, 0, msg) < 0)
+    if (frags_copy(&frags, source, 0, dest, 0, 0, msg) < 0)
         ERAISE(-EINVAL);
 
     /* Copy extra data (partial block) */
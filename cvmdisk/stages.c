@@ -0,0 +1,303 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "stages.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <common/err.h>
+#include "eraise.h"
+#include "colors.h"
+#include "stopwatch.h"
+
+typedef struct scheduler
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stages_t* stages;
+    stopwatch_t stopwatch;
+    uint64_t started;
+    uint64_t finished;
+    size_t num_running;
+    bool failed;
+}
+scheduler_t;
+
+typedef struct worker
+{
+    scheduler_t* scheduler;
+    size_t index;
+}
+worker_t;
+
+/* the stage that the calling thread runs (if any) */
+static __thread worker_t* _worker_self;
+
+int stages_add(
+    stages_t* stages,
+    const char* name,
+    uint32_t inputs,
+    uint32_t outputs,
+    void (*run)(void* arg),
+    void* arg)
+{
+    int ret = 0;
+    stage_t* stage;
+
+    if (!stages || !name || !run)
+        ERAISE(-EINVAL);
+
+    if (stages->num_stages == STAGES_MAX)
+        ERAISE(-ERANGE);
+
+    stage = &stages->stages[stages->num_stages++];
+    memset(stage, 0, sizeof(stage_t));
+    stage->name = name;
+    stage->inputs = inputs;
+    stage->outputs = outputs;
+    stage->run = run;
+    stage->arg = arg;
+
+done:
+    return ret;
+}
+
+/* Called by ERR() before it exits: fail the stage and end its thread */
+static void _exit_hook(void)
+{
+    worker_t* w = _worker_self;
+    scheduler_t* s;
+    stage_t* stage;
+
+    if (!w)
+        return;
+
+    s = w->scheduler;
+    stage = &s->stages->stages[w->index];
+
+    pthread_mutex_lock(&s->lock);
+    {
+        stage->end = stopwatch_seconds(&s->stopwatch);
+
+        if (!s->failed)
+            s->stages->failed = stage->name;
+
+        s->failed = true;
+        s->num_running--;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_exit(NULL);
+}
+
+static void* _worker(void* arg)
+{
+    worker_t* w = (worker_t*)arg;
+    scheduler_t* s = w->scheduler;
+    stage_t* stage = &s->stages->stages[w->index];
+
+    _worker_self = w;
+    stage->run(stage->arg);
+    _worker_self = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    {
+        stage->end = stopwatch_seconds(&s->stopwatch);
+        s->finished |= (uint64_t)1 << w->index;
+        s->num_running--;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+int stages_run(stages_t* stages, size_t max_threads)
+{
+    int ret = 0;
+    scheduler_t s;
+    pthread_t threads[STAGES_MAX];
+    worker_t workers[STAGES_MAX];
+    size_t num_threads = 0;
+    uint64_t all;
+
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    if (!stages || max_threads == 0)
+        ERAISE(-EINVAL);
+
+    s.stages = stages;
+    stages->failed = NULL;
+    all = stages->num_stages == 64 ? UINT64_MAX :
+        ((uint64_t)1 << stages->num_stages) - 1;
+
+    /* Derive the dependencies from the resources */
+    for (size_t i = 0; i < stages->num_stages; i++)
+    {
+        stage_t* si = &stages->stages[i];
+
+        si->deps = 0;
+
+        for (size_t j = 0; j < i; j++)
+        {
+            const stage_t* sj = &stages->stages[j];
+
+            if ((si->inputs & sj->outputs) ||
+                (si->outputs & (sj->inputs | sj->outputs)))
+            {
+                si->deps |= (uint64_t)1 << j;
+            }
+        }
+    }
+
+    err_set_exit_hook(_exit_hook);
+    stopwatch_start(&s.stopwatch);
+    pthread_mutex_lock(&s.lock);
+
+    /* Once a stage fails, only wait for the running ones */
+    while (s.num_running > 0 || (!s.failed && s.finished != all))
+    {
+        /* Start the ready stages in the order added */
+        for (size_t i = 0; !s.failed && i < stages->num_stages; i++)
+        {
+            stage_t* stage = &stages->stages[i];
+            const uint64_t mask = (uint64_t)1 << i;
+
+            if (s.num_running == max_threads)
+                break;
+
+            if ((s.started & mask) || (stage->deps & ~s.finished))
+                continue;
+
+            workers[num_threads].scheduler = &s;
+            workers[num_threads].index = i;
+            stage->start = stopwatch_seconds(&s.stopwatch);
+
+            if (pthread_create(&threads[num_threads], NULL, _worker,
+                &workers[num_threads]) != 0)
+            {
+                pthread_mutex_unlock(&s.lock);
+                ERAISE(-EAGAIN);
+            }
+
+            num_threads++;
+            s.started |= mask;
+            s.num_running++;
+        }
+
+        pthread_cond_wait(&s.cond, &s.lock);
+    }
+
+    pthread_mutex_unlock(&s.lock);
+    stages->elapsed = stopwatch_seconds(&s.stopwatch);
+
+    if (s.failed)
+        ERAISE(-ECANCELED);
+
+done:
+
+    for (size_t i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    err_set_exit_hook(NULL);
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+    return ret;
+}
+
+size_t stages_critical_path(const stages_t* stages, size_t path[STAGES_MAX])
+{
+    size_t n = 0;
+    size_t last = 0;
+
+    if (!stages || stages->num_stages == 0)
+        return 0;
+
+    for (size_t i = 1; i < stages->num_stages; i++)
+    {
+        if (stages->stages[i].end > stages->stages[last].end)
+            last = i;
+    }
+
+    /* Walk back, collecting the path in reverse */
+    for (;;)
+    {
+        const stage_t* stage = &stages->stages[last];
+        bool found = false;
+        size_t next = 0;
+
+        path[n++] = last;
+
+        for (size_t j = 0; j < stages->num_stages; j++)
+        {
+            if (!(stage->deps & ((uint64_t)1 << j)))
+                continue;
+
+            if (!found || stages->stages[j].end > stages->stages[next].end)
+            {
+                next = j;
+                found = true;
+            }
+        }
+
+        if (!found)
+            break;
+
+        last = next;
+    }
+
+    for (size_t i = 0; i < n / 2; i++)
+    {
+        size_t tmp = path[i];
+        path[i] = path[n - 1 - i];
+        path[n - 1 - i] = tmp;
+    }
+
+    return n;
+}
+
+void stages_dump(const stages_t* stages)
+{
+    size_t path[STAGES_MAX];
+    size_t n = stages_critical_path(stages, path);
+    uint64_t critical = 0;
+    double total = 0;
+    double critical_total = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const stage_t* stage = &stages->stages[path[i]];
+        critical |= (uint64_t)1 << path[i];
+        critical_total += stage->end - stage->start;
+    }
+
+    printf("%s>>> Stage timings (* marks the critical path):%s\n",
+        colors_green, colors_reset);
+
+    printf("  %-24s %10s %10s\n", "stage", "start", "elapsed");
+
+    for (size_t i = 0; i < stages->num_stages; i++)
+    {
+        const stage_t* stage = &stages->stages[i];
+        const bool on_path = critical & ((uint64_t)1 << i);
+
+        total += stage->end - stage->start;
+
+        printf("%s%c %-24s %9.2fs %9.2fs%s\n",
+            on_path ? colors_yellow : "",
+            on_path ? '*' : ' ',
+            stage->name,
+            stage->start,
+            stage->end - stage->start,
+            on_path ? colors_reset : "");
+    }
+
+    printf("critical path: %.2fs, wall: %.2fs, sum of stages: %.2fs\n",
+        critical_total, stages->elapsed, total);
+}
@@ -0,0 +1,74 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_STAGES_H
+#define _CVMBOOT_CVMDISK_STAGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STAGES_MAX 64
+
+typedef struct stage
+{
+    const char* name;
+
+    /* bitmasks of the resources (chosen by the caller) that the stage reads
+     * and writes */
+    uint32_t inputs;
+    uint32_t outputs;
+
+    void (*run)(void* arg);
+    void* arg;
+
+    /* set by stages_run(): bitmask of the earlier stages this one waits for
+     * and the start and end times (in seconds since stages_run() began) */
+    uint64_t deps;
+    double start;
+    double end;
+}
+stage_t;
+
+typedef struct stages
+{
+    stage_t stages[STAGES_MAX];
+    size_t num_stages;
+
+    /* seconds that stages_run() took */
+    double elapsed;
+
+    /* set by stages_run(): the name of the stage that failed (if any) */
+    const char* failed;
+}
+stages_t;
+
+int stages_add(
+    stages_t* stages,
+    const char* name,
+    uint32_t inputs,
+    uint32_t outputs,
+    void (*run)(void* arg),
+    void* arg);
+
+/* Run the stages, at most max_threads at a time. A stage waits for every
+ * earlier stage that writes one of its inputs or that reads or writes one of
+ * its outputs, so the results are those of running the stages in the order
+ * added, while independent stages overlap.
+ *
+ * A stage fails by calling ERR(), which then ends only the stage's thread: no
+ * further stages start, the running ones are waited for, and stages_run()
+ * fails with -ECANCELED, setting stages->failed. The caller then exits from
+ * its own thread, so atexit() handlers never run while stages are in flight.
+ * This does not extend to threads that a stage creates itself. */
+int stages_run(stages_t* stages, size_t max_threads);
+
+/* Get the critical path that stages_run() took: starting from the stage that
+ * finished last, the dependency that finished last, and so on. The indices
+ * are written in order of execution. Returns the number of stages. */
+size_t stages_critical_path(const stages_t* stages, size_t path[STAGES_MAX]);
+
+/* Print the start and elapsed time of each stage, marking the critical path */
+void stages_dump(const stages_t* stages);
+
+#endif /* _CVMBOOT_CVMDISK_STAGES_H */
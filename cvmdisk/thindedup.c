@@ -0,0 +1,405 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "thindedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <utils/sha256.h>
+#include "eraise.h"
+#include "progress.h"
+
+#define SECTOR_SIZE 512
+
+/* blocks claimed by a hashing thread at a time */
+#define BATCH_SIZE 64
+
+#define UNMAPPED UINT32_MAX
+
+typedef struct dedup
+{
+    pthread_mutex_t lock;
+    int fd;
+    size_t start;
+    size_t end;
+    size_t block_size;
+    /* virtual blocks in the order first touched, and their hashes */
+    const uint32_t* order;
+    sha256_t* hashes;
+    size_t num_mapped;
+    size_t next;
+    size_t num_hashed;
+    int err;
+    progress_t progress;
+}
+dedup_t;
+
+/* read virtual block b of the root file system, zero-padding the tail */
+static int _read_block(int fd, size_t start, size_t end, size_t block_size,
+    size_t b, void* buf)
+{
+    size_t offset = start + b * block_size;
+    size_t n = block_size;
+
+    if (n > end - offset)
+    {
+        n = end - offset;
+        memset((uint8_t*)buf + n, 0, block_size - n);
+    }
+
+    if (pread(fd, buf, n, offset) != (ssize_t)n)
+        return -EIO;
+
+    return 0;
+}
+
+static void* _worker(void* arg)
+{
+    dedup_t* d = (dedup_t*)arg;
+    uint8_t* buf;
+    int r = 0;
+
+    if (!(buf = malloc(d->block_size)))
+    {
+        r = -ENOMEM;
+        goto done;
+    }
+
+    for (;;)
+    {
+        size_t first;
+        size_t last;
+
+        pthread_mutex_lock(&d->lock);
+        {
+            if (d->err || d->next == d->num_mapped)
+            {
+                pthread_mutex_unlock(&d->lock);
+                break;
+            }
+
+            first = d->next;
+            last = first + BATCH_SIZE;
+
+            if (last > d->num_mapped)
+                last = d->num_mapped;
+
+            d->next = last;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        for (size_t i = first; i < last; i++)
+        {
+            if ((r = _read_block(d->fd, d->start, d->end, d->block_size,
+                d->order[i], buf)) < 0)
+            {
+                goto done;
+            }
+
+            sha256_compute(&d->hashes[i], buf, d->block_size);
+        }
+
+        pthread_mutex_lock(&d->lock);
+        {
+            d->num_hashed += last - first;
+            progress_update(&d->progress, d->num_hashed, d->num_mapped);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+done:
+
+    if (r != 0)
+    {
+        pthread_mutex_lock(&d->lock);
+
+        if (!d->err)
+            d->err = r;
+
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static uint64_t _prefix(const sha256_t* hash)
+{
+    uint64_t x;
+    memcpy(&x, hash->data, sizeof(x));
+    return x;
+}
+
+/* emit the mappings in origin order, merging runs into range mappings */
+static int _write_xml(
+    const char* path,
+    const uint32_t* data_blocks,
+    size_t num_blocks,
+    size_t num_mapped,
+    size_t block_size,
+    size_t num_data_blocks)
+{
+    int ret = 0;
+    FILE* os;
+
+    if (!(os = fopen(path, "w")))
+        ERAISE(-errno);
+
+    fprintf(os, "<superblock uuid=\"\" time=\"1\" transaction=\"1\" "
+        "data_block_size=\"%zu\" nr_data_blocks=\"%zu\">\n",
+        block_size / SECTOR_SIZE, num_data_blocks);
+
+    fprintf(os, "  <device dev_id=\"0\" mapped_blocks=\"%zu\" "
+        "transaction=\"0\" creation_time=\"0\" snap_time=\"1\">\n",
+        num_mapped);
+
+    for (size_t v = 0; v < num_blocks; )
+    {
+        size_t n = 1;
+
+        if (data_blocks[v] == UNMAPPED)
+        {
+            v++;
+            continue;
+        }
+
+        while (v + n < num_blocks && data_blocks[v + n] != UNMAPPED &&
+            data_blocks[v + n] == data_blocks[v] + n)
+        {
+            n++;
+        }
+
+        if (n == 1)
+        {
+            fprintf(os, "    <single_mapping origin_block=\"%zu\" "
+                "data_block=\"%u\" time=\"0\"/>\n", v, data_blocks[v]);
+        }
+        else
+        {
+            fprintf(os, "    <range_mapping origin_begin=\"%zu\" "
+                "data_begin=\"%u\" length=\"%zu\" time=\"0\"/>\n",
+                v, data_blocks[v], n);
+        }
+
+        v += n;
+    }
+
+    fprintf(os, "  </device>\n");
+    fprintf(os, "</superblock>\n");
+
+    if (fclose(os) != 0)
+        ERAISE(-EIO);
+
+done:
+    return ret;
+}
+
+int thindedup_convert(
+    const frag_list_t* frags,
+    const char* source,
+    size_t start,
+    size_t end,
+    const char* data,
+    size_t num_data_blocks,
+    size_t block_size,
+    size_t num_threads,
+    const char* xml_path,
+    thindedup_stats_t* stats)
+{
+    int ret = 0;
+    dedup_t d;
+    size_t num_blocks;
+    uint32_t* order = NULL;
+    uint32_t* data_blocks = NULL;
+    pthread_t* threads = NULL;
+    size_t nthreads = 0;
+    size_t capacity = 1;
+    uint64_t* keys = NULL;
+    uint32_t* values = NULL;
+    uint8_t* buf = NULL;
+    int data_fd = -1;
+    size_t num_unique = 0;
+    progress_t progress;
+
+    memset(&d, 0, sizeof(d));
+    d.fd = -1;
+    pthread_mutex_init(&d.lock, NULL);
+
+    if (stats)
+        memset(stats, 0, sizeof(thindedup_stats_t));
+
+    if (!frags || !source || !data || !xml_path || !stats || end <= start ||
+        block_size == 0 || block_size % SECTOR_SIZE || num_threads == 0)
+    {
+        ERAISE(-EINVAL);
+    }
+
+    num_blocks = (end - start + block_size - 1) / block_size;
+
+    if (num_blocks >= UNMAPPED)
+        ERAISE(-EFBIG);
+
+    /* Number the virtual blocks in the order that frags first touch them */
+    if (!(order = malloc(num_blocks * sizeof(uint32_t))))
+        ERAISE(-ENOMEM);
+
+    if (!(data_blocks = malloc(num_blocks * sizeof(uint32_t))))
+        ERAISE(-ENOMEM);
+
+    memset(data_blocks, 0xff, num_blocks * sizeof(uint32_t));
+
+    for (const frag_t* p = frags->head; p; p = p->next)
+    {
+        size_t x = p->offset < start ? start : p->offset;
+        size_t y = p->offset + p->length > end ? end : p->offset + p->length;
+
+        if (x >= y)
+            continue;
+
+        for (size_t b = (x - start) / block_size;
+            b <= (y - 1 - start) / block_size; b++)
+        {
+            /* mark as touched until the data block is known */
+            if (data_blocks[b] == UNMAPPED)
+            {
+                data_blocks[b] = 0;
+                order[d.num_mapped++] = b;
+            }
+        }
+    }
+
+    /* Hash the touched blocks in parallel */
+    if ((d.fd = open(source, O_RDONLY)) < 0)
+        ERAISE(-errno);
+
+    if (!(d.hashes = calloc(d.num_mapped + 1, sizeof(sha256_t))))
+        ERAISE(-ENOMEM);
+
+    d.start = start;
+    d.end = end;
+    d.block_size = block_size;
+    d.order = order;
+
+    progress_start(&d.progress, "Hashing thin blocks");
+    {
+        if (!(threads = calloc(num_threads, sizeof(pthread_t))))
+            ERAISE(-ENOMEM);
+
+        for (; nthreads < num_threads; nthreads++)
+        {
+            if (pthread_create(&threads[nthreads], NULL, _worker, &d) != 0)
+                break;
+        }
+
+        if (nthreads == 0)
+            ERAISE(-EAGAIN);
+
+        for (size_t i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+
+        nthreads = 0;
+        ECHECK(d.err);
+    }
+    progress_end(&d.progress);
+
+    /* Size the index to at most half full */
+    while (capacity < 2 * d.num_mapped)
+        capacity *= 2;
+
+    if (!(keys = calloc(capacity, sizeof(uint64_t))))
+        ERAISE(-ENOMEM);
+
+    /* the index of the first block with the hash, plus one (zero if empty) */
+    if (!(values = calloc(capacity, sizeof(uint32_t))))
+        ERAISE(-ENOMEM);
+
+    if (!(buf = malloc(block_size)))
+        ERAISE(-ENOMEM);
+
+    if ((data_fd = open(data, O_WRONLY)) < 0)
+        ERAISE(-errno);
+
+    /* Write the first block with each hash and map the others onto it */
+    progress_start(&progress, "Writing distinct thin blocks");
+
+    for (size_t i = 0; i < d.num_mapped; i++)
+    {
+        const uint64_t key = _prefix(&d.hashes[i]);
+        size_t slot = key & (capacity - 1);
+        bool found = false;
+
+        for (; values[slot]; slot = (slot + 1) & (capacity - 1))
+        {
+            const size_t j = values[slot] - 1;
+
+            if (keys[slot] == key && sha256_equal(&d.hashes[j], &d.hashes[i]))
+            {
+                data_blocks[order[i]] = data_blocks[order[j]];
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            if (num_unique == num_data_blocks)
+                ERAISE(-ENOSPC);
+
+            keys[slot] = key;
+            values[slot] = i + 1;
+            data_blocks[order[i]] = num_unique;
+
+            ECHECK(_read_block(d.fd, start, end, block_size, order[i], buf));
+
+            if (pwrite(data_fd, buf, block_size,
+                num_unique * block_size) != (ssize_t)block_size)
+            {
+                ERAISE(-EIO);
+            }
+
+            num_unique++;
+        }
+
+        progress_update(&progress, i + 1, d.num_mapped);
+    }
+
+    progress_end(&progress);
+
+    if (fsync(data_fd) < 0)
+        ERAISE(-errno);
+
+    ECHECK(_write_xml(xml_path, data_blocks, num_blocks, d.num_mapped,
+        block_size, num_data_blocks));
+
+    stats->num_mapped = d.num_mapped;
+    stats->num_unique = num_unique;
+    stats->block_size = block_size;
+
+done:
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (d.fd >= 0)
+        close(d.fd);
+
+    if (data_fd >= 0)
+        close(data_fd);
+
+    pthread_mutex_destroy(&d.lock);
+    free(threads);
+    free(d.hashes);
+    free(order);
+    free(data_blocks);
+    free(keys);
+    free(values);
+    free(buf);
+
+    return ret;
+}
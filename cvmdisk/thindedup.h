@@ -0,0 +1,48 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_THINDEDUP_H
+#define _CVMBOOT_CVMDISK_THINDEDUP_H
+
+#include <stddef.h>
+#include "frags.h"
+
+typedef struct thindedup_stats
+{
+    /* thin blocks of the volume that hold data */
+    size_t num_mapped;
+    /* distinct blocks written to the data device */
+    size_t num_unique;
+    /* in bytes */
+    size_t block_size;
+}
+thindedup_stats_t;
+
+/* Convert the root file system, which spans [start, end) of source, into the
+ * data blocks of a thin pool without going through dm-thin, so identical
+ * blocks can share one data block:
+ *
+ *     - Every block_size block that frags (absolute data fragments) touch is
+ *       hashed (SHA-256), by num_threads threads.
+ *     - Duplicates are found with an open-addressing index of 64-bit hash
+ *       prefixes, confirmed by the whole hash.
+ *     - Each distinct block is written once to data (a device or file of
+ *       num_data_blocks blocks), in the order that frags first touch them.
+ *     - The mappings of thin device 0 are written to xml_path in the format
+ *       of thin_restore, which builds the pool metadata from it. Mappings
+ *       are marked as predating a snapshot, so that a write to a shared
+ *       block breaks the sharing rather than changing both blocks.
+ */
+int thindedup_convert(
+    const frag_list_t* frags,
+    const char* source,
+    size_t start,
+    size_t end,
+    const char* data,
+    size_t num_data_blocks,
+    size_t block_size,
+    size_t num_threads,
+    const char* xml_path,
+    thindedup_stats_t* stats);
+
+#endif /* _CVMBOOT_CVMDISK_THINDEDUP_H */
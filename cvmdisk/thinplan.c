@@ -0,0 +1,191 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "thinplan.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "eraise.h"
+#include "bits.h"
+
+static const char* _names[] =
+{
+    "size",
+    "balanced",
+    "mappings",
+};
+
+int thinplan_parse_objective(const char* str, thinplan_objective_t* objective)
+{
+    if (!str || !objective)
+        return -EINVAL;
+
+    for (size_t i = 0; i < sizeof(_names) / sizeof(_names[0]); i++)
+    {
+        if (strcmp(str, _names[i]) == 0)
+        {
+            *objective = (thinplan_objective_t)i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char* thinplan_objective_name(thinplan_objective_t objective)
+{
+    if ((size_t)objective >= sizeof(_names) / sizeof(_names[0]))
+        return "unknown";
+
+    return _names[objective];
+}
+
+int thinplan_simulate(
+    const frag_list_t* extents,
+    size_t start,
+    size_t end,
+    size_t block_size,
+    thinplan_candidate_t* candidate)
+{
+    int ret = 0;
+    size_t num_blocks;
+    uint8_t* bits = NULL;
+    size_t extent_size = 0;
+
+    if (candidate)
+        memset(candidate, 0, sizeof(thinplan_candidate_t));
+
+    if (!extents || !candidate || block_size == 0 || end <= start)
+        ERAISE(-EINVAL);
+
+    num_blocks = (end - start + block_size - 1) / block_size;
+
+    if (!(bits = calloc((num_blocks + 7) / 8, 1)))
+        ERAISE(-ENOMEM);
+
+    /* Mark the blocks that the extents touch (extents may come in any order
+     * but must not overlap) */
+    for (const frag_t* p = extents->head; p; p = p->next)
+    {
+        size_t x = p->offset < start ? start : p->offset;
+        size_t y = p->offset + p->length > end ? end : p->offset + p->length;
+
+        if (x >= y)
+            continue;
+
+        extent_size += y - x;
+
+        for (size_t b = (x - start) / block_size;
+            b <= (y - 1 - start) / block_size; b++)
+        {
+            if (!test_bit(bits, b))
+            {
+                set_bit(bits, b);
+                candidate->num_mappings++;
+            }
+        }
+    }
+
+    candidate->block_size = block_size;
+    candidate->data_size = candidate->num_mappings * block_size;
+    candidate->meta_size = candidate->num_mappings *
+        THINPLAN_META_BYTES_PER_BLOCK;
+
+    if (candidate->meta_size < THINPLAN_MIN_META_SIZE)
+        candidate->meta_size = THINPLAN_MIN_META_SIZE;
+
+    if (extent_size > candidate->data_size)
+        ERAISE(-EINVAL);
+
+    candidate->waste = candidate->data_size - extent_size;
+
+done:
+    free(bits);
+    return ret;
+}
+
+static size_t _total(const thinplan_candidate_t* c)
+{
+    return c->data_size + c->meta_size;
+}
+
+int thinplan_choose(
+    const frag_list_t* extents,
+    size_t start,
+    size_t end,
+    thinplan_objective_t objective,
+    thinplan_t* plan)
+{
+    int ret = 0;
+    size_t smallest = 0;
+
+    if (plan)
+        memset(plan, 0, sizeof(thinplan_t));
+
+    if (!extents || !plan)
+        ERAISE(-EINVAL);
+
+    plan->objective = objective;
+
+    for (const frag_t* p = extents->head; p; p = p->next)
+    {
+        plan->extent_size += p->length;
+        plan->num_extents++;
+    }
+
+    for (size_t n = THINPLAN_MIN_BLOCK_SIZE; n <= THINPLAN_MAX_BLOCK_SIZE;
+        n *= 2)
+    {
+        thinplan_candidate_t* c = &plan->candidates[plan->num_candidates];
+
+        ECHECK(thinplan_simulate(extents, start, end, n, c));
+
+        if (_total(c) < _total(&plan->candidates[smallest]))
+            smallest = plan->num_candidates;
+
+        plan->num_candidates++;
+    }
+
+    switch (objective)
+    {
+        case THINPLAN_OBJECTIVE_SIZE:
+        {
+            plan->chosen = smallest;
+            break;
+        }
+        case THINPLAN_OBJECTIVE_BALANCED:
+        {
+            const size_t limit = _total(&plan->candidates[smallest]) *
+                (100 + THINPLAN_BALANCED_PERCENT) / 100;
+
+            /* the candidates are in increasing block size */
+            for (size_t i = 0; i < plan->num_candidates; i++)
+            {
+                if (_total(&plan->candidates[i]) <= limit)
+                    plan->chosen = i;
+            }
+            break;
+        }
+        case THINPLAN_OBJECTIVE_MAPPINGS:
+        {
+            for (size_t i = 0; i < plan->num_candidates; i++)
+            {
+                const thinplan_candidate_t* c = &plan->candidates[i];
+
+                if (c->num_mappings <
+                    plan->candidates[plan->chosen].num_mappings)
+                {
+                    plan->chosen = i;
+                }
+            }
+            break;
+        }
+        default:
+        {
+            ERAISE(-EINVAL);
+        }
+    }
+
+done:
+    return ret;
+}
@@ -0,0 +1,83 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_THINPLAN_H
+#define _CVMBOOT_CVMDISK_THINPLAN_H
+
+#include <stddef.h>
+#include "frags.h"
+
+/* candidate thin-pool block sizes: 64 KiB, 128 KiB, ..., 1 MiB */
+#define THINPLAN_MIN_BLOCK_SIZE ((size_t)64 * 1024)
+#define THINPLAN_MAX_BLOCK_SIZE ((size_t)1024 * 1024)
+#define THINPLAN_NUM_CANDIDATES 5
+
+/* metadata estimate from the kernel's thin-provisioning guide: 48 bytes per
+ * data block, but no less than 2 MiB */
+#define THINPLAN_META_BYTES_PER_BLOCK ((size_t)48)
+#define THINPLAN_MIN_META_SIZE ((size_t)2 * 1024 * 1024)
+
+/* the balanced objective accepts this much growth over the smallest size */
+#define THINPLAN_BALANCED_PERCENT 10
+
+typedef enum thinplan_objective
+{
+    /* smallest data plus metadata */
+    THINPLAN_OBJECTIVE_SIZE,
+    /* largest block size within THINPLAN_BALANCED_PERCENT of the smallest */
+    THINPLAN_OBJECTIVE_BALANCED,
+    /* fewest mappings */
+    THINPLAN_OBJECTIVE_MAPPINGS,
+}
+thinplan_objective_t;
+
+typedef struct thinplan_candidate
+{
+    /* in bytes */
+    size_t block_size;
+    /* number of thin blocks holding data */
+    size_t num_mappings;
+    /* bytes of the thin data partition that are written */
+    size_t data_size;
+    /* estimated bytes of thin metadata */
+    size_t meta_size;
+    /* bytes of data_size that only hold zero padding */
+    size_t waste;
+}
+thinplan_candidate_t;
+
+typedef struct thinplan
+{
+    thinplan_candidate_t candidates[THINPLAN_NUM_CANDIDATES];
+    size_t num_candidates;
+    size_t chosen;
+    thinplan_objective_t objective;
+    /* bytes covered by the extents */
+    size_t extent_size;
+    size_t num_extents;
+}
+thinplan_t;
+
+int thinplan_parse_objective(const char* str, thinplan_objective_t* objective);
+
+const char* thinplan_objective_name(thinplan_objective_t objective);
+
+/* Simulate copying the extents (absolute byte ranges of the root file
+ * system, which spans [start, end)) into a thin volume with the given block
+ * size: every block that an extent touches is allocated in full. */
+int thinplan_simulate(
+    const frag_list_t* extents,
+    size_t start,
+    size_t end,
+    size_t block_size,
+    thinplan_candidate_t* candidate);
+
+/* Simulate every candidate block size and choose one by the objective */
+int thinplan_choose(
+    const frag_list_t* extents,
+    size_t start,
+    size_t end,
+    thinplan_objective_t objective,
+    thinplan_t* plan);
+
+#endif /* _CVMBOOT_CVMDISK_THINPLAN_H */
@@ -0,0 +1,328 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include "treedigest.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "eraise.h"
+
+/* files claimed by a hashing thread at a time */
+#define BATCH_SIZE 16
+
+#define READ_SIZE (256 * 1024)
+
+typedef struct entry
+{
+    /* relative to the root ("" for the root itself) */
+    char* relpath;
+    uint32_t mode;
+    /* the target of a symbolic link */
+    char* link;
+    /* the contents of a regular file */
+    sha256_t hash;
+}
+entry_t;
+
+typedef struct walker
+{
+    pthread_mutex_t lock;
+    const char* root;
+    entry_t* entries;
+    size_t num_entries;
+    size_t capacity;
+    size_t next;
+    int err;
+}
+walker_t;
+
+static int _compare(const struct dirent** a, const struct dirent** b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int _filter(const struct dirent* ent)
+{
+    return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+static int _fullpath(const walker_t* w, const char* relpath, char buf[PATH_MAX])
+{
+    int n;
+
+    if (*relpath)
+        n = snprintf(buf, PATH_MAX, "%s/%s", w->root, relpath);
+    else
+        n = snprintf(buf, PATH_MAX, "%s", w->root);
+
+    return n >= PATH_MAX ? -ENAMETOOLONG : 0;
+}
+
+/* Add relpath and (recursively) its children in strcmp() order */
+static int _walk(walker_t* w, const char* relpath)
+{
+    int ret = 0;
+    char path[PATH_MAX];
+    struct stat st;
+    entry_t* e;
+    struct dirent** ents = NULL;
+    int n = 0;
+
+    ECHECK(_fullpath(w, relpath, path));
+
+    if (lstat(path, &st) < 0)
+        ERAISE(-errno);
+
+    if (w->num_entries == w->capacity)
+    {
+        size_t capacity = w->capacity ? w->capacity * 2 : 1024;
+        entry_t* entries;
+
+        if (!(entries = realloc(w->entries, capacity * sizeof(entry_t))))
+            ERAISE(-ENOMEM);
+
+        w->entries = entries;
+        w->capacity = capacity;
+    }
+
+    e = &w->entries[w->num_entries++];
+    memset(e, 0, sizeof(entry_t));
+    e->mode = st.st_mode & (S_IFMT | 07777);
+
+    if (!(e->relpath = strdup(relpath)))
+        ERAISE(-ENOMEM);
+
+    if (S_ISLNK(st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t r;
+
+        if ((r = readlink(path, target, sizeof(target) - 1)) < 0)
+            ERAISE(-errno);
+
+        target[r] = '\0';
+
+        if (!(e->link = strdup(target)))
+            ERAISE(-ENOMEM);
+    }
+    else if (S_ISDIR(st.st_mode))
+    {
+        if ((n = scandir(path, &ents, _filter, _compare)) < 0)
+        {
+            n = 0;
+            ERAISE(-errno);
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            char child[PATH_MAX];
+            int r;
+
+            if (*relpath)
+                r = snprintf(child, sizeof(child), "%s/%s", relpath,
+                    ents[i]->d_name);
+            else
+                r = snprintf(child, sizeof(child), "%s", ents[i]->d_name);
+
+            if (r >= sizeof(child))
+                ERAISE(-ENAMETOOLONG);
+
+            ECHECK(_walk(w, child));
+        }
+    }
+
+done:
+
+    if (ents)
+    {
+        for (int i = 0; i < n; i++)
+            free(ents[i]);
+
+        free(ents);
+    }
+
+    return ret;
+}
+
+static int _hash_file(const char* path, void* buf, sha256_t* hash)
+{
+    int ret = 0;
+    int fd;
+    sha256_ctx_t ctx;
+    ssize_t n;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        ERAISE(-errno);
+
+    sha256_init(&ctx);
+
+    while ((n = read(fd, buf, READ_SIZE)) > 0)
+        sha256_update(&ctx, buf, n);
+
+    if (n < 0)
+        ERAISE(-errno);
+
+    sha256_final(hash, &ctx);
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    return ret;
+}
+
+static void* _worker(void* arg)
+{
+    walker_t* w = (walker_t*)arg;
+    void* buf;
+    int r = 0;
+
+    if (!(buf = malloc(READ_SIZE)))
+    {
+        r = -ENOMEM;
+        goto done;
+    }
+
+    for (;;)
+    {
+        size_t first;
+        size_t last;
+
+        pthread_mutex_lock(&w->lock);
+        {
+            if (w->err || w->next == w->num_entries)
+            {
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+
+            first = w->next;
+            last = first + BATCH_SIZE;
+
+            if (last > w->num_entries)
+                last = w->num_entries;
+
+            w->next = last;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        for (size_t i = first; i < last; i++)
+        {
+            entry_t* e = &w->entries[i];
+            char path[PATH_MAX];
+
+            if (!S_ISREG(e->mode))
+                continue;
+
+            if ((r = _fullpath(w, e->relpath, path)) < 0)
+                goto done;
+
+            if ((r = _hash_file(path, buf, &e->hash)) < 0)
+                goto done;
+        }
+    }
+
+done:
+
+    if (r != 0)
+    {
+        pthread_mutex_lock(&w->lock);
+
+        if (!w->err)
+            w->err = r;
+
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int treedigest(const char* path, size_t num_threads, sha256_t* digest)
+{
+    int ret = 0;
+    walker_t w;
+    pthread_t* threads = NULL;
+    size_t nthreads = 0;
+    sha256_ctx_t ctx;
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+
+    if (digest)
+        sha256_clear(digest);
+
+    if (!path || !digest || num_threads == 0)
+        ERAISE(-EINVAL);
+
+    w.root = path;
+
+    /* List the entries, which is cheap next to hashing the files */
+    ECHECK(_walk(&w, ""));
+
+    /* Hash the regular files in parallel */
+    {
+        if (!(threads = calloc(num_threads, sizeof(pthread_t))))
+            ERAISE(-ENOMEM);
+
+        for (; nthreads < num_threads; nthreads++)
+        {
+            if (pthread_create(&threads[nthreads], NULL, _worker, &w) != 0)
+                break;
+        }
+
+        if (nthreads == 0)
+            ERAISE(-EAGAIN);
+
+        for (size_t i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+
+        nthreads = 0;
+        ECHECK(w.err);
+    }
+
+    /* Digest the entries in order */
+    sha256_init(&ctx);
+
+    for (size_t i = 0; i < w.num_entries; i++)
+    {
+        const entry_t* e = &w.entries[i];
+
+        sha256_update(&ctx, e->relpath, strlen(e->relpath) + 1);
+        sha256_update(&ctx, &e->mode, sizeof(e->mode));
+
+        if (S_ISREG(e->mode))
+            sha256_update(&ctx, &e->hash, sizeof(e->hash));
+        else if (S_ISLNK(e->mode))
+            sha256_update(&ctx, e->link, strlen(e->link) + 1);
+    }
+
+    sha256_final(digest, &ctx);
+
+done:
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < w.num_entries; i++)
+    {
+        free(w.entries[i].relpath);
+        free(w.entries[i].link);
+    }
+
+    pthread_mutex_destroy(&w.lock);
+    free(w.entries);
+    free(threads);
+
+    return ret;
+}
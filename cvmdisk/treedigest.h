@@ -0,0 +1,19 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMDISK_TREEDIGEST_H
+#define _CVMBOOT_CVMDISK_TREEDIGEST_H
+
+#include <stddef.h>
+#include <utils/sha256.h>
+
+/* Compute the digest of the tree rooted at path (a directory, a file or a
+ * symbolic link), covering the relative path, type and permission bits of
+ * every entry, the target of every symbolic link and the contents of every
+ * regular file. Directories are walked in strcmp() order and the files are
+ * hashed by num_threads threads, so the digest depends only on the contents,
+ * not on timestamps, ownership or the order of readdir().
+ */
+int treedigest(const char* path, size_t num_threads, sha256_t* digest);
+
+#endif /* _CVMBOOT_CVMDISK_TREEDIGEST_H */
@@ -15,7 +15,6 @@
 #include "verity.h"
 #include "gpt.h"
 #include "blockdev.h"
-#include "loop.h"
 #include "colors.h"
 #include "guid.h"
 #include "progress.h"
@@ -87,52 +86,43 @@ void verity_superblock_dump(const verity_superblock_t* sb)
     hexstr_dump(sb->salt, sb->salt_size);
 }
 
-int verity_add_partition(
+int verity_create_partition(
     const char* disk,
-    const char* data_dev_path,
-    bool trace,
-    bool progress,
+    size_t data_index,
     guid_t* unique_guid,
-    sha256_t* roothash,
+    size_t* hash_index,
     err_t* err)
 {
     int ret = 0;
-    size_t hash_dev_size = 0;
-    blockdev_t* data_dev = NULL;
-    blockdev_t* hash_dev = NULL;
+    ssize_t hash_dev_size = 0;
     gpt_t* gpt = NULL;
     int r;
-    guid_t verity_uuid;
-    ssize_t data_dev_size;
-    char hash_dev_path[PATH_MAX] = "";
+    gpt_entry_t e;
 
     // Clear all output parameters
     guid_clear(unique_guid);
-    sha256_clear(roothash);
+    *hash_index = (size_t)-1;
     err_clear(err);
 
-    // Get the size of the data device
-    if ((data_dev_size = blockdev_getsize64(data_dev_path)) < 0)
-        ERR("cannot get size of %s", data_dev_path);
-
-    // Calculate the size of the hash device (from the data device)
-    if ((hash_dev_size = verity_hash_dev_size(data_dev_size)) < 0)
+    // Attempt to open the GPT.
+    if ((r = gpt_open(disk, O_RDWR | O_EXCL, &gpt)) < 0)
     {
-        err_format(err, "failed to get the hash device size");
-        ERAISE(hash_dev_size);
+        err_format(err, "GUID partition table not found: %s", disk);
+        ERAISE(r);
     }
 
-    if (trace)
+    if ((r = gpt_get_entry(gpt, data_index, &e)) < 0)
     {
-        printf("%s>>> Adding verity partition for %s...%s\n",
-            colors_green, data_dev_path, colors_reset);
+        err_format(err, "cannot find GPT entry for partition %zu",
+            data_index + 1);
+        ERAISE(-ENOENT);
     }
 
-    // Attempt to open the GPT.
-    if ((r = gpt_open(disk, O_RDWR | O_EXCL, &gpt)) < 0)
+    // Calculate the size of the hash device (from the data partition)
+    if ((hash_dev_size = verity_hash_dev_size(gpt_entry_size(&e))) < 0)
     {
-        err_format(err, "GUID partition table not found: %s", disk);
-        ERAISE(r);
+        err_format(err, "failed to get the hash device size");
+        ERAISE(hash_dev_size);
     }
 
     // Add a new verity-hash-device partition.
@@ -163,86 +153,96 @@ int verity_add_partition(
         ECHECK(gpt_sync(gpt));
     }
 
-    // Get the GPT entry for the hash device
+    // Find the index of the hash device
+    if ((*hash_index = gpt_find_partition(gpt, unique_guid)) == (size_t)-1)
     {
-        size_t index = 0;
-        uint32_t loopnum;
+        err_format(err, "unexpected: failed to find partition");
+        ERAISE(-ENOENT);
+    }
 
-        // Find the next available partition index.
-        if ((index = gpt_find_partition(gpt, unique_guid)) == (size_t)-1)
-        {
-            err_format(err, "unexpected: failed to find partition");
-            ERAISE(index);
-        }
+done:
 
-        if (loop_parse(disk, &loopnum, NULL) < 0)
-        {
-            err_format(err, "failed to loop device: %s", disk);
-            ERAISE(-EINVAL);
-        }
+    if (gpt)
+        gpt_close(gpt);
 
-        loop_format(hash_dev_path, loopnum, index + 1);
-    }
+    return ret;
+}
 
-    if (trace)
-        printf("Created verity partition");
+int verity_format_partition(
+    const char* disk,
+    size_t data_index,
+    size_t hash_index,
+    bool trace,
+    bool progress,
+    sha256_t* roothash,
+    err_t* err)
+{
+    int ret = 0;
+    blockdev_t* data_dev = NULL;
+    blockdev_t* hash_dev = NULL;
+    gpt_t* gpt = NULL;
+    int r;
+    guid_t verity_uuid;
 
-    // Set the verity-uuid to the unique-guid of the data device.
+    // Clear all output parameters
+    sha256_clear(roothash);
+    err_clear(err);
+
+    // Set the verity-uuid to the unique-guid of the data partition.
     {
-        uint32_t loopnum;
-        uint32_t partnum;
         gpt_entry_t e;
 
-        if (loop_parse(data_dev_path, &loopnum, &partnum) != 0)
-        {
-            err_format(err, "cannot parse SCSI device path: %s", data_dev_path);
-            ERAISE(-EINVAL);
-        }
-
-        if (partnum == 0)
+        if ((r = gpt_open(disk, O_RDONLY, &gpt)) < 0)
         {
-            err_format(err, "invalid data device pathname: %s", data_dev_path);
-            ERAISE(-EINVAL);
+            err_format(err, "GUID partition table not found: %s", disk);
+            ERAISE(r);
         }
 
-        if ((r = gpt_get_entry(gpt, partnum - 1, &e)) < 0)
+        if ((r = gpt_get_entry(gpt, data_index, &e)) < 0)
         {
-            err_format(err, "cannot find GPT entry for partition %u", partnum);
+            err_format(err, "cannot find GPT entry for partition %zu",
+                data_index + 1);
             ERAISE(-ENOENT);
         }
 
         guid_init_xy(&verity_uuid, e.unique_guid1, e.unique_guid2);
+
+        gpt_close(gpt);
+        gpt = NULL;
     }
 
-    // Close the GPT:
-    gpt_close(gpt);
-    gpt = NULL;
+    if (trace)
+    {
+        printf("%s>>> Formatting verity partition for %s partition %zu...%s\n",
+            colors_green, disk, data_index + 1, colors_reset);
+    }
 
-    // Open the data device for read.
-    if ((r = blockdev_open(
-        data_dev_path,
+    // Open the data partition for read (as a slice of the disk, so that
+    // no partition device is needed).
+    if ((r = gpt_open_partition(
+        disk,
+        data_index,
         O_RDONLY,
-        0,
         VERITY_BLOCK_SIZE,
         &data_dev)) < 0)
     {
-        err_format(err, "failed to open data device: %s", globals.disk);
+        err_format(err, "failed to open data partition: %s", disk);
         ERAISE(r);
     }
 
-    // Open the hash device (the new partition).
-    if ((r = blockdev_open(
-        hash_dev_path,
+    // Open the hash device.
+    if ((r = gpt_open_partition(
+        disk,
+        hash_index,
         O_RDWR,
-        0600,
         VERITY_BLOCK_SIZE,
         &hash_dev)) < 0)
     {
-        err_format(err, "failed to open hash device: %s", globals.disk);
+        err_format(err, "failed to open hash partition: %s", disk);
         ERAISE(r);
     }
 
-    // Format the new partition.
+    // Format the hash device.
     if ((r = verity_format(
         data_dev, hash_dev, &verity_uuid, roothash, trace, progress)) < 0)
     {
@@ -250,6 +250,14 @@ int verity_add_partition(
         ERAISE(r);
     }
 
+    // Flush the hash device, since a whole-disk device does not share its
+    // cache with the partition device that later readers may use.
+    if (fsync(hash_dev->fd) < 0)
+    {
+        err_format(err, "failed to flush hash device");
+        ERAISE(-errno);
+    }
+
     if (trace)
     {
         sha256_string_t str;
@@ -257,18 +265,6 @@ int verity_add_partition(
         printf("roothash: %s\n", str.buf);
     }
 
-    if (data_dev)
-    {
-        blockdev_close(data_dev);
-        data_dev = NULL;
-    }
-
-    if (hash_dev)
-    {
-        blockdev_close(hash_dev);
-        hash_dev = NULL;
-    }
-
 done:
 
     if (data_dev)
@@ -283,6 +279,39 @@ done:
     return ret;
 }
 
+int verity_add_partition(
+    const char* disk,
+    size_t data_index,
+    bool trace,
+    bool progress,
+    guid_t* unique_guid,
+    sha256_t* roothash,
+    err_t* err)
+{
+    int ret = 0;
+    size_t hash_index;
+
+    sha256_clear(roothash);
+
+    if (trace)
+    {
+        printf("%s>>> Adding verity partition for %s partition %zu...%s\n",
+            colors_green, disk, data_index + 1, colors_reset);
+    }
+
+    ECHECK(verity_create_partition(disk, data_index, unique_guid,
+        &hash_index, err));
+
+    if (trace)
+        printf("Created verity partition\n");
+
+    ECHECK(verity_format_partition(disk, data_index, hash_index, trace,
+        progress, roothash, err));
+
+done:
+    return ret;
+}
+
 /* Fill the hash device with zero blocks */
 /* ATTN: consider removing unused function */
 __attribute__((__unused__))
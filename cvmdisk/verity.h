@@ -82,9 +82,31 @@ typedef struct
 }
 verity_block_t;
 
+/* Add an unformatted verity partition for the data partition with the given
+ * (zero-based) index and get the index of the new partition; disk may be an
+ * image file or a whole-disk device */
+int verity_create_partition(
+    const char* disk,
+    size_t data_index,
+    guid_t* unique_guid,
+    size_t* hash_index,
+    err_t* err);
+
+/* Format the verity partition for the data partition, reading and writing
+ * them as slices of disk */
+int verity_format_partition(
+    const char* disk,
+    size_t data_index,
+    size_t hash_index,
+    bool trace,
+    bool progress,
+    sha256_t* roothash,
+    err_t* err);
+
+/* Create and format a verity partition (see above) */
 int verity_add_partition(
     const char* disk,
-    const char* data_dev_path,
+    size_t data_index,
     bool trace,
     bool progress,
     guid_t* unique_guid,
@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/dm-ioctl.h>
+#include <cvmdisk/eraise.h>
+#include "dm.h"
+
+#define DM_CONTROL_PATH DM_MAPPER_DIR "/control"
+
+#define DM_BUFFER_SIZE 16384
+
+typedef union dm_buffer
+{
+    struct dm_ioctl io;
+    char buf[DM_BUFFER_SIZE];
+}
+dm_buffer_t;
+
+static void _init(dm_buffer_t* b, const char* name, uint32_t flags)
+{
+    memset(b, 0, sizeof(dm_buffer_t));
+    b->io.version[0] = DM_VERSION_MAJOR;
+    b->io.version[1] = 0;
+    b->io.version[2] = 0;
+    b->io.data_size = sizeof(dm_buffer_t);
+    b->io.data_start = sizeof(struct dm_ioctl);
+    b->io.flags = flags;
+
+    if (name)
+        strncpy(b->io.name, name, sizeof(b->io.name) - 1);
+}
+
+static int _ioctl(unsigned long request, dm_buffer_t* b)
+{
+    int ret = 0;
+    int fd;
+
+    if ((fd = open(DM_CONTROL_PATH, O_RDWR | O_CLOEXEC)) < 0)
+        ERAISE(-errno);
+
+    if (ioctl(fd, request, &b->io) < 0)
+        ERAISE(-errno);
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    return ret;
+}
+
+int dm_create(
+    const char* name,
+    const char* target_type,
+    uint64_t num_sectors,
+    const char* params,
+    int secure,
+    dev_t* dev)
+{
+    int ret = 0;
+    dm_buffer_t b;
+    const uint32_t flags = secure ? DM_SECURE_DATA_FLAG : 0;
+    bool created = false;
+
+    if (!name || !target_type || !params || !dev)
+        ERAISE(-EINVAL);
+
+    if (strlen(name) >= DM_NAME_LEN ||
+        strlen(target_type) >= DM_MAX_TYPE_NAME)
+    {
+        ERAISE(-ENAMETOOLONG);
+    }
+
+    /* Create the (inactive) device */
+    _init(&b, name, flags);
+    ECHECK(_ioctl(DM_DEV_CREATE, &b));
+    created = true;
+
+    /* Load its table: one target spec followed by its parameter string */
+    {
+        struct dm_target_spec* spec;
+        size_t n = strlen(params) + 1;
+        size_t size = (sizeof(struct dm_target_spec) + n + 7) & ~7;
+
+        _init(&b, name, flags);
+
+        if (b.io.data_start + size > sizeof(b))
+            ERAISE(-E2BIG);
+
+        b.io.target_count = 1;
+        spec = (struct dm_target_spec*)(b.buf + b.io.data_start);
+        spec->sector_start = 0;
+        spec->length = num_sectors;
+        spec->next = size;
+        strcpy(spec->target_type, target_type);
+        memcpy(spec + 1, params, n);
+
+        ret = _ioctl(DM_TABLE_LOAD, &b);
+
+        if (secure)
+            memset(b.buf, 0, sizeof(b.buf));
+
+        ECHECK(ret);
+    }
+
+    /* Activate the table (resume) */
+    _init(&b, name, flags);
+    ECHECK(_ioctl(DM_DEV_SUSPEND, &b));
+
+    *dev = (dev_t)b.io.dev;
+    created = false;
+
+done:
+
+    if (created)
+        dm_remove(name);
+
+    return ret;
+}
+
+int dm_remove(const char* name)
+{
+    int ret = 0;
+    dm_buffer_t b;
+
+    _init(&b, name, 0);
+    ECHECK(_ioctl(DM_DEV_REMOVE, &b));
+
+done:
+    return ret;
+}
+
+int dm_get_dev(const char* name, dev_t* dev)
+{
+    int ret = 0;
+    dm_buffer_t b;
+
+    _init(&b, name, 0);
+    ECHECK(_ioctl(DM_DEV_STATUS, &b));
+
+    if (!(b.io.flags & DM_ACTIVE_PRESENT_FLAG))
+        ERAISE(-ENXIO);
+
+    *dev = (dev_t)b.io.dev;
+
+done:
+    return ret;
+}
+
+int dm_message(const char* name, uint64_t sector, const char* message)
+{
+    int ret = 0;
+    dm_buffer_t b;
+    struct dm_target_msg* msg;
+    size_t n;
+
+    if (!name || !message)
+        ERAISE(-EINVAL);
+
+    n = strlen(message) + 1;
+    _init(&b, name, 0);
+
+    if (b.io.data_start + sizeof(struct dm_target_msg) + n > sizeof(b))
+        ERAISE(-E2BIG);
+
+    msg = (struct dm_target_msg*)(b.buf + b.io.data_start);
+    msg->sector = sector;
+    memcpy(msg->message, message, n);
+
+    ECHECK(_ioctl(DM_TARGET_MSG, &b));
+
+done:
+    return ret;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMEPHEMERAL_DM_H
+#define _CVMBOOT_CVMEPHEMERAL_DM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DM_MAPPER_DIR "/dev/mapper"
+
+/* size of a device name buffer, including the terminator (DM_NAME_LEN) */
+#define DM_NAME_MAX 128
+
+/* create and activate the single-target device /dev/mapper/<name> through
+ * the device-mapper control device (as "dmsetup create" does); set secure
+ * when the table holds a key, so the kernel wipes its copy of the buffer */
+int dm_create(
+    const char* name,
+    const char* target_type,
+    uint64_t num_sectors,
+    const char* params,
+    int secure,
+    dev_t* dev);
+
+int dm_remove(const char* name);
+
+/* get the device number of an active device-mapper device */
+int dm_get_dev(const char* name, dev_t* dev);
+
+/* send a message to the target at the given sector (as "dmsetup message"
+ * does), e.g., "create_thin 0" to a thin-pool */
+int dm_message(const char* name, uint64_t sector, const char* message);
+
+#endif /* _CVMBOOT_CVMEPHEMERAL_DM_H */
@@ -0,0 +1,532 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <utils/hexstr.h>
+#include <utils/strings.h>
+#include <utils/allocator.h>
+#include <common/err.h>
+#include <cvmdisk/gpt.h>
+#include <cvmdisk/guid.h>
+#include <cvmdisk/round.h>
+#include <cvmdisk/blockdev.h>
+#include "dm.h"
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** cvmephemeral: a static helper for the resource-disk initramfs script that
+** builds the ephemeral writable layer of the root file system in process:
+**
+**     upper DISK NAME
+**         Rewrite the GUID partition table of the resource disk so that it has
+**         one basic-data (NTFS) partition over its first 10 percent, and map
+**         the rest of the disk with dm-crypt onto /dev/mapper/NAME, under a
+**         key drawn from getrandom() that is never stored.
+**
+**     snapshot NAME ORIGIN COW [CHUNK-SECTORS]
+**         Join /dev/mapper/ORIGIN (read-only) and /dev/mapper/COW (writable)
+**         with a non-persistent dm-snapshot onto /dev/mapper/NAME.
+**
+**     thin NAME ORIGIN UPPER [BLOCK-SECTORS]
+**         Build a thin-pool on /dev/mapper/UPPER (metadata at its start, data
+**         after it) and map a thin device onto /dev/mapper/NAME that uses
+**         /dev/mapper/ORIGIN as its read-only external origin. Unlike the
+**         snapshot exception store, the pool metadata is a b-tree, so the
+**         cost of a write does not grow with the number of blocks written.
+**
+** This replaces parted, fdisk, sleep, losetup, dd, cryptsetup and dmsetup.
+** Device nodes are waited for with inotify rather than with fixed sleeps.
+**
+**==============================================================================
+*/
+
+/* exit status when DISK has no GUID partition table (e.g., it uses an MBR) */
+#define EXIT_NO_GPT 2
+
+/* partitions start and end on 1 MiB boundaries, like parted */
+#define ALIGNMENT_SECTORS 2048
+
+/* percentage of the resource disk kept as the NTFS partition */
+#define NTFS_PERCENT 10
+
+/* aes-xts-plain64 with a 512-bit key (two AES-256 keys) */
+#define CRYPT_CIPHER "aes-xts-plain64"
+#define CRYPT_KEY_SIZE 64
+
+/* default snapshot chunk size in sectors (4 KiB), non-persistent */
+#define SNAPSHOT_CHUNK_SECTORS 8
+
+/* default thin-pool block size in sectors (64 KiB); the kernel requires a
+ * multiple of 64 KiB between 64 KiB and 1 GiB */
+#define THIN_BLOCK_SECTORS 128
+#define THIN_MIN_BLOCK_SECTORS 128
+#define THIN_MAX_BLOCK_SECTORS 2097152
+
+/* thin-pool metadata: about 64 bytes per data block, rounded up to 1 MiB and
+ * kept within the bounds the kernel supports (DM_THIN_MAX_METADATA_SECTORS,
+ * beyond which the excess is ignored with a warning) */
+#define THIN_META_BYTES_PER_BLOCK 64
+#define THIN_MIN_META_SECTORS 4096
+#define THIN_MAX_META_SECTORS 33423360
+
+/* how long to wait for udev before creating a node directly */
+#define NODE_TIMEOUT_MSEC 5000
+
+static const char* _arg0;
+
+static long _msec_since(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000 +
+        (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* wait until path exists, watching its directory for created entries */
+static int _wait_for_node(const char* path, long timeout_msec)
+{
+    int ret = -1;
+    int fd = -1;
+    char dir[PATH_MAX];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    strlcpy(dir, path, sizeof(dir));
+
+    if ((fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0)
+        goto done;
+
+    if (inotify_add_watch(fd, dirname(dir), IN_CREATE | IN_MOVED_TO) < 0)
+        goto done;
+
+    /* check after adding the watch so that no creation can be missed */
+    while (access(path, F_OK) != 0)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        char buf[4096];
+        long remaining = timeout_msec - _msec_since(&start);
+
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0)
+            goto done;
+
+        /* drain the events; the access() check above decides */
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    ret = 0;
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    return ret;
+}
+
+/* wait for udev to create /dev/mapper/<name>, else create it directly (as
+ * libdevmapper does when it does not synchronize with udev) */
+static void _wait_for_dm_node(const char* name, dev_t dev)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", DM_MAPPER_DIR, name);
+
+    if (_wait_for_node(path, NODE_TIMEOUT_MSEC) == 0)
+        return;
+
+    if (mknod(path, S_IFBLK | 0600, dev) < 0 && errno != EEXIST)
+        ERR("cannot create device node: %s", path);
+}
+
+static void _format_dev(char buf[32], dev_t dev)
+{
+    snprintf(buf, 32, "%u:%u", major(dev), minor(dev));
+}
+
+static dev_t _get_block_dev(const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+        ERR("not a block device: %s", path);
+
+    return st.st_rdev;
+}
+
+static void _upper(const char* disk, const char* name)
+{
+    gpt_t* gpt = NULL;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint64_t start;
+    uint64_t ntfs_sectors;
+    uint64_t crypt_start;
+    uint64_t crypt_sectors;
+    char partition[PATH_MAX];
+    char disk_dev[32];
+    uint8_t key[CRYPT_KEY_SIZE];
+    char key_hex[CRYPT_KEY_SIZE * 2 + 1];
+    char params[256];
+    dev_t dev;
+    int r;
+
+    _get_block_dev(disk);
+
+    if (gpt_open(disk, O_RDWR, &gpt) < 0)
+    {
+        fprintf(stderr, "%s: no GUID partition table: %s\n", _arg0, disk);
+        exit(EXIT_NO_GPT);
+    }
+
+    /* Lay out the disk: NTFS partition, then the unpartitioned upper layer */
+    gpt_get_usable_lbas(gpt, &first_usable_lba, &last_usable_lba);
+    start = round_up_to_multiple(first_usable_lba, ALIGNMENT_SECTORS);
+
+    if (last_usable_lba <= start + 2 * ALIGNMENT_SECTORS)
+        ERR("disk is too small: %s", disk);
+
+    ntfs_sectors = (last_usable_lba + 1 - start) * NTFS_PERCENT / 100;
+    ntfs_sectors = ntfs_sectors / ALIGNMENT_SECTORS * ALIGNMENT_SECTORS;
+
+    if (ntfs_sectors == 0)
+        ntfs_sectors = ALIGNMENT_SECTORS;
+
+    crypt_start = start + ntfs_sectors;
+    crypt_sectors = last_usable_lba + 1 - crypt_start;
+    crypt_sectors = crypt_sectors / ALIGNMENT_SECTORS * ALIGNMENT_SECTORS;
+
+    /* Rewrite the partition table in memory, then write it and have the
+     * kernel reread it once */
+    {
+        gpt_entry_t e;
+
+        while (gpt_get_num_entries(gpt) > 0)
+        {
+            if (gpt_remove_partition(gpt, 0) < 0)
+                ERR("cannot remove partition: %s", disk);
+        }
+
+        memset(&e, 0, sizeof(e));
+        guid_get_xy(&basic_data_type_guid, &e.type_guid1, &e.type_guid2);
+        e.starting_lba = start;
+        e.ending_lba = start + ntfs_sectors - 1;
+
+        if ((r = gpt_append_entry(gpt, &e)) < 0)
+            ERR("cannot add partition: %s: %s", disk, strerror(-r));
+
+        if ((r = gpt_sync(gpt)) < 0)
+            ERR("cannot update partition table: %s: %s", disk, strerror(-r));
+
+        gpt_close(gpt);
+    }
+
+    /* Wait for the NTFS partition node (the script formats it) */
+    snprintf(partition, sizeof(partition), "%s%s1",
+        disk, isdigit(disk[strlen(disk) - 1]) ? "p" : "");
+
+    if (_wait_for_node(partition, NODE_TIMEOUT_MSEC) < 0)
+        ERR("timed out waiting for %s", partition);
+
+    /* Generate the ephemeral key */
+    if (getrandom(key, sizeof(key), 0) != sizeof(key))
+        ERR("getrandom() failed");
+
+    if (hexstr_format(key_hex, sizeof(key_hex), key, sizeof(key)) < 0)
+        ERR("cannot format key");
+
+    /* Map the remainder of the disk with dm-crypt (no loop device) */
+    _format_dev(disk_dev, _get_block_dev(disk));
+    snprintf(params, sizeof(params), "%s %s 0 %s %lu 1 no_write_workqueue",
+        CRYPT_CIPHER, key_hex, disk_dev, crypt_start);
+
+    r = dm_create(name, "crypt", crypt_sectors, params, 1, &dev);
+
+    memset(key, 0, sizeof(key));
+    memset(key_hex, 0, sizeof(key_hex));
+    memset(params, 0, sizeof(params));
+
+    if (r < 0)
+        ERR("cannot create dm-crypt device: %s: %s", name, strerror(-r));
+
+    _wait_for_dm_node(name, dev);
+}
+
+static uint64_t _get_dm_sectors(const char* name)
+{
+    char path[PATH_MAX];
+    ssize_t size;
+
+    snprintf(path, sizeof(path), "%s/%s", DM_MAPPER_DIR, name);
+
+    if ((size = blockdev_getsize64(path)) < 0)
+        ERR("cannot get size of %s", path);
+
+    return (uint64_t)size / 512;
+}
+
+static uint64_t _parse_sectors(const char* str)
+{
+    char* end;
+    unsigned long long x;
+
+    errno = 0;
+    x = strtoull(str, &end, 10);
+
+    if (errno || end == str || *end || x == 0)
+        ERR("bad sector count: %s", str);
+
+    return x;
+}
+
+static void _snapshot(
+    const char* name,
+    const char* origin,
+    const char* cow,
+    uint64_t chunk_sectors)
+{
+    char origin_dev[32];
+    char cow_dev[32];
+    char params[256];
+    dev_t dev;
+    int r;
+
+    /* dm-snapshot requires a power-of-two chunk size */
+    if (chunk_sectors & (chunk_sectors - 1))
+        ERR("chunk size is not a power of two: %lu", chunk_sectors);
+
+    if (dm_get_dev(origin, &dev) < 0)
+        ERR("no such device-mapper device: %s", origin);
+
+    _format_dev(origin_dev, dev);
+
+    if (dm_get_dev(cow, &dev) < 0)
+        ERR("no such device-mapper device: %s", cow);
+
+    _format_dev(cow_dev, dev);
+
+    snprintf(params, sizeof(params), "%s %s N %lu",
+        origin_dev, cow_dev, chunk_sectors);
+
+    r = dm_create(name, "snapshot", _get_dm_sectors(origin), params, 0, &dev);
+
+    if (r < 0)
+        ERR("cannot create snapshot: %s: %s", name, strerror(-r));
+
+    _wait_for_dm_node(name, dev);
+}
+
+/* names of the devices created so far by _thin(), removed on failure */
+static char _created[4][DM_NAME_MAX];
+static size_t _num_created;
+
+static void _rollback(void)
+{
+    while (_num_created > 0)
+        dm_remove(_created[--_num_created]);
+}
+
+static dev_t _create(
+    const char* name,
+    const char* target_type,
+    uint64_t num_sectors,
+    const char* params)
+{
+    dev_t dev;
+    int r;
+
+    if ((r = dm_create(name, target_type, num_sectors, params, 0, &dev)) < 0)
+    {
+        _rollback();
+        ERR("cannot create %s device: %s: %s",
+            target_type, name, strerror(-r));
+    }
+
+    strlcpy(_created[_num_created++], name, DM_NAME_MAX);
+
+    return dev;
+}
+
+/* clear the start of the metadata area so that the kernel formats a new
+ * thin-pool superblock rather than reading a stale one */
+static void _zero_superblock(const char* name)
+{
+    char path[PATH_MAX];
+    char zeros[4096];
+    int fd;
+
+    memset(zeros, 0, sizeof(zeros));
+    snprintf(path, sizeof(path), "%s/%s", DM_MAPPER_DIR, name);
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        ERR("cannot open %s", path);
+
+    if (pwrite(fd, zeros, sizeof(zeros), 0) != sizeof(zeros) || fsync(fd) < 0)
+        ERR("cannot write %s", path);
+
+    close(fd);
+}
+
+static void _thin(
+    const char* name,
+    const char* origin,
+    const char* upper,
+    uint64_t block_sectors)
+{
+    char tmeta[DM_NAME_MAX];
+    char tdata[DM_NAME_MAX];
+    char tpool[DM_NAME_MAX];
+    char origin_dev[32];
+    char upper_dev[32];
+    char meta_dev[32];
+    char data_dev[32];
+    char pool_dev[32];
+    char params[256];
+    uint64_t origin_sectors;
+    uint64_t upper_sectors;
+    uint64_t meta_sectors;
+    uint64_t data_sectors;
+    dev_t dev;
+    int r;
+
+    if (block_sectors % THIN_MIN_BLOCK_SECTORS ||
+        block_sectors > THIN_MAX_BLOCK_SECTORS)
+    {
+        ERR("block size is not a multiple of 64 KiB up to 1 GiB: %lu",
+            block_sectors);
+    }
+
+    if (strlen(name) + sizeof("-tmeta") > DM_NAME_MAX)
+        ERR("device name is too long: %s", name);
+
+    snprintf(tmeta, sizeof(tmeta), "%s-tmeta", name);
+    snprintf(tdata, sizeof(tdata), "%s-tdata", name);
+    snprintf(tpool, sizeof(tpool), "%s-tpool", name);
+
+    if (dm_get_dev(origin, &dev) < 0)
+        ERR("no such device-mapper device: %s", origin);
+
+    _format_dev(origin_dev, dev);
+
+    if (dm_get_dev(upper, &dev) < 0)
+        ERR("no such device-mapper device: %s", upper);
+
+    _format_dev(upper_dev, dev);
+
+    origin_sectors = _get_dm_sectors(origin);
+    upper_sectors = _get_dm_sectors(upper);
+
+    /* Split the upper device into metadata and data areas */
+    meta_sectors = upper_sectors / block_sectors *
+        THIN_META_BYTES_PER_BLOCK / 512;
+    meta_sectors = round_up_to_multiple(meta_sectors, ALIGNMENT_SECTORS);
+
+    if (meta_sectors < THIN_MIN_META_SECTORS)
+        meta_sectors = THIN_MIN_META_SECTORS;
+
+    if (meta_sectors > THIN_MAX_META_SECTORS)
+        meta_sectors = THIN_MAX_META_SECTORS;
+
+    if (upper_sectors <= meta_sectors + block_sectors)
+        ERR("device is too small for a thin-pool: %s", upper);
+
+    data_sectors = (upper_sectors - meta_sectors) / block_sectors *
+        block_sectors;
+
+    /* Create the metadata and data devices over the upper device */
+    _zero_superblock(upper);
+
+    snprintf(params, sizeof(params), "%s 0", upper_dev);
+    _format_dev(meta_dev, _create(tmeta, "linear", meta_sectors, params));
+
+    snprintf(params, sizeof(params), "%s %lu", upper_dev, meta_sectors);
+    _format_dev(data_dev, _create(tdata, "linear", data_sectors, params));
+
+    /* Create the pool: no low-water mark; the data is encrypted with an
+     * ephemeral key so there is nothing to leak by skipping block zeroing */
+    snprintf(params, sizeof(params), "%s %s %lu 0 1 skip_block_zeroing",
+        meta_dev, data_dev, block_sectors);
+    _format_dev(pool_dev, _create(tpool, "thin-pool", data_sectors, params));
+
+    if ((r = dm_message(tpool, 0, "create_thin 0")) < 0)
+    {
+        _rollback();
+        ERR("cannot create thin volume: %s: %s", tpool, strerror(-r));
+    }
+
+    /* Map thin volume 0 with the read-only lower layer as its origin */
+    snprintf(params, sizeof(params), "%s 0 %s", pool_dev, origin_dev);
+    dev = _create(name, "thin", origin_sectors, params);
+
+    _wait_for_dm_node(name, dev);
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+        "Usage:\n"
+        "    %s upper DISK NAME\n"
+        "    %s snapshot NAME ORIGIN COW [CHUNK-SECTORS]\n"
+        "    %s thin NAME ORIGIN UPPER [BLOCK-SECTORS]\n"
+        "\n"
+        "Creates the ephemeral upper layer of the root file system on a\n"
+        "resource disk (upper), and joins it with the read-only lower\n"
+        "layer, either as a dm-snapshot (snapshot) or as a dm-thin volume\n"
+        "with an external origin (thin).\n"
+        "\n", _arg0, _arg0, _arg0);
+}
+
+int main(int argc, const char* argv[])
+{
+    _arg0 = argv[0];
+    err_set_arg0(argv[0]);
+
+    if (argc == 4 && strcmp(argv[1], "upper") == 0)
+    {
+        _upper(argv[2], argv[3]);
+    }
+    else if ((argc == 5 || argc == 6) && strcmp(argv[1], "snapshot") == 0)
+    {
+        uint64_t n = SNAPSHOT_CHUNK_SECTORS;
+
+        if (argc == 6)
+            n = _parse_sectors(argv[5]);
+
+        _snapshot(argv[2], argv[3], argv[4], n);
+    }
+    else if ((argc == 5 || argc == 6) && strcmp(argv[1], "thin") == 0)
+    {
+        uint64_t n = THIN_BLOCK_SECTORS;
+
+        if (argc == 6)
+            n = _parse_sectors(argv[5]);
+
+        _thin(argv[2], argv[3], argv[4], n);
+    }
+    else
+    {
+        _usage();
+        exit(1);
+    }
+
+    return 0;
+}
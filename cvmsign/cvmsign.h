@@ -0,0 +1,38 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_CVMSIGN_CVMSIGN_H
+#define _CVMBOOT_CVMSIGN_CVMSIGN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <utils/key.h>
+#include <utils/sha256.h>
+
+/* The signing key and what is published about it */
+typedef struct signer
+{
+    private_rsa_key_t* privkey;
+    public_rsa_key_t* pubkey;
+
+    /* public key in PEM format */
+    void* pubkey_data;
+    size_t pubkey_size;
+
+    /* SHA256(modulus||exponent) */
+    sha256_t signer_hash;
+}
+signer_t;
+
+/* Get the cvmsign home directory ($HOME/.cvmsign) */
+void cvmsign_get_homedir(char path[PATH_MAX], bool check);
+
+/* Load the keys from the cvmsign home directory (exits on failure) */
+void cvmsign_load_signer(signer_t* signer);
+
+void cvmsign_free_signer(signer_t* signer);
+
+int cvmsign_serve_main(int argc, const char* argv[]);
+
+#endif /* _CVMBOOT_CVMSIGN_CVMSIGN_H */
@@ -24,6 +24,7 @@
 #include <common/getoption.h>
 #include <common/sudo.h>
 #include "timestamp.h"
+#include "cvmsign.h"
 
 __attribute__((__used__)) static const char _timestamp[] = TIMESTAMP;
 
@@ -39,7 +40,7 @@ static const char* _basename(const char* path)
     return path;
 }
 
-static void _get_cvmsign_homedir(char path[PATH_MAX], bool check)
+void cvmsign_get_homedir(char path[PATH_MAX], bool check)
 {
     char home[PATH_MAX];
     struct stat statbuf;
@@ -78,96 +79,60 @@ static void _get_public_key_path(const char* homedir, char path[PATH_MAX])
         ERR("public key does not exist: %s", path);
 }
 
-static void _genkeys(const char* privkey, const char* pubkey)
+void cvmsign_load_signer(signer_t* signer)
 {
-    buf_t buf = BUF_INITIALIZER;
-
-    execf(&buf, "openssl genrsa -out %s", privkey);
-    execf(&buf,
-        "openssl rsa -in %s -pubout -out %s 2>/dev/null", privkey, pubkey);
-
-    if (access(privkey, R_OK) < 0)
-        ERR("Failed to create %s", privkey);
-
-    if (access(pubkey, R_OK) < 0)
-        ERR("Failed to create %s", pubkey);
-
-    buf_release(&buf);
-}
-
-int cvmsign_main(int argc, const char* argv[])
-{
-    sha256_t digest = SHA256_INITIALIZER;
-    const char* filename;
-    void* filename_data = NULL;
-    size_t filename_size = 0;
-    char home[PATH_MAX];
     char homedir[PATH_MAX];
     char privkey_path[PATH_MAX];
     char pubkey_path[PATH_MAX];
     void* privkey_data = NULL;
     size_t privkey_size = 0;
-    void* pubkey_data = NULL;
-    size_t pubkey_size = 0;
-    private_rsa_key_t* privkey = NULL;
-    public_rsa_key_t* pubkey = NULL;
-    uint8_t signature[SIG_MAX_SIGNATURE_SIZE];
-    size_t signature_size = sizeof(signature);
     uint8_t modulus[SIG_MAX_MODULUS_SIZE];
     size_t modulus_size = sizeof(modulus);
     uint8_t exponent[SIG_MAX_EXPONENT_SIZE];
     size_t exponent_size = sizeof(exponent);
     ssize_t r;
-    sha256_t signer_hash = SHA256_INITIALIZER;
-
-    if (sudo_get_home_dir(home) < 0)
-        ERR("unexpected: failed to resolve user home directory");
 
-    err_set_arg0(argv[0]);
-
-    /* check the usage */
-    if (argc != 2)
-    {
-        fprintf(stderr, "Usage: %s <file-name>\n", argv[0]);
-        exit(1);
-    }
+    memset(signer, 0, sizeof(signer_t));
 
     /* get cvmsign home directory and key paths */
-    _get_cvmsign_homedir(homedir, true);
+    cvmsign_get_homedir(homedir, true);
     _get_private_key_path(homedir, privkey_path);
     _get_public_key_path(homedir, pubkey_path);
 
-    /* get the filename of the file being signed */
-    filename = argv[1];
-
-    /* load the file being signed into memory */
-    if (load_file(filename, &filename_data, &filename_size) != 0)
-        ERR("failed read file: %s", filename);
-
-    /* Get the SHA-256 of the file */
-    sha256_compute(&digest, filename_data, filename_size);
-
     /* load the private key into memory */
     {
         if (load_file(privkey_path, &privkey_data, &privkey_size) != 0)
             ERR("failed to load private key: %s", privkey_path);
 
-        if (read_private_rsa_key(&privkey, privkey_data, privkey_size + 1) < 0)
+        if (read_private_rsa_key(
+            &signer->privkey, privkey_data, privkey_size + 1) < 0)
+        {
             ERR("failed to read private key: %s", privkey_path);
+        }
+
+        /* do not keep the private key PEM in memory */
+        memset(privkey_data, 0, privkey_size);
+        free(privkey_data);
     }
 
     /* load the public key into memory */
     {
-        if (load_file(pubkey_path, &pubkey_data, &pubkey_size) != 0)
+        if (load_file(pubkey_path,
+            &signer->pubkey_data, &signer->pubkey_size) != 0)
+        {
             ERR("failed to load public key: %s", pubkey_path);
+        }
 
-        if (read_public_rsa_key(&pubkey, pubkey_data, pubkey_size + 1) < 0)
+        if (read_public_rsa_key(&signer->pubkey,
+            signer->pubkey_data, signer->pubkey_size + 1) < 0)
+        {
             ERR("invalid public key: %s", pubkey_path);
+        }
     }
 
     /* get the exponent of the key */
     {
-        if ((r = key_get_exponent(pubkey, exponent, exponent_size)) < 0)
+        if ((r = key_get_exponent(signer->pubkey, exponent, exponent_size)) < 0)
             ERR("failed to get modulus from public key: %s", pubkey_path);
 
         exponent_size = r;
@@ -178,7 +143,7 @@ int cvmsign_main(int argc, const char* argv[])
 
     /* get the modulus of the key */
     {
-        if ((r = key_get_modulus(pubkey, modulus, modulus_size)) < 0)
+        if ((r = key_get_modulus(signer->pubkey, modulus, modulus_size)) < 0)
             ERR("failed to get modulus from public key: %s", pubkey_path);
 
         modulus_size = r;
@@ -193,16 +158,96 @@ int cvmsign_main(int argc, const char* argv[])
         const size_t buf_size = modulus_size + exponent_size;
         memcpy(buf, modulus, modulus_size);
         memcpy(&buf[modulus_size], exponent, exponent_size);
-        sha256_compute(&signer_hash, buf, buf_size);
+        sha256_compute(&signer->signer_hash, buf, buf_size);
+    }
+}
+
+void cvmsign_free_signer(signer_t* signer)
+{
+    free_private_rsa_key(signer->privkey);
+    free_public_rsa_key(signer->pubkey);
+    free(signer->pubkey_data);
+    memset(signer, 0, sizeof(signer_t));
+}
+
+static void _genkeys(const char* privkey, const char* pubkey)
+{
+    buf_t buf = BUF_INITIALIZER;
+
+    execf(&buf, "openssl genrsa -out %s", privkey);
+    execf(&buf,
+        "openssl rsa -in %s -pubout -out %s 2>/dev/null", privkey, pubkey);
+
+    if (access(privkey, R_OK) < 0)
+        ERR("Failed to create %s", privkey);
+
+    if (access(pubkey, R_OK) < 0)
+        ERR("Failed to create %s", pubkey);
+
+    buf_release(&buf);
+}
+
+int cvmsign_main(int argc, const char* argv[])
+{
+    sha256_t digest = SHA256_INITIALIZER;
+    const char* filename;
+    void* filename_data = NULL;
+    size_t filename_size = 0;
+    signer_t signer;
+    uint8_t signature[SIG_MAX_SIGNATURE_SIZE];
+    size_t signature_size = sizeof(signature);
+    const char* digest_opt = NULL;
+    err_t err;
+
+    err_set_arg0(argv[0]);
+
+    /* answer the probe for the digest protocol (see cvmdisk/sig.c) */
+    if (argc == 2 && strcmp(argv[1], "--digest-supported") == 0)
+        return 0;
+
+    /* get the --digest option (sign this digest rather than a file) */
+    if (getoption(&argc, argv, "--digest", &digest_opt, &err) < 0)
+        ERR("%s", err.buf);
+
+    /* check the usage */
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s [--digest <sha256-hex>] <file-name>\n",
+            argv[0]);
+        fprintf(stderr, "       %s serve [options]\n", argv[0]);
+        exit(1);
     }
 
+    /* get the filename of the file being signed */
+    filename = argv[1];
+
+    if (digest_opt)
+    {
+        /* the file need not exist; its name is only used for the outputs */
+        if (sha256_scan(digest_opt, &digest) < 0)
+            ERR("bad --digest option argument: %s", digest_opt);
+    }
+    else
+    {
+        /* load the file being signed into memory */
+        if (load_file(filename, &filename_data, &filename_size) != 0)
+            ERR("failed read file: %s", filename);
+
+        /* Get the SHA-256 of the file */
+        sha256_compute(&digest, filename_data, filename_size);
+    }
+
+    /* load the keys */
+    cvmsign_load_signer(&signer);
+
     /* sign the digest */
     {
         ssize_t r;
 
-        if ((r = rsa_sign(privkey, &digest, signature, signature_size)) < 0)
+        if ((r = rsa_sign(signer.privkey, &digest, signature,
+            signature_size)) < 0)
         {
-            ERR("signing operation failed: %s", privkey_path);
+            ERR("signing operation failed");
         }
 
         signature_size = r;
@@ -231,8 +276,11 @@ int cvmsign_main(int argc, const char* argv[])
         strlcpy(path, filename, sizeof(path));
         strlcat(path, ".signerpubkeyhash", sizeof(path));
 
-        if (write_file(path, &signer_hash, sizeof(signer_hash)) < 0)
+        if (write_file(path, &signer.signer_hash,
+            sizeof(signer.signer_hash)) < 0)
+        {
             ERR("failed to write file: %s", path);
+        }
 
         printf("%s: Created %s\n", argv[0], path);
     }
@@ -244,16 +292,14 @@ int cvmsign_main(int argc, const char* argv[])
         strlcpy(path, filename, sizeof(path));
         strlcat(path, ".pub", sizeof(path));
 
-        if (write_file(path, pubkey_data, pubkey_size) < 0)
+        if (write_file(path, signer.pubkey_data, signer.pubkey_size) < 0)
             ERR("failed to write file: %s", path);
 
         printf("%s: Created %s\n", argv[0], path);
     }
 
-    free(privkey_data);
     free(filename_data);
-    free(pubkey_data);
-    free_public_rsa_key(pubkey);
+    cvmsign_free_signer(&signer);
 
     return 0;
 }
@@ -282,7 +328,7 @@ int cvmsign_init_main(int argc, const char* argv[])
     }
 
     /* get cvmsign home directory: $HOME/.cvmsign */
-    _get_cvmsign_homedir(homedir, false);
+    cvmsign_get_homedir(homedir, false);
 
     /* create the directory if it does not already exist */
     if (stat(homedir, &statbuf) != 0)
@@ -401,6 +447,9 @@ int main(int argc, const char* argv[])
 
     if (strcmp(basename, "cvmsign") == 0)
     {
+        if (argc >= 2 && strcmp(argv[1], "serve") == 0)
+            return cvmsign_serve_main(argc, argv);
+
         return cvmsign_main(argc, argv);
     }
     else if (strcmp(basename, "cvmsign-init") == 0)
@@ -0,0 +1,216 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <utils/strings.h>
+#include <utils/sha256.h>
+#include <common/key.h>
+#include <common/err.h>
+#include <common/getoption.h>
+#include <common/signproto.h>
+#include "cvmsign.h"
+
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 256
+
+/* microseconds to wait before accepting again when out of descriptors */
+#define ACCEPT_BACKOFF_USECS 100000
+
+#define SERVE_USAGE "\
+Usage: %s serve [--socket <path>] [--workers <count>]\n\
+\n\
+Loads the signing key once and signs SHA-256 digests sent over a Unix\n\
+domain socket (default: $HOME/.cvmsign/" SIGNPROTO_DEFAULT_SOCKET_NAME ")\n\
+by any number of clients, using a pool of worker threads (default: %d).\n\
+Use it by passing unix:<path> as the signing tool to cvmdisk.\n\
+\n"
+
+static signer_t _signer;
+static int _listen_fd = -1;
+static char _socket_path[PATH_MAX];
+
+/* Remove the socket when terminated so a later run can bind it again */
+static void _signal_handler(int signum)
+{
+    unlink(_socket_path);
+    _exit(0);
+}
+
+static void _handle_request(
+    const signproto_request_t* request,
+    signproto_response_t* response)
+{
+    ssize_t r;
+
+    memset(response, 0, sizeof(signproto_response_t));
+    response->magic = SIGNPROTO_MAGIC;
+    response->status = -1;
+
+    if (request->magic != SIGNPROTO_MAGIC)
+        return;
+
+    if ((r = rsa_sign(_signer.privkey, &request->digest,
+        response->signature, sizeof(response->signature))) < 0)
+    {
+        return;
+    }
+
+    response->signature_size = (uint32_t)r;
+    response->signer = _signer.signer_hash;
+    response->pubkey_size = (uint32_t)_signer.pubkey_size;
+    memcpy(response->pubkey, _signer.pubkey_data, _signer.pubkey_size);
+    response->status = 0;
+}
+
+/* Each worker accepts a connection and serves it until the client hangs up */
+static void* _worker(void* arg)
+{
+    signproto_request_t request;
+    signproto_response_t* response;
+
+    if (!(response = malloc(sizeof(signproto_response_t))))
+        ERR("out of memory");
+
+    for (;;)
+    {
+        int fd;
+
+        if ((fd = accept(_listen_fd, NULL, NULL)) < 0)
+        {
+            /* the connection went away before it was accepted */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* out of descriptors or memory: wait for clients to hang up */
+            if (errno == EMFILE || errno == ENFILE ||
+                errno == ENOBUFS || errno == ENOMEM)
+            {
+                ERR_NOEXIT("accept() failed: %s", strerror(errno));
+                usleep(ACCEPT_BACKOFF_USECS);
+                continue;
+            }
+
+            unlink(_socket_path);
+            ERR("accept() failed: %s", strerror(errno));
+        }
+
+        while (signproto_readn(fd, &request, sizeof(request)) == 0)
+        {
+            _handle_request(&request, response);
+
+            if (signproto_writen(fd, response, sizeof(*response)) < 0)
+                break;
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int cvmsign_serve_main(int argc, const char* argv[])
+{
+    const char* socket_opt = NULL;
+    const char* workers_opt = NULL;
+    size_t workers = DEFAULT_WORKERS;
+    struct sockaddr_un addr;
+    pthread_t* threads;
+    err_t err;
+
+    err_set_arg0(argv[0]);
+
+    if (getoption(&argc, argv, "--socket", &socket_opt, &err) < 0)
+        ERR("%s", err.buf);
+
+    if (getoption(&argc, argv, "--workers", &workers_opt, &err) < 0)
+        ERR("%s", err.buf);
+
+    /* check the usage: cvmsign serve [options] */
+    if (argc != 2)
+    {
+        fprintf(stderr, SERVE_USAGE, argv[0], DEFAULT_WORKERS);
+        exit(1);
+    }
+
+    if (workers_opt)
+    {
+        char* end;
+        unsigned long n = strtoul(workers_opt, &end, 10);
+
+        if (*end || n == 0 || n > MAX_WORKERS)
+            ERR("bad --workers option argument: %s", workers_opt);
+
+        workers = n;
+    }
+
+    if (socket_opt)
+    {
+        strlcpy(_socket_path, socket_opt, sizeof(_socket_path));
+    }
+    else
+    {
+        cvmsign_get_homedir(_socket_path, true);
+        strlcat(_socket_path, "/" SIGNPROTO_DEFAULT_SOCKET_NAME, PATH_MAX);
+    }
+
+    /* load the keys once for all requests */
+    cvmsign_load_signer(&_signer);
+
+    /* create the listening socket (accessible only to this user) */
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if (strlcpy(addr.sun_path, _socket_path, sizeof(addr.sun_path)) >=
+            sizeof(addr.sun_path))
+        {
+            ERR("socket path is too long: %s", _socket_path);
+        }
+
+        if ((_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            ERR("failed to create socket");
+
+        unlink(_socket_path);
+
+        if (bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            ERR("failed to bind socket: %s", _socket_path);
+
+        if (chmod(_socket_path, 0600) < 0)
+            ERR("failed to change mode of socket: %s", _socket_path);
+
+        if (listen(_listen_fd, SOMAXCONN) < 0)
+            ERR("failed to listen on socket: %s", _socket_path);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, _signal_handler);
+    signal(SIGTERM, _signal_handler);
+
+    /* start the worker pool */
+    if (!(threads = calloc(workers, sizeof(pthread_t))))
+        ERR("out of memory");
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        if (pthread_create(&threads[i], NULL, _worker, NULL) != 0)
+            ERR("failed to create worker thread");
+    }
+
+    printf("%s: listening on %s (%zu workers)\n",
+        argv[0], _socket_path, workers);
+    fflush(stdout);
+
+    for (size_t i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+
+    return 0;
+}
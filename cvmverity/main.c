@@ -0,0 +1,252 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <utils/sha256.h>
+#include <utils/allocator.h>
+#include <common/err.h>
+#include <common/file.h>
+#include <cvmdisk/gpt.h>
+#include <cvmdisk/guid.h>
+#include <cvmdisk/verity.h>
+#include <cvmdisk/blockdev.h>
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** cvmverity: a static helper for the initramfs premount script. It reads the
+** GUID partition table once, finds the partitions that make up the protected
+** root file system, reads the verity superblock and computes the roothash in
+** process, and prints the results as shell variable assignments:
+**
+**     linuxdev=/dev/sda1
+**     thindatadev=
+**     thinmetadev=
+**     thindatasectors=0
+**     hashdev=/dev/sda3
+**     roothash=<hex>
+**     efiroothash=<hex>
+**
+** The script would otherwise spawn fdisk, grep, awk, tr, veritysetup, dd and
+** sha256sum, several times per partition, to find the same values.
+**
+**==============================================================================
+*/
+
+#define EFIVARFS_ROOTHASH_PATH \
+    "/sys/firmware/efi/efivars/roothash-08b5e462-25eb-42c0-a7d1-e9f78c3c7e09"
+
+static const char* _arg0;
+
+/* get the device name of a partition: /dev/sda => /dev/sda3 and
+ * /dev/nvme0n1 => /dev/nvme0n1p3 */
+static void _format_partition(
+    char path[PATH_MAX],
+    const char* disk,
+    size_t index)
+{
+    const size_t n = strlen(disk);
+    const char* sep = (n && isdigit(disk[n - 1])) ? "p" : "";
+
+    snprintf(path, PATH_MAX, "%s%s%zu", disk, sep, index + 1);
+}
+
+static ssize_t _find_entry(
+    const gpt_entry_t* entries,
+    size_t num_entries,
+    const guid_t* type_guid)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        guid_t guid;
+
+        guid_init_xy(&guid, entries[i].type_guid1, entries[i].type_guid2);
+
+        if (guid_equal(&guid, type_guid))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Find the verity partition whose superblock UUID is the unique GUID of the
+ * data partition (any verity partition if data_index is negative) and compute
+ * its roothash: SHA-256(salt + first hash block) */
+static ssize_t _find_hash_device(
+    const char* disk,
+    const gpt_entry_t* entries,
+    size_t num_entries,
+    ssize_t data_index,
+    sha256_t* roothash)
+{
+    guid_t data_uuid;
+
+    if (data_index >= 0)
+    {
+        guid_init_xy(&data_uuid,
+            entries[data_index].unique_guid1,
+            entries[data_index].unique_guid2);
+    }
+
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        char path[PATH_MAX];
+        blockdev_t* dev;
+        verity_superblock_t sb;
+        guid_t guid;
+        int r;
+
+        guid_init_xy(&guid, entries[i].type_guid1, entries[i].type_guid2);
+
+        if (!guid_equal(&guid, &verity_type_guid))
+            continue;
+
+        _format_partition(path, disk, i);
+
+        if (blockdev_open(path, O_RDONLY, 0, VERITY_BLOCK_SIZE, &dev) < 0)
+            continue;
+
+        if (verity_get_superblock(dev, &sb) < 0)
+        {
+            blockdev_close(dev);
+            continue;
+        }
+
+        guid_init_bytes(&guid, sb.uuid);
+
+        if (data_index >= 0 && !guid_equal(&guid, &data_uuid))
+        {
+            blockdev_close(dev);
+            continue;
+        }
+
+        r = verity_get_roothash(dev, roothash);
+        blockdev_close(dev);
+
+        if (r < 0)
+            ERR("cannot compute the roothash: %s", path);
+
+        return i;
+    }
+
+    return -1;
+}
+
+/* efivarfs files start with the 4-byte variable attributes */
+static void _get_efi_roothash(char buf[SHA256_STRING_SIZE])
+{
+    char* data;
+    size_t size;
+
+    *buf = '\0';
+
+    if (load_file(EFIVARFS_ROOTHASH_PATH, (void**)&data, &size) < 0)
+        return;
+
+    if (size > sizeof(uint32_t))
+    {
+        size_t n = 0;
+
+        for (size_t i = sizeof(uint32_t); i < size; i++)
+        {
+            if (!isxdigit(data[i]) || n + 1 == SHA256_STRING_SIZE)
+                break;
+
+            buf[n++] = tolower(data[i]);
+        }
+
+        buf[n] = '\0';
+    }
+
+    free(data);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* disk;
+    gpt_t* gpt = NULL;
+    gpt_entry_t entries[GPT_MAX_ENTRIES];
+    size_t num_entries;
+    ssize_t root_index;
+    ssize_t thin_data_index;
+    ssize_t thin_meta_index;
+    ssize_t hash_index;
+    size_t thin_data_sectors = 0;
+    char linuxdev[PATH_MAX] = "";
+    char thindatadev[PATH_MAX] = "";
+    char thinmetadev[PATH_MAX] = "";
+    char hashdev[PATH_MAX];
+    sha256_t roothash;
+    sha256_string_t str;
+    char efi_roothash[SHA256_STRING_SIZE];
+
+    _arg0 = argv[0];
+    err_set_arg0(argv[0]);
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s DISK\n\n", _arg0);
+        fprintf(stderr, "Finds the partitions of the protected root file "
+            "system on DISK and prints\nthem, with the roothash computed "
+            "from the verity hash device, as shell\nvariable assignments.\n");
+        exit(1);
+    }
+
+    disk = argv[1];
+
+    /* Read the GUID partition table once */
+    if (gpt_open(disk, O_RDONLY, &gpt) < 0)
+        ERR("GUID partition table not found: %s", disk);
+
+    gpt_get_entries(gpt, entries, &num_entries);
+    gpt_close(gpt);
+
+    root_index = _find_entry(entries, num_entries, &linux_type_guid);
+    thin_data_index = _find_entry(entries, num_entries, &thin_data_type_guid);
+    thin_meta_index = _find_entry(entries, num_entries, &thin_meta_type_guid);
+
+    if (root_index >= 0)
+        _format_partition(linuxdev, disk, root_index);
+
+    if (thin_data_index >= 0 && thin_meta_index >= 0)
+    {
+        const gpt_entry_t* e = &entries[thin_data_index];
+
+        _format_partition(thindatadev, disk, thin_data_index);
+        _format_partition(thinmetadev, disk, thin_meta_index);
+        thin_data_sectors = gpt_entry_size(e) / GPT_SECTOR_SIZE;
+    }
+
+    if (root_index < 0 && !*thindatadev)
+        ERR("cannot find the root file system partition: %s", disk);
+
+    /* Prefer the hash device whose UUID names the Linux partition */
+    if ((hash_index = _find_hash_device(
+        disk, entries, num_entries, root_index, &roothash)) < 0 &&
+        (hash_index = _find_hash_device(
+        disk, entries, num_entries, -1, &roothash)) < 0)
+    {
+        ERR("cannot find the verity hash device: %s", disk);
+    }
+
+    _format_partition(hashdev, disk, hash_index);
+    sha256_format(&str, &roothash);
+    _get_efi_roothash(efi_roothash);
+
+    printf("linuxdev=%s\n", linuxdev);
+    printf("thindatadev=%s\n", thindatadev);
+    printf("thinmetadev=%s\n", thinmetadev);
+    printf("thindatasectors=%zu\n", thin_data_sectors);
+    printf("hashdev=%s\n", hashdev);
+    printf("roothash=%s\n", str.buf);
+    printf("efiroothash=%s\n", efi_roothash);
+
+    return 0;
+}
@@ -4,49 +4,87 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include "unaligned.h"
 
+/* All loads of a region happen before the overlapping tail store, so this
+ * is also safe for forward overlapping copies (dest < src) as used by
+ * memmove().
+ */
 void* memcpy(void* dest, const void* src, size_t n)
 {
     uint8_t* p = (uint8_t*)dest;
     const uint8_t* q = (const uint8_t*)src;
 
-    /* if dest and src are 8-byte aligned */
-    if (((uint64_t)p & 0x0000000000000007) == 0 &&
-        ((uint64_t)q & 0x0000000000000007) == 0)
+    /* 0 to 16 bytes: two possibly overlapping moves */
+    if (n <= 16)
     {
-        uint64_t* pp = (uint64_t*)p;
-        const uint64_t* qq = (const uint64_t*)q;
-        size_t nn = n / 8;
-
-#ifdef USE_LOOP_UNROLLING
-
-        while (nn >= 8)
+        if (n >= 8)
         {
-            pp[0] = qq[0];
-            pp[1] = qq[1];
-            pp[2] = qq[2];
-            pp[3] = qq[3];
-            pp[4] = qq[4];
-            pp[5] = qq[5];
-            pp[6] = qq[6];
-            pp[7] = qq[7];
-            pp += 8;
-            qq += 8;
-            nn -= 8;
+            const uint64_t head = load64(q);
+            const uint64_t tail = load64(q + n - 8);
+            store64(p, head);
+            store64(p + n - 8, tail);
+        }
+        else if (n >= 4)
+        {
+            const uint32_t head = load32(q);
+            const uint32_t tail = load32(q + n - 4);
+            store32(p, head);
+            store32(p + n - 4, tail);
+        }
+        else if (n)
+        {
+            const uint8_t a = q[0];
+            const uint8_t b = q[n / 2];
+            const uint8_t c = q[n - 1];
+            p[0] = a;
+            p[n / 2] = b;
+            p[n - 1] = c;
         }
 
-#endif /* USE_LOOP_UNROLLING */
+        return dest;
+    }
 
-        while (nn--)
-            *pp++ = *qq++;
+    /* Large copies: rep movsb is fastest on CPUs with ERMS */
+    if (n >= REP_MOVSB_THRESHOLD)
+    {
+        __asm__ __volatile__(
+            "rep movsb"
+            : "+D"(p), "+S"(q), "+c"(n)
+            :
+            : "memory");
 
-        n %= 8;
-        p = (uint8_t*)pp;
-        q = (const uint8_t*)qq;
+        return dest;
     }
 
-    while (n--)
-        *p++ = *q++;
+    /* 17 bytes and up: 16-byte moves with an overlapping final move */
+    {
+        const v16 tail = load128(q + n - 16);
+        uint8_t* end = p + n - 16;
+
+        while (end - p >= 64)
+        {
+            const v16 x0 = load128(q);
+            const v16 x1 = load128(q + 16);
+            const v16 x2 = load128(q + 32);
+            const v16 x3 = load128(q + 48);
+            store128(p, x0);
+            store128(p + 16, x1);
+            store128(p + 32, x2);
+            store128(p + 48, x3);
+            p += 64;
+            q += 64;
+        }
+
+        while (p < end)
+        {
+            store128(p, load128(q));
+            p += 16;
+            q += 16;
+        }
+
+        store128(end, tail);
+    }
 
     return dest;
 }
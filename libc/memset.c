@@ -4,56 +4,60 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include "unaligned.h"
 
 void* memset(void* s, int c, size_t n)
 {
     uint8_t* p = (uint8_t*)s;
+    const uint64_t cc = 0x0101010101010101ULL * (uint8_t)c;
 
-    /* copy while more bytes and not 8-byte aligned */
-    while (n && (((ptrdiff_t)p) & 0x000000000000000f))
+    /* 0 to 16 bytes: two possibly overlapping stores */
+    if (n <= 16)
     {
-        *p++ = (uint8_t)c;
-        n--;
+        if (n >= 8)
+        {
+            store64(p, cc);
+            store64(p + n - 8, cc);
+        }
+        else if (n >= 4)
+        {
+            store32(p, (uint32_t)cc);
+            store32(p + n - 4, (uint32_t)cc);
+        }
+        else if (n)
+        {
+            p[0] = (uint8_t)c;
+            p[n / 2] = (uint8_t)c;
+            p[n - 1] = (uint8_t)c;
+        }
+
+        return s;
     }
 
-    /* if more bytes and p is 8-byte aligned */
-    if (n > sizeof(__uint128_t) && ((ptrdiff_t)p & 0x000000000000000f) == 0)
+    /* Large fills: rep stosb is fastest on CPUs with ERMS */
+    if (n >= REP_STOSB_THRESHOLD)
     {
-        __uint128_t* pp = (__uint128_t*)p;
-        size_t nn = n / sizeof(__uint128_t);
-        __uint128_t cc;
+        __asm__ __volatile__(
+            "rep stosb"
+            : "+D"(p), "+c"(n)
+            : "a"(c)
+            : "memory");
 
-        memset(&cc, c, sizeof(cc));
+        return s;
+    }
 
-        while (nn > 8)
-        {
-            pp[0] = cc;
-            pp[1] = cc;
-            pp[2] = cc;
-            pp[3] = cc;
-            pp[4] = cc;
-            pp[5] = cc;
-            pp[6] = cc;
-            pp[7] = cc;
-            pp += 8;
-            nn -= 8;
-        }
+    /* 17 bytes and up: 16-byte stores with an overlapping final store */
+    {
+        const v16 v = (v16)(v2u64){ cc, cc };
+        uint8_t* end = p + n - 16;
 
-        while (nn > 0)
+        while (p < end)
         {
-            *pp++ = cc;
-            nn--;
+            store128(p, v);
+            p += 16;
         }
 
-        p = (uint8_t*)pp;
-        n %= sizeof(__uint128_t);
-    }
-
-    /* handle remaining bytes if any */
-    while (n > 0)
-    {
-        *p++ = (uint8_t)c;
-        n--;
+        store128(end, v);
     }
 
     return s;
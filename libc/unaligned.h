@@ -0,0 +1,54 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_LIBC_UNALIGNED_H
+#define _CVMBOOT_LIBC_UNALIGNED_H
+
+#include <stdint.h>
+
+/* Unaligned, alias-safe accessors used by memcpy(), memset() and memcmp().
+ * These compile to single mov/movdqu instructions on x86-64 and never call
+ * back into memcpy().
+ */
+
+typedef uint32_t u32_u __attribute__((aligned(1), may_alias));
+typedef uint64_t u64_u __attribute__((aligned(1), may_alias));
+typedef char v16_u __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char v16 __attribute__((vector_size(16)));
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+
+/* Sizes at or above which rep movsb/stosb beats the SSE2 loops (ERMS) */
+#define REP_MOVSB_THRESHOLD 512
+#define REP_STOSB_THRESHOLD 512
+
+static __inline__ uint32_t load32(const void* p)
+{
+    return *(const u32_u*)p;
+}
+
+static __inline__ void store32(void* p, uint32_t x)
+{
+    *(u32_u*)p = x;
+}
+
+static __inline__ uint64_t load64(const void* p)
+{
+    return *(const u64_u*)p;
+}
+
+static __inline__ void store64(void* p, uint64_t x)
+{
+    *(u64_u*)p = x;
+}
+
+static __inline__ v16 load128(const void* p)
+{
+    return (v16)*(const v16_u*)p;
+}
+
+static __inline__ void store128(void* p, v16 x)
+{
+    *(v16_u*)p = x;
+}
+
+#endif /* _CVMBOOT_LIBC_UNALIGNED_H */
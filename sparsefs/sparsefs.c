@@ -18,6 +18,8 @@
 #include <dirent.h>
 #include <fuse.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include <common/strings.h>
 
@@ -39,6 +41,8 @@ typedef struct options
     int help; /* print help/usage message if non-zero */
     int trace; /* enable tracing if non-zero */
     int foreground; /* run in the foreground if non-zero */
+    int digest; /* compute shasha256 digests of written files if non-zero */
+    unsigned int stats_interval; /* seconds between statistics dumps */
 }
 options_t;
 
@@ -46,11 +50,51 @@ static options_t _options;
 
 #define FILE_HANDLE_MAGIC 0xd32dc6db1ddd4622
 
+/* leaf block size of the shasha256 digest (see cvmdisk/shasha256.c) */
+#define DIGEST_BLOCK_SIZE 4096
+
+/* suffix of the sidecar file that holds the shasha256 digest */
+#define DIGEST_SUFFIX ".shasha256"
+
+/* number of leaves hashed between acquisitions of the digest lock */
+#define DIGEST_BATCH_SIZE 64
+
+typedef enum leaf_state
+{
+    LEAF_UNSET = 0, /* never written: hole or pre-existing data */
+    LEAF_FULL, /* leaf hash is valid */
+    LEAF_DIRTY, /* partially written: must be rehashed from the file */
+}
+leaf_state_t;
+
+typedef uint8_t leaf_t[SHA256_DIGEST_LENGTH];
+
+/* in-memory shasha256 leaf array shared by all handles of one file */
+typedef struct _digest
+{
+    struct _digest* next;
+    char* path;
+    size_t refs;
+    pthread_mutex_t lock;
+    uint8_t* states; /* leaf_state_t for each block */
+    leaf_t* leaves;
+    size_t capacity; /* number of blocks in states[] and leaves[] */
+    bool dirty; /* written since the last digest was emitted */
+}
+digest_t;
+
+static digest_t* _digests;
+static pthread_mutex_t _digests_lock = PTHREAD_MUTEX_INITIALIZER;
+static leaf_t _zero_leaf;
+
 typedef struct _file_handle
 {
     uint64_t magic;
     int fd;
     size_t peak; /* peak zero-write */
+    digest_t* digest; /* null unless digests are enabled for this file */
+    char* stats; /* snapshot of the statistics file (fd is -1) */
+    size_t stats_size;
 }
 file_handle_t;
 
@@ -61,6 +105,8 @@ static const struct fuse_opt _fuse_opts[] =
     {"-t", offsetof(options_t, trace), 1},
     {"--trace", offsetof(options_t, trace), 1},
     {"-f", offsetof(options_t, foreground), 1},
+    {"--digest", offsetof(options_t, digest), 1},
+    {"--stats-interval=%u", offsetof(options_t, stats_interval), 0},
     FUSE_OPT_END
 };
 
@@ -162,10 +208,624 @@ done:
     return ret;
 }
 
+/*
+**==============================================================================
+**
+** runtime statistics:
+**
+**     Each thread accumulates counters into its own stats_t without locking.
+**     Snapshots sum the live per-thread counters together with the counters
+**     of threads that have already exited. The snapshot is exposed through
+**     the read-only virtual file STATS_PATH at the root of the mount.
+**
+**==============================================================================
+*/
+
+#define STATS_PATH "/.sparsefs-stats"
+
+/* latency bucket i counts operations that took [2^i, 2^(i+1)) nanoseconds */
+#define STATS_NUM_BUCKETS 32
+
+typedef enum stats_op
+{
+    STATS_OP_GETATTR,
+    STATS_OP_OPENDIR,
+    STATS_OP_READDIR,
+    STATS_OP_RELEASEDIR,
+    STATS_OP_CREATE,
+    STATS_OP_OPEN,
+    STATS_OP_FLUSH,
+    STATS_OP_RELEASE,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_LSEEK,
+    STATS_OP_READLINK,
+    STATS_OP_UTIMENS,
+    STATS_OP_UNLINK,
+    STATS_OP_TRUNCATE,
+    STATS_OP_RENAME,
+    STATS_NUM_OPS,
+}
+stats_op_t;
+
+static const char* _stats_op_names[STATS_NUM_OPS] =
+{
+    "getattr",
+    "opendir",
+    "readdir",
+    "releasedir",
+    "create",
+    "open",
+    "flush",
+    "release",
+    "read",
+    "write",
+    "lseek",
+    "readlink",
+    "utimens",
+    "unlink",
+    "truncate",
+    "rename",
+};
+
+typedef struct stats_op_counters
+{
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t buckets[STATS_NUM_BUCKETS];
+}
+stats_op_counters_t;
+
+typedef struct _stats
+{
+    struct _stats* next;
+    stats_op_counters_t ops[STATS_NUM_OPS];
+    uint64_t bytes_read;
+    uint64_t bytes_written; /* bytes written to the base file as data */
+    uint64_t bytes_punched; /* zero bytes punched out as holes */
+    uint64_t bytes_extended; /* zero bytes appended with ftruncate() */
+    uint64_t fallocate_calls;
+    uint64_t ftruncate_calls;
+}
+stats_t;
+
+static stats_t* _stats_threads; /* per-thread counters of live threads */
+static stats_t _stats_retired; /* sum of counters of exited threads */
+static pthread_mutex_t _stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _stats_key;
+static __thread stats_t* _stats_self;
+static uint64_t _stats_start_time;
+
+static pthread_t _stats_thread;
+static bool _stats_thread_started;
+static bool _stats_thread_stop;
+static pthread_cond_t _stats_cond = PTHREAD_COND_INITIALIZER;
+
+static inline uint64_t _stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* counters have a single writer, so a relaxed store avoids locked adds */
+static inline void _stats_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t _stats_load(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void _stats_sum(stats_t* sum, const stats_t* s)
+{
+    const uint64_t* src = (const uint64_t*)s->ops;
+    uint64_t* dest = (uint64_t*)sum->ops;
+    const size_t n = (sizeof(stats_t) - offsetof(stats_t, ops)) /
+        sizeof(uint64_t);
+
+    for (size_t i = 0; i < n; i++)
+        dest[i] += _stats_load(&src[i]);
+}
+
+/* fold the counters of an exiting thread into _stats_retired */
+static void _stats_thread_exit(void* arg)
+{
+    stats_t* s = (stats_t*)arg;
+
+    pthread_mutex_lock(&_stats_lock);
+    {
+        for (stats_t** p = &_stats_threads; *p; p = &(*p)->next)
+        {
+            if (*p == s)
+            {
+                *p = s->next;
+                break;
+            }
+        }
+
+        _stats_sum(&_stats_retired, s);
+    }
+    pthread_mutex_unlock(&_stats_lock);
+
+    free(s);
+}
+
+/* get the counters of the calling thread (null if out of memory) */
+static stats_t* _stats_get(void)
+{
+    stats_t* s;
+
+    if ((s = _stats_self))
+        return s;
+
+    if (!(s = calloc(1, sizeof(stats_t))))
+        return NULL;
+
+    pthread_mutex_lock(&_stats_lock);
+    s->next = _stats_threads;
+    _stats_threads = s;
+    pthread_mutex_unlock(&_stats_lock);
+
+    pthread_setspecific(_stats_key, s);
+    _stats_self = s;
+
+    return s;
+}
+
+/* record completion of a FUSE operation that started at the given time */
+static void _stats_op(stats_op_t op, uint64_t start, int ret)
+{
+    stats_t* s;
+    stats_op_counters_t* c;
+    uint64_t ns = _stats_now() - start;
+    size_t bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    if (!(s = _stats_get()))
+        return;
+
+    if (bucket >= STATS_NUM_BUCKETS)
+        bucket = STATS_NUM_BUCKETS - 1;
+
+    c = &s->ops[op];
+    _stats_add(&c->count, 1);
+    _stats_add(&c->total_ns, ns);
+    _stats_add(&c->buckets[bucket], 1);
+
+    if (ret < 0)
+        _stats_add(&c->errors, 1);
+}
+
+/* account for I/O against the base file (by member offset in stats_t) */
+static void _stats_io(size_t offset, uint64_t n)
+{
+    stats_t* s;
+
+    if ((s = _stats_get()))
+        _stats_add((uint64_t*)((uint8_t*)s + offset), n);
+}
+
+#define STATS_IO(FIELD, N) _stats_io(offsetof(stats_t, FIELD), N)
+
+/* format a snapshot of all counters as a single-line JSON object */
+static int _stats_format(char** data_out, size_t* size_out)
+{
+    stats_t sum;
+    FILE* os;
+
+    memset(&sum, 0, sizeof(sum));
+
+    pthread_mutex_lock(&_stats_lock);
+    {
+        _stats_sum(&sum, &_stats_retired);
+
+        for (const stats_t* s = _stats_threads; s; s = s->next)
+            _stats_sum(&sum, s);
+    }
+    pthread_mutex_unlock(&_stats_lock);
+
+    if (!(os = open_memstream(data_out, size_out)))
+        return -ENOMEM;
+
+    fprintf(os, "{\"uptime_ns\":%lu", _stats_now() - _stats_start_time);
+    fprintf(os, ",\"bytes_read\":%lu", sum.bytes_read);
+    fprintf(os, ",\"bytes_written\":%lu", sum.bytes_written);
+    fprintf(os, ",\"bytes_punched\":%lu", sum.bytes_punched);
+    fprintf(os, ",\"bytes_extended\":%lu", sum.bytes_extended);
+    fprintf(os, ",\"fallocate_calls\":%lu", sum.fallocate_calls);
+    fprintf(os, ",\"ftruncate_calls\":%lu", sum.ftruncate_calls);
+    fprintf(os, ",\"ops\":{");
+
+    for (size_t i = 0; i < STATS_NUM_OPS; i++)
+    {
+        const stats_op_counters_t* c = &sum.ops[i];
+        size_t nbuckets = STATS_NUM_BUCKETS;
+
+        /* omit the trailing empty buckets */
+        while (nbuckets > 0 && c->buckets[nbuckets - 1] == 0)
+            nbuckets--;
+
+        fprintf(os, "%s\"%s\":{", i ? "," : "", _stats_op_names[i]);
+        fprintf(os, "\"count\":%lu", c->count);
+        fprintf(os, ",\"errors\":%lu", c->errors);
+        fprintf(os, ",\"total_ns\":%lu", c->total_ns);
+        fprintf(os, ",\"log2_ns_histogram\":[");
+
+        for (size_t j = 0; j < nbuckets; j++)
+            fprintf(os, "%s%lu", j ? "," : "", c->buckets[j]);
+
+        fprintf(os, "]}");
+    }
+
+    fprintf(os, "}}\n");
+
+    if (fclose(os) != 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static void _stats_dump(void)
+{
+    char* data = NULL;
+    size_t size;
+
+    if (_stats_format(&data, &size) == 0)
+    {
+        fwrite(data, 1, size, stdout);
+        fflush(stdout);
+    }
+
+    free(data);
+}
+
+/* dump the counters to standard output every --stats-interval seconds */
+static void* _stats_thread_main(void* arg)
+{
+    pthread_mutex_lock(&_stats_lock);
+
+    while (!_stats_thread_stop)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += _options.stats_interval;
+
+        if (pthread_cond_timedwait(&_stats_cond, &_stats_lock, &ts) == 0)
+            continue;
+
+        pthread_mutex_unlock(&_stats_lock);
+        _stats_dump();
+        pthread_mutex_lock(&_stats_lock);
+    }
+
+    pthread_mutex_unlock(&_stats_lock);
+
+    return NULL;
+}
+
+static bool _is_stats_path(const char* path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+/* find or create the digest for the given file and take a reference */
+static digest_t* _digest_acquire(const char* fullpath, bool truncate)
+{
+    digest_t* d;
+
+    pthread_mutex_lock(&_digests_lock);
+
+    for (d = _digests; d; d = d->next)
+    {
+        if (strcmp(d->path, fullpath) == 0)
+        {
+            d->refs++;
+            goto done;
+        }
+    }
+
+    if (!(d = calloc(1, sizeof(digest_t))))
+        goto done;
+
+    if (!(d->path = strdup(fullpath)))
+    {
+        free(d);
+        d = NULL;
+        goto done;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    d->refs = 1;
+    d->next = _digests;
+    _digests = d;
+
+done:
+
+    /* a truncated file starts over with an empty leaf array */
+    if (d && truncate)
+    {
+        pthread_mutex_lock(&d->lock);
+        if (d->capacity)
+            memset(d->states, LEAF_UNSET, d->capacity);
+        d->dirty = true;
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    pthread_mutex_unlock(&_digests_lock);
+    return d;
+}
+
+/* grow the leaf array to hold at least n blocks (called with d->lock held) */
+static int _digest_reserve(digest_t* d, size_t n)
+{
+    size_t capacity = d->capacity ? d->capacity : 1024;
+    uint8_t* states;
+    leaf_t* leaves;
+
+    if (n <= d->capacity)
+        return 0;
+
+    while (capacity < n)
+        capacity *= 2;
+
+    if (!(states = realloc(d->states, capacity)))
+        return -ENOMEM;
+
+    d->states = states;
+    memset(d->states + d->capacity, LEAF_UNSET, capacity - d->capacity);
+
+    if (!(leaves = realloc(d->leaves, capacity * sizeof(leaf_t))))
+        return -ENOMEM;
+
+    d->leaves = leaves;
+    d->capacity = capacity;
+
+    return 0;
+}
+
+/* record the leaf hashes of a write that landed at the given offset */
+static int _digest_update(
+    digest_t* d,
+    const void* data,
+    size_t size,
+    off_t offset)
+{
+    int ret = 0;
+    const size_t bs = DIGEST_BLOCK_SIZE;
+    const size_t lo = offset / bs; /* first block touched */
+    const size_t hi = (offset + size + bs - 1) / bs; /* past last touched */
+    const size_t first = (offset + bs - 1) / bs; /* first full block */
+    const size_t end = (offset + size) / bs; /* past last full block */
+    leaf_t batch[DIGEST_BATCH_SIZE];
+
+    if (size == 0)
+        return 0;
+
+    pthread_mutex_lock(&d->lock);
+    {
+        if ((ret = _digest_reserve(d, hi)) < 0)
+        {
+            pthread_mutex_unlock(&d->lock);
+            goto done;
+        }
+
+        /* partially written blocks are rehashed from the file later */
+        if (lo < first || first >= end)
+            d->states[lo] = LEAF_DIRTY;
+
+        if (end < hi)
+            d->states[hi - 1] = LEAF_DIRTY;
+
+        d->dirty = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    /* hash the full blocks outside the lock, one batch at a time */
+    for (size_t blk = first; blk < end; )
+    {
+        size_t n = end - blk;
+
+        if (n > DIGEST_BATCH_SIZE)
+            n = DIGEST_BATCH_SIZE;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            const uint8_t* p = (const uint8_t*)data + (blk + i) * bs - offset;
+
+            if (all_zeros(p, bs))
+                memcpy(batch[i], _zero_leaf, sizeof(leaf_t));
+            else
+                SHA256(p, bs, batch[i]);
+        }
+
+        pthread_mutex_lock(&d->lock);
+        memcpy(&d->leaves[blk], batch, n * sizeof(leaf_t));
+        memset(&d->states[blk], LEAF_FULL, n);
+        pthread_mutex_unlock(&d->lock);
+
+        blk += n;
+    }
+
+done:
+    return ret;
+}
+
+/* compute the shasha256 digest of the file from the leaf array */
+static int _digest_compute(digest_t* d, int fd, uint8_t hash[32])
+{
+    int ret = 0;
+    const size_t bs = DIGEST_BLOCK_SIZE;
+    struct stat statbuf;
+    size_t nblocks;
+    size_t rem;
+    off_t next_data = -1;
+    uint8_t buf[DIGEST_BLOCK_SIZE];
+    leaf_t leaf;
+    SHA256_CTX ctx;
+
+    if (fstat(fd, &statbuf) < 0)
+        return -errno;
+
+    nblocks = statbuf.st_size / bs;
+    rem = statbuf.st_size % bs;
+
+    SHA256_Init(&ctx);
+
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        const off_t off = i * bs;
+        const uint8_t state = (i < d->capacity) ? d->states[i] : LEAF_UNSET;
+
+        if (state == LEAF_FULL)
+        {
+            SHA256_Update(&ctx, d->leaves[i], sizeof(leaf_t));
+            continue;
+        }
+
+        /* unwritten blocks that lie within a hole are zero blocks */
+        if (state == LEAF_UNSET)
+        {
+            if (next_data < off)
+            {
+                if ((next_data = lseek(fd, off, SEEK_DATA)) < 0)
+                    next_data = (errno == ENXIO) ? statbuf.st_size : off;
+            }
+
+            if (next_data >= off + (off_t)bs)
+            {
+                SHA256_Update(&ctx, _zero_leaf, sizeof(leaf_t));
+                continue;
+            }
+        }
+
+        if ((ret = _readn(fd, buf, bs, off)) != bs)
+            return (ret < 0) ? ret : -EIO;
+
+        SHA256(buf, bs, leaf);
+        SHA256_Update(&ctx, leaf, sizeof(leaf_t));
+
+        if (i < d->capacity)
+        {
+            memcpy(d->leaves[i], leaf, sizeof(leaf_t));
+            d->states[i] = LEAF_FULL;
+        }
+    }
+
+    /* the final partial block is always rehashed from the file */
+    if (rem)
+    {
+        if ((ret = _readn(fd, buf, rem, nblocks * bs)) != rem)
+            return (ret < 0) ? ret : -EIO;
+
+        SHA256(buf, rem, leaf);
+
+        /* shasha256_final() folds in only sizeof(sha256_t*) bytes of the
+         * final leaf, so do the same to produce identical digests */
+        SHA256_Update(&ctx, leaf, sizeof(void*));
+    }
+
+    SHA256_Final(hash, &ctx);
+
+    return 0;
+}
+
+/* write the digest into the sidecar file if the file was written */
+static int _digest_emit(digest_t* d)
+{
+    int ret = 0;
+    int fd = -1;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    char sidecar[3*PATH_MAX];
+    FILE* os;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (!d->dirty)
+        goto done;
+
+    /* handles may be write-only (see creat()), so open a reader */
+    if ((fd = open(d->path, O_RDONLY)) < 0)
+    {
+        ret = -errno;
+        goto done;
+    }
+
+    if ((ret = _digest_compute(d, fd, hash)) < 0)
+        goto done;
+
+    snprintf(sidecar, sizeof(sidecar), "%s%s", d->path, DIGEST_SUFFIX);
+
+    if (!(os = fopen(sidecar, "w")))
+    {
+        ret = -errno;
+        goto done;
+    }
+
+    for (size_t i = 0; i < sizeof(hash); i++)
+        fprintf(os, "%02x", hash[i]);
+
+    fprintf(os, "\n");
+
+    if (fclose(os) != 0)
+    {
+        ret = -EIO;
+        goto done;
+    }
+
+    d->dirty = false;
+
+done:
+
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_unlock(&d->lock);
+    _trace("%s(): path=%s ret=%d\n", __FUNCTION__, d->path, ret);
+    return ret;
+}
+
+/* drop a reference to the digest and free it with the final reference */
+static void _digest_release(digest_t* d)
+{
+    pthread_mutex_lock(&_digests_lock);
+
+    if (--d->refs == 0)
+    {
+        for (digest_t** p = &_digests; *p; p = &(*p)->next)
+        {
+            if (*p == d)
+            {
+                *p = d->next;
+                break;
+            }
+        }
+
+        pthread_mutex_destroy(&d->lock);
+        free(d->states);
+        free(d->leaves);
+        free(d->path);
+        free(d);
+    }
+
+    pthread_mutex_unlock(&_digests_lock);
+}
+
 static void* _fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
 {
     cfg->kernel_cache = 1;
 
+    /* started here rather than in main() since fuse_main() may fork */
+    if (_options.stats_interval)
+    {
+        if (pthread_create(&_stats_thread, NULL, _stats_thread_main, NULL) == 0)
+            _stats_thread_started = true;
+    }
+
     return NULL;
 }
 
@@ -174,12 +834,24 @@ static int _fs_getattr(
     struct stat* statbuf,
     struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     char fullpath[3*PATH_MAX];
 
     _trace("%s(): path=%s\n", func, path);
 
+    /* the statistics file is generated on open, so report a zero size */
+    if (_is_stats_path(path))
+    {
+        memset(statbuf, 0, sizeof(struct stat));
+        statbuf->st_mode = S_IFREG | 0444;
+        statbuf->st_nlink = 1;
+        statbuf->st_uid = getuid();
+        statbuf->st_gid = getgid();
+        goto done;
+    }
+
     snprintf(fullpath, sizeof(fullpath), "%s/%s", basedir, path);
 
     if ((ret = stat(fullpath, statbuf)) < 0)
@@ -190,11 +862,13 @@ static int _fs_getattr(
 
 done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_GETATTR, start, ret);
     return ret;
 }
 
 static int _fs_opendir(const char* name, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     DIR* dir;
@@ -216,6 +890,7 @@ static int _fs_opendir(const char* name, struct fuse_file_info* fi)
 
 done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_OPENDIR, start, ret);
     return ret;
 }
 
@@ -228,6 +903,7 @@ static int _fs_readdir(
     struct fuse_file_info* fi,
     enum fuse_readdir_flags flags)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     struct dirent* ent;
@@ -246,11 +922,13 @@ static int _fs_readdir(
     }
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_READDIR, start, ret);
     return ret;
 }
 
 static int _fs_releasedir(const char* name, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     DIR* dir = (DIR*)fi->fh;
@@ -265,11 +943,13 @@ static int _fs_releasedir(const char* name, struct fuse_file_info* fi)
 
 done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_RELEASEDIR, start, ret);
     return ret;
 }
 
 static int _fs_create(const char * path, mode_t mode, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fullpath[3*PATH_MAX];
@@ -278,6 +958,12 @@ static int _fs_create(const char * path, mode_t mode, struct fuse_file_info* fi)
 
     _trace("%s(): path=%s mode=%u\n", func, path, mode);
 
+    if (_is_stats_path(path))
+    {
+        ret = -EACCES;
+        goto done;
+    }
+
     snprintf(fullpath, sizeof(fullpath), "%s/%s", basedir, path);
 
     if ((fd = creat(fullpath, mode)) < 0)
@@ -286,7 +972,7 @@ static int _fs_create(const char * path, mode_t mode, struct fuse_file_info* fi)
         goto done;
     }
 
-    if (!(fh = malloc(sizeof(file_handle_t))))
+    if (!(fh = calloc(1, sizeof(file_handle_t))))
     {
         ret = -ENOMEM;
         goto done;
@@ -296,19 +982,25 @@ static int _fs_create(const char * path, mode_t mode, struct fuse_file_info* fi)
     fh->fd = fd;
     fd = -1;
     fh->peak = 0;
+    fh->digest = NULL;
     fi->fh = (uint64_t)fh;
 
+    if (_options.digest)
+        fh->digest = _digest_acquire(fullpath, true);
+
 done:
 
     if (fd >= 0)
         close(fd);
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_CREATE, start, ret);
     return ret;
 }
 
 static int _fs_open(const char* path, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     int fd = -1;
@@ -317,6 +1009,36 @@ static int _fs_open(const char* path, struct fuse_file_info* fi)
 
     _trace("%s(): path=%s\n", func, path);
 
+    /* take a snapshot of the statistics for the reads that follow */
+    if (_is_stats_path(path))
+    {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        {
+            ret = -EACCES;
+            goto done;
+        }
+
+        if (!(fh = calloc(1, sizeof(file_handle_t))))
+        {
+            ret = -ENOMEM;
+            goto done;
+        }
+
+        if ((ret = _stats_format(&fh->stats, &fh->stats_size)) < 0)
+        {
+            free(fh);
+            goto done;
+        }
+
+        fh->magic = FILE_HANDLE_MAGIC;
+        fh->fd = -1;
+        fi->fh = (uint64_t)fh;
+
+        /* bypass the page cache since the reported size is zero */
+        fi->direct_io = 1;
+        goto done;
+    }
+
     snprintf(fullpath, sizeof(fullpath), "%s/%s", basedir, path);
 
     if ((fd = open(fullpath, fi->flags)) < 0)
@@ -325,7 +1047,7 @@ static int _fs_open(const char* path, struct fuse_file_info* fi)
         goto done;
     }
 
-    if (!(fh = malloc(sizeof(file_handle_t))))
+    if (!(fh = calloc(1, sizeof(file_handle_t))))
     {
         ret = -ENOMEM;
         goto done;
@@ -335,30 +1057,72 @@ static int _fs_open(const char* path, struct fuse_file_info* fi)
     fh->fd = fd;
     fd = -1;
     fh->peak = 0;
+    fh->digest = NULL;
     fi->fh = (uint64_t)fh;
 
+    if (_options.digest && (fi->flags & O_ACCMODE) != O_RDONLY)
+        fh->digest = _digest_acquire(fullpath, (fi->flags & O_TRUNC));
+
 done:
 
     if (fd >= 0)
         close(fd);
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_OPEN, start, ret);
+    return ret;
+}
+
+/* called on each close() of a file descriptor, before close() returns */
+static int _fs_flush(const char* path, struct fuse_file_info* fi)
+{
+    const uint64_t start = _stats_now();
+    const char* func = __FUNCTION__;
+    int ret = 0;
+    file_handle_t* fh = (file_handle_t*)fi->fh;
+
+    _trace("%s(): path=%s\n", func, path);
+
+    /* emit the digest here so it exists once the writer's close() returns */
+    if (fh->digest)
+        ret = _digest_emit(fh->digest);
+
+    _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_FLUSH, start, ret);
+
     return ret;
 }
 
 /* called when final reference to an open file is closed */
 static int _fs_release(const char* path, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     file_handle_t* fh = (file_handle_t*)fi->fh;
 
     _trace("%s(): path=%s\n", func, path);
 
+    if (fh->stats)
+    {
+        free(fh->stats);
+        free(fh);
+        goto done;
+    }
+
+    if (fh->digest)
+    {
+        _digest_emit(fh->digest);
+        _digest_release(fh->digest);
+        fh->digest = NULL;
+    }
+
     /* ATTN: extend file to maxsize */
     close(fh->fd);
 
+done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_RELEASE, start, ret);
 
     return ret;
 }
@@ -370,15 +1134,37 @@ static int _fs_read(
     off_t offset,
     struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     file_handle_t* fh = (file_handle_t*)fi->fh;
 
     _trace("%s(): path=%s size=%zu offset=%lu\n", func, path, size, offset);
 
-    ret = (int)_readn(fh->fd, buf, size, offset);
+    if (fh->stats)
+    {
+        size_t n = 0;
 
+        if (offset < fh->stats_size)
+        {
+            n = fh->stats_size - offset;
+
+            if (n > size)
+                n = size;
+
+            memcpy(buf, fh->stats + offset, n);
+        }
+
+        ret = (int)n;
+        goto done;
+    }
+
+    if ((ret = (int)_readn(fh->fd, buf, size, offset)) > 0)
+        STATS_IO(bytes_read, ret);
+
+done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_READ, start, ret);
 
     return ret;
 }
@@ -390,6 +1176,7 @@ static int _fs_write(
     off_t offset,
     struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     file_handle_t* fh = (file_handle_t*)fi->fh;
@@ -429,6 +1216,9 @@ static int _fs_write(
                     ret = r;
                     goto done;
                 }
+
+                STATS_IO(fallocate_calls, 1);
+                STATS_IO(bytes_punched, blksz);
             }
 
             if (extend)
@@ -438,13 +1228,22 @@ static int _fs_write(
                     ret = -errno;
                     goto done;
                 }
+
+                STATS_IO(ftruncate_calls, 1);
+                STATS_IO(bytes_extended, off + blksz - statbuf.st_size);
             }
+
+            r = blksz;
         }
         else if ((r = _writen(fh->fd, ptr, blksz, off)) < 0)
         {
             ret = r;
             goto done;
         }
+        else
+        {
+            STATS_IO(bytes_written, r);
+        }
 
         if (r != blksz)
         {
@@ -482,6 +1281,9 @@ static int _fs_write(
                     ret = r;
                     goto done;
                 }
+
+                STATS_IO(fallocate_calls, 1);
+                STATS_IO(bytes_punched, rem);
             }
 
             if (extend)
@@ -491,13 +1293,22 @@ static int _fs_write(
                     ret = -errno;
                     goto done;
                 }
+
+                STATS_IO(ftruncate_calls, 1);
+                STATS_IO(bytes_extended, off + rem - statbuf.st_size);
             }
+
+            r = rem;
         }
         else if ((r = _writen(fh->fd, ptr, rem, off)) < 0)
         {
             ret = r;
             goto done;
         }
+        else
+        {
+            STATS_IO(bytes_written, r);
+        }
 
         if (r != rem)
         {
@@ -511,13 +1322,24 @@ static int _fs_write(
 
     ret = (int)(off - offset);
 
+    if (fh->digest)
+    {
+        if ((r = _digest_update(fh->digest, buf, size, offset)) < 0)
+        {
+            ret = r;
+            goto done;
+        }
+    }
+
 done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_WRITE, start, ret);
     return ret;
 }
 
 static off_t _fs_lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     const char* func = __FUNCTION__;
     int ret = 0;
     file_handle_t* fh = (file_handle_t*)fi->fh;
@@ -532,11 +1354,13 @@ static off_t _fs_lseek(const char* path, off_t off, int whence, struct fuse_file
 
 done:
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_LSEEK, start, ret);
     return ret;
 }
 
 static int _fs_readlink(const char* path, char* buf, size_t bufsize)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fullpath[3*PATH_MAX];
@@ -549,6 +1373,7 @@ static int _fs_readlink(const char* path, char* buf, size_t bufsize)
         ret = -errno;
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_READLINK, start, ret);
     return ret;
 }
 
@@ -557,6 +1382,21 @@ static void _fs_destroy(void* private_data)
     const char* func = __FUNCTION__;
 
     _trace("%s(): private_data=%p\n", func, private_data);
+
+    if (_stats_thread_started)
+    {
+        pthread_mutex_lock(&_stats_lock);
+        _stats_thread_stop = true;
+        pthread_cond_signal(&_stats_cond);
+        pthread_mutex_unlock(&_stats_lock);
+
+        pthread_join(_stats_thread, NULL);
+        _stats_thread_started = false;
+
+        /* final dump so short runs still report something */
+        _stats_dump();
+    }
+
     _trace("%s(): ret=%d\n", func, 0);
 }
 
@@ -565,6 +1405,7 @@ static int _fs_utimens(
     const struct timespec tv[2],
     struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fullpath[3*PATH_MAX];
@@ -592,17 +1433,25 @@ done:
         close(fd);
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_UTIMENS, start, ret);
     return ret;
 }
 
 static int _fs_unlink(const char* path)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fullpath[3*PATH_MAX];
 
     _trace("%s(): path=%s\n", func, path);
 
+    if (_is_stats_path(path))
+    {
+        ret = -EACCES;
+        goto done;
+    }
+
     snprintf(fullpath, sizeof(fullpath), "%s/%s", basedir, path);
 
     if (unlink(fullpath))
@@ -614,11 +1463,13 @@ static int _fs_unlink(const char* path)
 done:
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_UNLINK, start, ret);
     return ret;
 }
 
 static int _fs_truncate(const char* path, off_t offset, struct fuse_file_info* fi)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fullpath[3*PATH_MAX];
@@ -636,11 +1487,13 @@ static int _fs_truncate(const char* path, off_t offset, struct fuse_file_info* f
 done:
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_TRUNCATE, start, ret);
     return ret;
 }
 
 static int _fs_rename(const char* oldpath, const char* newpath, unsigned int flags)
 {
+    const uint64_t start = _stats_now();
     int ret = 0;
     const char* func = __FUNCTION__;
     char fulloldpath[3*PATH_MAX];
@@ -660,6 +1513,7 @@ static int _fs_rename(const char* oldpath, const char* newpath, unsigned int fla
 done:
 
     _trace("%s(): ret=%d\n", func, ret);
+    _stats_op(STATS_OP_RENAME, start, ret);
     return ret;
 }
 
@@ -672,6 +1526,7 @@ static const struct fuse_operations _operations =
     .releasedir = _fs_releasedir,
     .open = _fs_open,
     .create = _fs_create,
+    .flush = _fs_flush,
     .release = _fs_release,
     .read = _fs_read,
     .write = _fs_write,
@@ -689,6 +1544,10 @@ static const struct fuse_operations _operations =
     "\n"                                                                  \
     "File-system specific options:\n"                                     \
     "    -t  --trace            enable file-system specific tracing\n"    \
+    "    --digest               write the shasha256 digest of each written\n" \
+    "                           file to <file>" DIGEST_SUFFIX " on close\n"   \
+    "    --stats-interval=<n>   print the statistics in " STATS_PATH "\n"     \
+    "                           as JSON every <n> seconds (use with -f)\n"   \
     "\n"
 
 __attribute__((__unused__))
@@ -715,6 +1574,16 @@ int main(int argc, const char* argv[])
 
     arg0 = argv[0];
 
+    _stats_start_time = _stats_now();
+    pthread_key_create(&_stats_key, _stats_thread_exit);
+
+    /* leaf hash of an all-zero block */
+    {
+        uint8_t zeros[DIGEST_BLOCK_SIZE];
+        memset(zeros, 0, sizeof(zeros));
+        SHA256(zeros, sizeof(zeros), _zero_leaf);
+    }
+
     /* Parse options */
     if (fuse_opt_parse(&args, &_options, _fuse_opts, NULL) == -1)
         goto done;
@@ -0,0 +1,380 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <utils/allocator.h>
+#include <cvmdisk/gpt.h>
+#include <cvmdisk/guid.h>
+#include <cvmdisk/frags.h>
+#include <cvmdisk/boottrace.h>
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** bootlayout: replays a boot trace against the thin data partition laid out
+** two ways -- in disk-offset order (as before) and in first-read order (with
+** cvmdisk --boot-trace) -- and reports the read locality of each. The thin
+** pool is modeled as allocating data blocks in the order first written, which
+** holds exactly since frags_copy() writes out each thin block before the next.
+**
+**     bootlayout                   -- synthesize a rootfs and trace; check
+**     bootlayout TRACE DISK        -- replay a recorded trace for DISK
+**
+**==============================================================================
+*/
+
+#define TRACE_PATH "bootlayout.trace"
+
+/* a thin block size that cvmdisk may choose (--thin-block-size=512) */
+#define THIN_BLOCK_SIZE (1024 * 512)
+
+#define PAGE_SIZE 4096
+
+/* a seek further than this is counted as far (one thin block and beyond) */
+#define FAR_SEEK (1024 * 1024)
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "bootlayout: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static uint64_t _xorshift(uint64_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+typedef struct locality
+{
+    size_t reads;
+    size_t seeks;
+    size_t far_seeks;
+    size_t distance;
+}
+locality_t;
+
+/* model the thin pool: number each block in the order it is first written */
+static size_t* _place(const frag_list_t* list, size_t start, size_t end)
+{
+    const size_t num_blocks = (end - start + THIN_BLOCK_SIZE - 1) /
+        THIN_BLOCK_SIZE;
+    size_t* slots;
+    size_t next = 0;
+
+    if (!(slots = malloc(num_blocks * sizeof(size_t))))
+        _fail("out of memory");
+
+    memset(slots, 0xff, num_blocks * sizeof(size_t));
+
+    for (const frag_t* p = list->head; p; p = p->next)
+    {
+        size_t x = p->offset < start ? start : p->offset;
+        size_t y = p->offset + p->length > end ? end : p->offset + p->length;
+        size_t first;
+        size_t last;
+
+        if (x >= y)
+            continue;
+
+        first = (x - start) / THIN_BLOCK_SIZE;
+        last = (y - 1 - start) / THIN_BLOCK_SIZE;
+
+        for (size_t b = first; b <= last; b++)
+        {
+            if (slots[b] == SIZE_MAX)
+                slots[b] = next++;
+        }
+    }
+
+    return slots;
+}
+
+/* replay the reads against the layout, one physical run per thin block */
+static void _replay(
+    const frag_list_t* reads,
+    const size_t* slots,
+    size_t num_blocks,
+    locality_t* loc)
+{
+    size_t prev_end = 0;
+    bool first = true;
+
+    memset(loc, 0, sizeof(locality_t));
+
+    for (const frag_t* p = reads->head; p; p = p->next)
+    {
+        size_t offset = p->offset;
+        size_t end = p->offset + p->length;
+
+        while (offset < end)
+        {
+            const size_t b = offset / THIN_BLOCK_SIZE;
+            size_t n = (b + 1) * THIN_BLOCK_SIZE - offset;
+            size_t phys;
+
+            if (n > end - offset)
+                n = end - offset;
+
+            /* unprovisioned blocks read as zeros without any I/O */
+            if (b < num_blocks && slots[b] != SIZE_MAX)
+            {
+                phys = slots[b] * THIN_BLOCK_SIZE + offset % THIN_BLOCK_SIZE;
+
+                if (!first && phys != prev_end)
+                {
+                    size_t d = phys > prev_end ?
+                        phys - prev_end : prev_end - phys;
+
+                    loc->seeks++;
+                    loc->distance += d;
+
+                    if (d >= FAR_SEEK)
+                        loc->far_seeks++;
+                }
+
+                loc->reads++;
+                prev_end = phys + n;
+                first = false;
+            }
+
+            offset += n;
+        }
+    }
+}
+
+static void _print(const char* layout, const locality_t* loc)
+{
+    double mean = loc->seeks ? (double)loc->distance / loc->seeks : 0;
+
+    printf("%-12s %10zu %10zu %10zu %14.1f\n", layout,
+        loc->reads, loc->seeks, loc->far_seeks, mean / 1024);
+}
+
+/* mark the 4 KiB pages of the fragments, failing on any overlap */
+static uint8_t* _mark(const frag_list_t* list, size_t start, size_t end)
+{
+    const size_t num_pages = (end - start) / PAGE_SIZE;
+    uint8_t* pages;
+
+    if (!(pages = calloc(num_pages, 1)))
+        _fail("out of memory");
+
+    for (const frag_t* p = list->head; p; p = p->next)
+    {
+        size_t x = p->offset < start ? start : p->offset;
+        size_t y = p->offset + p->length > end ? end : p->offset + p->length;
+
+        for (size_t i = x; i < y; i += PAGE_SIZE)
+        {
+            if (pages[(i - start) / PAGE_SIZE]++)
+                return NULL;
+        }
+    }
+
+    return pages;
+}
+
+/* write a boot-like trace: files read front to back, in scattered order, as
+ * tracefs lines, plus lines that must be ignored */
+static size_t _synthesize_trace(size_t size)
+{
+    FILE* os;
+    uint64_t seed = 0x2545f4914f6cdd1d;
+    size_t num_reads = 0;
+
+    if (!(os = fopen(TRACE_PATH, "w")))
+        _fail("cannot create trace");
+
+    fprintf(os, "# tracer: nop\n#\n");
+    fprintf(os, "  systemd-1 [000] ..... 2.1: block_bio_queue: "
+        "253,0 WS 4096 + 8 [systemd]\n");
+    fprintf(os, "  systemd-1 [000] ..... 2.2: block_bio_queue: "
+        "8,0 R 4096 + 8 [systemd]\n");
+
+    for (size_t i = 0; i < 400; i++)
+    {
+        size_t sector = (_xorshift(&seed) % (size - (1 << 20))) / 512;
+        size_t left = 32 + _xorshift(&seed) % 480;
+
+        sector &= ~(size_t)7;
+
+        while (left > 0)
+        {
+            size_t n = left < 64 ? left : 64;
+
+            fprintf(os, "  systemd-1 [000] ..... 3.%zu: block_bio_queue: "
+                "253,0 RA %zu + %zu [systemd]\n", i, sector, n);
+            sector += n;
+            left -= n;
+            num_reads++;
+        }
+    }
+
+    fclose(os);
+
+    return num_reads;
+}
+
+static void _report(
+    const frag_list_t* frags,
+    size_t start,
+    size_t end,
+    const frag_list_t* reads,
+    locality_t* before,
+    locality_t* after)
+{
+    frag_list_t ordered;
+    size_t num_blocks = (end - start + THIN_BLOCK_SIZE - 1) / THIN_BLOCK_SIZE;
+    size_t* slots;
+
+    if (boottrace_order_frags(
+        frags, start, end, reads, THIN_BLOCK_SIZE, &ordered) < 0)
+    {
+        _fail("boottrace_order_frags()");
+    }
+
+    printf("%-12s %10s %10s %10s %14s\n",
+        "layout", "reads", "seeks", "far-seeks", "mean-seek-KiB");
+
+    slots = _place(frags, start, end);
+    _replay(reads, slots, num_blocks, before);
+    _print("offset", before);
+    free(slots);
+
+    slots = _place(&ordered, start, end);
+    _replay(reads, slots, num_blocks, after);
+    _print("boot-order", after);
+    free(slots);
+
+    /* the reordered list must copy exactly the same pages */
+    {
+        uint8_t* x = _mark(frags, start, end);
+        uint8_t* y = _mark(&ordered, start, end);
+
+        if (!x || !y)
+            _fail("fragments overlap");
+
+        if (memcmp(x, y, (end - start) / PAGE_SIZE) != 0)
+            _fail("reordered fragments cover different pages");
+
+        free(x);
+        free(y);
+    }
+
+    frags_release(&ordered);
+}
+
+static void _test(void)
+{
+    const size_t start = 1024 * 1024;
+    const size_t size = 1024 * 1024 * 1024;
+    frag_list_t frags = FRAG_LIST_INITIALIZER;
+    frag_list_t reads;
+    size_t num_reads;
+    locality_t before;
+    locality_t after;
+
+    /* a partly sparse rootfs: 768 KiB of data in every 1 MiB */
+    for (size_t i = 0; i < size; i += 1024 * 1024)
+    {
+        if (frags_append(&frags, start + i, 768 * 1024) < 0)
+            _fail("out of memory");
+    }
+
+    num_reads = _synthesize_trace(size);
+
+    if (boottrace_load(TRACE_PATH, &reads) < 0)
+        _fail("boottrace_load()");
+
+    /* the write and the read of the other device are skipped */
+    if (reads.size != num_reads)
+        _fail("unexpected number of reads in trace");
+
+    _report(&frags, start, start + size, &reads, &before, &after);
+
+    if (after.far_seeks * 4 > before.far_seeks)
+        _fail("boot-order layout did not improve read locality");
+
+    frags_release(&frags);
+    frags_release(&reads);
+
+    printf("=== passed bootlayout\n");
+}
+
+static void _bench(const char* trace, const char* disk)
+{
+    gpt_t* gpt;
+    gpt_entry_t entries[GPT_MAX_ENTRIES];
+    size_t num_entries;
+    frag_list_t frags;
+    frag_list_t holes;
+    frag_list_t reads;
+    locality_t before;
+    locality_t after;
+    size_t start = 0;
+    size_t end = 0;
+
+    if (gpt_open(disk, O_RDONLY, &gpt) < 0)
+        _fail("cannot read the GUID partition table");
+
+    gpt_get_entries(gpt, entries, &num_entries);
+    gpt_close(gpt);
+
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        guid_t guid;
+
+        guid_init_xy(&guid, entries[i].type_guid1, entries[i].type_guid2);
+
+        if (guid_equal(&guid, &linux_type_guid))
+        {
+            start = gpt_entry_offset(&entries[i]);
+            end = start + gpt_entry_size(&entries[i]);
+            break;
+        }
+    }
+
+    if (end == 0)
+        _fail("cannot find the Linux partition");
+
+    if (frags_find(disk, start, end, &frags, &holes) < 0)
+        _fail("frags_find()");
+
+    if (boottrace_load(trace, &reads) < 0)
+        _fail("boottrace_load()");
+
+    _report(&frags, start, end, &reads, &before, &after);
+
+    frags_release(&frags);
+    frags_release(&holes);
+    frags_release(&reads);
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc == 1)
+    {
+        _test();
+    }
+    else if (argc == 3)
+    {
+        _bench(argv[1], argv[2]);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s [TRACE DISK]\n", argv[0]);
+        exit(1);
+    }
+
+    return 0;
+}
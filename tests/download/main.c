@@ -0,0 +1,240 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <cvmdisk/download.h>
+#include <cvmdisk/http.h>
+#include <cvmdisk/sparse.h>
+
+#define SOURCE "source.img"
+#define DEST "dest.img"
+
+#define BLOCK_SIZE 4096
+
+/* 37 MiB plus a 512-byte tail, like a VHD footer */
+#define SOURCE_SIZE ((size_t)(37 * 1024 * 1024 + 512))
+
+#define CHUNK_SIZE ((size_t)(1024 * 1024))
+
+static int _port;
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "download: FAILED: %s\n", msg);
+    exit(1);
+}
+
+/* data blocks interleaved with long zero runs */
+static void _create_source(void)
+{
+    uint8_t* data;
+    FILE* os;
+
+    if (!(data = calloc(1, SOURCE_SIZE)))
+        _fail("out of memory");
+
+    srand(1234);
+
+    for (size_t i = 0; i < SOURCE_SIZE / BLOCK_SIZE; i++)
+    {
+        if ((i / 97) % 3 == 0 || i % 13 == 0)
+        {
+            for (size_t j = 0; j < BLOCK_SIZE; j++)
+                data[i * BLOCK_SIZE + j] = rand();
+        }
+    }
+
+    memset(data + SOURCE_SIZE - 512, 0xab, 512);
+
+    if (!(os = fopen(SOURCE, "w")))
+        _fail("cannot create " SOURCE);
+
+    if (fwrite(data, 1, SOURCE_SIZE, os) != SOURCE_SIZE)
+        _fail("cannot write " SOURCE);
+
+    fclose(os);
+    free(data);
+}
+
+static pid_t _start_server(const char* opt, const char* optarg)
+{
+    pid_t pid;
+    char port[16];
+    http_url_t url;
+    char urlstr[64];
+
+    snprintf(port, sizeof(port), "%d", _port);
+
+    if ((pid = fork()) < 0)
+        _fail("fork");
+
+    if (pid == 0)
+    {
+        if (opt)
+        {
+            execlp("python3", "python3", "server.py", "--port", port,
+                "--file", SOURCE, opt, optarg, NULL);
+        }
+        else
+        {
+            execlp("python3", "python3", "server.py", "--port", port,
+                "--file", SOURCE, NULL);
+        }
+
+        _exit(127);
+    }
+
+    /* wait for the server to accept connections */
+    snprintf(urlstr, sizeof(urlstr), "http://127.0.0.1:%d/", _port);
+    http_parse_url(urlstr, &url);
+
+    for (size_t i = 0; i < 100; i++)
+    {
+        http_conn_t* conn;
+
+        if (http_connect(&url, &conn) == 0)
+        {
+            http_close(conn);
+            return pid;
+        }
+
+        usleep(100000);
+    }
+
+    _fail("server did not start");
+    return -1;
+}
+
+static void _stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int _download(size_t connections, sha256_t* digest)
+{
+    download_options_t options;
+    char url[64];
+
+    options.connections = connections;
+    options.chunk_size = CHUNK_SIZE;
+    options.progress = false;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/blob?sv=1&sig=x", _port);
+
+    return download_file(url, DEST, &options, digest);
+}
+
+static void _check_dest(const sha256_t* digest)
+{
+    sha256_t expect;
+    struct stat st;
+    char cmd[256];
+
+    snprintf(cmd, sizeof(cmd), "cmp %s %s", SOURCE, DEST);
+
+    if (system(cmd) != 0)
+        _fail("downloaded file differs");
+
+    if (sparse_shasha256(SOURCE, &expect) < 0)
+        _fail("sparse_shasha256");
+
+    if (!sha256_equal(digest, &expect))
+        _fail("digest differs from sparse_shasha256()");
+
+    if (stat(DEST, &st) < 0)
+        _fail("stat " DEST);
+
+    /* more than half of the source blocks are zero */
+    if ((size_t)st.st_blocks * 512 > SOURCE_SIZE / 2)
+        _fail("zero blocks were not left as holes");
+
+    if (access(DEST DOWNLOAD_STATE_SUFFIX, F_OK) == 0)
+        _fail("state file was not removed");
+}
+
+static void _test_download(void)
+{
+    pid_t pid = _start_server(NULL, NULL);
+    sha256_t digest;
+
+    unlink(DEST);
+
+    if (_download(4, &digest) != 0)
+        _fail("download");
+
+    _check_dest(&digest);
+    _stop_server(pid);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_resume(void)
+{
+    pid_t pid;
+    sha256_t digest;
+
+    unlink(DEST);
+
+    /* the server stops granting access part way through */
+    pid = _start_server("--deny-after", "3");
+
+    if (_download(1, &digest) == 0)
+        _fail("download should have failed");
+
+    _stop_server(pid);
+
+    if (access(DEST DOWNLOAD_STATE_SUFFIX, F_OK) != 0)
+        _fail("state file is missing after failed download");
+
+    /* resume with a well-behaved server */
+    pid = _start_server(NULL, NULL);
+
+    if (_download(3, &digest) != 0)
+        _fail("resumed download");
+
+    _check_dest(&digest);
+    _stop_server(pid);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_dropped_connections(void)
+{
+    pid_t pid = _start_server("--drop-every", "5");
+    sha256_t digest;
+
+    unlink(DEST);
+
+    if (_download(8, &digest) != 0)
+        _fail("download with dropped connections");
+
+    _check_dest(&digest);
+    _stop_server(pid);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+int main(int argc, const char* argv[])
+{
+    _port = 20000 + (getpid() % 20000);
+
+    _create_source();
+    _test_download();
+    _test_resume();
+    _test_dropped_connections();
+
+    unlink(SOURCE);
+    unlink(DEST);
+
+    return 0;
+}
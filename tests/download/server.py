@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT License.
+
+# Local stand-in for a blob endpoint: serves one file over HTTP/1.1 with
+# keep-alive, byte-range GET requests and an ETag. Failure injection:
+#   --deny-after N   answer 403 to every range request after the first N
+#   --drop-every N   close the connection instead of answering every Nth
+#                    range request
+
+import argparse
+import hashlib
+import os
+import re
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+args = None
+lock = threading.Lock()
+count = 0
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *a):
+        pass
+
+    def do_GET(self):
+        global count
+        size = os.path.getsize(args.file)
+        m = re.fullmatch(r"bytes=(\d+)-(\d+)", self.headers.get("Range", ""))
+
+        if not m:
+            self.send_error(400)
+            return
+
+        with lock:
+            count += 1
+            n = count
+
+        if args.drop_every and n % args.drop_every == 0:
+            self.close_connection = True
+            return
+
+        if args.deny_after and n > args.deny_after:
+            self.send_response(403)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+
+        first = int(m.group(1))
+        last = min(int(m.group(2)), size - 1)
+
+        with open(args.file, "rb") as f:
+            f.seek(first)
+            data = f.read(last - first + 1)
+
+        self.send_response(206)
+        self.send_header("Content-Length", str(len(data)))
+        self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, size))
+        self.send_header("ETag", '"%s"' % etag)
+        self.end_headers()
+        self.wfile.write(data)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, required=True)
+    parser.add_argument("--file", required=True)
+    parser.add_argument("--deny-after", type=int, default=0)
+    parser.add_argument("--drop-every", type=int, default=0)
+    args = parser.parse_args()
+
+    st = os.stat(args.file)
+    etag = hashlib.sha256(b"%d:%d" % (st.st_size, st.st_mtime_ns)).hexdigest()
+
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+    server.daemon_threads = True
+    server.serve_forever()
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_TESTS_EFIEMU_EMU_H
+#define _CVMBOOT_TESTS_EFIEMU_EMU_H
+
+/*
+**==============================================================================
+**
+** Interface between the emulated firmware (libefi.c and services.c, built
+** against gnu-efi like the bootloader) and the host program (main.c, built
+** against glibc). Only plain C types may appear here.
+**
+**==============================================================================
+*/
+
+/* Emulated physical memory backing AllocatePages(). The bootloader truncates
+ * some addresses to 32 bits and keeps the initrd below 1 GiB, so this range
+ * is mapped at the same virtual address in the host process.
+ */
+#define EMU_MEMORY_BASE 0x01000000UL
+#define EMU_MEMORY_END 0x40000000UL
+
+#define EMU_MAX_PCRS 24
+#define EMU_MAX_EVENTS 64
+#define EMU_MAX_VARIABLES 16
+
+/* how a boot attempt ended (passed to siglongjmp) */
+#define EMU_EXIT_HANDOVER 1 /* reached the kernel handover */
+#define EMU_EXIT_RESET 2 /* the bootloader called ResetSystem() */
+#define EMU_EXIT_RETURN 3 /* efi_main() returned */
+
+/* provided by main.c */
+void* host_malloc(unsigned long size);
+void host_free(void* ptr);
+void host_write(const char* data, unsigned long size);
+int host_open(const char* path, int* is_directory, unsigned long* size);
+long host_read(int fd, void* data, unsigned long size);
+int host_seek(int fd, unsigned long offset);
+void host_close(int fd);
+void host_stall(unsigned long microseconds);
+void host_reset(void) __attribute__((__noreturn__));
+
+/* provided by services.c */
+void emu_init(const char* root);
+unsigned long emu_boot(void);
+const void* emu_get_variable(const char* name, unsigned long* size);
+void emu_get_pcr(unsigned int index, unsigned char digest[32]);
+int emu_get_event(
+    unsigned int index,
+    unsigned int* pcr,
+    unsigned char digest[32]);
+unsigned long emu_pages_in_use(void);
+
+#endif /* _CVMBOOT_TESTS_EFIEMU_EMU_H */
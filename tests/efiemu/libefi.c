@@ -0,0 +1,372 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+/*
+**==============================================================================
+**
+** Replacements for the parts of gnu-efi's libefi used by the bootloader.
+**
+** This file deliberately does not include <efilib.h> (whose prototypes vary
+** in constness across gnu-efi versions); the bootloader objects resolve these
+** symbols by name at link time.
+**
+**==============================================================================
+*/
+
+#include <efi.h>
+#include "emu.h"
+
+EFI_SYSTEM_TABLE* ST;
+EFI_BOOT_SERVICES* BS;
+EFI_RUNTIME_SERVICES* RT;
+
+VOID InitializeLib(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table)
+{
+    (void)image_handle;
+    ST = system_table;
+    BS = system_table->BootServices;
+    RT = system_table->RuntimeServices;
+}
+
+VOID* AllocatePool(UINTN size)
+{
+    VOID* ptr = NULL;
+
+    if (uefi_call_wrapper(
+        BS->AllocatePool, 3, EfiBootServicesData, size, &ptr) != EFI_SUCCESS)
+    {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+VOID FreePool(VOID* ptr)
+{
+    uefi_call_wrapper(BS->FreePool, 1, ptr);
+}
+
+VOID CopyMem(VOID* dest, const VOID* src, UINTN len)
+{
+    UINT8* p = dest;
+    const UINT8* q = src;
+
+    if (p < q)
+    {
+        while (len--)
+            *p++ = *q++;
+    }
+    else
+    {
+        while (len--)
+            p[len] = q[len];
+    }
+}
+
+EFI_STATUS WaitForSingleEvent(EFI_EVENT event, UINT64 timeout)
+{
+    UINTN index;
+
+    (void)timeout;
+    return uefi_call_wrapper(BS->WaitForEvent, 3, 1, &event, &index);
+}
+
+VOID Pause(VOID)
+{
+    EFI_INPUT_KEY key;
+
+    WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
+    uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &key);
+}
+
+/*
+**==============================================================================
+**
+** Print() supports the gnu-efi conversions used by the bootloader: %a (ASCII
+** string), %s (CHAR16 string), %c, %d, %u, %x, %X, %p, %r (EFI_STATUS), with
+** the 'l' (64-bit), '0', '-' and width modifiers. The attribute escapes (%E,
+** %H, %N, %B, %V) are ignored.
+**
+**==============================================================================
+*/
+
+typedef struct _output
+{
+    char buf[256];
+    UINTN len;
+    UINTN total;
+}
+output_t;
+
+static void _flush(output_t* out)
+{
+    host_write(out->buf, out->len);
+    out->len = 0;
+}
+
+static void _putc(output_t* out, char c)
+{
+    if (out->len == sizeof(out->buf))
+        _flush(out);
+
+    out->buf[out->len++] = c;
+    out->total++;
+}
+
+static void _pad(output_t* out, char c, UINTN n)
+{
+    while (n--)
+        _putc(out, c);
+}
+
+static void _puts(output_t* out, const char* s, UINTN width, BOOLEAN left)
+{
+    UINTN n = 0;
+
+    while (s[n])
+        n++;
+
+    if (!left && width > n)
+        _pad(out, ' ', width - n);
+
+    while (*s)
+        _putc(out, *s++);
+
+    if (left && width > n)
+        _pad(out, ' ', width - n);
+}
+
+static void _putw(output_t* out, const CHAR16* s, UINTN width, BOOLEAN left)
+{
+    UINTN n = 0;
+
+    while (s[n])
+        n++;
+
+    if (!left && width > n)
+        _pad(out, ' ', width - n);
+
+    while (*s)
+        _putc(out, (char)*s++);
+
+    if (left && width > n)
+        _pad(out, ' ', width - n);
+}
+
+static void _putn(
+    output_t* out,
+    UINT64 value,
+    BOOLEAN negative,
+    UINTN base,
+    BOOLEAN upper,
+    UINTN width,
+    char pad,
+    BOOLEAN left)
+{
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buf[24];
+    UINTN n = 0;
+    UINTN len;
+
+    do
+    {
+        buf[n++] = digits[value % base];
+        value /= base;
+    }
+    while (value);
+
+    len = n + (negative ? 1 : 0);
+
+    if (negative && pad == '0')
+        _putc(out, '-');
+
+    if (!left && width > len)
+        _pad(out, pad, width - len);
+
+    if (negative && pad != '0')
+        _putc(out, '-');
+
+    while (n)
+        _putc(out, buf[--n]);
+
+    if (left && width > len)
+        _pad(out, ' ', width - len);
+}
+
+static const char* _status_str(EFI_STATUS status)
+{
+    switch (status)
+    {
+        case EFI_SUCCESS:
+            return "Success";
+        case EFI_INVALID_PARAMETER:
+            return "Invalid Parameter";
+        case EFI_UNSUPPORTED:
+            return "Unsupported";
+        case EFI_BUFFER_TOO_SMALL:
+            return "Buffer Too Small";
+        case EFI_NOT_FOUND:
+            return "Not Found";
+        case EFI_OUT_OF_RESOURCES:
+            return "Out of Resources";
+        case EFI_DEVICE_ERROR:
+            return "Device Error";
+        default:
+            return NULL;
+    }
+}
+
+UINTN Print(const CHAR16* fmt, ...)
+{
+    output_t out;
+    __builtin_va_list ap;
+    const CHAR16* p;
+
+    out.len = 0;
+    out.total = 0;
+    __builtin_va_start(ap, fmt);
+
+    for (p = fmt; *p; p++)
+    {
+        BOOLEAN left = FALSE;
+        BOOLEAN is64 = FALSE;
+        char pad = ' ';
+        UINTN width = 0;
+
+        if (*p != '%')
+        {
+            _putc(&out, (char)*p);
+            continue;
+        }
+
+        p++;
+
+        /* flags */
+        for (;; p++)
+        {
+            if (*p == '-')
+                left = TRUE;
+            else if (*p == '0')
+                pad = '0';
+            else if (*p == ',')
+                ;
+            else
+                break;
+        }
+
+        /* width */
+        if (*p == '*')
+        {
+            width = __builtin_va_arg(ap, UINTN);
+            p++;
+        }
+        else
+        {
+            while (*p >= '0' && *p <= '9')
+                width = width * 10 + (*p++ - '0');
+        }
+
+        if (*p == 'l')
+        {
+            is64 = TRUE;
+            p++;
+        }
+
+        switch (*p)
+        {
+            case 'a':
+            {
+                const char* s = __builtin_va_arg(ap, const char*);
+                _puts(&out, s ? s : "(null)", width, left);
+                break;
+            }
+            case 's':
+            {
+                const CHAR16* s = __builtin_va_arg(ap, const CHAR16*);
+
+                if (s)
+                    _putw(&out, s, width, left);
+                else
+                    _puts(&out, "(null)", width, left);
+                break;
+            }
+            case 'c':
+            {
+                _putc(&out, (char)__builtin_va_arg(ap, UINTN));
+                break;
+            }
+            case 'd':
+            {
+                INT64 x = is64 ?
+                    __builtin_va_arg(ap, INT64) : __builtin_va_arg(ap, INT32);
+
+                if (x < 0)
+                    _putn(&out, -(UINT64)x, TRUE, 10, FALSE, width, pad, left);
+                else
+                    _putn(&out, x, FALSE, 10, FALSE, width, pad, left);
+                break;
+            }
+            case 'u':
+            {
+                UINT64 x = is64 ?
+                    __builtin_va_arg(ap, UINT64) : __builtin_va_arg(ap, UINT32);
+                _putn(&out, x, FALSE, 10, FALSE, width, pad, left);
+                break;
+            }
+            case 'x':
+            case 'X':
+            {
+                UINT64 x = is64 ?
+                    __builtin_va_arg(ap, UINT64) : __builtin_va_arg(ap, UINT32);
+
+                /* gnu-efi zero-pads %X to the width of the argument */
+                if (*p == 'X' && width == 0)
+                {
+                    width = is64 ? 16 : 8;
+                    pad = '0';
+                }
+
+                _putn(&out, x, FALSE, 16, *p == 'X', width, pad, left);
+                break;
+            }
+            case 'p':
+            {
+                UINT64 x = (UINTN)__builtin_va_arg(ap, void*);
+                _putn(&out, x, FALSE, 16, TRUE, 16, '0', FALSE);
+                break;
+            }
+            case 'r':
+            {
+                EFI_STATUS status = __builtin_va_arg(ap, EFI_STATUS);
+                const char* s = _status_str(status);
+
+                if (s)
+                    _puts(&out, s, width, left);
+                else
+                    _putn(&out, status, FALSE, 16, TRUE, 16, '0', FALSE);
+                break;
+            }
+            case 'E':
+            case 'H':
+            case 'N':
+            case 'B':
+            case 'V':
+                break;
+            case '%':
+                _putc(&out, '%');
+                break;
+            case '\0':
+                p--;
+                break;
+            default:
+                _putc(&out, '%');
+                _putc(&out, (char)*p);
+                break;
+        }
+    }
+
+    __builtin_va_end(ap);
+    _flush(&out);
+
+    return out.total;
+}
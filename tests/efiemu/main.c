@@ -0,0 +1,407 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <float.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utils/boottime.h>
+#include <utils/sha256.h>
+#include "emu.h"
+
+static const char* _arg0;
+static int _quiet;
+static sigjmp_buf _jmp;
+
+/*
+**==============================================================================
+**
+** Host services used by the emulated firmware
+**
+**==============================================================================
+*/
+
+void* host_malloc(unsigned long size)
+{
+    return malloc(size);
+}
+
+void host_free(void* ptr)
+{
+    free(ptr);
+}
+
+void host_write(const char* data, unsigned long size)
+{
+    if (!_quiet)
+        fwrite(data, 1, size, stdout);
+}
+
+int host_open(const char* path, int* is_directory, unsigned long* size)
+{
+    int fd;
+    struct stat st;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    *is_directory = S_ISDIR(st.st_mode);
+    *size = st.st_size;
+    return fd;
+}
+
+long host_read(int fd, void* data, unsigned long size)
+{
+    unsigned char* p = data;
+    unsigned long total = 0;
+
+    while (total < size)
+    {
+        ssize_t n = read(fd, p + total, size - total);
+
+        if (n < 0)
+            return -1;
+
+        if (n == 0)
+            break;
+
+        total += n;
+    }
+
+    return total;
+}
+
+int host_seek(int fd, unsigned long offset)
+{
+    return lseek(fd, offset, SEEK_SET) == (off_t)offset ? 0 : -1;
+}
+
+void host_close(int fd)
+{
+    close(fd);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* busy-wait like firmware so the bootloader's TSC calibration is accurate */
+void host_stall(unsigned long microseconds)
+{
+    const double end = _now() + microseconds / 1e6;
+
+    while (_now() < end)
+        ;
+}
+
+void host_reset(void)
+{
+    siglongjmp(_jmp, EMU_EXIT_RESET);
+}
+
+/*
+**==============================================================================
+**
+** Booting: the bootloader disables interrupts immediately before jumping to
+** the kernel's EFI handover entry point. In user mode that instruction
+** faults, which is how the emulator knows the boot succeeded.
+**
+**==============================================================================
+*/
+
+static void _sigsegv_handler(int sig, siginfo_t* info, void* context)
+{
+    const ucontext_t* uc = context;
+    const unsigned char* rip = (void*)uc->uc_mcontext.gregs[REG_RIP];
+
+    if (rip[0] == 0xfa) /* cli */
+        siglongjmp(_jmp, EMU_EXIT_HANDOVER);
+
+    /* Let a genuine fault crash the process */
+    signal(SIGSEGV, SIG_DFL);
+}
+
+static void _map_memory(void)
+{
+    void* addr = (void*)EMU_MEMORY_BASE;
+    const size_t size = EMU_MEMORY_END - EMU_MEMORY_BASE;
+    void* p;
+
+    p = mmap(addr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+        -1, 0);
+
+    if (p != addr)
+    {
+        fprintf(stderr, "%s: cannot map emulated memory at %p\n", _arg0, addr);
+        exit(1);
+    }
+}
+
+static int _boot(void)
+{
+    int r;
+
+    if ((r = sigsetjmp(_jmp, 1)) == 0)
+    {
+        emu_boot();
+        r = EMU_EXIT_RETURN;
+    }
+
+    return r;
+}
+
+static void _check_boot(int r)
+{
+    if (r == EMU_EXIT_HANDOVER)
+        return;
+
+    if (r == EMU_EXIT_RESET)
+        fprintf(stderr, "%s: the bootloader reset the system\n", _arg0);
+    else
+        fprintf(stderr, "%s: efi_main() returned\n", _arg0);
+
+    exit(1);
+}
+
+/*
+**==============================================================================
+**
+** Reporting
+**
+**==============================================================================
+*/
+
+/* print the results in the form that mkesp predicts */
+static void _print_results(void)
+{
+    const char* roothash;
+    unsigned long size;
+    unsigned int pcr;
+    sha256_t digest;
+    sha256_string_t str;
+
+    if ((roothash = emu_get_variable("roothash", &size)) &&
+        size > 0 && roothash[size - 1] == '\0')
+    {
+        printf("roothash=%s\n", roothash);
+    }
+
+    for (unsigned int i = 0; emu_get_event(i, &pcr, digest.data) == 0; i++)
+    {
+        sha256_format(&str, &digest);
+        printf("LOG[%u:%s]\n", pcr, str.buf);
+    }
+
+    for (unsigned int i = 0; i < EMU_MAX_PCRS; i++)
+    {
+        const sha256_t zeros = SHA256_INITIALIZER;
+
+        emu_get_pcr(i, digest.data);
+
+        if (memcmp(&digest, &zeros, sizeof(digest)) != 0)
+        {
+            sha256_format(&str, &digest);
+            printf("PCR[%u]=%s\n", i, str.buf);
+        }
+    }
+}
+
+typedef struct _stats
+{
+    char name[BOOTTIME_NAME_SIZE];
+    double sum;
+    double min;
+    double max;
+}
+stats_t;
+
+static void _update(stats_t* stats, const char* name, double ms)
+{
+    if (!*stats->name)
+    {
+        strcpy(stats->name, name);
+        stats->min = DBL_MAX;
+    }
+
+    stats->sum += ms;
+
+    if (ms < stats->min)
+        stats->min = ms;
+
+    if (ms > stats->max)
+        stats->max = ms;
+}
+
+static void _print_stats(const stats_t* stats, size_t iterations)
+{
+    printf("%-16s %10.3f %10.3f %10.3f\n",
+        stats->name, stats->sum / iterations, stats->min, stats->max);
+}
+
+/* boot repeatedly and report the bootloader's own stage timings */
+static void _bench(const char* esp, size_t iterations)
+{
+    stats_t stages[BOOTTIME_MAX_STAGES];
+    stats_t total;
+    stats_t wall;
+    size_t num_stages = 0;
+
+    memset(stages, 0, sizeof(stages));
+    memset(&total, 0, sizeof(total));
+    memset(&wall, 0, sizeof(wall));
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        const boottime_t* bt;
+        unsigned long size;
+        double start = _now();
+        double ticks_per_ms;
+
+        _check_boot(_boot());
+        _update(&wall, "efi_main", (_now() - start) * 1000.0);
+
+        bt = emu_get_variable(BOOTTIME_VARIABLE_NAME, &size);
+
+        if (!bt || size != sizeof(boottime_t) ||
+            bt->magic != BOOTTIME_MAGIC ||
+            bt->num_stages > BOOTTIME_MAX_STAGES ||
+            bt->tsc_frequency == 0)
+        {
+            fprintf(stderr, "%s: no boottime variable\n", _arg0);
+            exit(1);
+        }
+
+        if (i == 0)
+            num_stages = bt->num_stages;
+
+        if (bt->num_stages != num_stages)
+        {
+            fprintf(stderr, "%s: stages differ between boots\n", _arg0);
+            exit(1);
+        }
+
+        ticks_per_ms = bt->tsc_frequency / 1000.0;
+
+        for (size_t j = 0; j < num_stages; j++)
+        {
+            const boottime_stage_t* s = &bt->stages[j];
+            _update(&stages[j], s->name, (s->end - s->start) / ticks_per_ms);
+        }
+
+        if (num_stages)
+        {
+            _update(&total, "total",
+                bt->stages[num_stages - 1].end / ticks_per_ms);
+        }
+    }
+
+    printf("%s: %zu boots of %s\n", _arg0, iterations, esp);
+    printf("%-16s %10s %10s %10s\n", "stage", "mean(ms)", "min(ms)", "max(ms)");
+
+    for (size_t j = 0; j < num_stages; j++)
+        _print_stats(&stages[j], iterations);
+
+    if (num_stages)
+        _print_stats(&total, iterations);
+
+    /* includes boottime_publish() and the emulated firmware */
+    _print_stats(&wall, iterations);
+    printf("pages in use at handover: %lu\n", emu_pages_in_use());
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+        "Usage: %s [--quiet] [--bench ITERATIONS] ESPDIR\n"
+        "\n"
+        "Runs the bootloader's efi_main() against emulated boot services,\n"
+        "with the EFI system partition backed by ESPDIR, up to the kernel\n"
+        "handover. Prints the roothash variable and the TCG2 log and PCRs,\n"
+        "or with --bench the stage timings over repeated boots.\n"
+        "\n", _arg0);
+}
+
+int main(int argc, const char* argv[])
+{
+    size_t iterations = 0;
+    const char* esp = NULL;
+    struct sigaction sa;
+
+    _arg0 = argv[0];
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quiet") == 0)
+        {
+            _quiet = 1;
+        }
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+        {
+            char* end;
+
+            iterations = strtoul(argv[++i], &end, 10);
+
+            if (*end || iterations == 0)
+            {
+                _usage();
+                exit(1);
+            }
+        }
+        else if (argv[i][0] != '-' && !esp)
+        {
+            esp = argv[i];
+        }
+        else
+        {
+            _usage();
+            exit(1);
+        }
+    }
+
+    if (!esp)
+    {
+        _usage();
+        exit(1);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = _sigsegv_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, NULL);
+
+    _map_memory();
+    emu_init(esp);
+
+    if (iterations)
+    {
+        _bench(esp, iterations);
+    }
+    else
+    {
+        _check_boot(_boot());
+        fflush(stdout);
+        _print_results();
+    }
+
+    return 0;
+}
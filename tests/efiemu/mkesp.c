@@ -0,0 +1,376 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utils/sig.h>
+#include <utils/lz4.h>
+#include <utils/paths.h>
+#include <utils/sha256.h>
+#include <utils/strings.h>
+#include <utils/allocator.h>
+#include <common/buf.h>
+#include <common/file.h>
+#include <cvmdisk/mkcpio.h>
+#include <cvmdisk/events.h>
+#include <cvmdisk/sig.h>
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** mkesp: creates a synthetic EFI system partition directory for efiemu, laid
+** out and signed the way "cvmdisk protect" does it, and writes the roothash,
+** TCG2 log and PCRs that the bootloader is expected to produce.
+**
+**==============================================================================
+*/
+
+#define KERNEL_SIZE ((size_t)(4 * 1024 * 1024))
+#define DEFAULT_INITRD_SIZE ((size_t)(8 * 1024 * 1024))
+
+#define ROOTHASH \
+    "5c4ee2d3d1fa7d5bb05b16b0c8d5f01e44f6a8b6f07ba9b9a3b8a7c3d6e1f0a9"
+
+#define CMDLINE "console=ttyS0 root=/dev/mapper/root ro"
+
+static const char _events[] =
+    "PCR11:string:\"os-image-identity\":{\"signer\":\"__signer__\","
+    "\"svn\":\"1\",\"diskId\":\"efiemu\",\"eventVersion\":\"1\"}\n"
+    "PCR11:binary:"
+    "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\n";
+
+static const char* _arg0;
+
+static void _fail(const char* msg, const char* arg)
+{
+    if (arg)
+        fprintf(stderr, "%s: %s: %s\n", _arg0, msg, arg);
+    else
+        fprintf(stderr, "%s: %s\n", _arg0, msg);
+
+    exit(1);
+}
+
+static void _put16(uint8_t* p, uint16_t x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+static void _put32(uint8_t* p, uint32_t x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+static void _put64(uint8_t* p, uint64_t x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+/* deterministic filler that does not compress to nothing */
+static void _fill(uint8_t* data, size_t size, uint32_t seed)
+{
+    uint32_t x = seed;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        x = x * 1103515245 + 12345;
+        data[i] = (i % 4096 < 1024) ? 0 : (uint8_t)(x >> 16);
+    }
+}
+
+/* a bzImage with just enough of a Linux setup header for the bootloader */
+static void _write_kernel(const char* path)
+{
+    const uint8_t setup_sects = 4;
+    uint8_t* data;
+
+    if (!(data = malloc(KERNEL_SIZE)))
+        _fail("out of memory", NULL);
+
+    _fill(data, KERNEL_SIZE, 1);
+    memset(data, 0, (setup_sects + 1) * 512);
+
+    data[0x1F1] = setup_sects;
+    _put16(data + 0x1FE, 0xAA55); /* boot_flag */
+    _put32(data + 0x202, 0x53726448); /* header: "HdrS" */
+    _put16(data + 0x206, 0x020F); /* version */
+    data[0x211] = 0x01; /* loadflags: LOADED_HIGH */
+    _put32(data + 0x230, 0x200000); /* kernel_alignment */
+    data[0x234] = 1; /* relocatable_kernel */
+    _put32(data + 0x238, 2048); /* cmdline_size */
+    _put64(data + 0x258, 0x1000000); /* pref_address */
+    _put32(data + 0x260, KERNEL_SIZE); /* init_size */
+    _put32(data + 0x264, 0x190); /* handover_offset */
+
+    if (write_file(path, data, KERNEL_SIZE) != 0)
+        _fail("cannot write", path);
+
+    free(data);
+}
+
+static void _write_initrd(const char* path, size_t size)
+{
+    uint8_t* data;
+
+    if (!(data = malloc(size)))
+        _fail("out of memory", NULL);
+
+    _fill(data, size, 2);
+
+    if (write_file(path, data, size) != 0)
+        _fail("cannot write", path);
+
+    free(data);
+}
+
+static void _write_string(const char* path, const char* str)
+{
+    if (write_file(path, str, strlen(str)) != 0)
+        _fail("cannot write", path);
+}
+
+static int _buf_write_callback(void* context, const void* data, size_t size)
+{
+    return buf_append((buf_t*)context, data, size);
+}
+
+static void _write_cpio(
+    const char* home,
+    const char* cpio,
+    int compress,
+    sha256_t* digest)
+{
+    size_t size;
+
+    if (compress)
+    {
+        buf_t buf = BUF_INITIALIZER;
+        size_t bound;
+        void* data;
+
+        if (mkcpio(home, 4096, 0, _buf_write_callback, &buf, NULL, NULL) < 0)
+            _fail("cannot create archive from", home);
+
+        bound = lz4_compress_frame_bound(buf.size);
+
+        if (!(data = malloc(bound)))
+            _fail("out of memory", NULL);
+
+        if (!(size = lz4_compress_frame(buf.data, buf.size, data, bound)))
+            _fail("cannot compress", cpio);
+
+        if (write_file(cpio, data, size) != 0)
+            _fail("cannot write", cpio);
+
+        sha256_compute(digest, data, size);
+        free(data);
+        buf_release(&buf);
+    }
+    else
+    {
+        if (mkcpio_file(home, cpio, 4096, 0, digest, &size) < 0)
+            _fail("cannot create", cpio);
+    }
+}
+
+/* flip a bit at the end of a file */
+static void _corrupt(const char* path)
+{
+    uint8_t* data;
+    size_t size;
+
+    if (load_file(path, (void**)&data, &size) != 0 || size == 0)
+        _fail("cannot load", path);
+
+    data[size - 1] ^= 1;
+
+    if (write_file(path, data, size) != 0)
+        _fail("cannot write", path);
+
+    free(data);
+}
+
+/* same form as the expected values that "cvmdisk protect" prints */
+static void _write_expected(
+    const char* path,
+    const char* events,
+    const sig_t* sig)
+{
+    process_events_callback_data_t cbd;
+    sha256_string_t signer;
+    sha256_string_t str;
+    FILE* os;
+
+    memset(&cbd, 0, sizeof(cbd));
+    sha256_format(&signer, (const sha256_t*)sig->signer);
+
+    if (events)
+    {
+        if (process_events(events, signer.buf, &cbd) < 0)
+            _fail("cannot process events", events);
+    }
+    else
+    {
+        /* without an events file the bootloader measures the signer */
+        sha256_compute(
+            &cbd.events[0].digest, sig->signer, sizeof(sig->signer));
+        cbd.events[0].pcrnum = 11;
+        cbd.num_events = 1;
+        sha256_extend(&cbd.sha256_pcrs[11], &cbd.events[0].digest);
+    }
+
+    if (!(os = fopen(path, "w")))
+        _fail("cannot create", path);
+
+    fprintf(os, "roothash=%s\n", ROOTHASH);
+
+    for (size_t i = 0; i < cbd.num_events; i++)
+    {
+        sha256_format(&str, &cbd.events[i].digest);
+        fprintf(os, "LOG[%d:%s]\n", cbd.events[i].pcrnum, str.buf);
+    }
+
+    for (size_t i = 0; i < MAX_PCRS; i++)
+    {
+        const sha256_t zeros = SHA256_INITIALIZER;
+
+        if (memcmp(&cbd.sha256_pcrs[i], &zeros, sizeof(zeros)) != 0)
+        {
+            sha256_format(&str, &cbd.sha256_pcrs[i]);
+            fprintf(os, "PCR[%zu]=%s\n", i, str.buf);
+        }
+    }
+
+    fclose(os);
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+        "Usage: %s SIGNTOOL ESPDIR EXPECTED [OPTIONS]\n"
+        "\n"
+        "Options:\n"
+        "    --events none|text|blob  events file to include (default none)\n"
+        "    --compress               LZ4-compress cvmboot.cpio\n"
+        "    --initrd-size BYTES      size of the initrd (default %zu)\n"
+        "    --corrupt                alter cvmboot.cpio after signing it\n"
+        "\n", _arg0, DEFAULT_INITRD_SIZE);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* signtool;
+    const char* esp;
+    const char* expected;
+    const char* events_mode = "none";
+    size_t initrd_size = DEFAULT_INITRD_SIZE;
+    int compress = 0;
+    int corrupt = 0;
+    char home[PATH_MAX];
+    char path[PATH_MAX];
+    char events[PATH_MAX];
+    char cpio[PATH_MAX];
+    char cpio_sig[PATH_MAX];
+    sha256_t digest;
+    sig_t sig;
+
+    _arg0 = argv[0];
+
+    if (argc < 4)
+    {
+        _usage();
+        exit(1);
+    }
+
+    signtool = argv[1];
+    esp = argv[2];
+    expected = argv[3];
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--events") == 0 && i + 1 < argc)
+            events_mode = argv[++i];
+        else if (strcmp(argv[i], "--compress") == 0)
+            compress = 1;
+        else if (strcmp(argv[i], "--corrupt") == 0)
+            corrupt = 1;
+        else if (strcmp(argv[i], "--initrd-size") == 0 && i + 1 < argc)
+            initrd_size = strtoul(argv[++i], NULL, 0);
+        else
+        {
+            _usage();
+            exit(1);
+        }
+    }
+
+    if (strcmp(events_mode, "none") != 0 &&
+        strcmp(events_mode, "text") != 0 &&
+        strcmp(events_mode, "blob") != 0)
+    {
+        _fail("bad --events argument", events_mode);
+    }
+
+    if (initrd_size == 0)
+        _fail("bad --initrd-size argument", NULL);
+
+    paths_set_prefix("");
+    paths_get(home, DIRNAME_CVMBOOT_HOME, esp);
+    paths_get(events, FILENAME_EVENTS, esp);
+    paths_get(cpio, FILENAME_CVMBOOT_CPIO, esp);
+    paths_get(cpio_sig, FILENAME_CVMBOOT_CPIO_SIG, esp);
+
+    strlcpy2(path, "mkdir -p ", home, sizeof(path));
+
+    if (system(path) != 0)
+        _fail("cannot create", home);
+
+    /* Populate the cvmboot directory like "cvmdisk protect" */
+    strlcpy2(path, home, "/vmlinuz", sizeof(path));
+    _write_kernel(path);
+
+    strlcpy2(path, home, "/initrd.img", sizeof(path));
+    _write_initrd(path, initrd_size);
+
+    strlcpy2(path, home, "/cvmboot.conf", sizeof(path));
+    _write_string(path,
+        "cmdline=" CMDLINE "\n"
+        "roothash=" ROOTHASH "\n"
+        "kernel=vmlinuz\n"
+        "initrd=initrd.img\n");
+
+    if (strcmp(events_mode, "none") != 0)
+    {
+        _write_string(events, _events);
+
+        if (strcmp(events_mode, "blob") == 0)
+        {
+            paths_get(path, FILENAME_EVENTS_BIN, esp);
+
+            if (compile_events(events, path) != 0)
+                _fail("cannot compile", events);
+        }
+    }
+
+    /* Create and sign cvmboot.cpio */
+    _write_cpio(home, cpio, compress, &digest);
+
+    if (sig_create_file(cpio, &digest, signtool, &sig) != 0)
+        _fail("cannot sign", cpio);
+
+    if (write_file(cpio_sig, &sig, sizeof(sig)) != 0)
+        _fail("cannot write", cpio_sig);
+
+    if (corrupt)
+        _corrupt(cpio);
+
+    _write_expected(
+        expected, strcmp(events_mode, "none") != 0 ? events : NULL, &sig);
+
+    return 0;
+}
@@ -0,0 +1,899 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <efi.h>
+#include <string.h>
+#include <limits.h>
+#include <utils/sha256.h>
+#include <utils/strings.h>
+#include <bootloader/tcg2.h>
+#include "emu.h"
+
+/* gnu-efi versions differ in the constness of some service parameters */
+#define SET(FIELD, FUNCTION) ((FIELD) = (__typeof__(FIELD))(FUNCTION))
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES ((EMU_MEMORY_END - EMU_MEMORY_BASE) / PAGE_SIZE)
+
+#define MAX_NAME_SIZE 64
+
+EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table);
+
+static EFI_SYSTEM_TABLE _st;
+static EFI_BOOT_SERVICES _bs;
+static EFI_RUNTIME_SERVICES _rt;
+static SIMPLE_TEXT_OUTPUT_INTERFACE _con_out;
+static SIMPLE_INPUT_INTERFACE _con_in;
+static EFI_LOADED_IMAGE _loaded_image;
+static EFI_FILE_IO_INTERFACE _file_io;
+static EFI_TCG2_PROTOCOL _tcg2;
+
+/* handles and events are only compared, never dereferenced */
+static UINT8 _image_handle;
+static UINT8 _device_handle;
+static UINT8 _key_event;
+static UINT8 _timer_event;
+
+/* host directory backing the volume */
+static char _root[PATH_MAX];
+
+/*
+**==============================================================================
+**
+** Memory services: pages come from the emulated physical memory (one byte
+** of state per page); pool allocations come from the host heap.
+**
+**==============================================================================
+*/
+
+static UINT8 _pages[NUM_PAGES];
+static UINTN _num_pages_in_use;
+
+static EFI_STATUS EFIAPI _AllocatePages(
+    EFI_ALLOCATE_TYPE type,
+    EFI_MEMORY_TYPE memory_type,
+    UINTN num_pages,
+    EFI_PHYSICAL_ADDRESS* memory)
+{
+    UINTN first = 0;
+    UINTN last = NUM_PAGES;
+    UINTN i;
+    UINTN n;
+
+    (void)memory_type;
+
+    if (!memory || num_pages == 0 || num_pages > NUM_PAGES)
+        return EFI_INVALID_PARAMETER;
+
+    if (type == AllocateAddress)
+    {
+        if (*memory % PAGE_SIZE ||
+            *memory < EMU_MEMORY_BASE ||
+            *memory > EMU_MEMORY_END - num_pages * PAGE_SIZE)
+        {
+            return EFI_NOT_FOUND;
+        }
+
+        first = (*memory - EMU_MEMORY_BASE) / PAGE_SIZE;
+
+        for (i = first; i < first + num_pages; i++)
+        {
+            if (_pages[i])
+                return EFI_NOT_FOUND;
+        }
+
+        goto found;
+    }
+
+    if (type == AllocateMaxAddress)
+    {
+        if (*memory < EMU_MEMORY_BASE + PAGE_SIZE - 1)
+            return EFI_NOT_FOUND;
+
+        if (*memory < EMU_MEMORY_END)
+            last = (*memory + 1 - EMU_MEMORY_BASE) / PAGE_SIZE;
+    }
+    else if (type != AllocateAnyPages)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    /* Search down from the highest permitted page, as firmware does */
+    for (i = last, n = 0; i > 0; i--)
+    {
+        if (_pages[i - 1])
+        {
+            n = 0;
+        }
+        else if (++n == num_pages)
+        {
+            first = i - 1;
+            goto found;
+        }
+    }
+
+    return EFI_OUT_OF_RESOURCES;
+
+found:
+    memset(&_pages[first], 1, num_pages);
+    _num_pages_in_use += num_pages;
+    *memory = EMU_MEMORY_BASE + first * PAGE_SIZE;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _FreePages(
+    EFI_PHYSICAL_ADDRESS memory,
+    UINTN num_pages)
+{
+    UINTN first;
+    UINTN i;
+
+    if (memory % PAGE_SIZE ||
+        memory < EMU_MEMORY_BASE ||
+        num_pages > NUM_PAGES ||
+        memory > EMU_MEMORY_END - num_pages * PAGE_SIZE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    first = (memory - EMU_MEMORY_BASE) / PAGE_SIZE;
+
+    for (i = first; i < first + num_pages; i++)
+    {
+        if (!_pages[i])
+            return EFI_NOT_FOUND;
+    }
+
+    memset(&_pages[first], 0, num_pages);
+    _num_pages_in_use -= num_pages;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _AllocatePool(
+    EFI_MEMORY_TYPE pool_type,
+    UINTN size,
+    VOID** buffer)
+{
+    (void)pool_type;
+
+    if (!buffer)
+        return EFI_INVALID_PARAMETER;
+
+    if (!(*buffer = host_malloc(size ? size : 1)))
+        return EFI_OUT_OF_RESOURCES;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _FreePool(VOID* buffer)
+{
+    host_free(buffer);
+    return EFI_SUCCESS;
+}
+
+/*
+**==============================================================================
+**
+** Event and timer services: there are no asynchronous events, so every wait
+** completes immediately.
+**
+**==============================================================================
+*/
+
+static EFI_STATUS EFIAPI _CreateEvent(
+    UINT32 type,
+    EFI_TPL notify_tpl,
+    EFI_EVENT_NOTIFY notify_function,
+    VOID* notify_context,
+    EFI_EVENT* event)
+{
+    (void)type;
+    (void)notify_tpl;
+    (void)notify_function;
+    (void)notify_context;
+
+    if (!event)
+        return EFI_INVALID_PARAMETER;
+
+    *event = &_timer_event;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _SetTimer(
+    EFI_EVENT event,
+    EFI_TIMER_DELAY type,
+    UINT64 trigger_time)
+{
+    (void)event;
+    (void)type;
+    (void)trigger_time;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _WaitForEvent(
+    UINTN num_events,
+    EFI_EVENT* event,
+    UINTN* index)
+{
+    (void)event;
+
+    if (num_events == 0 || !index)
+        return EFI_INVALID_PARAMETER;
+
+    *index = 0;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _CloseEvent(EFI_EVENT event)
+{
+    (void)event;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _Stall(UINTN microseconds)
+{
+    host_stall(microseconds);
+    return EFI_SUCCESS;
+}
+
+/*
+**==============================================================================
+**
+** Simple file system protocol backed by a host directory (read only)
+**
+**==============================================================================
+*/
+
+typedef struct _emu_file
+{
+    /* must be first (the bootloader sees a pointer to this field) */
+    EFI_FILE protocol;
+    int fd;
+    BOOLEAN is_directory;
+    UINT64 size;
+    char path[PATH_MAX];
+}
+emu_file_t;
+
+static EFI_STATUS _new_file(const char* path, EFI_FILE** file_out);
+
+static EFI_STATUS EFIAPI _FileOpen(
+    EFI_FILE* file,
+    EFI_FILE** new_handle,
+    CHAR16* file_name,
+    UINT64 open_mode,
+    UINT64 attributes)
+{
+    emu_file_t* self = (emu_file_t*)file;
+    char path[PATH_MAX];
+    UINTN n;
+    UINTN i;
+
+    (void)attributes;
+
+    if (!file || !new_handle || !file_name)
+        return EFI_INVALID_PARAMETER;
+
+    if (open_mode != EFI_FILE_MODE_READ)
+        return EFI_WRITE_PROTECTED;
+
+    /* Resolve the name against the volume root or this directory */
+    if (file_name[0] == '\\')
+        n = strlcpy(path, _root, sizeof(path));
+    else
+        n = strlcpy(path, self->path, sizeof(path));
+
+    if (n + 1 >= sizeof(path))
+        return EFI_NOT_FOUND;
+
+    if (file_name[0] != '\\')
+        path[n++] = '/';
+
+    for (i = 0; file_name[i]; i++)
+    {
+        if (n + 1 >= sizeof(path))
+            return EFI_NOT_FOUND;
+
+        if (file_name[i] > 0x7f)
+            return EFI_NOT_FOUND;
+
+        path[n++] = (file_name[i] == '\\') ? '/' : (char)file_name[i];
+    }
+
+    path[n] = '\0';
+
+    return _new_file(path, new_handle);
+}
+
+static EFI_STATUS EFIAPI _FileClose(EFI_FILE* file)
+{
+    emu_file_t* self = (emu_file_t*)file;
+
+    if (!self)
+        return EFI_INVALID_PARAMETER;
+
+    host_close(self->fd);
+    host_free(self);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _FileRead(
+    EFI_FILE* file,
+    UINTN* buffer_size,
+    VOID* buffer)
+{
+    emu_file_t* self = (emu_file_t*)file;
+    long n;
+
+    if (!self || !buffer_size || (!buffer && *buffer_size))
+        return EFI_INVALID_PARAMETER;
+
+    if (self->is_directory)
+        return EFI_UNSUPPORTED;
+
+    if ((n = host_read(self->fd, buffer, *buffer_size)) < 0)
+        return EFI_DEVICE_ERROR;
+
+    *buffer_size = n;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _FileSetPosition(EFI_FILE* file, UINT64 position)
+{
+    emu_file_t* self = (emu_file_t*)file;
+
+    if (!self)
+        return EFI_INVALID_PARAMETER;
+
+    /* 0xFFFFFFFFFFFFFFFF moves to the end of the file */
+    if (position == (UINT64)-1)
+        position = self->size;
+
+    if (host_seek(self->fd, position) != 0)
+        return EFI_DEVICE_ERROR;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _FileGetInfo(
+    EFI_FILE* file,
+    EFI_GUID* information_type,
+    UINTN* buffer_size,
+    VOID* buffer)
+{
+    emu_file_t* self = (emu_file_t*)file;
+    EFI_GUID file_info_id = EFI_FILE_INFO_ID;
+    EFI_FILE_INFO* info = buffer;
+    const char* name;
+    UINTN required;
+    UINTN i;
+
+    if (!self || !information_type || !buffer_size)
+        return EFI_INVALID_PARAMETER;
+
+    if (memcmp(information_type, &file_info_id, sizeof(EFI_GUID)) != 0)
+        return EFI_UNSUPPORTED;
+
+    for (name = self->path, i = 0; self->path[i]; i++)
+    {
+        if (self->path[i] == '/')
+            name = &self->path[i + 1];
+    }
+
+    required = SIZE_OF_EFI_FILE_INFO + (strlen(name) + 1) * sizeof(CHAR16);
+
+    if (*buffer_size < required || !buffer)
+    {
+        *buffer_size = required;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    memset(info, 0, required);
+    info->Size = required;
+    info->FileSize = self->size;
+    info->PhysicalSize = (self->size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    info->Attribute = EFI_FILE_READ_ONLY;
+
+    if (self->is_directory)
+        info->Attribute |= EFI_FILE_DIRECTORY;
+
+    for (i = 0; name[i]; i++)
+        info->FileName[i] = (CHAR16)(UINT8)name[i];
+
+    info->FileName[i] = '\0';
+    *buffer_size = required;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS _new_file(const char* path, EFI_FILE** file_out)
+{
+    emu_file_t* file;
+    int is_directory;
+    unsigned long size;
+    int fd;
+
+    if ((fd = host_open(path, &is_directory, &size)) < 0)
+        return EFI_NOT_FOUND;
+
+    if (!(file = host_malloc(sizeof(emu_file_t))))
+    {
+        host_close(fd);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    memset(file, 0, sizeof(emu_file_t));
+    file->protocol.Revision = EFI_FILE_HANDLE_REVISION;
+    SET(file->protocol.Open, _FileOpen);
+    SET(file->protocol.Close, _FileClose);
+    SET(file->protocol.Read, _FileRead);
+    SET(file->protocol.SetPosition, _FileSetPosition);
+    SET(file->protocol.GetInfo, _FileGetInfo);
+    file->fd = fd;
+    file->is_directory = is_directory ? TRUE : FALSE;
+    file->size = size;
+    strlcpy(file->path, path, sizeof(file->path));
+
+    *file_out = &file->protocol;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _OpenVolume(
+    EFI_FILE_IO_INTERFACE* this,
+    EFI_FILE** root)
+{
+    if (!this || !root)
+        return EFI_INVALID_PARAMETER;
+
+    return _new_file(_root, root);
+}
+
+/*
+**==============================================================================
+**
+** Protocol lookup
+**
+**==============================================================================
+*/
+
+static BOOLEAN _same_guid(const EFI_GUID* x, const EFI_GUID* y)
+{
+    return memcmp(x, y, sizeof(EFI_GUID)) == 0;
+}
+
+static EFI_STATUS EFIAPI _HandleProtocol(
+    EFI_HANDLE handle,
+    EFI_GUID* protocol,
+    VOID** interface)
+{
+    EFI_GUID loaded_image_protocol = LOADED_IMAGE_PROTOCOL;
+    EFI_GUID simple_file_system_protocol = SIMPLE_FILE_SYSTEM_PROTOCOL;
+
+    if (!protocol || !interface)
+        return EFI_INVALID_PARAMETER;
+
+    if (handle == &_image_handle &&
+        _same_guid(protocol, &loaded_image_protocol))
+    {
+        *interface = &_loaded_image;
+        return EFI_SUCCESS;
+    }
+
+    if (handle == &_device_handle &&
+        _same_guid(protocol, &simple_file_system_protocol))
+    {
+        *interface = &_file_io;
+        return EFI_SUCCESS;
+    }
+
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI _LocateProtocol(
+    EFI_GUID* protocol,
+    VOID* registration,
+    VOID** interface)
+{
+    EFI_GUID tcg2_protocol = EFI_TCG2_PROTOCOL_GUID;
+
+    (void)registration;
+
+    if (!protocol || !interface)
+        return EFI_INVALID_PARAMETER;
+
+    if (_same_guid(protocol, &tcg2_protocol))
+    {
+        *interface = &_tcg2;
+        return EFI_SUCCESS;
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+/*
+**==============================================================================
+**
+** Runtime services: variables are kept in memory for the host to inspect
+**
+**==============================================================================
+*/
+
+typedef struct _variable
+{
+    char name[MAX_NAME_SIZE];
+    EFI_GUID guid;
+    UINT32 attributes;
+    VOID* data;
+    UINTN size;
+}
+variable_t;
+
+static variable_t _variables[EMU_MAX_VARIABLES];
+static UINTN _num_variables;
+
+static variable_t* _find_variable(const char* name)
+{
+    UINTN i;
+
+    for (i = 0; i < _num_variables; i++)
+    {
+        if (strcmp(_variables[i].name, name) == 0)
+            return &_variables[i];
+    }
+
+    return NULL;
+}
+
+static EFI_STATUS EFIAPI _SetVariable(
+    CHAR16* variable_name,
+    EFI_GUID* vendor_guid,
+    UINT32 attributes,
+    UINTN data_size,
+    VOID* data)
+{
+    char name[MAX_NAME_SIZE];
+    variable_t* var;
+    UINTN i;
+
+    if (!variable_name || !vendor_guid || (data_size && !data))
+        return EFI_INVALID_PARAMETER;
+
+    for (i = 0; variable_name[i]; i++)
+    {
+        if (i + 1 == sizeof(name) || variable_name[i] > 0x7f)
+            return EFI_INVALID_PARAMETER;
+
+        name[i] = (char)variable_name[i];
+    }
+
+    name[i] = '\0';
+
+    if (!(var = _find_variable(name)))
+    {
+        if (data_size == 0)
+            return EFI_NOT_FOUND;
+
+        if (_num_variables == EMU_MAX_VARIABLES)
+            return EFI_OUT_OF_RESOURCES;
+
+        var = &_variables[_num_variables++];
+        strlcpy(var->name, name, sizeof(var->name));
+    }
+
+    host_free(var->data);
+    var->data = NULL;
+    var->size = 0;
+
+    if (data_size == 0)
+    {
+        *var = _variables[--_num_variables];
+        return EFI_SUCCESS;
+    }
+
+    if (!(var->data = host_malloc(data_size)))
+        return EFI_OUT_OF_RESOURCES;
+
+    memcpy(var->data, data, data_size);
+    var->size = data_size;
+    var->guid = *vendor_guid;
+    var->attributes = attributes;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _ResetSystem(
+    EFI_RESET_TYPE reset_type,
+    EFI_STATUS reset_status,
+    UINTN data_size,
+    CHAR16* reset_data)
+{
+    (void)reset_type;
+    (void)reset_status;
+    (void)data_size;
+    (void)reset_data;
+    host_reset();
+}
+
+/*
+**==============================================================================
+**
+** Console: output goes to the host; every key press is Enter
+**
+**==============================================================================
+*/
+
+static EFI_STATUS EFIAPI _OutputString(
+    SIMPLE_TEXT_OUTPUT_INTERFACE* this,
+    CHAR16* string)
+{
+    char buf[256];
+    UINTN n = 0;
+
+    (void)this;
+
+    for (; *string; string++)
+    {
+        buf[n++] = (char)*string;
+
+        if (n == sizeof(buf))
+        {
+            host_write(buf, n);
+            n = 0;
+        }
+    }
+
+    host_write(buf, n);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _SetAttribute(
+    SIMPLE_TEXT_OUTPUT_INTERFACE* this,
+    UINTN attribute)
+{
+    (void)this;
+    (void)attribute;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _ClearScreen(SIMPLE_TEXT_OUTPUT_INTERFACE* this)
+{
+    (void)this;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _ReadKeyStroke(
+    SIMPLE_INPUT_INTERFACE* this,
+    EFI_INPUT_KEY* key)
+{
+    (void)this;
+
+    if (!key)
+        return EFI_INVALID_PARAMETER;
+
+    key->ScanCode = 0;
+    key->UnicodeChar = '\r';
+    return EFI_SUCCESS;
+}
+
+/*
+**==============================================================================
+**
+** TCG2 protocol: extends a simulated SHA-256 PCR bank and keeps the log
+**
+**==============================================================================
+*/
+
+typedef struct _event
+{
+    UINT32 pcr;
+    UINT32 type;
+    sha256_t digest;
+}
+event_t;
+
+static sha256_t _pcrs[EMU_MAX_PCRS];
+static event_t _events[EMU_MAX_EVENTS];
+static UINTN _num_events;
+
+static EFI_STATUS EFIAPI _GetCapability(
+    EFI_TCG2_PROTOCOL* this,
+    EFI_TCG2_BOOT_SERVICE_CAPABILITY* capability)
+{
+    (void)this;
+
+    if (!capability)
+        return EFI_INVALID_PARAMETER;
+
+    memset(capability, 0, sizeof(EFI_TCG2_BOOT_SERVICE_CAPABILITY));
+    capability->Size = sizeof(EFI_TCG2_BOOT_SERVICE_CAPABILITY);
+    capability->StructureVersion.Major = 1;
+    capability->StructureVersion.Minor = 1;
+    capability->ProtocolVersion.Major = 1;
+    capability->ProtocolVersion.Minor = 1;
+    capability->HashAlgorithmBitmap = 0x00000002; /* SHA-256 */
+    capability->SupportedEventLogs = 0x00000002; /* crypto agile */
+    capability->TPMPresentFlag = TRUE;
+    capability->MaxCommandSize = 4096;
+    capability->MaxResponseSize = 4096;
+    capability->NumberOfPcrBanks = 1;
+    capability->ActivePcrBanks = 0x00000002;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _HashLogExtendEvent(
+    EFI_TCG2_PROTOCOL* this,
+    UINT64 flags,
+    EFI_PHYSICAL_ADDRESS data_to_hash,
+    UINT64 data_to_hash_len,
+    EFI_TCG2_EVENT* event)
+{
+    sha256_t digest;
+    UINT32 pcr;
+
+    (void)this;
+    (void)flags;
+
+    if (!event || (!data_to_hash && data_to_hash_len))
+        return EFI_INVALID_PARAMETER;
+
+    if ((pcr = event->Header.PCRIndex) >= EMU_MAX_PCRS)
+        return EFI_INVALID_PARAMETER;
+
+    sha256_compute(&digest, (const void*)data_to_hash, data_to_hash_len);
+    sha256_extend(&_pcrs[pcr], &digest);
+
+    if (_num_events == EMU_MAX_EVENTS)
+        return EFI_VOLUME_FULL;
+
+    _events[_num_events].pcr = pcr;
+    _events[_num_events].type = event->Header.EventType;
+    _events[_num_events].digest = digest;
+    _num_events++;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI _SubmitCommand(
+    EFI_TCG2_PROTOCOL* this,
+    UINT32 input_parameter_block_size,
+    UINT8* input_parameter_block,
+    UINT32 output_parameter_block_size,
+    UINT8* output_parameter_block)
+{
+    (void)this;
+    (void)input_parameter_block_size;
+    (void)input_parameter_block;
+    (void)output_parameter_block_size;
+    (void)output_parameter_block;
+    return EFI_UNSUPPORTED;
+}
+
+/*
+**==============================================================================
+**
+** Setup
+**
+**==============================================================================
+*/
+
+/* any service the bootloader is not expected to call */
+static EFI_STATUS EFIAPI _Unimplemented(void)
+{
+    static const char msg[] = "efiemu: unimplemented service called\n";
+
+    host_write(msg, sizeof(msg) - 1);
+    return EFI_UNSUPPORTED;
+}
+
+static void _fill_table(void* table, UINTN header_size, UINTN table_size)
+{
+    VOID** p = (VOID**)((UINT8*)table + header_size);
+    VOID** end = (VOID**)((UINT8*)table + table_size);
+
+    while (p < end)
+        *p++ = (VOID*)_Unimplemented;
+}
+
+void emu_init(const char* root)
+{
+    strlcpy(_root, root, sizeof(_root));
+
+    /* Boot services */
+    _fill_table(&_bs, sizeof(EFI_TABLE_HEADER), sizeof(_bs));
+    _bs.Hdr.Signature = EFI_BOOT_SERVICES_SIGNATURE;
+    _bs.Hdr.HeaderSize = sizeof(_bs);
+    SET(_bs.AllocatePages, _AllocatePages);
+    SET(_bs.FreePages, _FreePages);
+    SET(_bs.AllocatePool, _AllocatePool);
+    SET(_bs.FreePool, _FreePool);
+    SET(_bs.CreateEvent, _CreateEvent);
+    SET(_bs.SetTimer, _SetTimer);
+    SET(_bs.WaitForEvent, _WaitForEvent);
+    SET(_bs.CloseEvent, _CloseEvent);
+    SET(_bs.HandleProtocol, _HandleProtocol);
+    SET(_bs.LocateProtocol, _LocateProtocol);
+    SET(_bs.Stall, _Stall);
+
+    /* Runtime services */
+    _fill_table(&_rt, sizeof(EFI_TABLE_HEADER), sizeof(_rt));
+    _rt.Hdr.Signature = EFI_RUNTIME_SERVICES_SIGNATURE;
+    _rt.Hdr.HeaderSize = sizeof(_rt);
+    SET(_rt.SetVariable, _SetVariable);
+    SET(_rt.ResetSystem, _ResetSystem);
+
+    /* Console */
+    SET(_con_out.OutputString, _OutputString);
+    SET(_con_out.SetAttribute, _SetAttribute);
+    SET(_con_out.ClearScreen, _ClearScreen);
+    SET(_con_in.ReadKeyStroke, _ReadKeyStroke);
+    _con_in.WaitForKey = &_key_event;
+
+    /* Protocols */
+    _loaded_image.Revision = EFI_LOADED_IMAGE_INFORMATION_REVISION;
+    _loaded_image.SystemTable = &_st;
+    _loaded_image.DeviceHandle = &_device_handle;
+    _file_io.Revision = EFI_FILE_IO_INTERFACE_REVISION;
+    SET(_file_io.OpenVolume, _OpenVolume);
+    SET(_tcg2.GetCapability, _GetCapability);
+    SET(_tcg2.HashLogExtendEvent, _HashLogExtendEvent);
+    SET(_tcg2.SubmitCommand, _SubmitCommand);
+
+    /* System table */
+    _st.Hdr.Signature = EFI_SYSTEM_TABLE_SIGNATURE;
+    _st.Hdr.HeaderSize = sizeof(_st);
+    _st.ConIn = &_con_in;
+    _st.ConOut = &_con_out;
+    _st.StdErr = &_con_out;
+    _st.BootServices = &_bs;
+    _st.RuntimeServices = &_rt;
+}
+
+unsigned long emu_boot(void)
+{
+    UINTN i;
+
+    /* Start from freshly reset firmware (emulated memory stays mapped) */
+    for (i = 0; i < _num_variables; i++)
+        host_free(_variables[i].data);
+
+    memset(_variables, 0, sizeof(_variables));
+    _num_variables = 0;
+    memset(_pcrs, 0, sizeof(_pcrs));
+    _num_events = 0;
+    memset(_pages, 0, sizeof(_pages));
+    _num_pages_in_use = 0;
+
+    return efi_main(&_image_handle, &_st);
+}
+
+const void* emu_get_variable(const char* name, unsigned long* size)
+{
+    variable_t* var;
+
+    if (!(var = _find_variable(name)))
+        return NULL;
+
+    *size = var->size;
+    return var->data;
+}
+
+void emu_get_pcr(unsigned int index, unsigned char digest[32])
+{
+    memcpy(digest, &_pcrs[index], sizeof(sha256_t));
+}
+
+int emu_get_event(
+    unsigned int index,
+    unsigned int* pcr,
+    unsigned char digest[32])
+{
+    if (index >= _num_events)
+        return -1;
+
+    *pcr = _events[index].pcr;
+    memcpy(digest, &_events[index].digest, sizeof(sha256_t));
+    return 0;
+}
+
+unsigned long emu_pages_in_use(void)
+{
+    return _num_pages_in_use;
+}
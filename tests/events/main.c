@@ -10,6 +10,8 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <utils/events.h>
+#include <utils/hexstr.h>
+#include <utils/sha256.h>
 #include <utils/allocator.h>
 
 allocator_t __allocator = { malloc, free };
@@ -148,11 +150,115 @@ static int _callback2(
     return 0;
 }
 
+#define MAX_MEASUREMENTS 16
+
+typedef struct measurements
+{
+    size_t count;
+    uint32_t pcrs[MAX_MEASUREMENTS];
+    sha256_t digests[MAX_MEASUREMENTS];
+}
+measurements_t;
+
+static void _add_measurement(
+    measurements_t* m,
+    uint32_t pcr,
+    const void* data,
+    size_t size)
+{
+    assert(m->count < MAX_MEASUREMENTS);
+    m->pcrs[m->count] = pcr;
+    sha256_compute(&m->digests[m->count], data, size);
+    m->count++;
+}
+
+/* measures what the boot loader measures for the text events file */
+static int _text_callback(
+    size_t index,
+    uint32_t pcrnum,
+    const char* type,
+    const char* data,
+    const char* signer,
+    void* callback_data)
+{
+    measurements_t* m = (measurements_t*)callback_data;
+
+    if (strcmp(type, "binary") == 0)
+    {
+        uint8_t buf[256];
+        size_t size = strlen(data) / 2;
+
+        assert(size <= sizeof(buf));
+        assert(hexstr_scan(data, buf, size) == size);
+        _add_measurement(m, pcrnum, buf, size);
+    }
+    else
+    {
+        _add_measurement(m, pcrnum, data, strlen(data) + 1);
+    }
+
+    return 0;
+}
+
+static int _blob_callback(
+    uint32_t pcr,
+    uint32_t type,
+    const void* data,
+    size_t size,
+    void* callback_data)
+{
+    _add_measurement((measurements_t*)callback_data, pcr, data, size);
+    return 0;
+}
+
+/* the precompiled events must measure the same as the text events */
+static void _test_blob(const char* text, size_t text_size)
+{
+    const char signer[] =
+        "6d1b8b2c1c7bd0c49e7a4f1d8b40d7a0b1eaf7e4f06e3c5c91a2bb3ee4f1d0c9";
+    measurements_t m1;
+    measurements_t m2;
+    void* blob = NULL;
+    size_t blob_size;
+    unsigned int error_line = 0;
+    err_t err = ERR_INITIALIZER;
+
+    memset(&m1, 0, sizeof(m1));
+    memset(&m2, 0, sizeof(m2));
+
+    assert(parse_events_file(text, text_size, signer, _text_callback, &m1,
+        &error_line, &err) == 0);
+
+    assert(events_blob_compile(text, text_size, &blob, &blob_size,
+        &error_line, &err) == 0);
+
+    assert(events_blob_walk(blob, blob_size, signer, _blob_callback, &m2,
+        &err) == 0);
+
+    assert(m1.count > 0);
+    assert(m1.count == m2.count);
+    assert(memcmp(m1.pcrs, m2.pcrs, sizeof(m1.pcrs)) == 0);
+    assert(memcmp(m1.digests, m2.digests, sizeof(m1.digests)) == 0);
+
+    /* a truncated blob is rejected */
+    assert(events_blob_walk(blob, blob_size - 16, signer, _blob_callback,
+        &m2, &err) != 0);
+
+    /* a blob with a bad magic number is rejected */
+    ((uint8_t*)blob)[0] ^= 0xff;
+    assert(events_blob_walk(blob, blob_size, signer, _blob_callback,
+        &m2, &err) != 0);
+
+    free(blob);
+
+    printf("=== passed test (events blob)\n");
+}
+
 int main(int argc, const char* argv[])
 {
     void* data = NULL;
     size_t size = 0;
-    const char signer[32] = "95b3fc4b2fba43ff82570c725f94edaa";
+    const char signer[] = "95b3fc4b2fba43ff82570c725f94edaa";
     unsigned int error_line = 0;
     err_t err = ERR_INITIALIZER;
     process_events_callback_t callback;
@@ -184,5 +290,8 @@ int main(int argc, const char* argv[])
 
     printf("=== passed test (events %s)\n", argv[1]);
 
+    if (callback == _callback2)
+        _test_blob(data, size);
+
     return 0;
 }
@@ -0,0 +1,213 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cvmdisk/ext4.h>
+#include <cvmdisk/bits.h>
+
+/*
+**==============================================================================
+**
+** ext4bitmap: creates EXT4 images with mke2fs and debugfs (writing files and
+** deleting one, to leave stale data in free blocks) and checks the bitmap from
+** ext4_get_bitmap() against the free blocks that dumpe2fs reports.
+**
+**==============================================================================
+*/
+
+#define IMAGE "ext4bitmap.img"
+#define DATA "ext4bitmap.data"
+#define COMMANDS "ext4bitmap.cmds"
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "ext4bitmap: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _run(const char* cmd)
+{
+    if (system(cmd) != 0)
+        _fail(cmd);
+}
+
+static void _create_image(const char* mke2fs_options)
+{
+    char cmd[1024];
+    FILE* os;
+
+    /* some non-zero data to write into the file system */
+    if (!(os = fopen(DATA, "w")))
+        _fail("cannot create data file");
+
+    for (size_t i = 0; i < 3 * 1024 * 1024; i++)
+        fputc('a' + i % 26, os);
+
+    fclose(os);
+
+    if (!(os = fopen(COMMANDS, "w")))
+        _fail("cannot create debugfs commands");
+
+    fprintf(os, "write %s f1\nwrite %s f2\nmkdir d\nwrite %s d/f3\nrm f1\n",
+        DATA, DATA, DATA);
+    fclose(os);
+
+    unlink(IMAGE);
+    snprintf(cmd, sizeof(cmd),
+        "mke2fs -q -F -t ext4 %s %s 256M > /dev/null 2>&1",
+        mke2fs_options, IMAGE);
+    _run(cmd);
+
+    snprintf(cmd, sizeof(cmd),
+        "debugfs -w -f %s %s > /dev/null 2>&1", COMMANDS, IMAGE);
+    _run(cmd);
+}
+
+/* build the expected bitmap from the dumpe2fs group listing */
+static uint8_t* _dumpe2fs_bitmap(size_t num_blocks)
+{
+    FILE* is;
+    char line[4096];
+    uint8_t* bits;
+
+    if (!(bits = malloc((num_blocks + 7) / 8)))
+        _fail("out of memory");
+
+    /* everything is in use unless listed as free */
+    memset(bits, 0xff, (num_blocks + 7) / 8);
+
+    if (!(is = popen("dumpe2fs " IMAGE " 2> /dev/null", "r")))
+        _fail("cannot run dumpe2fs");
+
+    while (fgets(line, sizeof(line), is))
+    {
+        const char* p;
+
+        if (!(p = strstr(line, "  Free blocks: ")))
+            continue;
+
+        p += strlen("  Free blocks: ");
+
+        while (*p && *p != '\n')
+        {
+            char* end;
+            size_t first = strtoul(p, &end, 10);
+            size_t last = first;
+
+            if (end == p)
+                _fail("cannot parse dumpe2fs output");
+
+            if (*end == '-')
+                last = strtoul(end + 1, &end, 10);
+
+            for (size_t i = first; i <= last && i < num_blocks; i++)
+                clear_bit(bits, i);
+
+            p = end;
+
+            while (*p == ',' || *p == ' ')
+                p++;
+        }
+    }
+
+    pclose(is);
+
+    return bits;
+}
+
+static void _check(const char* mke2fs_options)
+{
+    ext4_bitmap_t bitmap;
+    uint8_t* expected;
+    size_t num_free = 0;
+
+    _create_image(mke2fs_options);
+
+    if (ext4_get_bitmap(IMAGE, 0, &bitmap) < 0)
+        _fail("ext4_get_bitmap()");
+
+    expected = _dumpe2fs_bitmap(bitmap.num_blocks);
+
+    for (size_t i = 0; i < bitmap.num_blocks; i++)
+    {
+        if (test_bit(bitmap.bits, i) != test_bit(expected, i))
+        {
+            fprintf(stderr, "block %zu\n", i);
+            _fail("bitmap differs from dumpe2fs");
+        }
+
+        if (!test_bit(bitmap.bits, i))
+            num_free++;
+    }
+
+    /* the extents must cover exactly the blocks in use */
+    {
+        frag_list_t extents = FRAG_LIST_INITIALIZER;
+        size_t size = 0;
+
+        if (ext4_get_extents(&bitmap, 0, &extents) < 0)
+            _fail("ext4_get_extents()");
+
+        for (const frag_t* p = extents.head; p; p = p->next)
+        {
+            for (size_t i = 0; i < p->length / bitmap.block_size; i++)
+            {
+                if (!test_bit(bitmap.bits, p->offset / bitmap.block_size + i))
+                    _fail("extent covers a free block");
+            }
+
+            size += p->length;
+        }
+
+        if (size != (bitmap.num_blocks - num_free) * bitmap.block_size)
+            _fail("extents do not cover the blocks in use");
+
+        frags_release(&extents);
+    }
+
+    /* the deleted file must have left free blocks behind */
+    if (num_free * bitmap.block_size < 3 * 1024 * 1024)
+        _fail("too few free blocks");
+
+    printf("=== passed ext4bitmap (%s): %zu of %zu blocks free\n",
+        mke2fs_options, num_free, bitmap.num_blocks);
+
+    free(expected);
+    ext4_release_bitmap(&bitmap);
+}
+
+/* file systems whose bitmaps are not laid out as expected must be refused */
+static void _check_unsupported(const char* mke2fs_options)
+{
+    ext4_bitmap_t bitmap;
+
+    _create_image(mke2fs_options);
+
+    if (ext4_get_bitmap(IMAGE, 0, &bitmap) != -ENOTSUP)
+        _fail("ext4_get_bitmap() did not fail with -ENOTSUP");
+
+    printf("=== passed ext4bitmap (%s): not supported\n", mke2fs_options);
+}
+
+int main(int argc, const char* argv[])
+{
+    _check("-b 4096");
+    _check("-b 1024");
+    _check("-b 4096 -O ^flex_bg,^metadata_csum,^uninit_bg");
+    _check("-b 4096 -O 64bit");
+    _check("-b 4096 -O sparse_super2");
+    _check("-b 1024 -O ^sparse_super,^resize_inode");
+    _check_unsupported("-b 4096 -O bigalloc -C 16384 -g 4096");
+    _check_unsupported("-b 4096 -O meta_bg,^resize_inode");
+
+    unlink(IMAGE);
+    unlink(DATA);
+    unlink(COMMANDS);
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cvmdisk/extents.h>
+
+/*
+**==============================================================================
+**
+** extents: creates a sparse image with data that is unaligned, spans a chunk
+** boundary and is all zero, then checks the ranges of the manifest (and
+** their hashes) and its binary and JSON forms.
+**
+**==============================================================================
+*/
+
+#define IMAGE "extents.img"
+#define JSON "extents.json"
+#define BINARY "extents.bin"
+#define IMAGE_SIZE ((size_t)1024 * 1024)
+#define GRANULARITY ((size_t)64 * 1024)
+#define ALIGNMENT ((size_t)512)
+
+static const extent_t _expected[] =
+{
+    /* two fragments merged within chunk 0 */
+    { 512, 40448 - 512 },
+    /* a fragment split at the end of chunk 1 */
+    { 130560, 131072 - 130560 },
+    { 131072, 132096 - 131072 },
+    /* the last page (like the footer of a VHD) */
+    { IMAGE_SIZE - 512, 512 },
+};
+
+static const size_t _num_expected = sizeof(_expected) / sizeof(_expected[0]);
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "extents: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _fill(int fd, size_t offset, size_t length, uint8_t byte)
+{
+    uint8_t* buf;
+
+    if (!(buf = malloc(length)))
+        _fail("out of memory");
+
+    memset(buf, byte, length);
+
+    if (pwrite(fd, buf, length, offset) != (ssize_t)length)
+        _fail("cannot write image");
+
+    free(buf);
+}
+
+static void _create_image(void)
+{
+    int fd;
+
+    unlink(IMAGE);
+
+    if ((fd = open(IMAGE, O_CREAT | O_RDWR, 0644)) < 0)
+        _fail("cannot create image");
+
+    if (ftruncate(fd, IMAGE_SIZE) != 0)
+        _fail("cannot size image");
+
+    _fill(fd, 1000, 100, 0xaa);
+    _fill(fd, 40000, 10, 0xbb);
+    _fill(fd, 131000, 1000, 0xcc);
+
+    /* allocated but all zero */
+    _fill(fd, 300000, 8192, 0x00);
+
+    _fill(fd, IMAGE_SIZE - 1, 1, 0xdd);
+
+    close(fd);
+}
+
+static void _check(const extents_t* extents, bool sha256)
+{
+    int fd;
+
+    if (extents->size != _num_expected)
+        _fail("unexpected number of ranges");
+
+    if (extents->file_size != IMAGE_SIZE)
+        _fail("unexpected file size");
+
+    if ((fd = open(IMAGE, O_RDONLY)) < 0)
+        _fail("cannot open image");
+
+    for (size_t i = 0; i < _num_expected; i++)
+    {
+        const extent_t* e = &extents->data[i];
+        uint8_t buf[GRANULARITY];
+        sha256_t hash;
+
+        if (e->offset != _expected[i].offset ||
+            e->length != _expected[i].length)
+        {
+            fprintf(stderr, "range %zu: %lu:%lu\n", i, e->offset, e->length);
+            _fail("unexpected range");
+        }
+
+        if (!sha256)
+            continue;
+
+        if (pread(fd, buf, e->length, e->offset) != (ssize_t)e->length)
+            _fail("cannot read image");
+
+        sha256_compute(&hash, buf, e->length);
+
+        if (!sha256_equal(&hash, &e->hash))
+            _fail("unexpected hash");
+    }
+
+    close(fd);
+}
+
+static void _check_binary(const extents_t* extents)
+{
+    FILE* os;
+    FILE* is;
+    extents_header_t h;
+
+    if (!(os = fopen(BINARY, "w")))
+        _fail("cannot create binary manifest");
+
+    if (extents_write_binary(extents, os) != 0)
+        _fail("extents_write_binary()");
+
+    fclose(os);
+
+    if (!(is = fopen(BINARY, "r")))
+        _fail("cannot open binary manifest");
+
+    if (fread(&h, sizeof(h), 1, is) != 1)
+        _fail("cannot read header");
+
+    if (h.magic != EXTENTS_MAGIC || memcmp(&h.magic, "CVMEXTS", 8) != 0 ||
+        h.version != EXTENTS_VERSION || h.flags != EXTENTS_FLAG_SHA256 ||
+        h.file_size != IMAGE_SIZE || h.granularity != GRANULARITY ||
+        h.alignment != ALIGNMENT || h.num_ranges != _num_expected)
+    {
+        _fail("unexpected header");
+    }
+
+    for (size_t i = 0; i < _num_expected; i++)
+    {
+        uint64_t record[2];
+        sha256_t hash;
+
+        if (fread(record, sizeof(record), 1, is) != 1 ||
+            fread(&hash, sizeof(hash), 1, is) != 1)
+        {
+            _fail("cannot read record");
+        }
+
+        if (record[0] != _expected[i].offset ||
+            record[1] != _expected[i].length ||
+            !sha256_equal(&hash, &extents->data[i].hash))
+        {
+            _fail("unexpected record");
+        }
+    }
+
+    if (fgetc(is) != EOF)
+        _fail("trailing data in binary manifest");
+
+    fclose(is);
+    unlink(BINARY);
+}
+
+static void _check_json(const extents_t* extents)
+{
+    FILE* os;
+    char* text;
+    sha256_string_t str;
+    char expect[256];
+
+    if (!(os = fopen(JSON, "w")))
+        _fail("cannot create JSON manifest");
+
+    if (extents_write_json(extents, os) != 0)
+        _fail("extents_write_json()");
+
+    fclose(os);
+
+    if (!(os = fopen(JSON, "r")))
+        _fail("cannot open JSON manifest");
+
+    if (!(text = calloc(1, 64 * 1024)))
+        _fail("out of memory");
+
+    if (fread(text, 1, 64 * 1024 - 1, os) == 0)
+        _fail("cannot read JSON manifest");
+
+    fclose(os);
+
+    sha256_format(&str, &extents->data[0].hash);
+    snprintf(expect, sizeof(expect),
+        "{ \"offset\": 512, \"length\": 39936, \"sha256\": \"%s\" }", str.buf);
+
+    if (!strstr(text, expect) ||
+        !strstr(text, "\"file_size\": 1048576,") ||
+        !strstr(text, "\"data_size\": 41984,"))
+    {
+        _fail("unexpected JSON manifest");
+    }
+
+    free(text);
+    unlink(JSON);
+}
+
+int main(int argc, const char* argv[])
+{
+    extents_t e1;
+    extents_t e4;
+
+    _create_image();
+
+    if (extents_find(IMAGE, GRANULARITY, ALIGNMENT, false, 1, &e1) != 0)
+        _fail("extents_find()");
+
+    _check(&e1, false);
+    extents_release(&e1);
+
+    /* the hashes do not depend on the number of threads */
+    if (extents_find(IMAGE, GRANULARITY, ALIGNMENT, true, 1, &e1) != 0 ||
+        extents_find(IMAGE, GRANULARITY, ALIGNMENT, true, 4, &e4) != 0)
+    {
+        _fail("extents_find()");
+    }
+
+    _check(&e1, true);
+    _check(&e4, true);
+
+    if (extents_sizeof(&e4) != 41984)
+        _fail("extents_sizeof()");
+
+    _check_binary(&e4);
+    _check_json(&e4);
+
+    extents_release(&e1);
+    extents_release(&e4);
+
+    /* errors */
+    if (extents_find(IMAGE, GRANULARITY, 384, false, 1, &e1) != -EINVAL)
+        _fail("accepted an alignment that is not a power of two");
+
+    if (extents_find(IMAGE, 1000, ALIGNMENT, false, 1, &e1) != -EINVAL)
+        _fail("accepted a granularity that is not a multiple of alignment");
+
+    if (truncate(IMAGE, IMAGE_SIZE + 1) != 0)
+        _fail("cannot resize image");
+
+    if (extents_find(IMAGE, GRANULARITY, ALIGNMENT, false, 1, &e1) != -EINVAL)
+        _fail("accepted an image that is not a whole number of pages");
+
+    unlink(IMAGE);
+
+    printf("=== passed extents\n");
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/* the bootloader's libc versions (renamed when compiled) */
+void* libc_memcpy(void* dest, const void* src, size_t n);
+void* libc_memset(void* s, int c, size_t n);
+int libc_memcmp(const void* s1, const void* s2, size_t n);
+
+#define MAX_SIZE 1100
+#define MAX_ALIGN 64
+
+/* guard bytes on either side of the destination */
+#define GUARD 64
+
+#define BENCH_BYTES ((size_t)(256 * 1024 * 1024))
+
+static void _fail(const char* func, size_t n, size_t a1, size_t a2)
+{
+    fprintf(stderr, "libc: FAILED: %s: n=%zu align=%zu/%zu\n",
+        func, n, a1, a2);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int _sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static void _fill(uint8_t* p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = rand();
+}
+
+static void _test_memcpy(void)
+{
+    static uint8_t src[MAX_SIZE + MAX_ALIGN];
+    static uint8_t dest[MAX_SIZE + MAX_ALIGN + 2 * GUARD];
+    static uint8_t expect[sizeof(dest)];
+
+    _fill(src, sizeof(src));
+
+    for (size_t n = 0; n <= MAX_SIZE; n++)
+    {
+        for (size_t a1 = 0; a1 < MAX_ALIGN; a1 += (n < 64) ? 1 : 7)
+        {
+            for (size_t a2 = 0; a2 < 16; a2++)
+            {
+                uint8_t* p = dest + GUARD + a1;
+
+                _fill(dest, sizeof(dest));
+                memcpy(expect, dest, sizeof(dest));
+                memcpy(expect + GUARD + a1, src + a2, n);
+
+                if (libc_memcpy(p, src + a2, n) != p)
+                    _fail("memcpy", n, a1, a2);
+
+                if (memcmp(dest, expect, sizeof(dest)) != 0)
+                    _fail("memcpy", n, a1, a2);
+            }
+        }
+    }
+
+    /* forward overlapping copies, as memmove() does when dest < src */
+    for (size_t n = 0; n <= MAX_SIZE; n++)
+    {
+        for (size_t d = 1; d < 40; d += 3)
+        {
+            _fill(dest, sizeof(dest));
+            memmove(expect, dest, sizeof(dest));
+            memmove(expect + GUARD, expect + GUARD + d, n);
+            libc_memcpy(dest + GUARD, dest + GUARD + d, n);
+
+            if (memcmp(dest, expect, sizeof(dest)) != 0)
+                _fail("memcpy (overlapping)", n, d, 0);
+        }
+    }
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_memset(void)
+{
+    static uint8_t dest[MAX_SIZE + MAX_ALIGN + 2 * GUARD];
+    static uint8_t expect[sizeof(dest)];
+    const int values[] = { 0, 0xab, -1, 0x1ff };
+
+    for (size_t n = 0; n <= MAX_SIZE; n++)
+    {
+        for (size_t a = 0; a < MAX_ALIGN; a++)
+        {
+            for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+            {
+                uint8_t* p = dest + GUARD + a;
+
+                _fill(dest, sizeof(dest));
+                memcpy(expect, dest, sizeof(dest));
+                memset(expect + GUARD + a, values[i], n);
+
+                if (libc_memset(p, values[i], n) != p)
+                    _fail("memset", n, a, 0);
+
+                if (memcmp(dest, expect, sizeof(dest)) != 0)
+                    _fail("memset", n, a, 0);
+            }
+        }
+    }
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_memcmp(void)
+{
+    static uint8_t s1[MAX_SIZE + MAX_ALIGN];
+    static uint8_t s2[MAX_SIZE + MAX_ALIGN];
+
+    for (size_t n = 0; n <= 300; n++)
+    {
+        for (size_t a1 = 0; a1 < 16; a1++)
+        {
+            for (size_t a2 = 0; a2 < 16; a2++)
+            {
+                _fill(s1 + a1, n);
+                memcpy(s2 + a2, s1 + a1, n);
+
+                if (libc_memcmp(s1 + a1, s2 + a2, n) != 0)
+                    _fail("memcmp (equal)", n, a1, a2);
+
+                /* differ at every position, in both directions */
+                for (size_t i = 0; i < n; i++)
+                {
+                    const uint8_t saved = s2[a2 + i];
+
+                    s2[a2 + i] = rand();
+
+                    if (_sign(libc_memcmp(s1 + a1, s2 + a2, n)) !=
+                        _sign(memcmp(s1 + a1, s2 + a2, n)))
+                    {
+                        _fail("memcmp", n, a1, a2);
+                    }
+
+                    s2[a2 + i] = saved;
+                }
+            }
+        }
+    }
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+typedef void* (*copy_func_t)(void* dest, const void* src, size_t n);
+
+static void* _bytewise_memcpy(void* dest, const void* src, size_t n)
+{
+    volatile uint8_t* p = (volatile uint8_t*)dest;
+    const uint8_t* q = (const uint8_t*)src;
+
+    while (n--)
+        *p++ = *q++;
+
+    return dest;
+}
+
+static double _bench_copy(copy_func_t func, size_t n, size_t align)
+{
+    static uint8_t* buf;
+    const size_t iterations = BENCH_BYTES / n;
+    double t;
+
+    if (!buf && !(buf = calloc(1, 2 * (64 * 1024 * 1024) + 128)))
+        exit(1);
+
+    t = _now();
+
+    for (size_t i = 0; i < iterations; i++)
+        (*func)(buf + align, buf + 64 * 1024 * 1024 + 64, n);
+
+    t = _now() - t;
+    return BENCH_BYTES / t / 1e9;
+}
+
+static void _benchmark(void)
+{
+    const size_t sizes[] = { 16, 256, 4096, 65536, 4 * 1024 * 1024 };
+
+    printf("%10s %6s %12s %12s %12s\n",
+        "size", "align", "bytewise", "libc", "glibc");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (size_t align = 0; align < 2; align++)
+        {
+            const size_t n = sizes[i];
+            const size_t a = align ? 3 : 0;
+            const double t0 = _bench_copy(_bytewise_memcpy, n, a);
+            const double t1 = _bench_copy(libc_memcpy, n, a);
+            const double t2 = _bench_copy(memcpy, n, a);
+
+            printf("%10zu %6zu %7.2f GB/s %7.2f GB/s %7.2f GB/s\n",
+                n, a, t0, t1, t2);
+        }
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    srand(1234);
+
+    _test_memcpy();
+    _test_memset();
+    _test_memcmp();
+
+    /* pass "bench" to measure memcpy() throughput */
+    if (argc == 2 && strcmp(argv[1], "bench") == 0)
+        _benchmark();
+
+    return 0;
+}
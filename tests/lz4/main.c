@@ -0,0 +1,332 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utils/lz4.h>
+#include <utils/sha256.h>
+#include <utils/allocator.h>
+
+allocator_t __allocator = { malloc, free };
+
+/* default device throughput (MB/s) for the load estimate */
+#define DEFAULT_DEVICE_MBPS 200.0
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "lz4: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void _fill_random(uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        data[i] = rand();
+}
+
+/* text-like data: words from a small vocabulary */
+static void _fill_text(uint8_t* data, size_t size)
+{
+    static const char* words[] =
+    {
+        "module", "kernel", "initrd", "verity", "root", "hash", "block",
+        "device", "mapper", "lib", "firmware", "x86_64", ".ko", "/usr/",
+    };
+    const size_t nwords = sizeof(words) / sizeof(words[0]);
+    size_t i = 0;
+
+    while (i < size)
+    {
+        const char* w = words[rand() % nwords];
+
+        while (*w && i < size)
+            data[i++] = *w++;
+
+        if (i < size)
+            data[i++] = (rand() % 4) ? ' ' : '\n';
+    }
+}
+
+static size_t _compress(const uint8_t* data, size_t size, uint8_t** out)
+{
+    size_t n;
+
+    if (!(*out = malloc(lz4_compress_frame_bound(size))))
+        _fail("out of memory");
+
+    n = lz4_compress_frame(data, size, *out, lz4_compress_frame_bound(size));
+
+    if (n == 0)
+        _fail("lz4_compress_frame");
+
+    return n;
+}
+
+static void _round_trip(const uint8_t* data, size_t size)
+{
+    uint8_t* frame;
+    uint8_t* out;
+    size_t n = _compress(data, size, &frame);
+    uint64_t content_size;
+
+    if (!lz4_is_frame(frame, n))
+        _fail("lz4_is_frame");
+
+    if (lz4_get_content_size(frame, n, &content_size) != 0)
+        _fail("lz4_get_content_size");
+
+    if (content_size != size)
+        _fail("content size mismatch");
+
+    if (!(out = malloc(size + 1)))
+        _fail("out of memory");
+
+    if (lz4_decompress_frame(frame, n, out, size) != 0)
+        _fail("lz4_decompress_frame");
+
+    if (memcmp(out, data, size) != 0)
+        _fail("round trip mismatch");
+
+    /* the output size must match the content size exactly */
+    if (lz4_decompress_frame(frame, n, out, size + 1) == 0)
+        _fail("accepted wrong output size");
+
+    free(out);
+    free(frame);
+}
+
+static void _test_xxh32(void)
+{
+    if (lz4_xxh32("", 0, 0) != 0x02CC5D05)
+        _fail("xxh32 empty");
+
+    if (lz4_xxh32("abc", 3, 0) != 0x32D153FF)
+        _fail("xxh32 abc");
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_round_trips(void)
+{
+    const size_t max = 9 * 1024 * 1024 + 17;
+    uint8_t* data;
+
+    if (!(data = malloc(max)))
+        _fail("out of memory");
+
+    srand(1234);
+
+    /* small sizes around the block end conditions */
+    for (size_t size = 0; size < 300; size++)
+    {
+        _fill_text(data, size);
+        _round_trip(data, size);
+        _fill_random(data, size);
+        _round_trip(data, size);
+        memset(data, 0, size);
+        _round_trip(data, size);
+    }
+
+    /* multiple blocks, with a short last block */
+    _fill_random(data, max);
+    _round_trip(data, max);
+    _fill_text(data, max);
+    _round_trip(data, max);
+    memset(data, 0, max);
+    _round_trip(data, max);
+
+    /* mixed: random, then zeros, then text */
+    _fill_random(data, max / 3);
+    memset(data + max / 3, 0, max / 3);
+    _fill_text(data + 2 * (max / 3), max - 2 * (max / 3));
+    _round_trip(data, max);
+
+    free(data);
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_corrupt(void)
+{
+    const size_t size = 256 * 1024;
+    uint8_t* data;
+    uint8_t* frame;
+    uint8_t* out;
+    size_t n;
+
+    if (!(data = malloc(size)) || !(out = malloc(size)))
+        _fail("out of memory");
+
+    srand(1234);
+    _fill_text(data, size);
+    n = _compress(data, size, &frame);
+
+    /* truncated frames */
+    for (size_t i = 0; i < n; i += (i < 64) ? 1 : 997)
+    {
+        if (lz4_decompress_frame(frame, i, out, size) == 0)
+            _fail("accepted truncated frame");
+    }
+
+    /* bad header checksum */
+    frame[14] ^= 1;
+
+    if (lz4_decompress_frame(frame, n, out, size) == 0)
+        _fail("accepted bad header checksum");
+
+    frame[14] ^= 1;
+
+    /* corrupt bytes must never cause out-of-bounds accesses (run under
+     * valgrind or ASan to check); the result is simply an error or
+     * different output */
+    for (size_t i = 15; i < n; i += 101)
+    {
+        const uint8_t b = frame[i];
+        frame[i] = ~b;
+        lz4_decompress_frame(frame, n, out, size);
+        frame[i] = b;
+    }
+
+    if (lz4_decompress_frame(frame, n, out, size) != 0)
+        _fail("lz4_decompress_frame");
+
+    if (memcmp(out, data, size) != 0)
+        _fail("mismatch after corruption tests");
+
+    if (lz4_is_frame(data, size))
+        _fail("lz4_is_frame on plain data");
+
+    free(frame);
+    free(out);
+    free(data);
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+/* A synthetic cvmboot.cpio: an already-compressed kernel, an initrd and
+ * modules that compress moderately, and page-alignment padding.
+ */
+static size_t _make_archive(uint8_t** data_out)
+{
+    const size_t kernel = 12 * 1024 * 1024;
+    const size_t initrd = 48 * 1024 * 1024;
+    const size_t padding = 4 * 1024 * 1024;
+    const size_t size = kernel + initrd + padding;
+    uint8_t* data;
+
+    if (!(data = calloc(1, size)))
+        _fail("out of memory");
+
+    srand(1234);
+    _fill_random(data, kernel);
+    _fill_text(data + kernel, initrd / 2);
+
+    /* binary-like half: random bytes with repeated structure */
+    for (size_t i = kernel + initrd / 2; i < kernel + initrd; i += 64)
+    {
+        if (rand() % 3 == 0)
+            _fill_random(data + i, 64);
+        else
+            memcpy(data + i, data + i - 4096, 64);
+    }
+
+    *data_out = data;
+    return size;
+}
+
+static void _benchmark(double device_mbps)
+{
+    uint8_t* data;
+    uint8_t* frame;
+    uint8_t* out;
+    const size_t size = _make_archive(&data);
+    size_t n;
+    double t;
+    double hash_raw;
+    double hash_frame;
+    double decompress;
+    double compress;
+    sha256_t hash;
+    const double mb = 1024.0 * 1024.0;
+
+    t = _now();
+    n = _compress(data, size, &frame);
+    compress = _now() - t;
+
+    if (!(out = malloc(size)))
+        _fail("out of memory");
+
+    t = _now();
+    sha256_compute(&hash, data, size);
+    hash_raw = _now() - t;
+
+    t = _now();
+    sha256_compute(&hash, frame, n);
+    hash_frame = _now() - t;
+
+    t = _now();
+
+    if (lz4_decompress_frame(frame, n, out, size) != 0)
+        _fail("lz4_decompress_frame");
+
+    decompress = _now() - t;
+
+    if (memcmp(out, data, size) != 0)
+        _fail("benchmark mismatch");
+
+    printf("archive: %.1f MB raw, %.1f MB compressed (%.1f%%)\n",
+        size / mb, n / mb, 100.0 * n / size);
+    printf("compress: %.1f ms (%.0f MB/s)\n",
+        compress * 1000, size / mb / compress);
+    printf("decompress: %.1f ms (%.0f MB/s)\n",
+        decompress * 1000, size / mb / decompress);
+
+    /* load = read from the device + hash (+ decompress) */
+    {
+        const double read_raw = size / mb / device_mbps;
+        const double read_frame = n / mb / device_mbps;
+        const double raw = read_raw + hash_raw;
+        const double comp = read_frame + hash_frame + decompress;
+
+        printf("load+verify at %.0f MB/s: raw %.1f ms, compressed %.1f ms\n",
+            device_mbps, raw * 1000, comp * 1000);
+    }
+
+    free(out);
+    free(frame);
+    free(data);
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        double mbps = DEFAULT_DEVICE_MBPS;
+
+        if (argc == 3)
+            mbps = atof(argv[2]);
+
+        if (argc > 3 || mbps <= 0)
+        {
+            fprintf(stderr, "Usage: %s bench [device-MB/s]\n", argv[0]);
+            exit(1);
+        }
+
+        _benchmark(mbps);
+        return 0;
+    }
+
+    _test_xxh32();
+    _test_round_trips();
+    _test_corrupt();
+    _benchmark(DEFAULT_DEVICE_MBPS);
+
+    return 0;
+}
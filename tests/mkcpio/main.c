@@ -0,0 +1,299 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utils/cpio.h>
+#include <utils/sha256.h>
+#include <utils/allocator.h>
+#include <common/file.h>
+#include <cvmdisk/mkcpio.h>
+
+allocator_t __allocator = { malloc, free };
+
+#define DIR "mkcpio.dir"
+#define CPIO1 "mkcpio1.cpio"
+#define CPIO2 "mkcpio2.cpio"
+
+#define ALIGNMENT 4096
+
+typedef struct test_file
+{
+    const char* name;
+    size_t size;
+}
+test_file_t;
+
+/* listed in reverse order so creation order differs from archive order */
+static const test_file_t _files[] =
+{
+    { "vmlinuz", 5 * 1024 * 1024 + 123 },
+    { "initrd", 11 * 1024 * 1024 + 7 },
+    { "events", 300 },
+    { "empty", 0 },
+    { "dir/sub/b", 4096 },
+    { "dir/a", 4095 },
+    { "cvmboot.conf", 77 },
+};
+
+static const size_t _nfiles = sizeof(_files) / sizeof(_files[0]);
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "mkcpio: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _fill(uint8_t* data, size_t size, size_t seed)
+{
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 31 + seed * 7 + (i >> 12));
+}
+
+static void _create_tree(void)
+{
+    if (system("rm -rf " DIR) != 0)
+        _fail("rm");
+
+    if (mkdir(DIR, 0755) < 0 || mkdir(DIR "/dir", 0755) < 0 ||
+        mkdir(DIR "/dir/sub", 0755) < 0)
+    {
+        _fail("mkdir");
+    }
+
+    for (size_t i = 0; i < _nfiles; i++)
+    {
+        char path[256];
+        uint8_t* data;
+
+        if (!(data = malloc(_files[i].size + 1)))
+            _fail("out of memory");
+
+        _fill(data, _files[i].size, i);
+        snprintf(path, sizeof(path), "%s/%s", DIR, _files[i].name);
+
+        if (write_file(path, data, _files[i].size) < 0)
+            _fail("write_file");
+
+        free(data);
+    }
+}
+
+static void _check_archive(const char* path, const sha256_t* hash, size_t size)
+{
+    void* cpio_data;
+    size_t cpio_size;
+    sha256_t expect;
+
+    if (load_file(path, &cpio_data, &cpio_size) < 0)
+        _fail("load_file");
+
+    if (cpio_size != size || cpio_size % 512)
+        _fail("archive size");
+
+    /* the digest is of exactly the bytes written */
+    sha256_compute(&expect, cpio_data, cpio_size);
+
+    if (!sha256_equal(hash, &expect))
+        _fail("digest differs from the archive");
+
+    for (size_t i = 0; i < _nfiles; i++)
+    {
+        const void* data;
+        size_t n;
+        uint8_t* buf;
+
+        if (cpio_get_file_direct(cpio_data, cpio_size, _files[i].name,
+            &data, &n) < 0)
+        {
+            _fail("file not found in archive");
+        }
+
+        if (n != _files[i].size)
+            _fail("file size");
+
+        if (!(buf = malloc(n + 1)))
+            _fail("out of memory");
+
+        _fill(buf, n, i);
+
+        if (memcmp(buf, data, n) != 0)
+            _fail("file contents");
+
+        free(buf);
+
+        /* large files start on an alignment boundary */
+        if (n >= ALIGNMENT &&
+            ((const uint8_t*)data - (const uint8_t*)cpio_data) % ALIGNMENT)
+        {
+            fprintf(stderr, "%s\n", _files[i].name);
+            _fail("file data is not aligned");
+        }
+    }
+
+    free(cpio_data);
+}
+
+/* entries appear in sorted order: ".", then a depth-first strcmp() walk */
+static void _check_order(const char* path)
+{
+    static const char* expect[] =
+    {
+        ".", "cvmboot.conf", "dir", "dir/a", "dir/sub", "dir/sub/b",
+        "empty", "events", "initrd", "vmlinuz", "TRAILER!!!",
+    };
+    void* data;
+    size_t size;
+    const char* p;
+    size_t i = 0;
+
+    if (load_file(path, &data, &size) < 0)
+        _fail("load_file");
+
+    /* scan the names of the entries (skipping filler entries) */
+    for (p = data; p < (const char*)data + size && i < 11; )
+    {
+        char hex[9];
+        size_t namesize;
+        size_t filesize;
+        const char* name = p + 110;
+
+        if (memcmp(p, "070701", 6) != 0)
+            _fail("bad magic");
+
+        memcpy(hex, p + 54, 8);
+        hex[8] = '\0';
+        filesize = strtoul(hex, NULL, 16);
+        memcpy(hex, p + 94, 8);
+        namesize = strtoul(hex, NULL, 16);
+
+        /* all entries have the same mtime */
+        if (memcmp(p + 46, "499602D2", 8) != 0)
+            _fail("mtime");
+
+        if (strcmp(name, CPIO_FILLER_NAME) != 0)
+        {
+            if (strcmp(name, expect[i]) != 0)
+            {
+                fprintf(stderr, "%s != %s\n", name, expect[i]);
+                _fail("entry order");
+            }
+
+            i++;
+        }
+
+        p += (110 + namesize + 3) / 4 * 4;
+        p += (filesize + 3) / 4 * 4;
+    }
+
+    if (i != 11)
+        _fail("missing entries");
+
+    free(data);
+}
+
+static void _test_mkcpio(void)
+{
+    sha256_t hash1;
+    sha256_t hash2;
+    size_t size1;
+    size_t size2;
+    void* data1;
+    void* data2;
+
+    _create_tree();
+
+    if (mkcpio_file(DIR, CPIO1, ALIGNMENT, 1234567890, &hash1, &size1) < 0)
+        _fail("mkcpio_file");
+
+    _check_archive(CPIO1, &hash1, size1);
+    _check_order(CPIO1);
+
+    /* recreating the tree (new inodes and mtimes) gives the same archive */
+    sleep(1);
+    _create_tree();
+
+    if (mkcpio_file(DIR, CPIO2, ALIGNMENT, 1234567890, &hash2, &size2) < 0)
+        _fail("mkcpio_file");
+
+    if (!sha256_equal(&hash1, &hash2) || size1 != size2)
+        _fail("archive is not reproducible");
+
+    if (load_file(CPIO1, &data1, &size1) < 0 ||
+        load_file(CPIO2, &data2, &size2) < 0)
+    {
+        _fail("load_file");
+    }
+
+    if (size1 != size2 || memcmp(data1, data2, size1) != 0)
+        _fail("archives differ");
+
+    free(data1);
+    free(data2);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_no_alignment(void)
+{
+    sha256_t hash;
+    size_t size;
+    size_t total = 0;
+
+    if (mkcpio_file(DIR, CPIO1, 0, 0, &hash, &size) < 0)
+        _fail("mkcpio_file");
+
+    /* without alignment the archive has no filler entries */
+    for (size_t i = 0; i < _nfiles; i++)
+        total += _files[i].size;
+
+    if (size > total + 512 + 20 * 128)
+        _fail("unaligned archive is too big");
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static int _null_callback(void* context, const void* data, size_t size)
+{
+    return 0;
+}
+
+static void _test_writer_errors(void)
+{
+    cpio_writer_t writer;
+
+    if (cpio_writer_init(&writer, 6, 0, _null_callback, NULL) == 0)
+        _fail("accepted alignment that is not a multiple of 4");
+
+    if (cpio_writer_init(&writer, 4096, 0, _null_callback, NULL) != 0)
+        _fail("cpio_writer_init");
+
+    if (cpio_writer_add(&writer, "TRAILER!!!", 0100644, NULL, 0) == 0)
+        _fail("accepted trailer name");
+
+    if (cpio_writer_add(&writer, "", 0100644, NULL, 0) == 0)
+        _fail("accepted empty name");
+
+    if (cpio_writer_add(&writer, "x", 0100644, NULL, 1) == 0)
+        _fail("accepted null data");
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+int main(int argc, const char* argv[])
+{
+    _test_mkcpio();
+    _test_no_alignment();
+    _test_writer_errors();
+
+    if (system("rm -rf " DIR) != 0)
+        _fail("rm");
+
+    unlink(CPIO1);
+    unlink(CPIO2);
+
+    return 0;
+}
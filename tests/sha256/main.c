@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+#include <utils/sha256.h>
+#include <utils/sha256ni.h>
+#include <utils/allocator.h>
+
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+allocator_t __allocator = { malloc, free };
+
+#define BENCH_SIZE ((size_t)(256 * 1024 * 1024))
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "sha256: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void _check(const sha256_t* hash, const char* expect)
+{
+    sha256_string_t str;
+
+    sha256_format(&str, hash);
+
+    if (strcmp(str.buf, expect) != 0)
+    {
+        fprintf(stderr, "expected %s\ngot      %s\n", expect, str.buf);
+        _fail("known answer");
+    }
+}
+
+/* FIPS 180-2 known answers */
+static void _test_known_answers(void)
+{
+    sha256_t hash;
+    sha256_ctx_t ctx;
+    char a[1000];
+
+    sha256_compute(&hash, "", 0);
+    _check(&hash,
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+    sha256_compute(&hash, "abc", 3);
+    _check(&hash,
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    sha256_compute(&hash,
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56);
+    _check(&hash,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    memset(a, 'a', sizeof(a));
+    sha256_init(&ctx);
+
+    for (size_t i = 0; i < 1000; i++)
+        sha256_update(&ctx, a, sizeof(a));
+
+    sha256_final(&hash, &ctx);
+    _check(&hash,
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+/* compare against OpenSSL for every length and split around block edges */
+static void _test_lengths(void)
+{
+    uint8_t data[1024];
+
+    srand(1234);
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = rand();
+
+    for (size_t n = 0; n <= sizeof(data); n++)
+    {
+        sha256_t expect;
+        sha256_t hash;
+
+        SHA256(data, n, expect.data);
+
+        sha256_compute(&hash, data, n);
+
+        if (!sha256_equal(&hash, &expect))
+            _fail("sha256_compute() differs from OpenSSL");
+
+        for (size_t split = 0; split <= n && split < 200; split += 7)
+        {
+            sha256_compute2(&hash, data, split, data + split, n - split);
+
+            if (!sha256_equal(&hash, &expect))
+                _fail("sha256_compute2() differs from OpenSSL");
+        }
+    }
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _benchmark(void)
+{
+    uint8_t* data;
+    sha256_t x;
+    sha256_t y;
+    double t1;
+    double t2;
+
+    if (!(data = malloc(BENCH_SIZE)))
+        _fail("out of memory");
+
+    memset(data, 0xab, BENCH_SIZE);
+
+    t1 = _now();
+    SHA256(data, BENCH_SIZE, x.data);
+    t1 = _now() - t1;
+
+    t2 = _now();
+    sha256_compute(&y, data, BENCH_SIZE);
+    t2 = _now() - t2;
+
+    if (!sha256_equal(&x, &y))
+        _fail("benchmark hash differs from OpenSSL");
+
+    printf("SHA extensions: %s\n", sha256ni_supported() ? "yes" : "no");
+    printf("OpenSSL:        %.0f MB/s\n", BENCH_SIZE / t1 / 1e6);
+    printf("sha256:         %.0f MB/s\n", BENCH_SIZE / t2 / 1e6);
+
+    free(data);
+}
+
+int main(int argc, const char* argv[])
+{
+    _test_known_answers();
+    _test_lengths();
+    _benchmark();
+    return 0;
+}
@@ -0,0 +1,256 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <utils/sha256.h>
+#include <utils/allocator.h>
+
+allocator_t __allocator = { malloc, free };
+
+#define TEST_FILE "sha256read.img"
+
+/* 64 MiB plus an odd tail so the last chunk is short */
+#define TEST_FILE_SIZE ((size_t)(64 * 1024 * 1024 + 12345))
+
+typedef struct read_context
+{
+    int fd;
+
+    /* if non-zero, return at most this many bytes per read (short reads) */
+    size_t max_read;
+}
+read_context_t;
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "sha256read: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int _read_callback(
+    void* context,
+    void* data,
+    size_t size,
+    size_t* size_read)
+{
+    read_context_t* rc = (read_context_t*)context;
+    ssize_t n;
+
+    if (rc->max_read && size > rc->max_read)
+        size = rc->max_read;
+
+    if ((n = read(rc->fd, data, size)) < 0)
+        return -1;
+
+    *size_read = (size_t)n;
+    return 0;
+}
+
+static size_t _file_size(const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+        _fail("stat");
+
+    return (size_t)st.st_size;
+}
+
+static void _create_file(void)
+{
+    uint8_t* data;
+    FILE* os;
+
+    if (!(data = malloc(TEST_FILE_SIZE)))
+        _fail("out of memory");
+
+    srand(1234);
+
+    for (size_t i = 0; i < TEST_FILE_SIZE; i++)
+        data[i] = rand();
+
+    if (!(os = fopen(TEST_FILE, "w")))
+        _fail("cannot create " TEST_FILE);
+
+    if (fwrite(data, 1, TEST_FILE_SIZE, os) != TEST_FILE_SIZE)
+        _fail("cannot write " TEST_FILE);
+
+    fclose(os);
+    free(data);
+}
+
+/* the bootloader's original approach: read everything, then hash it */
+static double _load_then_hash(const char* path, sha256_t* hash)
+{
+    size_t size = _file_size(path);
+    uint8_t* data;
+    read_context_t rc = { -1, 0 };
+    size_t off = 0;
+    double start = _now();
+
+    if (!(data = malloc(size)))
+        _fail("out of memory");
+
+    if ((rc.fd = open(path, O_RDONLY)) < 0)
+        _fail("open");
+
+    while (off < size)
+    {
+        size_t n;
+
+        if (_read_callback(&rc, data + off, size - off, &n) != 0 || n == 0)
+            _fail("read");
+
+        off += n;
+    }
+
+    sha256_compute(hash, data, size);
+
+    close(rc.fd);
+    free(data);
+    return _now() - start;
+}
+
+static double _load_and_hash(
+    const char* path,
+    size_t chunk_size,
+    size_t max_read,
+    sha256_t* hash)
+{
+    size_t size = _file_size(path);
+    uint8_t* data;
+    read_context_t rc = { -1, max_read };
+    double start = _now();
+
+    if (!(data = malloc(size)))
+        _fail("out of memory");
+
+    if ((rc.fd = open(path, O_RDONLY)) < 0)
+        _fail("open");
+
+    if (sha256_read(hash, data, size, chunk_size, _read_callback, &rc) != 0)
+        _fail("sha256_read");
+
+    close(rc.fd);
+    free(data);
+    return _now() - start;
+}
+
+static void _test_hashes(void)
+{
+    const size_t chunk_sizes[] = { 4096, 65536, SHA256_READ_CHUNK_SIZE };
+    sha256_t expect;
+
+    _load_then_hash(TEST_FILE, &expect);
+
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++)
+    {
+        sha256_t hash;
+
+        _load_and_hash(TEST_FILE, chunk_sizes[i], 0, &hash);
+
+        if (!sha256_equal(&hash, &expect))
+            _fail("hash mismatch");
+
+        /* the device may return less than was asked for */
+        _load_and_hash(TEST_FILE, chunk_sizes[i], 1000, &hash);
+
+        if (!sha256_equal(&hash, &expect))
+            _fail("hash mismatch with short reads");
+    }
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_errors(void)
+{
+    const char data[] = "abc";
+    sha256_t hash;
+    sha256_t expect;
+    uint8_t buf[sizeof(data)];
+    read_context_t rc = { -1, 0 };
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        _fail("pipe");
+
+    if (write(fds[1], data, sizeof(data)) != sizeof(data))
+        _fail("write");
+
+    close(fds[1]);
+    rc.fd = fds[0];
+
+    /* a one-byte chunk size hashes the same as one pass */
+    if (sha256_read(&hash, buf, sizeof(buf), 1, _read_callback, &rc) != 0)
+        _fail("sha256_read");
+
+    sha256_compute(&expect, data, sizeof(data));
+
+    if (!sha256_equal(&hash, &expect))
+        _fail("hash mismatch with one-byte chunks");
+
+    /* fail rather than spin at end of file */
+    if (sha256_read(&hash, buf, sizeof(buf), 1, _read_callback, &rc) == 0)
+        _fail("sha256_read succeeded past end of file");
+
+    if (sha256_read(&hash, buf, sizeof(buf), 0, _read_callback, &rc) == 0)
+        _fail("sha256_read accepted a zero chunk size");
+
+    close(fds[0]);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _benchmark(const char* path)
+{
+    size_t size = _file_size(path);
+    sha256_t x;
+    sha256_t y;
+    double t1;
+    double t2;
+
+    /* warm the page cache so both runs read from memory */
+    _load_then_hash(path, &x);
+
+    t1 = _load_then_hash(path, &x);
+    t2 = _load_and_hash(path, SHA256_READ_CHUNK_SIZE, 0, &y);
+
+    if (!sha256_equal(&x, &y))
+        _fail("hash mismatch");
+
+    printf("%s: %zu bytes\n", path, size);
+    printf("load then hash: %.3f seconds\n", t1);
+    printf("load and hash:  %.3f seconds\n", t2);
+}
+
+int main(int argc, const char* argv[])
+{
+    /* benchmark a given file, e.g. cvmboot.cpio */
+    if (argc == 2)
+    {
+        _benchmark(argv[1]);
+        return 0;
+    }
+
+    _create_file();
+    _test_hashes();
+    _test_errors();
+    _benchmark(TEST_FILE);
+
+    unlink(TEST_FILE);
+
+    return 0;
+}
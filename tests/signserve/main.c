@@ -0,0 +1,328 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <utils/sha256.h>
+#include <utils/allocator.h>
+#include <common/key.h>
+#include <common/signproto.h>
+
+#define DIRNAME "signserve.dir"
+#define SOCKET_PATH DIRNAME "/cvmsign.sock"
+
+allocator_t __allocator = { malloc, free };
+
+static const char* _cvmsign;
+static size_t _count = 100;
+static size_t _threads = 4;
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "signserve: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static void _make_digest(sha256_t* digest, size_t i)
+{
+    sha256_compute(digest, &i, sizeof(i));
+}
+
+static void _check_response(
+    const sha256_t* digest,
+    const signproto_response_t* response)
+{
+    public_rsa_key_t* pubkey = NULL;
+    char* pem;
+
+    /* the key reader expects a zero-terminated PEM string */
+    if (!(pem = calloc(1, response->pubkey_size + 1)))
+        _fail("out of memory");
+
+    memcpy(pem, response->pubkey, response->pubkey_size);
+
+    if (read_public_rsa_key(&pubkey, pem, response->pubkey_size + 1) < 0)
+        _fail("cannot read public key from response");
+
+    if (rsa_verify(pubkey, digest,
+        response->signature, response->signature_size) != 0)
+    {
+        _fail("signature verification failed");
+    }
+
+    free_public_rsa_key(pubkey);
+    free(pem);
+}
+
+static pid_t _start_server(void)
+{
+    pid_t pid;
+
+    unlink(SOCKET_PATH);
+
+    if ((pid = fork()) < 0)
+        _fail("fork");
+
+    if (pid == 0)
+    {
+        execl(_cvmsign, _cvmsign, "serve", "--socket", SOCKET_PATH,
+            "--workers", "8", NULL);
+        _exit(127);
+    }
+
+    /* wait for the service to accept connections */
+    for (size_t i = 0; i < 100; i++)
+    {
+        int fd;
+
+        if (signproto_connect(SOCKET_PATH, &fd) == 0)
+        {
+            close(fd);
+            return pid;
+        }
+
+        usleep(100000);
+    }
+
+    _fail("service did not start");
+    return -1;
+}
+
+static void _stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    if (access(SOCKET_PATH, F_OK) == 0)
+        _fail("socket was not removed on exit");
+}
+
+/* one cvmsign process per signature (loads the key every time) */
+static double _bench_exec(size_t count)
+{
+    double start = _now();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sha256_t digest;
+        sha256_string_t str;
+        char cmd[PATH_MAX + 256];
+
+        _make_digest(&digest, i);
+        sha256_format(&str, &digest);
+
+        snprintf(cmd, sizeof(cmd), "%s --digest %s %s/exec > /dev/null",
+            _cvmsign, str.buf, DIRNAME);
+
+        if (system(cmd) != 0)
+            _fail(cmd);
+    }
+
+    return (double)count / (_now() - start);
+}
+
+typedef struct thread_arg
+{
+    size_t first;
+    size_t count;
+}
+thread_arg_t;
+
+/* one connection per thread, one request per signature */
+static void* _client_thread(void* arg_)
+{
+    const thread_arg_t* arg = (const thread_arg_t*)arg_;
+    signproto_response_t* response;
+    int fd;
+
+    if (!(response = malloc(sizeof(signproto_response_t))))
+        _fail("out of memory");
+
+    if (signproto_connect(SOCKET_PATH, &fd) < 0)
+        _fail("signproto_connect");
+
+    for (size_t i = arg->first; i < arg->first + arg->count; i++)
+    {
+        sha256_t digest;
+
+        _make_digest(&digest, i);
+
+        if (signproto_request(fd, &digest, response) < 0)
+            _fail("signproto_request");
+
+        /* verify a sample of the signatures */
+        if (i % 16 == 0)
+            _check_response(&digest, response);
+    }
+
+    close(fd);
+    free(response);
+    return NULL;
+}
+
+static double _bench_service(size_t count, size_t nthreads)
+{
+    pthread_t threads[nthreads];
+    thread_arg_t args[nthreads];
+    double start = _now();
+
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        args[i].first = i * (count / nthreads);
+        args[i].count = count / nthreads;
+
+        if (pthread_create(&threads[i], NULL, _client_thread, &args[i]) != 0)
+            _fail("pthread_create");
+    }
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    return (double)(count / nthreads * nthreads) / (_now() - start);
+}
+
+/* the service and the exec'd tool produce the same signature */
+static void _test_same_signature(void)
+{
+    signproto_response_t* response;
+    sha256_t digest;
+    void* data;
+    size_t size;
+    char path[PATH_MAX];
+    FILE* is;
+
+    if (!(response = malloc(sizeof(signproto_response_t))))
+        _fail("out of memory");
+
+    _bench_exec(1);
+    _make_digest(&digest, 0);
+
+    if (signproto_sign(SOCKET_PATH, &digest, response) < 0)
+        _fail("signproto_sign");
+
+    _check_response(&digest, response);
+
+    snprintf(path, sizeof(path), "%s/exec.sig", DIRNAME);
+
+    if (!(is = fopen(path, "r")))
+        _fail("cannot open exec.sig");
+
+    if (!(data = malloc(response->signature_size + 1)))
+        _fail("out of memory");
+
+    size = fread(data, 1, response->signature_size + 1, is);
+    fclose(is);
+
+    if (size != response->signature_size ||
+        memcmp(data, response->signature, size) != 0)
+    {
+        _fail("service signature differs from cvmsign signature");
+    }
+
+    free(data);
+    free(response);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _test_bad_request(void)
+{
+    signproto_request_t request;
+    signproto_response_t* response;
+    int fd;
+
+    if (!(response = malloc(sizeof(signproto_response_t))))
+        _fail("out of memory");
+
+    memset(&request, 0, sizeof(request));
+
+    if (signproto_connect(SOCKET_PATH, &fd) < 0)
+        _fail("signproto_connect");
+
+    if (signproto_writen(fd, &request, sizeof(request)) < 0 ||
+        signproto_readn(fd, response, sizeof(*response)) < 0)
+    {
+        _fail("bad request was not answered");
+    }
+
+    if (response->status == 0)
+        _fail("bad request was accepted");
+
+    close(fd);
+    free(response);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+static void _bench(void)
+{
+    size_t exec_count = _count / 10 ? _count / 10 : 1;
+    double exec_rate = _bench_exec(exec_count);
+    double serial_rate = _bench_service(_count, 1);
+    double parallel_rate = _bench_service(_count, _threads);
+
+    printf("cvmsign (exec):      %10.1f signatures/second\n", exec_rate);
+    printf("cvmsign serve:       %10.1f signatures/second\n", serial_rate);
+    printf("cvmsign serve (x%zu): %10.1f signatures/second\n",
+        _threads, parallel_rate);
+
+    printf("=== passed %s()\n", __FUNCTION__);
+}
+
+int main(int argc, const char* argv[])
+{
+    pid_t pid;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <cvmsign-path> [count [threads]]\n",
+            argv[0]);
+        exit(1);
+    }
+
+    _cvmsign = argv[1];
+
+    if (argc > 2)
+        _count = strtoul(argv[2], NULL, 10);
+
+    if (argc > 3)
+        _threads = strtoul(argv[3], NULL, 10);
+
+    if (_count == 0 || _threads == 0 || _threads > 64)
+        _fail("bad arguments");
+
+    mkdir(DIRNAME, 0700);
+
+    /* cvmdisk probes for the digest protocol before using it */
+    {
+        char cmd[PATH_MAX + 64];
+
+        snprintf(cmd, sizeof(cmd), "%s --digest-supported", _cvmsign);
+
+        if (system(cmd) != 0)
+            _fail("cvmsign does not answer the digest protocol probe");
+    }
+
+    pid = _start_server();
+    _test_same_signature();
+    _test_bad_request();
+    _bench();
+    _stop_server(pid);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+**==============================================================================
+**
+** sparsefs: mounts sparsefs over a directory holding a regular file and opens,
+** reads and releases it many times through the mount point (each open gets a
+** new file handle), then reads the statistics file, checking the contents.
+**
+**==============================================================================
+*/
+
+#define DIRNAME "sparsefs.dir"
+#define BASEDIR DIRNAME "/basedir"
+#define MNTDIR DIRNAME "/mntdir"
+#define FILENAME "file"
+#define STATS_PATH MNTDIR "/.sparsefs-stats"
+#define FILE_SIZE (256 * 1024)
+#define ITERATIONS 1000
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "sparsefs: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _fill(char* buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        buf[i] = 'a' + i % 26;
+}
+
+static void _create_file(void)
+{
+    static char buf[FILE_SIZE];
+    int fd;
+
+    _fill(buf, sizeof(buf));
+
+    if ((fd = creat(BASEDIR "/" FILENAME, 0644)) < 0)
+        _fail("cannot create file");
+
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+        _fail("cannot write file");
+
+    close(fd);
+}
+
+static pid_t _mount(const char* sparsefs)
+{
+    pid_t pid;
+
+    if ((pid = fork()) < 0)
+        _fail("fork");
+
+    if (pid == 0)
+    {
+        execl(sparsefs, sparsefs, "-f", BASEDIR, MNTDIR, NULL);
+        _exit(127);
+    }
+
+    /* wait for the file to appear through the mount point */
+    for (size_t i = 0; i < 100; i++)
+    {
+        if (access(MNTDIR "/" FILENAME, F_OK) == 0)
+            return pid;
+
+        usleep(100000);
+    }
+
+    _fail("sparsefs did not mount");
+    return -1;
+}
+
+static void _umount(pid_t pid)
+{
+    if (system("fusermount -u " MNTDIR) != 0)
+        _fail("fusermount -u");
+
+    waitpid(pid, NULL, 0);
+}
+
+/* open, read and release the regular file */
+static void _read_file(void)
+{
+    static char expected[FILE_SIZE];
+    static char buf[FILE_SIZE];
+    int fd;
+    ssize_t n;
+    size_t size = 0;
+
+    _fill(expected, sizeof(expected));
+
+    if ((fd = open(MNTDIR "/" FILENAME, O_RDONLY)) < 0)
+        _fail("cannot open file");
+
+    while ((n = read(fd, buf + size, sizeof(buf) - size)) > 0)
+        size += n;
+
+    if (n < 0)
+        _fail("cannot read file");
+
+    if (size != sizeof(buf) || memcmp(buf, expected, sizeof(buf)) != 0)
+        _fail("file contents differ");
+
+    if (close(fd) != 0)
+        _fail("cannot close file");
+}
+
+static void _read_stats(void)
+{
+    char buf[4096];
+    int fd;
+    ssize_t n;
+
+    if ((fd = open(STATS_PATH, O_RDONLY)) < 0)
+        _fail("cannot open statistics file");
+
+    if ((n = read(fd, buf, sizeof(buf) - 1)) <= 0)
+        _fail("cannot read statistics file");
+
+    buf[n] = '\0';
+
+    if (buf[0] != '{' || !strstr(buf, "\"uptime_ns\":"))
+        _fail("unexpected statistics");
+
+    close(fd);
+}
+
+int main(int argc, const char* argv[])
+{
+    pid_t pid;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <sparsefs-mount>\n", argv[0]);
+        exit(1);
+    }
+
+    if (system("rm -rf " DIRNAME) != 0)
+        _fail("cannot remove " DIRNAME);
+
+    if (mkdir(DIRNAME, 0755) != 0 || mkdir(BASEDIR, 0755) != 0 ||
+        mkdir(MNTDIR, 0755) != 0)
+    {
+        _fail("cannot create directories");
+    }
+
+    _create_file();
+    pid = _mount(argv[1]);
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+        _read_file();
+
+    _read_stats();
+    _umount(pid);
+
+    printf("=== passed sparsefs (%d opens)\n", ITERATIONS);
+
+    return 0;
+}
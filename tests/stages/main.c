@@ -0,0 +1,254 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <common/err.h>
+#include <cvmdisk/stages.h>
+
+/*
+**==============================================================================
+**
+** stages: runs a graph shaped like "cvmdisk init" (a chain, then two long
+** branches and a short one, then a join) and checks the derived dependencies,
+** that every stage starts after those it depends on, that the branches
+** overlap and the critical path. Then checks that a stage failing with ERR()
+** stops the graph without exiting from the stage's thread.
+**
+**==============================================================================
+*/
+
+#define A (1 << 0)
+#define B (1 << 1)
+#define C (1 << 2)
+#define D (1 << 3)
+#define ALL 0xffffffff
+
+#define MSEC 1000
+
+typedef struct test_stage
+{
+    useconds_t usecs;
+    size_t order;
+}
+test_stage_t;
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t _num_finished;
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "stages: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _run(void* arg)
+{
+    test_stage_t* t = (test_stage_t*)arg;
+
+    usleep(t->usecs);
+
+    pthread_mutex_lock(&_lock);
+    t->order = _num_finished++;
+    pthread_mutex_unlock(&_lock);
+}
+
+static void _noop(void* arg)
+{
+}
+
+static void _bad(void* arg)
+{
+    usleep(20 * MSEC);
+    ERR("expected failure");
+}
+
+int main(int argc, const char* argv[])
+{
+    static stages_t stages;
+    test_stage_t t[6];
+    size_t path[STAGES_MAX];
+    size_t n;
+
+    err_set_arg0(argv[0]);
+
+    memset(t, 0, sizeof(t));
+    t[0].usecs = 50 * MSEC;  /* setup: writes everything */
+    t[1].usecs = 400 * MSEC; /* long: reads A, writes B */
+    t[2].usecs = 200 * MSEC; /* reads A, writes C */
+    t[3].usecs = 100 * MSEC; /* after 2: reads C, writes D */
+    t[4].usecs = 20 * MSEC;  /* reads A only */
+    t[5].usecs = 50 * MSEC;  /* join: writes everything */
+
+    stages_add(&stages, "setup", 0, ALL, _run, &t[0]);
+    stages_add(&stages, "long", A, B, _run, &t[1]);
+    stages_add(&stages, "first", A, C, _run, &t[2]);
+    stages_add(&stages, "second", C, D, _run, &t[3]);
+    stages_add(&stages, "short", A, 0, _run, &t[4]);
+    stages_add(&stages, "join", ALL, ALL, _run, &t[5]);
+
+    if (stages_run(&stages, 4) != 0)
+        _fail("stages_run()");
+
+    /* check the derived dependencies */
+    if (stages.stages[0].deps != 0 ||
+        stages.stages[1].deps != 0x1 ||
+        stages.stages[2].deps != 0x1 ||
+        stages.stages[3].deps != 0x5 ||
+        stages.stages[4].deps != 0x1 ||
+        stages.stages[5].deps != 0x1f)
+    {
+        _fail("unexpected dependencies");
+    }
+
+    /* every stage starts after the stages it depends on finish */
+    for (size_t i = 0; i < stages.num_stages; i++)
+    {
+        const stage_t* si = &stages.stages[i];
+
+        for (size_t j = 0; j < stages.num_stages; j++)
+        {
+            if ((si->deps & ((uint64_t)1 << j)) &&
+                (si->start < stages.stages[j].end || t[i].order <= t[j].order))
+            {
+                _fail("stage started before its dependency finished");
+            }
+        }
+    }
+
+    /* the branches overlap: 820ms of stages in about 500ms */
+    {
+        double sum = 0;
+
+        for (size_t i = 0; i < stages.num_stages; i++)
+            sum += stages.stages[i].end - stages.stages[i].start;
+
+        if (stages.elapsed > sum - 0.15)
+            _fail("independent stages did not overlap");
+    }
+
+    /* the long branch is the critical path */
+    if ((n = stages_critical_path(&stages, path)) != 3 ||
+        path[0] != 0 || path[1] != 1 || path[2] != 5)
+    {
+        _fail("unexpected critical path");
+    }
+
+    stages_dump(&stages);
+
+    /* one thread at a time runs the stages in the order added */
+    {
+        memset(&stages, 0, sizeof(stages));
+        _num_finished = 0;
+
+        for (size_t i = 0; i < 6; i++)
+        {
+            t[i].usecs = 10 * MSEC;
+            stages_add(&stages, "serial", A, 0, _run, &t[i]);
+        }
+
+        if (stages_run(&stages, 1) != 0)
+            _fail("stages_run()");
+
+        for (size_t i = 0; i < 6; i++)
+        {
+            if (t[i].order != i)
+                _fail("stages ran out of order with one thread");
+        }
+    }
+
+    /* the tail of "cvmdisk init": the thin verification (reading the
+     * partitions, writing the thin devices) and the CPIO archive (writing
+     * the ESP) overlap, and stripping (which rewrites everything) waits for
+     * both */
+    {
+        memset(&stages, 0, sizeof(stages));
+        _num_finished = 0;
+
+        t[0].usecs = 200 * MSEC;
+        t[1].usecs = 200 * MSEC;
+        t[2].usecs = 10 * MSEC;
+
+        stages_add(&stages, "verify-thin", A, B, _run, &t[0]);
+        stages_add(&stages, "create-cpio-archive", A, C, _run, &t[1]);
+        stages_add(&stages, "strip-disk", ALL, ALL, _run, &t[2]);
+
+        if (stages_run(&stages, 4) != 0)
+            _fail("stages_run()");
+
+        if (stages.stages[1].deps != 0 || stages.stages[2].deps != 0x3)
+            _fail("unexpected dependencies of the init tail");
+
+        if (stages.stages[1].start >= stages.stages[0].end ||
+            stages.stages[0].start >= stages.stages[1].end)
+        {
+            _fail("thin verification and CPIO archive did not overlap");
+        }
+
+        if (stages.stages[2].start < stages.stages[0].end ||
+            stages.stages[2].start < stages.stages[1].end)
+        {
+            _fail("stripping started before the stages it waits for");
+        }
+    }
+
+    /* a failing stage: the running stages finish, no others start */
+    {
+        memset(&stages, 0, sizeof(stages));
+        _num_finished = 0;
+
+        for (size_t i = 0; i < 6; i++)
+            t[i].order = SIZE_MAX;
+
+        t[0].usecs = 10 * MSEC;
+        t[1].usecs = 200 * MSEC;
+        t[2].usecs = 10 * MSEC;
+        t[3].usecs = 10 * MSEC;
+
+        stages_add(&stages, "setup", 0, ALL, _run, &t[0]);
+        stages_add(&stages, "slow", A, B, _run, &t[1]);
+        stages_add(&stages, "bad", A, C, _bad, NULL);
+        stages_add(&stages, "after", C, D, _run, &t[2]);
+        stages_add(&stages, "join", ALL, ALL, _run, &t[3]);
+
+        if (stages_run(&stages, 4) != -ECANCELED)
+            _fail("stages_run() did not fail");
+
+        if (!stages.failed || strcmp(stages.failed, "bad") != 0)
+            _fail("unexpected failed stage");
+
+        if (t[1].order == SIZE_MAX)
+            _fail("running stage was not waited for");
+
+        if (t[2].order != SIZE_MAX || t[3].order != SIZE_MAX)
+            _fail("stage started after a failure");
+    }
+
+    /* errors */
+    {
+        memset(&stages, 0, sizeof(stages));
+
+        for (size_t i = 0; i < STAGES_MAX; i++)
+        {
+            if (stages_add(&stages, "noop", 0, 0, _noop, NULL) != 0)
+                _fail("stages_add()");
+        }
+
+        if (stages_add(&stages, "noop", 0, 0, _noop, NULL) == 0)
+            _fail("stages_add() accepted too many stages");
+
+        if (stages_run(&stages, 0) == 0)
+            _fail("stages_run() accepted zero threads");
+
+        if (stages_run(&stages, 8) != 0)
+            _fail("stages_run() with all stages");
+    }
+
+    printf("=== passed stages\n");
+
+    return 0;
+}
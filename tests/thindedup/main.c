@@ -0,0 +1,237 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <utils/allocator.h>
+#include <cvmdisk/thindedup.h>
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** thindedup: builds a root file system image with known duplicate blocks,
+** converts it with thindedup_convert(), and rebuilds the thin volume from
+** the data file and the thin_restore XML to check that it matches the image
+** bit for bit and that each distinct block was stored once.
+**
+**==============================================================================
+*/
+
+#define SOURCE "thindedup.src"
+#define DATA "thindedup.data"
+#define XML "thindedup.xml"
+
+#define KB ((size_t)1024)
+#define BLOCK_SIZE (64 * KB)
+
+/* the rootfs starts here, as a partition would */
+#define START (1024 * KB)
+
+/* blocks of the rootfs; the last one is partial */
+#define NUM_BLOCKS 201
+#define SIZE (NUM_BLOCKS * BLOCK_SIZE - 12 * KB)
+
+/* the blocks hold one of this many patterns, or zeros */
+#define NUM_PATTERNS 7
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "thindedup: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static uint8_t _source[START + SIZE];
+
+/* pattern of block b (zero for blocks that are left unwritten) */
+static size_t _pattern(size_t b)
+{
+    if (b % 5 == 4)
+        return 0;
+
+    return 1 + (b * 7919) % NUM_PATTERNS;
+}
+
+static void _create_source(frag_list_t* frags)
+{
+    FILE* os;
+
+    for (size_t b = 0; b < NUM_BLOCKS; b++)
+    {
+        uint8_t* p = _source + START + b * BLOCK_SIZE;
+        size_t n = BLOCK_SIZE;
+        const size_t pattern = _pattern(b);
+
+        if (b == NUM_BLOCKS - 1)
+            n = SIZE - b * BLOCK_SIZE;
+
+        if (pattern == 0)
+            continue;
+
+        for (size_t i = 0; i < n; i++)
+            p[i] = (uint8_t)(pattern * 31 + i / 4096);
+    }
+
+    /* the fragments of the written blocks, last block first */
+    for (size_t b = NUM_BLOCKS; b-- > 0; )
+    {
+        const size_t offset = START + b * BLOCK_SIZE;
+        size_t n = BLOCK_SIZE;
+
+        if (_pattern(b) == 0)
+            continue;
+
+        if (b == NUM_BLOCKS - 1)
+            n = SIZE - b * BLOCK_SIZE;
+
+        if (frags_append(frags, offset, n) < 0)
+            _fail("out of memory");
+    }
+
+    if (!(os = fopen(SOURCE, "w")))
+        _fail("cannot create source");
+
+    if (fwrite(_source, 1, sizeof(_source), os) != sizeof(_source))
+        _fail("cannot write source");
+
+    fclose(os);
+}
+
+/* rebuild the volume from the data file and the mappings in the XML file */
+static void _rebuild(uint8_t* volume, size_t* num_mapped)
+{
+    FILE* is;
+    FILE* data;
+    char line[256];
+    uint8_t buf[BLOCK_SIZE];
+
+    *num_mapped = 0;
+    memset(volume, 0, NUM_BLOCKS * BLOCK_SIZE);
+
+    if (!(is = fopen(XML, "r")) || !(data = fopen(DATA, "r")))
+        _fail("cannot open output");
+
+    while (fgets(line, sizeof(line), is))
+    {
+        size_t v;
+        size_t d;
+        size_t n = 1;
+        const char* p;
+
+        if ((p = strstr(line, "<single_mapping ")))
+        {
+            if (sscanf(p, "<single_mapping origin_block=\"%zu\" "
+                "data_block=\"%zu\"", &v, &d) != 2)
+                _fail("bad single_mapping");
+        }
+        else if ((p = strstr(line, "<range_mapping ")))
+        {
+            if (sscanf(p, "<range_mapping origin_begin=\"%zu\" "
+                "data_begin=\"%zu\" length=\"%zu\"", &v, &d, &n) != 3)
+                _fail("bad range_mapping");
+        }
+        else
+        {
+            if (strstr(line, "data_block_size=") &&
+                !strstr(line, "data_block_size=\"128\""))
+                _fail("wrong data_block_size");
+
+            continue;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (v + i >= NUM_BLOCKS)
+                _fail("mapping beyond the volume");
+
+            if (fseek(data, (d + i) * BLOCK_SIZE, SEEK_SET) != 0 ||
+                fread(buf, 1, BLOCK_SIZE, data) != BLOCK_SIZE)
+                _fail("mapping beyond the data");
+
+            memcpy(volume + (v + i) * BLOCK_SIZE, buf, BLOCK_SIZE);
+            (*num_mapped)++;
+        }
+    }
+
+    fclose(is);
+    fclose(data);
+}
+
+static void _test(size_t num_threads)
+{
+    frag_list_t frags = FRAG_LIST_INITIALIZER;
+    thindedup_stats_t stats;
+    static uint8_t volume[NUM_BLOCKS * BLOCK_SIZE];
+    size_t num_mapped;
+    size_t num_written = 0;
+    FILE* os;
+
+    _create_source(&frags);
+
+    for (size_t b = 0; b < NUM_BLOCKS; b++)
+        num_written += _pattern(b) != 0;
+
+    /* a sparse data file with room for every block */
+    if (!(os = fopen(DATA, "w")) || ftruncate(fileno(os),
+        NUM_BLOCKS * BLOCK_SIZE) != 0)
+        _fail("cannot create data");
+
+    fclose(os);
+
+    if (thindedup_convert(&frags, SOURCE, START, START + SIZE, DATA,
+        NUM_BLOCKS, BLOCK_SIZE, num_threads, XML, &stats) < 0)
+    {
+        _fail("thindedup_convert()");
+    }
+
+    if (stats.num_mapped != num_written)
+        _fail("wrong number of mapped blocks");
+
+    /* the patterns, plus the partial last block */
+    if (stats.num_unique != NUM_PATTERNS + 1)
+        _fail("wrong number of distinct blocks");
+
+    _rebuild(volume, &num_mapped);
+
+    if (num_mapped != num_written)
+        _fail("XML maps the wrong number of blocks");
+
+    if (memcmp(volume, _source + START, SIZE) != 0)
+        _fail("rebuilt volume differs from the source");
+
+    /* the first block written is the last block of the rootfs */
+    if (num_threads == 1)
+    {
+        uint8_t buf[BLOCK_SIZE];
+        FILE* is = fopen(DATA, "r");
+
+        if (!is || fread(buf, 1, BLOCK_SIZE, is) != BLOCK_SIZE)
+            _fail("cannot read data");
+
+        fclose(is);
+
+        if (memcmp(buf, volume + (NUM_BLOCKS - 1) * BLOCK_SIZE, BLOCK_SIZE))
+            _fail("blocks not written in the order first touched");
+    }
+
+    frags_release(&frags);
+
+    printf("=== passed thindedup (%zu threads): %zu of %zu blocks stored\n",
+        num_threads, stats.num_unique, stats.num_mapped);
+}
+
+int main(int argc, const char* argv[])
+{
+    _test(1);
+    _test(4);
+
+    unlink(SOURCE);
+    unlink(DATA);
+    unlink(XML);
+
+    return 0;
+}
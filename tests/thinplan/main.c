@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/allocator.h>
+#include <cvmdisk/thinplan.h>
+
+allocator_t __allocator = { malloc, free };
+
+/*
+**==============================================================================
+**
+** thinplan: checks the thin-pool block-size planner against extent maps with
+** known answers (scattered small extents, one large extent, and extents that
+** straddle block boundaries).
+**
+**==============================================================================
+*/
+
+#define KB ((size_t)1024)
+#define MB (KB * 1024)
+#define GB (MB * 1024)
+
+/* the rootfs starts here, as a partition would */
+#define START MB
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "thinplan: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _append(frag_list_t* list, size_t offset, size_t length)
+{
+    if (frags_append(list, START + offset, length) < 0)
+        _fail("out of memory");
+}
+
+static size_t _choose(const frag_list_t* extents, size_t size, const char* obj)
+{
+    thinplan_objective_t objective;
+    thinplan_t plan;
+
+    if (thinplan_parse_objective(obj, &objective) != 0)
+        _fail("thinplan_parse_objective()");
+
+    if (thinplan_choose(extents, START, START + size, objective, &plan) < 0)
+        _fail("thinplan_choose()");
+
+    if (plan.num_candidates != THINPLAN_NUM_CANDIDATES)
+        _fail("wrong number of candidates");
+
+    /* every candidate must account for each byte of the extents */
+    for (size_t i = 0; i < plan.num_candidates; i++)
+    {
+        const thinplan_candidate_t* c = &plan.candidates[i];
+
+        if (c->block_size != THINPLAN_MIN_BLOCK_SIZE << i)
+            _fail("unexpected candidate block size");
+
+        if (c->data_size != c->num_mappings * c->block_size)
+            _fail("data size is not a whole number of blocks");
+
+        if (c->data_size - c->waste != plan.extent_size)
+            _fail("waste does not account for the extents");
+    }
+
+    return plan.candidates[plan.chosen].block_size;
+}
+
+/* 4 KiB of data in every MiB: small blocks waste far less */
+static void _test_scattered(void)
+{
+    frag_list_t extents = FRAG_LIST_INITIALIZER;
+
+    for (size_t i = 0; i < GB; i += MB)
+        _append(&extents, i + 256 * KB, 4 * KB);
+
+    if (_choose(&extents, GB, "size") != 64 * KB)
+        _fail("scattered: size should choose 64 KiB");
+
+    if (_choose(&extents, GB, "balanced") != 64 * KB)
+        _fail("scattered: balanced should choose 64 KiB");
+
+    /* every block size maps each extent once, so the smallest wins */
+    if (_choose(&extents, GB, "mappings") != 64 * KB)
+        _fail("scattered: mappings should choose 64 KiB");
+
+    frags_release(&extents);
+    printf("=== passed thinplan (scattered)\n");
+}
+
+/* one large extent: every size writes the same data */
+static void _test_contiguous(void)
+{
+    frag_list_t extents = FRAG_LIST_INITIALIZER;
+
+    _append(&extents, 0, 512 * MB);
+
+    if (_choose(&extents, GB, "balanced") != MB)
+        _fail("contiguous: balanced should choose 1 MiB");
+
+    if (_choose(&extents, GB, "mappings") != MB)
+        _fail("contiguous: mappings should choose 1 MiB");
+
+    frags_release(&extents);
+    printf("=== passed thinplan (contiguous)\n");
+}
+
+/* extents straddling block boundaries map a block on either side */
+static void _test_straddling(void)
+{
+    frag_list_t extents = FRAG_LIST_INITIALIZER;
+    thinplan_candidate_t c;
+
+    _append(&extents, 60 * KB, 8 * KB);
+    _append(&extents, 1020 * KB, 8 * KB);
+
+    if (thinplan_simulate(&extents, START, START + GB, 64 * KB, &c) < 0)
+        _fail("thinplan_simulate()");
+
+    if (c.num_mappings != 4 || c.waste != 4 * 64 * KB - 16 * KB)
+        _fail("straddling: expected 4 mappings of 64 KiB");
+
+    if (thinplan_simulate(&extents, START, START + GB, 128 * KB, &c) < 0)
+        _fail("thinplan_simulate()");
+
+    if (c.num_mappings != 3)
+        _fail("straddling: expected 3 mappings of 128 KiB");
+
+    if (thinplan_simulate(&extents, START, START + GB, MB, &c) < 0)
+        _fail("thinplan_simulate()");
+
+    if (c.num_mappings != 2)
+        _fail("straddling: expected 2 mappings of 1 MiB");
+
+    frags_release(&extents);
+    printf("=== passed thinplan (straddling)\n");
+}
+
+int main(int argc, const char* argv[])
+{
+    _test_scattered();
+    _test_contiguous();
+    _test_straddling();
+    return 0;
+}
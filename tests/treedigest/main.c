@@ -0,0 +1,186 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cvmdisk/treedigest.h>
+
+/*
+**==============================================================================
+**
+** treedigest: builds a small tree of directories, files and symbolic links
+** and checks that its digest does not depend on the number of threads or on
+** timestamps, but changes with the contents, names, modes and link targets.
+**
+**==============================================================================
+*/
+
+#define DIR "treedigest.dir"
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "treedigest: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static void _write(const char* path, const char* data, size_t size)
+{
+    int fd;
+
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+        _fail("cannot create file");
+
+    if (write(fd, data, size) != (ssize_t)size)
+        _fail("cannot write file");
+
+    close(fd);
+}
+
+static void _create_tree(void)
+{
+    char* big;
+    const size_t big_size = 3 * 1024 * 1024 + 17;
+
+    if (system("rm -rf " DIR) != 0)
+        _fail("cannot remove tree");
+
+    if (mkdir(DIR, 0755) != 0 ||
+        mkdir(DIR "/kernel", 0755) != 0 ||
+        mkdir(DIR "/kernel/drivers", 0755) != 0 ||
+        mkdir(DIR "/empty", 0700) != 0)
+    {
+        _fail("cannot create directories");
+    }
+
+    /* enough files for several hashing batches */
+    for (size_t i = 0; i < 100; i++)
+    {
+        char path[64];
+        char data[64];
+
+        snprintf(path, sizeof(path), DIR "/kernel/drivers/mod%zu.ko", i);
+        snprintf(data, sizeof(data), "module %zu", i);
+        _write(path, data, strlen(data));
+    }
+
+    if (!(big = malloc(big_size)))
+        _fail("out of memory");
+
+    for (size_t i = 0; i < big_size; i++)
+        big[i] = (char)(i * 7);
+
+    _write(DIR "/kernel/big.ko", big, big_size);
+    free(big);
+
+    _write(DIR "/modules.dep", "", 0);
+
+    if (symlink("kernel/big.ko", DIR "/link") != 0)
+        _fail("cannot create symbolic link");
+}
+
+static void _digest(size_t num_threads, sha256_t* digest)
+{
+    int r;
+
+    if ((r = treedigest(DIR, num_threads, digest)) != 0)
+    {
+        fprintf(stderr, "treedigest(): %s\n", strerror(-r));
+        _fail("treedigest()");
+    }
+}
+
+static void _expect_change(sha256_t* digest, const char* msg)
+{
+    sha256_t tmp;
+
+    _digest(4, &tmp);
+
+    if (sha256_equal(&tmp, digest))
+        _fail(msg);
+
+    *digest = tmp;
+}
+
+int main(int argc, const char* argv[])
+{
+    sha256_t d1;
+    sha256_t d8;
+
+    _create_tree();
+
+    /* the number of threads does not matter */
+    _digest(1, &d1);
+    _digest(8, &d8);
+
+    if (!sha256_equal(&d1, &d8))
+        _fail("digest depends on the number of threads");
+
+    /* neither do timestamps */
+    {
+        struct timeval times[2] = { { 1, 0 }, { 1, 0 } };
+
+        if (utimes(DIR "/kernel/big.ko", times) != 0)
+            _fail("utimes()");
+
+        _digest(3, &d8);
+
+        if (!sha256_equal(&d1, &d8))
+            _fail("digest depends on timestamps");
+    }
+
+    /* contents */
+    _write(DIR "/kernel/drivers/mod42.ko", "module 43", 9);
+    _expect_change(&d1, "contents not covered");
+
+    /* an empty file becomes non-empty */
+    _write(DIR "/modules.dep", "x", 1);
+    _expect_change(&d1, "empty file not covered");
+
+    /* names */
+    if (rename(DIR "/kernel/drivers/mod7.ko", DIR "/kernel/drivers/mod7x.ko"))
+        _fail("rename()");
+
+    _expect_change(&d1, "names not covered");
+
+    /* modes */
+    if (chmod(DIR "/kernel/big.ko", 0755) != 0)
+        _fail("chmod()");
+
+    _expect_change(&d1, "modes not covered");
+
+    /* empty directories */
+    if (rmdir(DIR "/empty") != 0)
+        _fail("rmdir()");
+
+    _expect_change(&d1, "directories not covered");
+
+    /* symbolic link targets */
+    if (unlink(DIR "/link") != 0 || symlink("kernel/big.kx", DIR "/link"))
+        _fail("cannot replace symbolic link");
+
+    _expect_change(&d1, "link targets not covered");
+
+    /* a single file */
+    if (treedigest(DIR "/modules.dep", 2, &d8) != 0)
+        _fail("treedigest() of a file");
+
+    /* errors */
+    if (treedigest(DIR "/missing", 2, &d8) != -ENOENT)
+        _fail("treedigest() of a missing path");
+
+    if (treedigest(DIR, 0, &d8) != -EINVAL)
+        _fail("treedigest() with no threads");
+
+    if (system("rm -rf " DIR) != 0)
+        _fail("cannot remove tree");
+
+    printf("=== passed treedigest\n");
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <linux/loop.h>
+#include <cvmephemeral/dm.h>
+
+/*
+**==============================================================================
+**
+** upperlayer: builds the root file system stack on loop devices the way the
+** initrd does (a read-only lower layer joined with a writable upper layer by
+** cvmephemeral) and times write workloads against it, once per engine:
+**
+**     snapshot:<chunk-kb>  -- dm-snapshot (non-persistent) with this chunk size
+**     thin:<block-kb>      -- dm-thin with the lower layer as external origin
+**
+** dm-linear devices stand in for dm-verity (lower) and dm-crypt (upper), so
+** the results compare the engines rather than the hashing or the cipher. The
+** stack is rebuilt on fresh sparse files before each workload.
+**
+**==============================================================================
+*/
+
+#define NAME "upperlayer"
+#define LOWER_NAME NAME "-ro"
+#define UPPER_NAME NAME "-rw"
+
+#define RANDOM_WRITE_SIZE 4096
+#define SEQUENTIAL_WRITE_SIZE (1024 * 1024)
+
+static const char* _dir;
+static const char* _cvmephemeral;
+static size_t _size_mb;
+static size_t _seconds;
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "upperlayer: FAILED: %s\n", msg);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+/* create a sparse file of the given size, discarding any old contents */
+static void _create_file(const char* path, size_t size)
+{
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+        _fail("cannot create backing file");
+
+    if (ftruncate(fd, size) < 0)
+        _fail("cannot size backing file");
+
+    close(fd);
+}
+
+/* attach path to a free loop device that detaches itself on last close;
+ * returns an open descriptor for the loop device */
+static int _attach_loop(const char* path, dev_t* dev)
+{
+    int ctl;
+    int fd;
+    int file;
+    int n;
+    char loop[PATH_MAX];
+    struct loop_info64 info;
+    struct stat st;
+
+    if ((ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC)) < 0)
+        _fail("cannot open /dev/loop-control");
+
+    if ((n = ioctl(ctl, LOOP_CTL_GET_FREE)) < 0)
+        _fail("no free loop device");
+
+    close(ctl);
+    snprintf(loop, sizeof(loop), "/dev/loop%d", n);
+
+    if ((fd = open(loop, O_RDWR | O_CLOEXEC)) < 0)
+        _fail("cannot open loop device");
+
+    if ((file = open(path, O_RDWR | O_CLOEXEC)) < 0)
+        _fail("cannot open backing file");
+
+    if (ioctl(fd, LOOP_SET_FD, file) < 0)
+        _fail("LOOP_SET_FD failed");
+
+    close(file);
+
+    memset(&info, 0, sizeof(info));
+    info.lo_flags = LO_FLAGS_AUTOCLEAR;
+
+    if (ioctl(fd, LOOP_SET_STATUS64, &info) < 0)
+        _fail("LOOP_SET_STATUS64 failed");
+
+    if (fstat(fd, &st) < 0)
+        _fail("cannot stat loop device");
+
+    *dev = st.st_rdev;
+
+    return fd;
+}
+
+static void _create_linear(const char* name, dev_t dev, size_t size)
+{
+    char params[64];
+    dev_t dm_dev;
+
+    snprintf(params, sizeof(params), "%u:%u 0", major(dev), minor(dev));
+
+    if (dm_create(name, "linear", size / 512, params, 0, &dm_dev) < 0)
+        _fail("cannot create dm-linear device");
+}
+
+/* remove everything cvmephemeral and _setup() may have created */
+static void _teardown(void)
+{
+    const char* names[] =
+    {
+        NAME,
+        NAME "-tpool",
+        NAME "-tdata",
+        NAME "-tmeta",
+        UPPER_NAME,
+        LOWER_NAME,
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        dm_remove(names[i]);
+}
+
+typedef struct layers
+{
+    int lower_fd;
+    int upper_fd;
+}
+layers_t;
+
+static void _setup(layers_t* layers, const char* engine, size_t sectors)
+{
+    const size_t lower_size = _size_mb * 1024 * 1024;
+    const size_t upper_size = 2 * lower_size;
+    char lower[PATH_MAX];
+    char upper[PATH_MAX];
+    char cmd[PATH_MAX * 2];
+    dev_t dev;
+
+    _teardown();
+
+    snprintf(lower, sizeof(lower), "%s/lower.img", _dir);
+    snprintf(upper, sizeof(upper), "%s/upper.img", _dir);
+
+    _create_file(lower, lower_size);
+    _create_file(upper, upper_size);
+
+    layers->lower_fd = _attach_loop(lower, &dev);
+    _create_linear(LOWER_NAME, dev, lower_size);
+
+    layers->upper_fd = _attach_loop(upper, &dev);
+    _create_linear(UPPER_NAME, dev, upper_size);
+
+    snprintf(cmd, sizeof(cmd), "%s %s %s %s %s %zu", _cvmephemeral,
+        engine, NAME, LOWER_NAME, UPPER_NAME, sectors);
+
+    if (system(cmd) != 0)
+        _fail(cmd);
+}
+
+static void _release(layers_t* layers)
+{
+    _teardown();
+    close(layers->lower_fd);
+    close(layers->upper_fd);
+}
+
+static uint64_t _xorshift(uint64_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* write blocks of the given size for _seconds (or until the device has been
+ * written once, when sequential) and print the throughput */
+static void _run(const char* engine_arg, const char* workload, bool random)
+{
+    const size_t size = random ? RANDOM_WRITE_SIZE : SEQUENTIAL_WRITE_SIZE;
+    const size_t num_blocks = _size_mb * 1024 * 1024 / size;
+    char path[PATH_MAX];
+    void* buf;
+    int fd;
+    size_t n = 0;
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    double start;
+    double elapsed;
+
+    snprintf(path, sizeof(path), "%s/%s", DM_MAPPER_DIR, NAME);
+
+    if ((fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC)) < 0)
+        _fail("cannot open the upper-layer device");
+
+    if (posix_memalign(&buf, 4096, size) != 0)
+        _fail("out of memory");
+
+    memset(buf, 0xa5, size);
+    start = _now();
+
+    do
+    {
+        uint64_t block = random ? _xorshift(&seed) % num_blocks : n;
+
+        if (pwrite(fd, buf, size, block * size) != (ssize_t)size)
+            _fail("write failed");
+
+        n++;
+    }
+    while (_now() - start < _seconds && (random || n < num_blocks));
+
+    if (fdatasync(fd) < 0)
+        _fail("fdatasync failed");
+
+    elapsed = _now() - start;
+
+    printf("%-16s %-14s %10zu %8.2f %10.0f %10.1f\n",
+        engine_arg, workload, n, elapsed, n / elapsed,
+        (double)(n * size) / elapsed / (1024 * 1024));
+    fflush(stdout);
+
+    free(buf);
+    close(fd);
+}
+
+static void _bench(const char* arg)
+{
+    char engine[32];
+    char* p;
+    size_t kb;
+    layers_t layers;
+
+    strncpy(engine, arg, sizeof(engine) - 1);
+    engine[sizeof(engine) - 1] = '\0';
+
+    if (!(p = strchr(engine, ':')))
+        _fail("engine must be snapshot:<chunk-kb> or thin:<block-kb>");
+
+    *p++ = '\0';
+    kb = strtoul(p, NULL, 10);
+
+    _setup(&layers, engine, kb * 2);
+    _run(arg, "randwrite-4k", true);
+    _release(&layers);
+
+    _setup(&layers, engine, kb * 2);
+    _run(arg, "seqwrite-1m", false);
+    _release(&layers);
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: %s DIR CVMEPHEMERAL SIZE-MB SECONDS "
+            "ENGINE...\n", argv[0]);
+        fprintf(stderr, "ENGINE: snapshot:<chunk-kb> | thin:<block-kb>\n");
+        exit(1);
+    }
+
+    if (geteuid() != 0)
+        _fail("must be run as root");
+
+    _dir = argv[1];
+    _cvmephemeral = argv[2];
+    _size_mb = strtoul(argv[3], NULL, 10);
+    _seconds = strtoul(argv[4], NULL, 10);
+
+    if (_size_mb == 0 || _seconds == 0)
+        _fail("bad size or duration");
+
+    if (mkdir(_dir, 0700) < 0 && errno != EEXIST)
+        _fail("cannot create directory");
+
+    printf("%-16s %-14s %10s %8s %10s %10s\n",
+        "engine", "workload", "writes", "seconds", "IOPS", "MB/s");
+
+    for (int i = 5; i < argc; i++)
+        _bench(argv[i]);
+
+    return 0;
+}
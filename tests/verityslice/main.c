@@ -0,0 +1,267 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cvmdisk/verity.h>
+#include <cvmdisk/gpt.h>
+#include <cvmdisk/globals.h>
+
+/*
+**==============================================================================
+**
+** verityslice: creates a GPT image file with a sparse Linux partition (as a
+** plain file, with no loop devices), adds and formats its verity partition
+** through GPT slices and checks the roothash against one computed here from
+** the dm-verity format, then verifies the data (and that corruption is found).
+**
+**==============================================================================
+*/
+
+#define IMAGE "verityslice.img"
+#define IMAGE_SIZE ((size_t)40 * 1024 * 1024)
+#define DATA_LBA 2048
+#define DATA_SIZE ((size_t)16 * 1024 * 1024)
+#define BLKSZ VERITY_BLOCK_SIZE
+
+static void _fail(const char* msg)
+{
+    fprintf(stderr, "verityslice: FAILED: %s\n", msg);
+    exit(1);
+}
+
+/* write an empty GPT; gpt_open() fills in the backup header */
+static void _create_image(void)
+{
+    int fd;
+    uint8_t block[GPT_BLOCK_SIZE];
+    gpt_header_t* h = (gpt_header_t*)block;
+    gpt_t* gpt;
+    gpt_entry_t e;
+
+    unlink(IMAGE);
+
+    if ((fd = open(IMAGE, O_CREAT | O_RDWR, 0644)) < 0)
+        _fail("cannot create image");
+
+    if (ftruncate(fd, IMAGE_SIZE) != 0)
+        _fail("cannot size image");
+
+    memset(block, 0, sizeof(block));
+    memcpy(h->signature, "EFI PART", GPT_SIGNATURE_SIZE);
+    h->revision = 0x10000;
+    h->header_size = 92;
+    h->primary_lba = 1;
+    h->first_usable_lba = 34;
+    h->first_entry_lba = 2;
+    h->number_of_entries = GPT_MAX_ENTRIES;
+    h->size_of_entry = sizeof(gpt_entry_t);
+
+    if (pwrite(fd, block, sizeof(block), GPT_BLOCK_SIZE) != sizeof(block))
+        _fail("cannot write GPT header");
+
+    /* fill two of every three blocks of the partition, leaving holes */
+    for (size_t i = 0; i < DATA_SIZE / BLKSZ; i++)
+    {
+        uint8_t data[BLKSZ];
+
+        if (i % 3 == 0)
+            continue;
+
+        for (size_t j = 0; j < BLKSZ; j++)
+            data[j] = (uint8_t)(i * 31 + j * 7);
+
+        if (pwrite(fd, data, BLKSZ, DATA_LBA * GPT_BLOCK_SIZE + i * BLKSZ) !=
+            BLKSZ)
+        {
+            _fail("cannot write data");
+        }
+    }
+
+    close(fd);
+
+    /* syncing the GPT of an image file must not ask the kernel to reload */
+    if (gpt_open(IMAGE, O_RDWR | O_EXCL, &gpt) < 0)
+        _fail("gpt_open()");
+
+    memset(&e, 0, sizeof(e));
+    guid_get_xy(&linux_type_guid, &e.type_guid1, &e.type_guid2);
+    e.starting_lba = DATA_LBA;
+    e.ending_lba = DATA_LBA + DATA_SIZE / GPT_BLOCK_SIZE - 1;
+
+    if (gpt_add_entry(gpt, &e) < 0)
+        _fail("gpt_add_entry()");
+
+    gpt_close(gpt);
+}
+
+/* compute the roothash of the data partition from the dm-verity format */
+static void _compute_roothash(
+    const verity_superblock_t* sb,
+    blockdev_t* dev,
+    sha256_t* roothash)
+{
+    const size_t per_block = BLKSZ / sizeof(sha256_t);
+    size_t n = sb->data_blocks;
+    uint8_t* level;
+    uint8_t block[BLKSZ];
+
+    if (!(level = calloc(n, BLKSZ)))
+        _fail("out of memory");
+
+    /* the leaves hash the data blocks */
+    for (size_t i = 0; i < n; i++)
+    {
+        sha256_t h;
+
+        if (blockdev_get(dev, i, block, 1) != 0)
+            _fail("cannot read data block");
+
+        sha256_compute2(&h, sb->salt, sb->salt_size, block, BLKSZ);
+        memcpy(level + i * sizeof(sha256_t), &h, sizeof(h));
+    }
+
+    /* each level hashes the (zero-padded) blocks of the level below */
+    for (;;)
+    {
+        const size_t nblocks = (n + per_block - 1) / per_block;
+
+        memset(level + n * sizeof(sha256_t), 0,
+            nblocks * BLKSZ - n * sizeof(sha256_t));
+
+        if (nblocks == 1)
+        {
+            sha256_compute2(roothash, sb->salt, sb->salt_size, level, BLKSZ);
+            break;
+        }
+
+        for (size_t i = 0; i < nblocks; i++)
+        {
+            sha256_t h;
+            sha256_compute2(&h, sb->salt, sb->salt_size, level + i * BLKSZ,
+                BLKSZ);
+            memcpy(level + i * sizeof(sha256_t), &h, sizeof(h));
+        }
+
+        n = nblocks;
+    }
+
+    free(level);
+}
+
+static int _verify(
+    size_t data_index,
+    size_t hash_index,
+    bool check_format,
+    sha256_t* roothash)
+{
+    blockdev_t* hdev;
+    blockdev_t* ddev;
+    verity_superblock_t sb;
+    verity_hashtree_t hashtree;
+    int r;
+
+    if (gpt_open_partition(IMAGE, hash_index, O_RDONLY, BLKSZ, &hdev) != 0)
+        _fail("cannot open hash partition");
+
+    if (gpt_open_partition(IMAGE, data_index, O_RDONLY, BLKSZ, &ddev) != 0)
+        _fail("cannot open data partition");
+
+    if (verity_get_roothash(hdev, roothash) != 0)
+        _fail("verity_get_roothash()");
+
+    if (verity_get_superblock(hdev, &sb) != 0)
+        _fail("verity_get_superblock()");
+
+    if (verity_load_hash_tree(hdev, &sb, roothash, &hashtree) != 0)
+        _fail("verity_load_hash_tree()");
+
+    /* check the format independently of the hash tree code */
+    if (check_format)
+    {
+        sha256_t expected;
+
+        _compute_roothash(&sb, ddev, &expected);
+
+        if (!sha256_equal(&expected, roothash))
+            _fail("roothash differs from the dm-verity format");
+    }
+
+    r = verity_verify_data_device(ddev, &sb, roothash, &hashtree);
+
+    free(hashtree.data);
+    blockdev_close(hdev);
+    blockdev_close(ddev);
+
+    return r;
+}
+
+int main(int argc, const char* argv[])
+{
+    guid_t unique_guid;
+    sha256_t roothash;
+    sha256_t stored;
+    size_t hash_index;
+    err_t err = ERR_INITIALIZER;
+    gpt_t* gpt;
+    int r;
+
+    _create_image();
+
+    /* the sparse-block scan reads the image file */
+    globals.disk = IMAGE;
+
+    if ((r = verity_add_partition(IMAGE, 0, false, false, &unique_guid,
+        &roothash, &err)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", err.buf, strerror(-r));
+        _fail("verity_add_partition()");
+    }
+
+    if (gpt_open(IMAGE, O_RDONLY, &gpt) < 0)
+        _fail("gpt_open()");
+
+    if ((hash_index = gpt_find_partition(gpt, &unique_guid)) == (size_t)-1)
+        _fail("cannot find verity partition");
+
+    gpt_close(gpt);
+
+    if (_verify(0, hash_index, true, &stored) != 0)
+        _fail("verity_verify_data_device()");
+
+    if (!sha256_equal(&stored, &roothash))
+        _fail("stored roothash differs from the returned roothash");
+
+    /* corrupt one byte of a data block */
+    {
+        int fd;
+        uint8_t byte;
+        const off_t offset = DATA_LBA * GPT_BLOCK_SIZE + 1000 * BLKSZ + 17;
+
+        if ((fd = open(IMAGE, O_RDWR)) < 0)
+            _fail("cannot open image");
+
+        if (pread(fd, &byte, 1, offset) != 1)
+            _fail("cannot read image");
+
+        byte ^= 0x01;
+
+        if (pwrite(fd, &byte, 1, offset) != 1)
+            _fail("cannot write image");
+
+        close(fd);
+    }
+
+    if (_verify(0, hash_index, false, &stored) == 0)
+        _fail("corruption was not detected");
+
+    unlink(IMAGE);
+
+    printf("=== passed verityslice\n");
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_UTILS_BOOTTIME_H
+#define _CVMBOOT_UTILS_BOOTTIME_H
+
+#include <stdint.h>
+
+/*
+**==============================================================================
+**
+** Bootloader stage timings, published by cvmboot.efi in the volatile EFI
+** variable boottime-08b5e462-25eb-42c0-a7d1-e9f78c3c7e09 just before it
+** starts the kernel. Linux exposes it under /sys/firmware/efi/efivars.
+**
+**==============================================================================
+*/
+
+#define BOOTTIME_MAGIC 0x454d49544f4f4243 /* "CBOOTIME" */
+#define BOOTTIME_VERSION 1
+#define BOOTTIME_MAX_STAGES 16
+#define BOOTTIME_NAME_SIZE 16
+
+#define BOOTTIME_VARIABLE_NAME "boottime"
+#define BOOTTIME_VARIABLE_GUID "08b5e462-25eb-42c0-a7d1-e9f78c3c7e09"
+
+typedef struct boottime_stage
+{
+    char name[BOOTTIME_NAME_SIZE]; /* zero-terminated */
+    uint64_t start; /* TSC ticks since efi_main() was entered */
+    uint64_t end;
+}
+boottime_stage_t;
+
+typedef struct boottime
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_stages;
+
+    /* TSC ticks per second (calibrated by the bootloader) */
+    uint64_t tsc_frequency;
+
+    /* TSC when efi_main() was entered (approximates time in firmware) */
+    uint64_t entry_tsc;
+
+    boottime_stage_t stages[BOOTTIME_MAX_STAGES];
+}
+boottime_t;
+
+#endif /* _CVMBOOT_UTILS_BOOTTIME_H */
@@ -334,3 +334,213 @@ done:
 
     return rc;
 }
+
+static void _IntToHex(char str[8], size_t x)
+{
+    const char digits[] = "0123456789ABCDEF";
+    size_t i;
+
+    for (i = 8; i > 0; i--)
+    {
+        str[i - 1] = digits[x & 0xF];
+        x >>= 4;
+    }
+}
+
+static void _FormatHeader(
+    CPIOHeader* header,
+    size_t ino,
+    size_t mode,
+    size_t nlink,
+    size_t mtime,
+    size_t filesize,
+    size_t namesize)
+{
+    memset(header, '0', sizeof(CPIOHeader));
+    memcpy(header->magic, "070701", sizeof(header->magic));
+    _IntToHex(header->ino, ino);
+    _IntToHex(header->mode, mode);
+    _IntToHex(header->nlink, nlink);
+    _IntToHex(header->mtime, mtime);
+    _IntToHex(header->filesize, filesize);
+    _IntToHex(header->namesize, namesize);
+}
+
+/* Size of a filler entry header (including its name and padding) */
+#define FILLER_HEADER_SIZE \
+    ((sizeof(CPIOHeader) + sizeof(CPIO_FILLER_NAME) + 3) / 4 * 4)
+
+/* Get the size of the filler entry needed before an entry whose header
+ * (including its name) is headerSize bytes, so that its data is aligned.
+ */
+static size_t _FillerSize(size_t offset, size_t headerSize, size_t alignment)
+{
+    size_t gap = (alignment - (offset + headerSize) % alignment) % alignment;
+
+    if (gap)
+    {
+        while (gap < FILLER_HEADER_SIZE)
+            gap += alignment;
+    }
+
+    return gap;
+}
+
+/*
+**==============================================================================
+**
+** cpio_writer_t
+**
+**==============================================================================
+*/
+
+static const unsigned char _zeros[512];
+
+static int _Write(cpio_writer_t* writer, const void* data, size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    sha256_update(&writer->ctx, data, size);
+
+    if (writer->callback(writer->context, data, size) != 0)
+        return -1;
+
+    writer->offset += size;
+    return 0;
+}
+
+static int _WriteZeros(cpio_writer_t* writer, size_t size)
+{
+    while (size)
+    {
+        size_t n = (size < sizeof(_zeros)) ? size : sizeof(_zeros);
+
+        if (_Write(writer, _zeros, n) != 0)
+            return -1;
+
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Write a header, the name, and padding up to the data */
+static int _WriteHeader(
+    cpio_writer_t* writer,
+    size_t mode,
+    size_t nlink,
+    size_t filesize,
+    const char* name)
+{
+    CPIOHeader header;
+    const size_t namesize = strlen(name) + 1;
+    const size_t headerSize = sizeof(CPIOHeader) + namesize;
+
+    _FormatHeader(&header, writer->ino++, mode, nlink, writer->mtime,
+        filesize, namesize);
+
+    if (_Write(writer, &header, sizeof(header)) != 0)
+        return -1;
+
+    if (_Write(writer, name, namesize) != 0)
+        return -1;
+
+    return _WriteZeros(writer, _RoundUpToMultiple(headerSize, 4) - headerSize);
+}
+
+int cpio_writer_init(
+    cpio_writer_t* writer,
+    size_t alignment,
+    uint32_t mtime,
+    cpio_write_callback_t callback,
+    void* context)
+{
+    if (!writer || !callback || alignment % 4)
+        return -1;
+
+    memset(writer, 0, sizeof(cpio_writer_t));
+    writer->callback = callback;
+    writer->context = context;
+    writer->alignment = alignment;
+    writer->mtime = mtime;
+    writer->ino = 1;
+    sha256_init(&writer->ctx);
+
+    return 0;
+}
+
+int cpio_writer_add(
+    cpio_writer_t* writer,
+    const char* name,
+    uint32_t mode,
+    const void* data,
+    size_t size)
+{
+    const int isRegular = (mode & 0170000) == 0100000;
+    const size_t alignment = writer ? writer->alignment : 0;
+
+    if (!writer || !name || !*name || (size && !data))
+        return -1;
+
+    /* The reader uses int sizes */
+    if (size > 0x7fffffff || strcmp(name, "TRAILER!!!") == 0)
+        return -1;
+
+    /* Insert a filler entry so the file data starts on a boundary */
+    if (isRegular && alignment && size >= alignment)
+    {
+        const size_t headerSize =
+            _RoundUpToMultiple(sizeof(CPIOHeader) + strlen(name) + 1, 4);
+        const size_t gap = _FillerSize(writer->offset, headerSize, alignment);
+
+        if (gap)
+        {
+            const size_t filesize = gap - FILLER_HEADER_SIZE;
+
+            if (_WriteHeader(writer, 0100644, 1, filesize,
+                CPIO_FILLER_NAME) != 0)
+            {
+                return -1;
+            }
+
+            if (_WriteZeros(writer, filesize) != 0)
+                return -1;
+        }
+    }
+
+    if (_WriteHeader(writer, mode, isRegular ? 1 : 2, size, name) != 0)
+        return -1;
+
+    if (_Write(writer, data, size) != 0)
+        return -1;
+
+    return _WriteZeros(writer, _RoundUpToMultiple(size, 4) - size);
+}
+
+int cpio_writer_finish(
+    cpio_writer_t* writer,
+    sha256_t* hash,
+    size_t* size)
+{
+    if (!writer)
+        return -1;
+
+    if (_WriteHeader(writer, 0, 1, 0, "TRAILER!!!") != 0)
+        return -1;
+
+    /* Pad the archive out to a whole number of blocks (like cpio does) */
+    if (_WriteZeros(writer,
+        _RoundUpToMultiple(writer->offset, 512) - writer->offset) != 0)
+    {
+        return -1;
+    }
+
+    if (hash)
+        sha256_final(hash, &writer->ctx);
+
+    if (size)
+        *size = writer->offset;
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "sha256.h"
 
 /* Get CPIO file, where data_out points directly into the CPIO archive */
 int cpio_get_file_direct(
@@ -23,4 +24,61 @@ int cpio_get_file(
     void** dest_data,
     size_t* dest_size);
 
+/* Name of the filler entries inserted by cpio_writer_t for alignment */
+#define CPIO_FILLER_NAME ".cvmboot-pad"
+
+/* Receives the bytes of the archive as cpio_writer_t produces them */
+typedef int (*cpio_write_callback_t)(
+    void* context,
+    const void* data,
+    size_t size);
+
+/* Writes a newc CPIO archive one entry at a time, passing the bytes to a
+ * callback and hashing them on the way, so the digest of the archive is
+ * known as soon as it has been written. Entries get consecutive inode
+ * numbers, the same mtime, and uid/gid 0, so the output depends only on the
+ * names, modes and contents of the entries (and the order of adding them).
+ */
+typedef struct cpio_writer
+{
+    cpio_write_callback_t callback;
+    void* context;
+    size_t alignment;
+    uint32_t mtime;
+    uint32_t ino;
+    size_t offset;
+    sha256_ctx_t ctx;
+}
+cpio_writer_t;
+
+/* If alignment is non-zero (a multiple of 4), filler entries are inserted
+ * so that the data of every regular file of at least alignment bytes starts
+ * at a multiple of alignment from the start of the archive. Readers that
+ * look files up by name are unaffected by the filler entries.
+ */
+int cpio_writer_init(
+    cpio_writer_t* writer,
+    size_t alignment,
+    uint32_t mtime,
+    cpio_write_callback_t callback,
+    void* context);
+
+/* Add an entry (mode includes the file type bits, e.g. 0100644 or 040755).
+ * Names are relative without a leading "./" (for example "vmlinuz").
+ */
+int cpio_writer_add(
+    cpio_writer_t* writer,
+    const char* name,
+    uint32_t mode,
+    const void* data,
+    size_t size);
+
+/* Write the trailer, pad to a multiple of 512 bytes, and get the digest
+ * and total size of the archive.
+ */
+int cpio_writer_finish(
+    cpio_writer_t* writer,
+    sha256_t* hash,
+    size_t* size);
+
 #endif /* _CVMBOOT_UTILS_CPIO_H */
@@ -11,10 +11,13 @@
 #include "json.h"
 #include "sha256.h"
 #include "sig.h"
+#include "hexstr.h"
 
 #define TYPE_SIZE 16
 
-#define OS_IMAGE_IDENTITY_FORMAT "\"os-image-identity\":{\"signer\":\"%s\",\"svn\":\"%s\",\"diskId\":\"%s\",\"eventVersion\":\"%s\"}"
+#define OS_IMAGE_IDENTITY_PREFIX "\"os-image-identity\":{\"signer\":\""
+
+#define OS_IMAGE_IDENTITY_FORMAT OS_IMAGE_IDENTITY_PREFIX "%s\",\"svn\":\"%s\",\"diskId\":\"%s\",\"eventVersion\":\"%s\"}"
 
 static const char* _get_line(const char** pp, const char* end)
 {
@@ -365,6 +368,255 @@ done:
     return status;
 }
 
+/*
+**==============================================================================
+**
+** Precompiled events
+**
+**==============================================================================
+*/
+
+#define BLOB_ALIGNMENT 8
+
+static size_t _blob_align(size_t n)
+{
+    return (n + BLOB_ALIGNMENT - 1) & ~((size_t)BLOB_ALIGNMENT - 1);
+}
+
+typedef struct _blob_callback_data
+{
+    /* null on the first pass, which only computes the size */
+    uint8_t* blob;
+    size_t size;
+    uint32_t num_events;
+}
+blob_callback_data_t;
+
+static int _blob_callback(
+    size_t index,
+    uint32_t pcrnum,
+    const char* type,
+    const char* data,
+    const char* signer,
+    void* callback_data)
+{
+    int ret = -1;
+    blob_callback_data_t* cbd = (blob_callback_data_t*)callback_data;
+    const char prefix[] = OS_IMAGE_IDENTITY_PREFIX;
+    events_blob_record_t rec;
+    uint8_t* p = NULL;
+
+    rec.pcr = pcrnum;
+    rec.signer_offset = EVENTS_BLOB_NO_SIGNER;
+
+    if (cbd->blob)
+        p = cbd->blob + cbd->size + sizeof(rec);
+
+    if (strcmp(type, "string") == 0)
+    {
+        rec.type = EVENTS_BLOB_TYPE_STRING;
+        rec.size = strlen(data) + 1;
+
+        /* the signer is the first field of the reformatted identity */
+        if (strncmp(data, prefix, sizeof(prefix) - 1) == 0)
+            rec.signer_offset = sizeof(prefix) - 1;
+
+        if (p)
+            memcpy(p, data, rec.size);
+    }
+    else
+    {
+        rec.type = EVENTS_BLOB_TYPE_BINARY;
+        rec.size = strlen(data) / 2;
+
+        if (p && hexstr_scan(data, p, rec.size) != rec.size)
+            goto done;
+    }
+
+    if (cbd->blob)
+        memcpy(cbd->blob + cbd->size, &rec, sizeof(rec));
+
+    cbd->size += _blob_align(sizeof(rec) + rec.size);
+    cbd->num_events++;
+    ret = 0;
+
+done:
+    return ret;
+}
+
+int events_blob_compile(
+    const char* text,
+    unsigned long text_size,
+    void** blob_out,
+    size_t* blob_size_out,
+    unsigned int* error_line,
+    err_t* err)
+{
+    int ret = -1;
+    char signer[EVENTS_BLOB_SIGNER_SIZE + 1];
+    blob_callback_data_t cbd;
+    events_blob_header_t header;
+
+    if (!blob_out || !blob_size_out)
+    {
+        err_format(err, "invalid parameter");
+        goto done;
+    }
+
+    *blob_out = NULL;
+    *blob_size_out = 0;
+
+    /* placeholder for the signer, which is not known until boot time */
+    memset(signer, '0', EVENTS_BLOB_SIGNER_SIZE);
+    signer[EVENTS_BLOB_SIGNER_SIZE] = '\0';
+
+    /* compute the size of the blob */
+    memset(&cbd, 0, sizeof(cbd));
+    cbd.size = sizeof(header);
+
+    if (parse_events_file(text, text_size, signer, _blob_callback, &cbd,
+        error_line, err) != 0)
+    {
+        goto done;
+    }
+
+    if (!(cbd.blob = __allocator.alloc(cbd.size)))
+    {
+        err_format(err, "out of memory");
+        goto done;
+    }
+
+    /* fill in the blob */
+    memset(cbd.blob, 0, cbd.size);
+    cbd.size = sizeof(header);
+    cbd.num_events = 0;
+
+    if (parse_events_file(text, text_size, signer, _blob_callback, &cbd,
+        error_line, err) != 0)
+    {
+        __allocator.free(cbd.blob);
+        goto done;
+    }
+
+    header.magic = EVENTS_BLOB_MAGIC;
+    header.num_events = cbd.num_events;
+    header.reserved = 0;
+    memcpy(cbd.blob, &header, sizeof(header));
+
+    *blob_out = cbd.blob;
+    *blob_size_out = cbd.size;
+    ret = 0;
+
+done:
+    return ret;
+}
+
+int events_blob_walk(
+    void* blob,
+    size_t blob_size,
+    const char* signer,
+    events_blob_callback_t callback,
+    void* callback_data,
+    err_t* err)
+{
+    int ret = -1;
+    uint8_t* p = (uint8_t*)blob;
+    uint8_t* end = p + blob_size;
+    events_blob_header_t header;
+    bool found_signer = false;
+    uint32_t i;
+
+    err_clear(err);
+
+    if (!blob || blob_size < sizeof(header) || !signer || !callback ||
+        strlen(signer) != EVENTS_BLOB_SIGNER_SIZE)
+    {
+        err_format(err, "invalid parameter");
+        goto done;
+    }
+
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+
+    if (header.magic != EVENTS_BLOB_MAGIC)
+    {
+        err_format(err, "bad events blob magic number");
+        goto done;
+    }
+
+    for (i = 0; i < header.num_events; i++)
+    {
+        events_blob_record_t rec;
+        uint8_t* data;
+
+        if ((size_t)(end - p) < sizeof(rec))
+        {
+            err_format(err, "events blob is truncated");
+            goto done;
+        }
+
+        memcpy(&rec, p, sizeof(rec));
+        data = p + sizeof(rec);
+
+        if (rec.size > (size_t)(end - data) || rec.pcr > 23)
+        {
+            err_format(err, "bad events blob record: %u", i);
+            goto done;
+        }
+
+        if (rec.type == EVENTS_BLOB_TYPE_STRING)
+        {
+            if (rec.size == 0 || data[rec.size - 1] != '\0')
+            {
+                err_format(err, "unterminated events blob string: %u", i);
+                goto done;
+            }
+        }
+        else if (rec.type != EVENTS_BLOB_TYPE_BINARY)
+        {
+            err_format(err, "bad events blob record type: %u", i);
+            goto done;
+        }
+
+        if (rec.signer_offset != EVENTS_BLOB_NO_SIGNER)
+        {
+            if (rec.type != EVENTS_BLOB_TYPE_STRING ||
+                rec.signer_offset > rec.size - 1 ||
+                rec.size - 1 - rec.signer_offset < EVENTS_BLOB_SIGNER_SIZE)
+            {
+                err_format(err, "bad events blob signer offset: %u", i);
+                goto done;
+            }
+
+            memcpy(data + rec.signer_offset, signer, EVENTS_BLOB_SIGNER_SIZE);
+            found_signer = true;
+        }
+
+        if ((*callback)(rec.pcr, rec.type, data, rec.size, callback_data) < 0)
+        {
+            err_format(err, "events_blob_callback_t failed: pcr=%u", rec.pcr);
+            goto done;
+        }
+
+        /* the last record may be unpadded */
+        if (_blob_align(sizeof(rec) + rec.size) > (size_t)(end - p))
+            p = end;
+        else
+            p += _blob_align(sizeof(rec) + rec.size);
+    }
+
+    if (!found_signer)
+    {
+        err_format(err, "required os-image-identity element not found");
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    return ret;
+}
+
 typedef struct _json_callback_data
 {
     identity_t id;
@@ -36,4 +36,70 @@ int parse_events_file(
     unsigned int* error_line,
     err_t* err);
 
+/*
+**==============================================================================
+**
+** Precompiled events (events.bin): the events file converted by cvmdisk into
+** length-prefixed records, so the boot loader can measure them without
+** parsing. Layout: events_blob_header_t followed by num_events records, each
+** an events_blob_record_t followed by its data (padded to 8 bytes). String
+** data includes the zero terminator (which is measured). The os-image-identity
+** record holds a placeholder of EVENTS_BLOB_SIGNER_SIZE characters at
+** signer_offset, which is overwritten with the signer before measuring.
+**
+**==============================================================================
+*/
+
+#define EVENTS_BLOB_MAGIC 0x3153544e45564543 /* "CEVENTS1" */
+
+#define EVENTS_BLOB_TYPE_STRING 1
+#define EVENTS_BLOB_TYPE_BINARY 2
+
+#define EVENTS_BLOB_NO_SIGNER 0xffffffff
+
+/* length of the signer as a hex string (without the zero terminator) */
+#define EVENTS_BLOB_SIGNER_SIZE 64
+
+typedef struct events_blob_header
+{
+    uint64_t magic;
+    uint32_t num_events;
+    uint32_t reserved;
+}
+events_blob_header_t;
+
+typedef struct events_blob_record
+{
+    uint32_t pcr;
+    uint32_t type;
+    uint32_t size;
+    uint32_t signer_offset;
+}
+events_blob_record_t;
+
+typedef int (*events_blob_callback_t)(
+    uint32_t pcr,
+    uint32_t type,
+    const void* data,
+    size_t size,
+    void* callback_data);
+
+/* Convert an events file to a blob (allocated with __allocator) */
+int events_blob_compile(
+    const char* text,
+    unsigned long text_size,
+    void** blob_out,
+    size_t* blob_size_out,
+    unsigned int* error_line,
+    err_t* err);
+
+/* Invoke the callback for each record, writing the signer into the blob */
+int events_blob_walk(
+    void* blob,
+    size_t blob_size,
+    const char* signer,
+    events_blob_callback_t callback,
+    void* callback_data,
+    err_t* err);
+
 #endif /* _CVMBOOT_UTILS_EVENTS_H */
@@ -0,0 +1,564 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "lz4.h"
+#include <string.h>
+#include "allocator.h"
+
+#define FLG_VERSION 0x40
+#define FLG_BLOCK_INDEPENDENCE 0x20
+#define FLG_BLOCK_CHECKSUM 0x10
+#define FLG_CONTENT_SIZE 0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_DICT_ID 0x01
+
+/* BD byte selecting a 4 MiB maximum block size */
+#define BD_4MB 0x70
+#define BLOCK_SIZE ((size_t)(4 * 1024 * 1024))
+
+#define BLOCK_UNCOMPRESSED 0x80000000
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+/* the last match must start at least 12 bytes before the end of a block and
+ * the last 5 bytes must be literals (LZ4 block format end conditions) */
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+
+#define HASH_BITS 16
+
+static uint32_t _get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void _put32(uint8_t* p, uint32_t x)
+{
+    p[0] = (uint8_t)x;
+    p[1] = (uint8_t)(x >> 8);
+    p[2] = (uint8_t)(x >> 16);
+    p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t _rotl(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+uint32_t lz4_xxh32(const void* data, size_t size, uint32_t seed)
+{
+    const uint32_t p1 = 2654435761U;
+    const uint32_t p2 = 2246822519U;
+    const uint32_t p3 = 3266489917U;
+    const uint32_t p4 = 668265263U;
+    const uint32_t p5 = 374761393U;
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint32_t h;
+
+    if (size >= 16)
+    {
+        uint32_t v1 = seed + p1 + p2;
+        uint32_t v2 = seed + p2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - p1;
+
+        while (end - p >= 16)
+        {
+            v1 = _rotl(v1 + _get32(p) * p2, 13) * p1;
+            v2 = _rotl(v2 + _get32(p + 4) * p2, 13) * p1;
+            v3 = _rotl(v3 + _get32(p + 8) * p2, 13) * p1;
+            v4 = _rotl(v4 + _get32(p + 12) * p2, 13) * p1;
+            p += 16;
+        }
+
+        h = _rotl(v1, 1) + _rotl(v2, 7) + _rotl(v3, 12) + _rotl(v4, 18);
+    }
+    else
+    {
+        h = seed + p5;
+    }
+
+    h += (uint32_t)size;
+
+    while (end - p >= 4)
+    {
+        h += _get32(p) * p3;
+        h = _rotl(h, 17) * p4;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h += (*p++) * p5;
+        h = _rotl(h, 11) * p1;
+    }
+
+    h ^= h >> 15;
+    h *= p2;
+    h ^= h >> 13;
+    h *= p3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+bool lz4_is_frame(const void* data, size_t size)
+{
+    return data && size >= 4 && _get32(data) == LZ4_FRAME_MAGIC;
+}
+
+/* Parse the frame header, returning its size (or zero if invalid) */
+static size_t _parse_header(
+    const uint8_t* p,
+    size_t size,
+    uint8_t* flg_out,
+    uint64_t* content_size)
+{
+    size_t n = 4 + 2;
+    uint8_t flg;
+    size_t i;
+
+    if (size < n + 1 || _get32(p) != LZ4_FRAME_MAGIC)
+        return 0;
+
+    flg = p[4];
+
+    /* Require version 01 and reject dictionaries and reserved bits */
+    if ((flg & 0xC0) != FLG_VERSION || (flg & (FLG_DICT_ID | 0x02)))
+        return 0;
+
+    /* The content size is needed to allocate the output up front */
+    if (!(flg & FLG_CONTENT_SIZE))
+        return 0;
+
+    if (size < n + 8 + 1)
+        return 0;
+
+    *content_size = 0;
+
+    for (i = 0; i < 8; i++)
+        *content_size |= (uint64_t)p[n + i] << (i * 8);
+
+    n += 8;
+
+    /* Check the header checksum (second byte of XXH32 of the descriptor) */
+    if (p[n] != (uint8_t)(lz4_xxh32(p + 4, n - 4, 0) >> 8))
+        return 0;
+
+    *flg_out = flg;
+    return n + 1;
+}
+
+int lz4_get_content_size(
+    const void* data,
+    size_t size,
+    uint64_t* content_size)
+{
+    uint8_t flg;
+
+    if (!data || !content_size)
+        return -1;
+
+    if (_parse_header(data, size, &flg, content_size) == 0)
+        return -1;
+
+    return 0;
+}
+
+/* Decode one block, appending to the output at *op (matches may refer back
+ * into earlier blocks, so dependent-block frames work too) */
+static int _decompress_block(
+    const uint8_t* ip,
+    size_t size,
+    uint8_t* out,
+    uint8_t** op_inout,
+    uint8_t* oend)
+{
+    const uint8_t* iend = ip + size;
+    uint8_t* op = *op_inout;
+
+    for (;;)
+    {
+        const uint8_t token = *ip++;
+        size_t len = token >> 4;
+        size_t offset;
+        const uint8_t* match;
+
+        /* Literals */
+        if (len == 15)
+        {
+            uint8_t b;
+
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            }
+            while (b == 255);
+        }
+
+        if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+            return -1;
+
+        /* Copy short literals 16 bytes at a time when there is room */
+        if (len <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, len);
+
+        op += len;
+        ip += len;
+
+        /* The last sequence has literals only */
+        if (ip == iend)
+            break;
+
+        /* Match */
+        if (iend - ip < 2)
+            return -1;
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        len = token & 15;
+
+        if (len == 15)
+        {
+            uint8_t b;
+
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            }
+            while (b == 255);
+        }
+
+        len += MIN_MATCH;
+
+        if ((size_t)(oend - op) < len)
+            return -1;
+
+        match = op - offset;
+
+        if (offset >= 8 && (size_t)(oend - op) >= len + 8)
+        {
+            /* Copy 8 bytes at a time (each copy reads bytes at least 8 bytes
+             * behind, so overlapping matches replicate correctly) */
+            uint8_t* end = op + len;
+
+            do
+            {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            }
+            while (op < end);
+
+            op = end;
+        }
+        else
+        {
+            /* Short offsets repeat a pattern, so copy byte by byte */
+            while (len--)
+                *op++ = *match++;
+        }
+
+        if (ip >= iend)
+            return -1;
+    }
+
+    *op_inout = op;
+    return 0;
+}
+
+int lz4_decompress_frame(
+    const void* data,
+    size_t size,
+    void* out,
+    size_t out_size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint8_t* op = (uint8_t*)out;
+    uint8_t* oend = op + out_size;
+    uint64_t content_size;
+    uint8_t flg;
+    size_t n;
+
+    if (!data || !out)
+        return -1;
+
+    if (!(n = _parse_header(p, size, &flg, &content_size)))
+        return -1;
+
+    if (content_size != out_size)
+        return -1;
+
+    p += n;
+
+    for (;;)
+    {
+        uint32_t block_size;
+
+        if (end - p < 4)
+            return -1;
+
+        block_size = _get32(p);
+        p += 4;
+
+        /* End mark */
+        if (block_size == 0)
+            break;
+
+        if (block_size & BLOCK_UNCOMPRESSED)
+        {
+            block_size &= ~BLOCK_UNCOMPRESSED;
+
+            if ((size_t)(end - p) < block_size ||
+                (size_t)(oend - op) < block_size)
+            {
+                return -1;
+            }
+
+            memcpy(op, p, block_size);
+            op += block_size;
+        }
+        else
+        {
+            if (block_size == 0 || (size_t)(end - p) < block_size)
+                return -1;
+
+            if (_decompress_block(p, block_size, out, &op, oend) != 0)
+                return -1;
+        }
+
+        p += block_size;
+
+        /* Skip the block checksum (the signature covers the frame) */
+        if (flg & FLG_BLOCK_CHECKSUM)
+        {
+            if (end - p < 4)
+                return -1;
+
+            p += 4;
+        }
+    }
+
+    if (op != oend)
+        return -1;
+
+    return 0;
+}
+
+size_t lz4_compress_frame_bound(size_t size)
+{
+    const size_t nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    /* header + blocks (each with a size) + worst-case expansion + end mark */
+    return 15 + nblocks * 4 + size + size / 255 + 16 + 4;
+}
+
+static uint32_t _hash(uint32_t x)
+{
+    return (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* _put_length(uint8_t* op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Greedy single-probe compressor (like LZ4's fast mode). Returns the size of
+ * the compressed block, or zero if it would not be smaller than the input.
+ */
+static size_t _compress_block(
+    const uint8_t* src,
+    size_t size,
+    uint8_t* dst,
+    uint32_t* table)
+{
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + size;
+    const uint8_t* mflimit = iend - MF_LIMIT;
+    const uint8_t* matchlimit = iend - LAST_LITERALS;
+    uint8_t* op = dst;
+    uint8_t* olimit = dst + size;
+
+    memset(table, 0xff, sizeof(uint32_t) << HASH_BITS);
+
+    if (size >= MF_LIMIT + 1)
+    {
+        while (ip < mflimit)
+        {
+            const uint32_t seq = _get32(ip);
+            const uint32_t h = _hash(seq);
+            const uint32_t ref = table[h];
+            const uint8_t* match = src + ref;
+            size_t lit;
+            size_t len;
+            uint8_t* token;
+
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref == 0xffffffff || ip - match > MAX_OFFSET ||
+                _get32(match) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            /* Extend the match forward */
+            len = MIN_MATCH;
+
+            while (ip + len < matchlimit && ip[len] == match[len])
+                len++;
+
+            /* Emit the sequence (checking against the output limit) */
+            lit = ip - anchor;
+
+            if ((size_t)(olimit - op) < 1 + lit + lit / 255 + 2 + len / 255 + 1)
+                return 0;
+
+            token = op++;
+
+            if (lit >= 15)
+            {
+                *token = 15 << 4;
+                op = _put_length(op, lit - 15);
+            }
+            else
+            {
+                *token = (uint8_t)(lit << 4);
+            }
+
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            *op++ = (uint8_t)(ip - match);
+            *op++ = (uint8_t)((ip - match) >> 8);
+
+            if (len - MIN_MATCH >= 15)
+            {
+                *token |= 15;
+                op = _put_length(op, len - MIN_MATCH - 15);
+            }
+            else
+            {
+                *token |= (uint8_t)(len - MIN_MATCH);
+            }
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    /* Last literals */
+    {
+        const size_t lit = iend - anchor;
+
+        if ((size_t)(olimit - op) <= 1 + lit + lit / 255)
+            return 0;
+
+        if (lit >= 15)
+        {
+            *op++ = 15 << 4;
+            op = _put_length(op, lit - 15);
+        }
+        else
+        {
+            *op++ = (uint8_t)(lit << 4);
+        }
+
+        memcpy(op, anchor, lit);
+        op += lit;
+    }
+
+    return op - dst;
+}
+
+size_t lz4_compress_frame(
+    const void* data,
+    size_t size,
+    void* out,
+    size_t out_size)
+{
+    size_t ret = 0;
+    const uint8_t* ip = (const uint8_t*)data;
+    uint8_t* op = (uint8_t*)out;
+    uint32_t* table = NULL;
+    size_t i;
+
+    if ((!data && size) || !out || out_size < lz4_compress_frame_bound(size))
+        goto done;
+
+    if (!(table = __allocator.alloc(sizeof(uint32_t) << HASH_BITS)))
+        goto done;
+
+    /* Frame header */
+    _put32(op, LZ4_FRAME_MAGIC);
+    op[4] = FLG_VERSION | FLG_BLOCK_INDEPENDENCE | FLG_CONTENT_SIZE;
+    op[5] = BD_4MB;
+
+    for (i = 0; i < 8; i++)
+        op[6 + i] = (uint8_t)((uint64_t)size >> (i * 8));
+
+    op[14] = (uint8_t)(lz4_xxh32(op + 4, 10, 0) >> 8);
+    op += 15;
+
+    /* Blocks */
+    while (size)
+    {
+        const size_t n = (size < BLOCK_SIZE) ? size : BLOCK_SIZE;
+        size_t m = _compress_block(ip, n, op + 4, table);
+
+        if (m)
+        {
+            _put32(op, (uint32_t)m);
+        }
+        else
+        {
+            /* store incompressible blocks as is */
+            _put32(op, (uint32_t)n | BLOCK_UNCOMPRESSED);
+            memcpy(op + 4, ip, n);
+            m = n;
+        }
+
+        op += 4 + m;
+        ip += n;
+        size -= n;
+    }
+
+    /* End mark */
+    _put32(op, 0);
+    op += 4;
+
+    ret = op - (uint8_t*)out;
+
+done:
+
+    if (table)
+        __allocator.free(table);
+
+    return ret;
+}
@@ -0,0 +1,54 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_UTILS_LZ4_H
+#define _CVMBOOT_UTILS_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+**==============================================================================
+**
+** Minimal LZ4 frame format support (https://github.com/lz4/lz4), used to
+** compress cvmboot.cpio. Frames written here have independent 4 MiB blocks,
+** a content size, and no checksums (the signature covers the frame). The
+** decoder accepts any frame without a dictionary that has a content size.
+**
+**==============================================================================
+*/
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+
+/* Return true if data starts with the LZ4 frame magic number */
+bool lz4_is_frame(const void* data, size_t size);
+
+/* Get the decompressed size recorded in the frame header */
+int lz4_get_content_size(
+    const void* data,
+    size_t size,
+    uint64_t* content_size);
+
+/* Decompress a frame into out, which must be exactly the content size */
+int lz4_decompress_frame(
+    const void* data,
+    size_t size,
+    void* out,
+    size_t out_size);
+
+/* Upper bound on the size of the frame produced by lz4_compress_frame() */
+size_t lz4_compress_frame_bound(size_t size);
+
+/* Compress data into a frame in out (at least lz4_compress_frame_bound()
+ * bytes), returning the size of the frame (or zero on failure).
+ */
+size_t lz4_compress_frame(
+    const void* data,
+    size_t size,
+    void* out,
+    size_t out_size);
+
+uint32_t lz4_xxh32(const void* data, size_t size, uint32_t seed);
+
+#endif /* _CVMBOOT_UTILS_LZ4_H */
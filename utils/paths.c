@@ -12,6 +12,8 @@ static const char* _lookup(pathid_t id)
     {
         case FILENAME_EVENTS:
             return "/EFI/cvmboot/events";
+        case FILENAME_EVENTS_BIN:
+            return "/EFI/cvmboot/events.bin";
         case FILENAME_CVMBOOT_CONF:
             return"/EFI/cvmboot/cvmboot.conf";
         case FILENAME_CVMBOOT_CPIO:
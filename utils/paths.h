@@ -11,6 +11,7 @@
 typedef enum pathid
 {
     FILENAME_EVENTS,
+    FILENAME_EVENTS_BIN,
     FILENAME_CVMBOOT_CONF,
     FILENAME_CVMBOOT_CPIO,
     FILENAME_CVMBOOT_CPIO_SIG,
@@ -5,41 +5,151 @@
 #include <openssl/sha.h>
 #include "sha256.h"
 #include "hexstr.h"
+#include "sha256ni.h"
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
 typedef struct sha256_ctx_impl
 {
-    SHA256_CTX ctx;
+    /* true if using the SHA extensions rather than portable OpenSSL code */
+    bool ni;
+
+    union
+    {
+        SHA256_CTX ctx;
+
+        struct
+        {
+            uint32_t state[8];
+            uint64_t nbytes;
+            uint8_t block[64];
+        }
+        ni;
+    }
+    u;
 }
 sha256_ctx_impl_t;
 
 _Static_assert(sizeof(sha256_ctx_impl_t) <= sizeof(sha256_ctx_t));
 
+static const uint32_t _iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static void _ni_update(sha256_ctx_impl_t* impl, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    size_t used = impl->u.ni.nbytes % 64;
+
+    impl->u.ni.nbytes += size;
+
+    /* Fill a partial block first */
+    if (used)
+    {
+        size_t n = 64 - used;
+
+        if (n > size)
+            n = size;
+
+        memcpy(impl->u.ni.block + used, p, n);
+        p += n;
+        size -= n;
+
+        if (used + n < 64)
+            return;
+
+        sha256ni_compress(impl->u.ni.state, impl->u.ni.block, 1);
+    }
+
+    /* Compress whole blocks straight from the caller's buffer */
+    if (size >= 64)
+    {
+        sha256ni_compress(impl->u.ni.state, p, size / 64);
+        p += size & ~(size_t)63;
+        size &= 63;
+    }
+
+    if (size)
+        memcpy(impl->u.ni.block, p, size);
+}
+
+static void _ni_final(sha256_t* hash, sha256_ctx_impl_t* impl)
+{
+    const uint64_t nbits = impl->u.ni.nbytes * 8;
+    size_t used = impl->u.ni.nbytes % 64;
+    size_t i;
+
+    /* Append the 0x80 byte, zero padding, and the 64-bit length */
+    impl->u.ni.block[used++] = 0x80;
+
+    if (used > 56)
+    {
+        memset(impl->u.ni.block + used, 0, 64 - used);
+        sha256ni_compress(impl->u.ni.state, impl->u.ni.block, 1);
+        used = 0;
+    }
+
+    memset(impl->u.ni.block + used, 0, 56 - used);
+
+    for (i = 0; i < 8; i++)
+        impl->u.ni.block[56 + i] = (uint8_t)(nbits >> (56 - i * 8));
+
+    sha256ni_compress(impl->u.ni.state, impl->u.ni.block, 1);
+
+    for (i = 0; i < 8; i++)
+    {
+        const uint32_t x = impl->u.ni.state[i];
+        hash->data[i * 4 + 0] = (uint8_t)(x >> 24);
+        hash->data[i * 4 + 1] = (uint8_t)(x >> 16);
+        hash->data[i * 4 + 2] = (uint8_t)(x >> 8);
+        hash->data[i * 4 + 3] = (uint8_t)x;
+    }
+}
+
 void sha256_init(sha256_ctx_t* ctx)
 {
     sha256_ctx_impl_t* impl = (sha256_ctx_impl_t*)ctx;
-    SHA256_Init(&impl->ctx);
+
+    /* Use the SHA extensions when available (OpenSSL is built no-asm) */
+    if ((impl->ni = sha256ni_supported()))
+    {
+        memcpy(impl->u.ni.state, _iv, sizeof(_iv));
+        impl->u.ni.nbytes = 0;
+    }
+    else
+    {
+        SHA256_Init(&impl->u.ctx);
+    }
 }
 
 void sha256_update(sha256_ctx_t* ctx, const void* data, size_t size)
 {
     sha256_ctx_impl_t* impl = (sha256_ctx_impl_t*)ctx;
-    SHA256_Update(&impl->ctx, data, size);
+
+    if (impl->ni)
+        _ni_update(impl, data, size);
+    else
+        SHA256_Update(&impl->u.ctx, data, size);
 }
 
 void sha256_final(sha256_t* hash, sha256_ctx_t* ctx)
 {
     sha256_ctx_impl_t* impl = (sha256_ctx_impl_t*)ctx;
-    SHA256_Final(hash->data, &impl->ctx);
+
+    if (impl->ni)
+        _ni_final(hash, impl);
+    else
+        SHA256_Final(hash->data, &impl->u.ctx);
 }
 
 void sha256_compute(sha256_t* hash, const void* data, size_t size)
 {
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, data, size);
-    SHA256_Final(hash->data, &ctx);
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, size);
+    sha256_final(hash, &ctx);
 }
 
 void sha256_compute2(
@@ -49,11 +159,53 @@ void sha256_compute2(
     const void* data2,
     size_t size2)
 {
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, data1, size1);
-    SHA256_Update(&ctx, data2, size2);
-    SHA256_Final(hash->data, &ctx);
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data1, size1);
+    sha256_update(&ctx, data2, size2);
+    sha256_final(hash, &ctx);
+}
+
+int sha256_read(
+    sha256_t* hash,
+    void* data,
+    size_t size,
+    size_t chunk_size,
+    sha256_read_callback_t callback,
+    void* context)
+{
+    int ret = -1;
+    sha256_ctx_t ctx;
+    uint8_t* p = (uint8_t*)data;
+    size_t r = size;
+
+    if (!hash || (!data && size) || !chunk_size || !callback)
+        goto done;
+
+    sha256_init(&ctx);
+
+    while (r)
+    {
+        size_t n = (r < chunk_size) ? r : chunk_size;
+        size_t m = 0;
+
+        if ((*callback)(context, p, n, &m) != 0)
+            goto done;
+
+        /* unexpected end of file */
+        if (m == 0 || m > n)
+            goto done;
+
+        sha256_update(&ctx, p, m);
+        p += m;
+        r -= m;
+    }
+
+    sha256_final(hash, &ctx);
+    ret = 0;
+
+done:
+    return ret;
 }
 
 void sha256_clear(sha256_t* hash)
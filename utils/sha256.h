@@ -39,6 +39,29 @@ void sha256_final(sha256_t* hash, sha256_ctx_t* ctx);
 
 void sha256_compute(sha256_t* hash, const void* data, size_t size);
 
+/* Callback that reads up to size bytes into data (size_read is zero at EOF) */
+typedef int (*sha256_read_callback_t)(
+    void* context,
+    void* data,
+    size_t size,
+    size_t* size_read);
+
+/* Suggested chunk size for sha256_read(): large enough to keep the device
+ * busy yet small enough for each chunk to still be in cache when hashed.
+ */
+#define SHA256_READ_CHUNK_SIZE ((size_t)(1024 * 1024))
+
+/* Read exactly size bytes into data, hashing each chunk as it arrives rather
+ * than making a second pass over the whole buffer afterwards.
+ */
+int sha256_read(
+    sha256_t* hash,
+    void* data,
+    size_t size,
+    size_t chunk_size,
+    sha256_read_callback_t callback,
+    void* context);
+
 void sha256_compute2(
     sha256_t* hash,
     const void* data1,
@@ -0,0 +1,177 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "sha256ni.h"
+
+/*
+**==============================================================================
+**
+** SHA-256 compression with the x86 SHA extensions (SHA-NI).
+**
+** This is written with GCC builtins rather than <immintrin.h> since EFI
+** objects are compiled with -nostdinc. Only SSE registers are used, which
+** UEFI always enables (unlike the AVX state, which firmware may leave off).
+**
+**==============================================================================
+*/
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef v4si v4si_u __attribute__((aligned(1)));
+
+#define TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+static const uint32_t _k[64] __attribute__((aligned(16))) =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void _cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __asm__ __volatile__(
+        "cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subleaf));
+}
+
+bool sha256ni_supported(void)
+{
+    /* -1: not yet checked, 0: unsupported, 1: supported */
+    static int _supported = -1;
+
+    if (_supported == -1)
+    {
+        uint32_t regs[4];
+        int supported = 0;
+
+        _cpuid(0, 0, regs);
+
+        if (regs[0] >= 7)
+        {
+            const uint32_t ssse3 = (1 << 9);
+            const uint32_t sse41 = (1 << 19);
+            const uint32_t sha = (1 << 29);
+            uint32_t ecx;
+
+            _cpuid(1, 0, regs);
+            ecx = regs[2];
+            _cpuid(7, 0, regs);
+
+            if ((ecx & ssse3) && (ecx & sse41) && (regs[1] & sha))
+                supported = 1;
+        }
+
+        _supported = supported;
+    }
+
+    return _supported == 1;
+}
+
+/* four rounds with the message words in msg */
+#define ROUNDS(I, MSG)                                                     \
+    do                                                                     \
+    {                                                                      \
+        v4si wk = (MSG) + *(const v4si*)&_k[(I) * 4];                      \
+        state1 = __builtin_ia32_sha256rnds2(state1, state0, wk);           \
+        wk = __builtin_ia32_pshufd(wk, 0x0E);                              \
+        state0 = __builtin_ia32_sha256rnds2(state0, state1, wk);           \
+    }                                                                      \
+    while (0)
+
+/* load and byte-swap four message words */
+#define LOAD(I, MSG)                                                       \
+    do                                                                     \
+    {                                                                      \
+        MSG = *(const v4si_u*)(p + (I) * 16);                              \
+        MSG = (v4si)__builtin_ia32_pshufb128((v16qi)MSG, (v16qi)mask);    \
+        ROUNDS(I, MSG);                                                    \
+    }                                                                      \
+    while (0)
+
+/* compute the next four message words into M0 (from M0 through M3) */
+#define SCHEDULE(I, M0, M1, M2, M3)                                        \
+    do                                                                     \
+    {                                                                      \
+        v4si t = (v4si)__builtin_ia32_palignr128(                          \
+            (v2di)(M3), (v2di)(M2), 4 * 8);                                \
+        M0 = __builtin_ia32_sha256msg1(M0, M1) + t;                        \
+        M0 = __builtin_ia32_sha256msg2(M0, M3);                            \
+        ROUNDS(I, M0);                                                     \
+    }                                                                      \
+    while (0)
+
+TARGET
+void sha256ni_compress(
+    uint32_t state[8],
+    const void* blocks,
+    size_t nblocks)
+{
+    const uint8_t* p = (const uint8_t*)blocks;
+    const v2di mask = { 0x0405060700010203LL, 0x0c0d0e0f08090a0bLL };
+    v4si state0;
+    v4si state1;
+    v4si tmp;
+
+    /* Rearrange ABCD/EFGH into the ABEF/CDGH layout the instructions use */
+    tmp = __builtin_ia32_pshufd(*(const v4si_u*)&state[0], 0xB1);
+    state1 = __builtin_ia32_pshufd(*(const v4si_u*)&state[4], 0x1B);
+    state0 = (v4si)__builtin_ia32_palignr128((v2di)tmp, (v2di)state1, 8 * 8);
+    state1 = (v4si)__builtin_ia32_pblendw128((v8hi)state1, (v8hi)tmp, 0xF0);
+
+    while (nblocks--)
+    {
+        const v4si save0 = state0;
+        const v4si save1 = state1;
+        v4si m0;
+        v4si m1;
+        v4si m2;
+        v4si m3;
+
+        LOAD(0, m0);
+        LOAD(1, m1);
+        LOAD(2, m2);
+        LOAD(3, m3);
+        SCHEDULE(4, m0, m1, m2, m3);
+        SCHEDULE(5, m1, m2, m3, m0);
+        SCHEDULE(6, m2, m3, m0, m1);
+        SCHEDULE(7, m3, m0, m1, m2);
+        SCHEDULE(8, m0, m1, m2, m3);
+        SCHEDULE(9, m1, m2, m3, m0);
+        SCHEDULE(10, m2, m3, m0, m1);
+        SCHEDULE(11, m3, m0, m1, m2);
+        SCHEDULE(12, m0, m1, m2, m3);
+        SCHEDULE(13, m1, m2, m3, m0);
+        SCHEDULE(14, m2, m3, m0, m1);
+        SCHEDULE(15, m3, m0, m1, m2);
+
+        state0 += save0;
+        state1 += save1;
+        p += 64;
+    }
+
+    /* Restore the ABCD/EFGH layout */
+    tmp = __builtin_ia32_pshufd(state0, 0x1B);
+    state1 = __builtin_ia32_pshufd(state1, 0xB1);
+    state0 = (v4si)__builtin_ia32_pblendw128((v8hi)tmp, (v8hi)state1, 0xF0);
+    state1 = (v4si)__builtin_ia32_palignr128((v2di)state1, (v2di)tmp, 8 * 8);
+
+    *(v4si_u*)&state[0] = state0;
+    *(v4si_u*)&state[4] = state1;
+}
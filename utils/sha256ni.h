@@ -0,0 +1,22 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#ifndef _CVMBOOT_UTILS_SHA256NI_H
+#define _CVMBOOT_UTILS_SHA256NI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Return true if the CPU supports the SHA extensions (and SSSE3/SSE4.1) */
+bool sha256ni_supported(void);
+
+/* Apply the SHA-256 compression function to nblocks 64-byte blocks using
+ * the SHA extensions. Only call this if sha256ni_supported() returns true.
+ */
+void sha256ni_compress(
+    uint32_t state[8],
+    const void* blocks,
+    size_t nblocks);
+
+#endif /* _CVMBOOT_UTILS_SHA256NI_H */